@@ -608,6 +608,7 @@ static config_var_t option_vars_[] = {
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
   V(ServerDNSResolvConfFile,     STRING,   NULL),
+  V(ServerDNSResolverThreads,    UINT,     "0"),
   V(ServerDNSSearchDomains,      BOOL,     "0"),
   V(ServerDNSTestAddresses,      CSV,
       "www.google.com,www.mit.edu,www.yahoo.com,www.slashdot.org"),
@@ -616,6 +617,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTSockInfoCacheTime,       MSEC_INTERVAL, "0 msec"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -3164,6 +3166,9 @@ compute_publishserverdescriptor(or_options_t *options)
 /** Highest allowable value for RendPostPeriod. */
 #define MAX_DIR_PERIOD ((7*24*60*60)/2)
 
+/** Highest allowable value for ServerDNSResolverThreads. */
+#define MAX_SERVER_DNS_RESOLVER_THREADS 128
+
 /** Lowest allowable value for MaxCircuitDirtiness; if this is too low, Tor
  * will generate too many circuits and potentially overload the network. */
 #define MIN_MAX_CIRCUIT_DIRTINESS 10
@@ -3323,6 +3328,12 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  if (options->KISTSockInfoCacheTime > KIST_SOCK_INFO_CACHE_TIME_MAX) {
+    tor_asprintf(msg, "KISTSockInfoCacheTime must not be more than %d (ms)",
+                 KIST_SOCK_INFO_CACHE_TIME_MAX);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -4327,6 +4338,19 @@ options_validate(or_options_t *old_options, or_options_t *options,
     smartlist_free(options_sl);
   }
 
+  if (options->ServerDNSResolverThreads > MAX_SERVER_DNS_RESOLVER_THREADS) {
+    tor_asprintf(msg, "ServerDNSResolverThreads must be at most %d, but "
+                 "was set to %d", MAX_SERVER_DNS_RESOLVER_THREADS,
+                 options->ServerDNSResolverThreads);
+    return -1;
+  }
+
+  /* The seccomp filter doesn't allow the system resolver, and the sandbox's
+   * getaddrinfo() cache isn't thread-safe. */
+  if (options->ServerDNSResolverThreads && options->Sandbox) {
+    REJECT("ServerDNSResolverThreads is not compatible with Sandbox.");
+  }
+
   if (options->ConstrainedSockets) {
     /* If the user wants to constrain socket buffer use, make sure the desired
      * limit is between MIN|MAX_TCPSOCK_BUFFER in k increments. */
@@ -8409,7 +8433,9 @@ parse_outbound_addresses(or_options_t *options, int validate_only, char **msg)
 
 /** Load one of the geoip files, <a>family</a> determining which
  * one. <a>default_fname</a> is used if on Windows and
- * <a>fname</a> equals "<default>". */
+ * <a>fname</a> equals "<default>".  A binary copy of the database is
+ * cached in our cache directory, so that we can map it directly next time
+ * if the file hasn't changed. */
 static void
 config_load_geoip_file_(sa_family_t family,
                         const char *fname,
@@ -8418,6 +8444,8 @@ config_load_geoip_file_(sa_family_t family,
   const or_options_t *options = get_options();
   const char *msg = "";
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
+  char *cache_fname = get_cachedir_fname(family == AF_INET ?
+                                         "cached-geoip" : "cached-geoip6");
   int r;
 
 #ifdef _WIN32
@@ -8429,12 +8457,13 @@ config_load_geoip_file_(sa_family_t family,
     tor_asprintf(&free_fname, "%s\\%s", conf_root, default_fname);
     fname = free_fname;
   }
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_with_cache(family, fname, cache_fname, severity);
   tor_free(free_fname);
 #else /* !(defined(_WIN32)) */
   (void)default_fname;
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_with_cache(family, fname, cache_fname, severity);
 #endif /* defined(_WIN32) */
+  tor_free(cache_fname);
 
   if (r < 0 && severity == LOG_WARN) {
     log_warn(LD_GENERAL, "%s", msg);
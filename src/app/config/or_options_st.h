@@ -594,6 +594,9 @@ struct or_options_t {
   char *ServerDNSResolvConfFile; /**< If provided, we configure our internal
                      * resolver from the file here rather than from
                      * /etc/resolv.conf (Unix) or the registry (Windows). */
+  /** If nonzero, resolve names for clients on this many threads using the
+   * system resolver, rather than with eventdns. */
+  int ServerDNSResolverThreads;
   char *DirPortFrontPage; /**< This is a full path to a file with an html
                     disclaimer. This allows a server administrator to show
                     that they're running Tor and anyone visiting their server
@@ -1045,6 +1048,11 @@ struct or_options_t {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** For how many milliseconds the KIST scheduler may reuse a socket's
+   * kernel information across scheduling runs. If zero, query the kernel on
+   * every run. */
+  int KISTSockInfoCacheTime;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
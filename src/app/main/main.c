@@ -45,6 +45,7 @@
 #include "feature/dirauth/process_descs.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircache/dirserv.h"
+#include "feature/dirclient/dirclient.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_cache.h"
@@ -787,6 +788,7 @@ tor_free_all(int postfork)
   scheduler_free_all();
   nodelist_free_all();
   microdesc_free_all();
+  dirclient_free_all();
   routerparse_free_all();
   ext_orport_free_all();
   control_free_all();
@@ -808,6 +810,7 @@ tor_free_all(int postfork)
   }
   if (!postfork) {
     tor_tls_free_all();
+    tor_compress_free_all();
 #ifndef _WIN32
     tor_getpwnam(NULL);
 #endif
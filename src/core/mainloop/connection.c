@@ -378,6 +378,10 @@ or_connection_new(int type, int socket_family)
   time_t now = time(NULL);
   tor_assert(type == CONN_TYPE_OR || type == CONN_TYPE_EXT_OR);
   connection_init(now, TO_CONN(or_conn), type, socket_family);
+  /* OR connections move a steady stream of cells through their buffers;
+   * let them recycle drained chunks instead of reallocating them. */
+  buf_enable_chunk_reuse(TO_CONN(or_conn)->inbuf);
+  buf_enable_chunk_reuse(TO_CONN(or_conn)->outbuf);
 
   connection_or_set_canonical(or_conn, 0);
 
@@ -4228,6 +4232,17 @@ connection_handle_write_impl(connection_t *conn, int force)
     CONN_LOG_PROTECT(conn,
                      result = buf_flush_to_socket(conn->outbuf, conn->s,
                                         max_to_write, &conn->outbuf_flushlen));
+    if (result >= 0 && result < max_to_write &&
+        conn->type == CONN_TYPE_DIR && buf_datalen(conn->outbuf) == 0) {
+      /* Large cached directory objects go straight from their (usually
+       * mmap'd) storage onto the socket, without a copy into the outbuf. */
+      ssize_t r = connection_dirserv_write_direct(TO_DIR_CONN(conn),
+                                             (size_t)(max_to_write - result));
+      if (r < 0)
+        result = -1;
+      else
+        result += (int)r;
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -4287,6 +4302,12 @@ connection_handle_write_impl(connection_t *conn, int force)
     }
   }
 
+  if (conn->type == CONN_TYPE_DIR &&
+      connection_dirserv_can_write_direct(TO_DIR_CONN(conn))) {
+    /* We have more to send, but it isn't in the outbuf. */
+    dont_stop_writing = 1;
+  }
+
   if (!connection_wants_to_flush(conn) &&
       !dont_stop_writing) { /* it's done flushing */
     if (connection_finished_flushing(conn) < 0) {
@@ -17,16 +17,17 @@
  *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/connection_or.h"
 #include "app/config/config.h"
+#include "core/or/onion.h"
 #include "core/mainloop/cpuworker.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
-#include "core/or/onion.h"
 #include "feature/relay/onion_queue.h"
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
@@ -34,10 +35,9 @@
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
+#include "lib/intmath/bits.h"
 #include "lib/intmath/weakrng.h"
 
-static void queue_pending_tasks(void);
-
 typedef struct worker_state_s {
   int generation;
   server_onion_keys_t *onion_keys;
@@ -78,6 +78,8 @@ static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** Number of threads in <b>threadpool</b>. */
+static int n_worker_threads = 1;
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
@@ -96,6 +98,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_worker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -112,65 +115,13 @@ cpu_init(void)
   crypto_seed_weak_rng(&request_sample_rng);
 }
 
-/** Magic numbers to make sure our cpuworker_requests don't grow any
- * mis-framing bugs. */
-#define CPUWORKER_REQUEST_MAGIC 0xda4afeed
-#define CPUWORKER_REPLY_MAGIC 0x5eedf00d
-
-/** A request sent to a cpuworker. */
-typedef struct cpuworker_request_t {
-  /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
-  uint32_t magic;
-
-  /** Flag: Are we timing this request? */
-  unsigned timed : 1;
-  /** If we're timing this request, when was it sent to the cpuworker? */
-  struct timeval started_at;
-
-  /** A create cell for the cpuworker to process. */
-  create_cell_t create_cell;
-
-  /* Turn the above into a tagged union if needed. */
-} cpuworker_request_t;
-
-/** A reply sent by a cpuworker. */
-typedef struct cpuworker_reply_t {
-  /** Magic number; must be CPUWORKER_REPLY_MAGIC. */
-  uint32_t magic;
-
-  /** True iff we got a successful request. */
-  uint8_t success;
-
-  /** Are we timing this request? */
-  unsigned int timed : 1;
-  /** What handshake type was the request? (Used for timing) */
-  uint16_t handshake_type;
-  /** When did we send the request to the cpuworker? */
-  struct timeval started_at;
-  /** Once the cpuworker received the request, how many microseconds did it
-   * take? (This shouldn't overflow; 4 billion micoseconds is over an hour,
-   * and we'll never have an onion handshake that takes so long.) */
-  uint32_t n_usec;
-
-  /** Output of processing a create cell
-   *
-   * @{
-   */
-  /** The created cell to send back. */
-  created_cell_t created_cell;
-  /** The keys to use on this circuit. */
-  uint8_t keys[CPATH_KEY_MATERIAL_LEN];
-  /** Input to use for authenticating introduce1 cells. */
-  uint8_t rend_auth_material[DIGEST_LEN];
-} cpuworker_reply_t;
-
-typedef struct cpuworker_job_u {
-  or_circuit_t *circ;
-  union {
-    cpuworker_request_t request;
-    cpuworker_reply_t reply;
-  } u;
-} cpuworker_job_t;
+/** Return true iff the cpuworker threadpool has been started, so that
+ * cpuworker_queue_work() may be called. */
+MOCK_IMPL(int,
+cpuworker_is_running,(void))
+{
+  return threadpool != NULL;
+}
 
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
@@ -223,6 +174,27 @@ static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
 
+/** Number of buckets in each onionskin latency histogram. Bucket <i>i</i>
+ * counts handshakes that took [2^i, 2^(i+1)) microseconds of cpuworker
+ * time; bucket 0 also counts handshakes that took no measurable time. This
+ * covers everything up to MAX_BELIEVABLE_ONIONSKIN_DELAY. */
+#define ONIONSKIN_HIST_N_BUCKETS 21
+/** Once a histogram holds this many samples, halve all of its buckets, so
+ * that it follows the recent behaviour of our cpuworkers rather than their
+ * whole history. */
+#define ONIONSKIN_HIST_DECAY_THRESHOLD 2048
+/** Until a histogram holds this many samples, we don't trust its
+ * quantiles. */
+#define ONIONSKIN_HIST_MIN_SAMPLES 100
+
+/** Indexed by handshake type: a histogram of how long recent timed
+ * onionskins of that type spent in a cpuworker. */
+static uint32_t onionskins_usec_hist[MAX_ONION_HANDSHAKE_TYPE+1]
+                                    [ONIONSKIN_HIST_N_BUCKETS];
+/** Indexed by handshake type: the total number of samples currently in
+ * onionskins_usec_hist. */
+static uint32_t onionskins_hist_n_samples[MAX_ONION_HANDSHAKE_TYPE+1];
+
 /** Return true iff we'd like to measure a handshake of type
  * <b>onionskin_type</b>. Call only from the main thread. */
 static int
@@ -262,6 +234,91 @@ estimated_usec_for_onionskins(uint32_t n_requests, uint16_t onionskin_type)
   }
 }
 
+/** Record that a cpuworker spent <b>usec</b> microseconds on an onionskin
+ * of type <b>onionskin_type</b> in that type's latency histogram. */
+STATIC void
+onionskin_hist_note(uint16_t onionskin_type, uint32_t usec)
+{
+  uint32_t *hist;
+  int bucket;
+
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE)
+    return;
+  hist = onionskins_usec_hist[onionskin_type];
+
+  bucket = usec ? tor_log2(usec) : 0;
+  if (bucket >= ONIONSKIN_HIST_N_BUCKETS)
+    bucket = ONIONSKIN_HIST_N_BUCKETS - 1;
+  ++hist[bucket];
+
+  if (++onionskins_hist_n_samples[onionskin_type] >=
+      ONIONSKIN_HIST_DECAY_THRESHOLD) {
+    uint32_t total = 0;
+    int i;
+    for (i = 0; i < ONIONSKIN_HIST_N_BUCKETS; ++i) {
+      hist[i] /= 2;
+      total += hist[i];
+    }
+    onionskins_hist_n_samples[onionskin_type] = total;
+  }
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of onionskins that we've handed to the worker threads
+ * and haven't yet handled the replies to. */
+STATIC int
+cpuworker_get_n_pending_tasks(void)
+{
+  return total_pending_tasks;
+}
+
+/** Forget everything in the onionskin latency histograms. */
+STATIC void
+onionskin_hist_clear(void)
+{
+  memset(onionskins_usec_hist, 0, sizeof(onionskins_usec_hist));
+  memset(onionskins_hist_n_samples, 0, sizeof(onionskins_hist_n_samples));
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Return an estimate of the <b>pct</b>th percentile of the time, in
+ * microseconds, that a single cpuworker needs to process an onionskin of
+ * type <b>onionskin_type</b>, based on recently timed handshakes.  Until we
+ * have enough samples, fall back to estimated_usec_for_onionskins(). */
+uint64_t
+estimated_usec_quantile_for_onionskin(uint16_t onionskin_type,
+                                      unsigned pct)
+{
+  const uint32_t *hist;
+  uint64_t target, seen = 0;
+  int i;
+
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE ||
+      onionskins_hist_n_samples[onionskin_type] < ONIONSKIN_HIST_MIN_SAMPLES)
+    return estimated_usec_for_onionskins(1, onionskin_type);
+  if (pct > 100)
+    pct = 100;
+
+  hist = onionskins_usec_hist[onionskin_type];
+  /* The rank of the sample we're looking for, rounded up. */
+  target = ((uint64_t)onionskins_hist_n_samples[onionskin_type] * pct + 99)
+    / 100;
+  if (target == 0)
+    target = 1;
+
+  for (i = 0; i < ONIONSKIN_HIST_N_BUCKETS; ++i) {
+    if (hist[i] && seen + hist[i] >= target) {
+      /* Interpolate linearly inside the bucket. */
+      uint64_t lo = i ? (UINT64_C(1) << i) : 0;
+      uint64_t width = (UINT64_C(1) << (i+1)) - lo;
+      return lo + (width * (target - seen)) / hist[i];
+    }
+    seen += hist[i];
+  }
+  /* Only reachable if the sample count is out of sync with the buckets. */
+  return MAX_BELIEVABLE_ONIONSKIN_DELAY; /* LCOV_EXCL_LINE */
+}
+
 /** Compute the absolute and relative overhead of using the cpuworker
  * framework for onionskins of type <b>onionskin_type</b>.*/
 static int
@@ -310,11 +367,11 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle the reply to one onionskin from the worker threads, and free
+ * <b>job</b>. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -340,6 +397,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
       ++onionskins_n_processed[rpl.handshake_type];
       onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
+      onionskin_hist_note(rpl.handshake_type, rpl.n_usec);
       if (onionskins_n_processed[rpl.handshake_type] >= 500000) {
         /* Scale down every 500000 handshakes.  On a busy server, that's
          * less impressive than it sounds. */
@@ -396,16 +454,27 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
+}
+
+/** Handle a batch of replies from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_reply_one(batch->jobs[i]);
+  tor_free(batch);
+
   queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
+/** Answer the onion handshake request in <b>job</b>, replacing it with the
+ * reply. */
 static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+cpuworker_onion_handshake_process(worker_state_t *state, cpuworker_job_t *job)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
-
   /* variables for onion processing */
   server_onion_keys_t *onion_keys = state->onion_keys;
   cpuworker_request_t req;
@@ -473,22 +542,146 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
-static void
+/** Implementation function for batches of onion handshake requests. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  workqueue_reply_t r;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    r = cpuworker_onion_handshake_process(state, batch->jobs[i]);
+    if (r != WQ_RPL_REPLY)
+      return r;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Make a new job asking a cpuworker to perform the public key operations
+ * necessary to respond to <b>onionskin</b> for the circuit <b>circ</b>, and
+ * free <b>onionskin</b>.  Return NULL if the circuit can't use an answer. */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return NULL;
+  }
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  return job;
+}
+
+/** Give <b>batch</b> to the worker threads, and count its jobs as pending.
+ * Return 0 on success, or -1 if we couldn't queue it, in which case the
+ * batch and its jobs are freed. */
+static int
+cpuworker_batch_queue(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    for (i = 0; i < batch->n_jobs; ++i) {
+      batch->jobs[i]->circ->workqueue_entry = NULL;
+      memwipe(batch->jobs[i], 0, sizeof(cpuworker_job_t));
+      tor_free(batch->jobs[i]);
+      tor_assert(total_pending_tasks > 0);
+      --total_pending_tasks;
+    }
+    tor_free(batch);
+    return -1;
+  }
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_job_t *job = batch->jobs[i];
+    log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
+              job, queue_entry, job->circ);
+    job->circ->workqueue_entry = queue_entry;
+  }
+  return 0;
+}
+
+/** Return how many onionskins we should put in each batch when we're
+ * draining the onion queue.  While there are few enough queued onionskins
+ * for every thread to get one, we don't batch them at all, so that no
+ * thread sits idle while another one works through a batch. */
+static int
+cpuworker_get_batch_size(void)
+{
+  int backlog = onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+                onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR);
+  int size = backlog / n_worker_threads;
+  return CLAMP(1, size, CPUWORKER_MAX_BATCH_SIZE);
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, in
+ * batches when the queue is long. */
+STATIC void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  cpuworker_batch_t *batch = NULL;
+  cpuworker_job_t *job;
+  const int batch_size = cpuworker_get_batch_size();
 
   while (total_pending_tasks < max_pending_tasks) {
     circ = onion_next_task(&onionskin);
 
     if (!circ)
-      return;
+      break;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    job = cpuworker_job_new(circ, onionskin);
+    if (!job) {
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+      continue;
+    }
+
+    if (!batch)
+      batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+    batch->jobs[batch->n_jobs++] = job;
+    ++total_pending_tasks;
+
+    if (batch->n_jobs >= batch_size) {
+      cpuworker_batch_queue(batch);
+      batch = NULL;
+    }
   }
+
+  if (batch)
+    cpuworker_batch_queue(batch);
 }
 
 /** DOCDOC */
@@ -516,12 +709,10 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
+  cpuworker_batch_t *batch;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
-  tor_assert(threadpool);
+  tor_assert(cpuworker_is_running());
 
   if (!circ->p_chan) {
     log_info(LD_OR,"circ->p_chan gone. Failing circ.");
@@ -538,44 +729,15 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+  job = cpuworker_job_new(circ, onionskin);
+  if (!job)
     return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
 
-  circ->workqueue_entry = queue_entry;
+  batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  batch->jobs[batch->n_jobs++] = job;
+  ++total_pending_tasks;
 
-  return 0;
+  return cpuworker_batch_queue(batch);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -583,18 +745,32 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  Drop our job from the batch. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      cpuworker_job_t *job = batch->jobs[i];
+      if (job->circ != circ)
+        continue;
+      memwipe(job, 0xe0, sizeof(*job));
+      tor_free(job);
+      batch->jobs[i] = batch->jobs[--batch->n_jobs];
+      tor_assert(total_pending_tasks > 0);
+      --total_pending_tasks;
+      break;
+    }
+    /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
     circ->workqueue_entry = NULL;
+
+    /* The other circuits in the batch still want their answers. */
+    if (batch->n_jobs)
+      cpuworker_batch_queue(batch);
+    else
+      tor_free(batch);
   }
 }
@@ -13,6 +13,7 @@
 #define TOR_CPUWORKER_H
 
 void cpu_init(void);
+MOCK_DECL(int, cpuworker_is_running, (void));
 void cpuworkers_rotate_keyinfo(void);
 struct workqueue_entry_s;
 enum workqueue_reply_t;
@@ -29,9 +30,94 @@ int assign_onionskin_to_cpuworker(or_circuit_t *circ,
 
 uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
+uint64_t estimated_usec_quantile_for_onionskin(uint16_t onionskin_type,
+                                               unsigned pct);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+#ifdef CPUWORKER_PRIVATE
+/* These need core/or/onion.h. */
+
+/** Magic numbers to make sure our cpuworker_requests don't grow any
+ * mis-framing bugs. */
+#define CPUWORKER_REQUEST_MAGIC 0xda4afeed
+#define CPUWORKER_REPLY_MAGIC 0x5eedf00d
+
+/** A request sent to a cpuworker. */
+typedef struct cpuworker_request_t {
+  /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
+  uint32_t magic;
+
+  /** Flag: Are we timing this request? */
+  unsigned timed : 1;
+  /** If we're timing this request, when was it sent to the cpuworker? */
+  struct timeval started_at;
+
+  /** A create cell for the cpuworker to process. */
+  create_cell_t create_cell;
+
+  /* Turn the above into a tagged union if needed. */
+} cpuworker_request_t;
+
+/** A reply sent by a cpuworker. */
+typedef struct cpuworker_reply_t {
+  /** Magic number; must be CPUWORKER_REPLY_MAGIC. */
+  uint32_t magic;
+
+  /** True iff we got a successful request. */
+  uint8_t success;
+
+  /** Are we timing this request? */
+  unsigned int timed : 1;
+  /** What handshake type was the request? (Used for timing) */
+  uint16_t handshake_type;
+  /** When did we send the request to the cpuworker? */
+  struct timeval started_at;
+  /** Once the cpuworker received the request, how many microseconds did it
+   * take? (This shouldn't overflow; 4 billion micoseconds is over an hour,
+   * and we'll never have an onion handshake that takes so long.) */
+  uint32_t n_usec;
+
+  /** Output of processing a create cell
+   *
+   * @{
+   */
+  /** The created cell to send back. */
+  created_cell_t created_cell;
+  /** The keys to use on this circuit. */
+  uint8_t keys[CPATH_KEY_MATERIAL_LEN];
+  /** Input to use for authenticating introduce1 cells. */
+  uint8_t rend_auth_material[DIGEST_LEN];
+} cpuworker_reply_t;
+
+typedef struct cpuworker_job_u {
+  or_circuit_t *circ;
+  union {
+    cpuworker_request_t request;
+    cpuworker_reply_t reply;
+  } u;
+} cpuworker_job_t;
+
+/** Largest number of onionskins that we hand to a worker thread at once. */
+#define CPUWORKER_MAX_BATCH_SIZE 8
+
+/** A set of onionskins that one worker thread handles back to back, and
+ * whose replies come back to the main thread together.  Every circuit in
+ * the batch has its workqueue_entry set to the batch's entry. */
+typedef struct cpuworker_batch_t {
+  /** Number of jobs in <b>jobs</b>. */
+  int n_jobs;
+  cpuworker_job_t *jobs[CPUWORKER_MAX_BATCH_SIZE];
+} cpuworker_batch_t;
+
+STATIC void onionskin_hist_note(uint16_t onionskin_type, uint32_t usec);
+STATIC void queue_pending_tasks(void);
+#ifdef TOR_UNIT_TESTS
+STATIC int cpuworker_get_n_pending_tasks(void);
+STATIC void onionskin_hist_clear(void);
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(CPUWORKER_PRIVATE) */
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
@@ -1183,6 +1183,9 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_EXT_OR)
+    connection_or_release_idle_spare_chunks(TO_OR_CONN(conn), now);
+
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
   if (conn->type == CONN_TYPE_DIR &&
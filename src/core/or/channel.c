@@ -916,6 +916,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -987,6 +989,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -415,6 +415,10 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Map from circuit ID to the circuits (and placeholders) on this channel;
+   * maintained by circuitlist.c. */
+  chan_circid_map_t *circid_map;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -15,8 +15,8 @@
  * find which circuit it is associated with, based on the channel and the
  * circuit ID in the relay cell.
  *
- * To handle that, we maintain a global list of circuits, and a hashtable
- * mapping [channel,circID] pairs to circuits.  Circuits are added to and
+ * To handle that, we maintain a global list of circuits, and for each
+ * channel a table mapping circIDs to circuits.  Circuits are added to and
  * removed from this mapping using circuit_set_p_circid_chan() and
  * circuit_set_n_circid_chan().  To look up a circuit from this map, most
  * callers should use circuit_get_by_circid_channel(), though
@@ -99,7 +99,7 @@
 #include "feature/split/splitcommon.h"
 #include "feature/split/spliteval.h"
 
-#include "ht.h"
+#include "siphash.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_reference_st.h"
@@ -170,57 +170,197 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
+/** One slot in a channel's circuit ID map.  A slot is in use iff
+ * <b>in_use</b> is set; a slot whose <b>circuit</b> is NULL is a placeholder
+ * for a circuit ID that we can't reuse until a DESTROY cell is sent. */
+typedef struct chan_circid_slot_t {
   circid_t circ_id;
+  unsigned int in_use;
   circuit_t *circuit;
   /* For debugging 12184: when was this placeholder item added? */
   time_t made_placeholder_at;
-} chan_circid_circuit_map_t;
+} chan_circid_slot_t;
 
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
+/** A map from circuit ID to circuit, for the circuits on a single channel.
+ * (Lookup performance is very important here, since we need to do it every
+ * time a cell arrives.)
+ *
+ * This is an open-addressed table with linear probing over a flat array of
+ * slots, so that a lookup usually touches a single cache line, and the
+ * circuit pointer comes out of the slot itself.  Each channel has its own
+ * map, so the tables stay small even on relays with tens of thousands of
+ * circuits. */
+struct chan_circid_map_t {
+  /** Number of slots in <b>slots</b>; always a power of two. */
+  unsigned int capacity;
+  /** Number of slots in use, including placeholders. */
+  unsigned int n_used;
+  /** The most recently returned slot; used to improve performance when
+   * many cells arrive in a row from the same circuit.  -1 if none. */
+  int last_idx;
+  chan_circid_slot_t *slots;
+};
+
+/** Initial number of slots in a channel's circuit ID map. */
+#define CHAN_CIRCID_MAP_MIN_CAPACITY 16
+
+/** Helper: return the preferred slot for <b>circ_id</b> in <b>map</b>. */
+static inline unsigned int
+chan_circid_map_bucket(const chan_circid_map_t *map, circid_t circ_id)
+{
+  /* Circuit IDs on the p side are chosen by our peer, so keep using a keyed
+   * hash here: a peer shouldn't be able to pile up collisions. */
+  uint32_t id = circ_id;
+  return ((unsigned) siphash24g(&id, sizeof(id))) & (map->capacity - 1);
+}
+
+/** Return the index of the slot for <b>circ_id</b> in <b>map</b>, or -1 if
+ * there is none. */
 static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
+chan_circid_map_find(chan_circid_map_t *map, circid_t circ_id)
 {
-  return a->chan == b->chan && a->circ_id == b->circ_id;
+  unsigned int mask, idx;
+
+  if (!map)
+    return -1;
+  if (map->last_idx >= 0 && map->slots[map->last_idx].circ_id == circ_id &&
+      map->slots[map->last_idx].in_use)
+    return map->last_idx;
+
+  mask = map->capacity - 1;
+  idx = chan_circid_map_bucket(map, circ_id);
+  while (map->slots[idx].in_use) {
+    if (map->slots[idx].circ_id == circ_id) {
+      map->last_idx = (int) idx;
+      return (int) idx;
+    }
+    idx = (idx + 1) & mask;
+  }
+  return -1;
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
-{
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_)
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_)
-
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Helper: put a copy of <b>slot</b> into the first free slot of its probe
+ * sequence in <b>map</b>.  The map must have room, and must not already
+ * contain slot-\>circ_id. */
+static unsigned int
+chan_circid_map_place(chan_circid_map_t *map, const chan_circid_slot_t *slot)
+{
+  unsigned int mask = map->capacity - 1;
+  unsigned int idx = chan_circid_map_bucket(map, slot->circ_id);
+  while (map->slots[idx].in_use)
+    idx = (idx + 1) & mask;
+  memcpy(&map->slots[idx], slot, sizeof(*slot));
+  return idx;
+}
+
+/** Make sure that <b>chan</b> has a circuit ID map with room for at least one
+ * more entry, keeping the load factor at or below 0.6. */
+static chan_circid_map_t *
+chan_circid_map_reserve(channel_t *chan)
+{
+  chan_circid_map_t *map = chan->circid_map;
+  chan_circid_slot_t *old_slots;
+  unsigned int old_capacity, i;
+
+  if (!map) {
+    map = chan->circid_map = tor_malloc_zero(sizeof(chan_circid_map_t));
+    map->capacity = CHAN_CIRCID_MAP_MIN_CAPACITY;
+    map->slots = tor_calloc(map->capacity, sizeof(chan_circid_slot_t));
+    map->last_idx = -1;
+    return map;
+  }
+
+  if ((map->n_used + 1) * 5 <= map->capacity * 3)
+    return map;
+
+  old_slots = map->slots;
+  old_capacity = map->capacity;
+  map->capacity *= 2;
+  map->slots = tor_calloc(map->capacity, sizeof(chan_circid_slot_t));
+  map->last_idx = -1;
+  for (i = 0; i < old_capacity; ++i) {
+    if (old_slots[i].in_use)
+      chan_circid_map_place(map, &old_slots[i]);
+  }
+  tor_free(old_slots);
+  return map;
+}
+
+/** Add a new slot for <b>circ_id</b> to <b>chan</b>'s map, and return it.
+ * There must not be a slot for <b>circ_id</b> already. */
+static chan_circid_slot_t *
+chan_circid_map_insert(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_map_t *map = chan_circid_map_reserve(chan);
+  chan_circid_slot_t slot;
+  unsigned int idx;
+
+  memset(&slot, 0, sizeof(slot));
+  slot.circ_id = circ_id;
+  slot.in_use = 1;
+  idx = chan_circid_map_place(map, &slot);
+  ++map->n_used;
+  return &map->slots[idx];
+}
+
+/** Remove the slot at <b>idx</b> from <b>map</b>, shifting back any later
+ * members of the same probe run so that lookups never need tombstones. */
+static void
+chan_circid_map_remove_idx(chan_circid_map_t *map, unsigned int idx)
+{
+  unsigned int mask = map->capacity - 1;
+  unsigned int hole = idx, next = (idx + 1) & mask;
+
+  while (map->slots[next].in_use) {
+    unsigned int want = chan_circid_map_bucket(map, map->slots[next].circ_id);
+    /* Move <b>next</b> into the hole unless its preferred slot lies
+     * cyclically in (hole, next]. */
+    if (((next - want) & mask) >= ((next - hole) & mask)) {
+      memcpy(&map->slots[hole], &map->slots[next], sizeof(chan_circid_slot_t));
+      hole = next;
+    }
+    next = (next + 1) & mask;
+  }
+  memset(&map->slots[hole], 0, sizeof(chan_circid_slot_t));
+  --map->n_used;
+  map->last_idx = -1;
+}
+
+/** Remove the slot for <b>circ_id</b> from <b>chan</b>'s map, if there is
+ * one.  Return true iff we removed a slot; if <b>circ_out</b> is provided,
+ * set it to the circuit that the slot held. */
+static int
+chan_circid_map_remove(channel_t *chan, circid_t circ_id,
+                       circuit_t **circ_out)
+{
+  int idx = chan_circid_map_find(chan->circid_map, circ_id);
+  if (idx < 0)
+    return 0;
+  if (circ_out)
+    *circ_out = chan->circid_map->slots[idx].circuit;
+  chan_circid_map_remove_idx(chan->circid_map, (unsigned) idx);
+  return 1;
+}
+
+/** Return the slot for <b>circ_id</b> in <b>chan</b>'s map, or NULL if there
+ * is none. */
+static inline chan_circid_slot_t *
+chan_circid_map_get(channel_t *chan, circid_t circ_id)
+{
+  int idx = chan_circid_map_find(chan->circid_map, circ_id);
+  return idx < 0 ? NULL : &chan->circid_map->slots[idx];
+}
+
+/** Release all storage held by <b>chan</b>'s circuit ID map.  Called when
+ * the channel is freed; by then, only placeholders may remain. */
+void
+channel_free_circid_map(channel_t *chan)
+{
+  if (!chan || !chan->circid_map)
+    return;
+  tor_free(chan->circid_map->slots);
+  tor_free(chan->circid_map);
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -231,8 +371,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  chan_circid_slot_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -253,14 +392,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -275,11 +406,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-    if (found) {
-      tor_free(found);
+    if (chan_circid_map_remove(old_chan, old_id, NULL)) {
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -299,19 +426,11 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
-    found->circuit = circ;
-    found->made_placeholder_at = 0;
-  } else {
-    found = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
-    found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
-  }
+  found = chan_circid_map_get(chan, id);
+  if (!found)
+    found = chan_circid_map_insert(chan, id);
+  found->circuit = circ;
+  found->made_placeholder_at = 0;
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -347,14 +466,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_slot_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_get(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -365,12 +480,9 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
   } else {
-    ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
+    ent = chan_circid_map_insert(chan, id);
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
   }
 }
 
@@ -380,22 +492,16 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_slot_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_get(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  chan_circid_map_remove(chan, id, NULL);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -1267,20 +1373,6 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
-
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -1404,19 +1496,8 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  chan_circid_slot_t *found = chan_circid_map_get(chan, circ_id);
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1513,14 +1594,7 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  chan_circid_slot_t *found = chan_circid_map_get(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -2601,42 +2675,51 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
   return max_age;
 }
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
+/** Restore the heap property of the max-heap <b>heap</b> of <b>n</b>
+ * entries, starting from the entry at <b>idx</b> and moving it down toward
+ * the leaves. */
+STATIC void
+oom_heap_sift_down(oom_heap_ent_t *heap, int n, int idx)
 {
-  const circuit_t *a = *a_;
-  const circuit_t *b = *b_;
-  uint32_t age_a = a->age_tmp;
-  uint32_t age_b = b->age_tmp;
-
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+  oom_heap_ent_t ent = heap[idx];
+  for (;;) {
+    int child = 2*idx + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && heap[child+1].age > heap[child].age)
+      ++child;
+    if (heap[child].age <= ent.age)
+      break;
+    heap[idx] = heap[child];
+    idx = child;
+  }
+  heap[idx] = ent;
 }
 
-static uint32_t now_ts_for_buf_cmp;
-
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-conns_compare_by_buffer_age_(const void **a_, const void **b_)
+/** Arrange the <b>n</b> entries of <b>heap</b> into a max-heap ordered by
+ * age, so that the oldest entry is first.  This takes O(n) time. */
+STATIC void
+oom_heap_build(oom_heap_ent_t *heap, int n)
 {
-  const connection_t *a = *a_;
-  const connection_t *b = *b_;
-  time_t age_a = conn_get_buffer_age(a, now_ts_for_buf_cmp);
-  time_t age_b = conn_get_buffer_age(b, now_ts_for_buf_cmp);
+  int idx;
+  for (idx = n/2 - 1; idx >= 0; --idx)
+    oom_heap_sift_down(heap, n, idx);
+}
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+/** Remove the oldest entry from the max-heap <b>heap</b> of *<b>n</b>
+ * entries, decrement *<b>n</b>, and return the removed item.  Return NULL if
+ * the heap is empty. */
+STATIC void *
+oom_heap_pop(oom_heap_ent_t *heap, int *n)
+{
+  void *item;
+  if (*n == 0)
+    return NULL;
+  item = heap[0].item;
+  heap[0] = heap[--*n];
+  if (*n)
+    oom_heap_sift_down(heap, *n, 0);
+  return item;
 }
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
@@ -2649,7 +2732,8 @@ circuits_handle_oom(size_t current_allocation)
 {
   smartlist_t *circlist;
   smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  oom_heap_ent_t *circ_heap = NULL, *conn_heap = NULL;
+  int n_circ_heap = 0, n_conn_heap = 0;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
@@ -2683,60 +2767,57 @@ circuits_handle_oom(size_t current_allocation)
 
   now_ts = monotime_coarse_get_stamp();
 
+  /* Rather than sorting every circuit and connection, build max-heaps keyed
+   * on the age of the oldest queued item: that is O(n), and each victim we
+   * actually kill only costs O(log n) more. Usually we stop long before
+   * draining either heap. */
   circlist = circuit_get_global_list();
+  n_circ_heap = smartlist_len(circlist);
+  circ_heap = tor_calloc(n_circ_heap ? n_circ_heap : 1,
+                         sizeof(oom_heap_ent_t));
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
     circ->age_tmp = circuit_max_queued_item_age(circ, now_ts);
+    circ_heap[circ_sl_idx].age = circ->age_tmp;
+    circ_heap[circ_sl_idx].item = circ;
   } SMARTLIST_FOREACH_END(circ);
+  oom_heap_build(circ_heap, n_circ_heap);
 
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* Now sort the connection array ... */
-  now_ts_for_buf_cmp = now_ts;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
-  now_ts_for_buf_cmp = 0;
-
-  /* Fix up the connection array to its new order. */
+  /* Only non-linked directory connections are candidates for freeing, so
+   * don't bother ordering anything else. */
+  conn_heap = tor_calloc(smartlist_len(connection_array) + 1,
+                         sizeof(oom_heap_ent_t));
   SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
+    if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
+      conn_heap[n_conn_heap].age = conn_get_buffer_age(conn, now_ts);
+      conn_heap[n_conn_heap].item = conn;
+      ++n_conn_heap;
+    }
   } SMARTLIST_FOREACH_END(conn);
+  oom_heap_build(conn_heap, n_conn_heap);
 
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
-  conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+  /* Okay, now pop the worst circuits and connections off their heaps. Let's
+   * mark them, and reclaim their storage aggressively. */
+  while (n_circ_heap) {
+    circuit_t *circ;
     size_t n;
     size_t freed;
 
     /* Free storage in any non-linked directory connections that have buffered
      * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
-      if (conn_age < circ->age_tmp) {
-        break;
-      }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
+    while (n_conn_heap && conn_heap[0].age >= circ_heap[0].age) {
+      connection_t *conn = oom_heap_pop(conn_heap, &n_conn_heap);
+      if (!conn->marked_for_close)
+        connection_mark_for_close(conn);
+      mem_recovered += single_conn_free_bytes(conn);
 
-        ++n_dirconns_killed;
+      ++n_dirconns_killed;
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
-      }
-      ++conn_idx;
+      if (mem_recovered >= mem_to_recover)
+        goto done_recovering_mem;
     }
 
     /* Now, kill the circuit. */
+    circ = oom_heap_pop(circ_heap, &n_circ_heap);
     n = n_cells_in_circ_queues(circ);
     const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
     if (! circ->marked_for_close) {
@@ -2754,9 +2835,11 @@ circuits_handle_oom(size_t current_allocation)
 
     if (mem_recovered >= mem_to_recover)
       goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+  }
 
  done_recovering_mem:
+  tor_free(circ_heap);
+  tor_free(conn_heap);
 
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -185,6 +185,7 @@ void circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
                                channel_t *chan);
 void channel_mark_circid_unusable(channel_t *chan, circid_t id);
 void channel_mark_circid_usable(channel_t *chan, circid_t id);
+void channel_free_circid_map(channel_t *chan);
 time_t circuit_id_when_marked_unusable_on_channel(circid_t circ_id,
                                                   channel_t *chan);
 void circuit_set_state(circuit_t *circ, uint8_t state);
@@ -243,12 +244,24 @@ MOCK_DECL(void, channel_note_destroy_not_pending,
 smartlist_t *circuit_find_circuits_to_upgrade_from_guard_wait(void);
 
 #ifdef CIRCUITLIST_PRIVATE
+/** An entry in one of the max-heaps that circuits_handle_oom() uses to pick
+ * the circuits and connections with the oldest queued data. */
+typedef struct oom_heap_ent_t {
+  /** Age of the oldest item queued on <b>item</b>, in timestamp units. */
+  uint32_t age;
+  /** The circuit_t or connection_t this entry refers to. */
+  void *item;
+} oom_heap_ent_t;
+
 STATIC void circuit_free_(circuit_t *circ);
 #define circuit_free(circ) FREE_AND_NULL(circuit_t, circuit_free_, (circ))
 STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
+STATIC void oom_heap_sift_down(oom_heap_ent_t *heap, int n, int idx);
+STATIC void oom_heap_build(oom_heap_ent_t *heap, int n);
+STATIC void *oom_heap_pop(oom_heap_ent_t *heap, int *n);
 #endif /* defined(CIRCUITLIST_PRIVATE) */
 
 #endif /* !defined(TOR_CIRCUITLIST_H) */
@@ -19,8 +19,14 @@
  * cell: that would be horribly inefficient.  Instead, we we keep the cell
  * count on all circuits on the same circuitmux scaled relative to a single
  * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * that has elapsed since the tick.  Since scaling every active circuit by
+ * the same factor doesn't change their order, we only re-scale the circuits
+ * on the circuitmux when the weight of a new cell gets large enough that we
+ * might otherwise overflow double.
+ *
+ * The active circuits on a circuitmux are kept in a 4-ary min-heap whose
+ * entries carry their cell count next to the cell_ewma_t pointer, so that
+ * sifting compares keys without chasing a pointer per comparison.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -57,6 +63,13 @@
 #define EPSILON 0.00001
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
+/** Once the factor that converts cell counts from the current tick to the
+ * tick that a circuitmux is scaled to grows beyond this, re-scale all the
+ * circuits on the circuitmux.  This keeps cell counts far away from the
+ * limits of double. */
+#define EWMA_MAX_SCALE_FACTOR 1e100
+/** How many children each node of the active circuit heap has. */
+#define EWMA_HEAP_ARITY 4
 
 /*** EWMA structures ***/
 
@@ -88,6 +101,14 @@ struct cell_ewma_s {
   int heap_index;
 };
 
+/** An entry in the priority queue of active circuits.  The cell count is
+ * duplicated here from the cell_ewma_t so that heap operations stay within
+ * the heap array. */
+typedef struct ewma_heap_ent_s {
+  double cell_count;
+  cell_ewma_t *ewma;
+} ewma_heap_ent_t;
+
 struct ewma_policy_data_s {
   circuitmux_policy_data_t base_;
 
@@ -97,7 +118,11 @@ struct ewma_policy_data_s {
    * in heap order according to EWMA.  This was formerly in channel_t, and
    * in or_connection_t before that.
    */
-  smartlist_t *active_circuit_pqueue;
+  ewma_heap_ent_t *active_circuit_pqueue;
+  /** Number of entries in active_circuit_pqueue. */
+  int n_active_circuits;
+  /** Number of allocated entries in active_circuit_pqueue. */
+  int active_circuit_pqueue_capacity;
 
   /**
    * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
@@ -170,11 +195,12 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
+static cell_ewma_t * first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
+static void update_first_cell_ewma(ewma_policy_data_t *pol,
+                                   double cell_count);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
@@ -273,7 +299,6 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
   pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
 
   return TO_CMUX_POL_DATA(pol);
@@ -294,7 +319,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuit_pqueue);
   tor_free(pol);
 }
 
@@ -431,8 +456,8 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
   unsigned int tick;
-  double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  double fractional_tick, ewma_increment, scale;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -443,28 +468,29 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
+  /* The active circuits stay scaled relative to the tick on which they were
+   * last rescaled; only rescale them if a cell sent now would weigh too
+   * much relative to that tick. */
   tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  scale = get_scale_factor(tick, pol->active_circuit_pqueue_last_recalibrated);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
+  if (scale > EWMA_MAX_SCALE_FACTOR) {
     scale_active_circuits(pol, tick);
+    scale = 1.0;
   }
 
   /* How much do we adjust the cell count in cell_ewma by? */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
-
-  /* Do the adjustment */
-  cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick) * scale;
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Adjust its cell count, and move it down the queue as
+   * needed.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  cell_ewma = &(cdata->cell_ewma);
+  tor_assert(first_cell_ewma(pol) == cell_ewma);
+  update_first_cell_ewma(pol, cell_ewma->cell_count + ewma_increment);
 }
 
 /**
@@ -486,9 +512,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->n_active_circuits > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = first_cell_ewma(pol);
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -506,6 +532,8 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 {
   ewma_policy_data_t *p1 = NULL, *p2 = NULL;
   cell_ewma_t *ce1 = NULL, *ce2 = NULL;
+  unsigned int tick1, tick2;
+  double count1, count2;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
@@ -517,18 +545,33 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
   if (p1 != p2) {
     /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
+    if (p1->n_active_circuits > 0) {
+      ce1 = first_cell_ewma(p1);
     }
 
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
+    if (p2->n_active_circuits > 0) {
+      ce2 = first_cell_ewma(p2);
     }
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      /* Pick whichever one has the better best circuit.  The two queues may
+       * be scaled relative to different ticks, so bring both counts to the
+       * later one before comparing. */
+      tick1 = p1->active_circuit_pqueue_last_recalibrated;
+      tick2 = p2->active_circuit_pqueue_last_recalibrated;
+      count1 = ce1->cell_count;
+      count2 = ce2->cell_count;
+      if ((int)(tick2 - tick1) > 0)
+        count1 *= get_scale_factor(tick1, tick2);
+      else
+        count2 *= get_scale_factor(tick2, tick1);
+      if (count1 < count2)
+        return -1;
+      else if (count1 > count2)
+        return 1;
+      else
+        return 0;
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -547,20 +590,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
-{
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
-    return -1;
-  else if (e1->cell_count > e2->cell_count)
-    return 1;
-  else
-    return 0;
-}
-
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -750,9 +779,9 @@ static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
   double factor;
+  int i;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
   factor =
     get_scale_factor(
@@ -760,24 +789,79 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
       cur_tick);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
+  for (i = 0; i < pol->n_active_circuits; ++i) {
+    ewma_heap_ent_t *ent = &pol->active_circuit_pqueue[i];
+    tor_assert(ent->ewma->last_adjusted_tick ==
                pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
+    ent->cell_count *= factor;
+    ent->ewma->cell_count = ent->cell_count;
+    ent->ewma->last_adjusted_tick = cur_tick;
+  }
   pol->active_circuit_pqueue_last_recalibrated = cur_tick;
 }
 
+/** Helper: store <b>ent</b> at position <b>idx</b> of <b>pol</b>'s
+ * priority queue, and let its cell_ewma_t know where it is. */
+static inline void
+ewma_heap_set(ewma_policy_data_t *pol, int idx, const ewma_heap_ent_t *ent)
+{
+  pol->active_circuit_pqueue[idx] = *ent;
+  ent->ewma->heap_index = idx;
+}
+
+/** Helper: move the entry at <b>idx</b> of <b>pol</b>'s priority queue up
+ * towards the root until the heap property holds again. */
+static void
+ewma_heap_sift_up(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_ent_t ent = pol->active_circuit_pqueue[idx];
+
+  while (idx > 0) {
+    int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    if (pol->active_circuit_pqueue[parent].cell_count <= ent.cell_count)
+      break;
+    ewma_heap_set(pol, idx, &pol->active_circuit_pqueue[parent]);
+    idx = parent;
+  }
+  ewma_heap_set(pol, idx, &ent);
+}
+
+/** Helper: move the entry at <b>idx</b> of <b>pol</b>'s priority queue down
+ * towards the leaves until the heap property holds again. */
+static void
+ewma_heap_sift_down(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_ent_t ent = pol->active_circuit_pqueue[idx];
+  const int n = pol->n_active_circuits;
+
+  for (;;) {
+    int first_child = idx * EWMA_HEAP_ARITY + 1;
+    int last_child = MIN(first_child + EWMA_HEAP_ARITY, n);
+    int best = -1, c;
+    double best_count = ent.cell_count;
+
+    for (c = first_child; c < last_child; ++c) {
+      if (pol->active_circuit_pqueue[c].cell_count < best_count) {
+        best = c;
+        best_count = pol->active_circuit_pqueue[c].cell_count;
+      }
+    }
+    if (best < 0)
+      break;
+    ewma_heap_set(pol, idx, &pol->active_circuit_pqueue[best]);
+    idx = best;
+  }
+  ewma_heap_set(pol, idx, &ent);
+}
+
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
  * <b>pol</b>'s priority queue of active circuits */
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_ent_t ent;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
@@ -785,38 +869,77 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  if (pol->n_active_circuits == pol->active_circuit_pqueue_capacity) {
+    int new_capacity = pol->active_circuit_pqueue_capacity ?
+      pol->active_circuit_pqueue_capacity * 2 : 16;
+    pol->active_circuit_pqueue =
+      tor_reallocarray(pol->active_circuit_pqueue, new_capacity,
+                       sizeof(ewma_heap_ent_t));
+    pol->active_circuit_pqueue_capacity = new_capacity;
+  }
+
+  ent.cell_count = ewma->cell_count;
+  ent.ewma = ewma;
+  ewma_heap_set(pol, pol->n_active_circuits++, &ent);
+  ewma_heap_sift_up(pol, pol->n_active_circuits - 1);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  int idx;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
+  idx = ewma->heap_index;
+  tor_assert(idx < pol->n_active_circuits);
+  tor_assert(pol->active_circuit_pqueue[idx].ewma == ewma);
+  ewma->heap_index = -1;
+
+  --pol->n_active_circuits;
+  if (idx == pol->n_active_circuits)
+    return;
+
+  /* Fill the hole with the last entry, and move it whichever way it needs
+   * to go. */
+  ewma_heap_set(pol, idx, &pol->active_circuit_pqueue[pol->n_active_circuits]);
+  if (idx > 0 &&
+      pol->active_circuit_pqueue[(idx - 1) / EWMA_HEAP_ARITY].cell_count >
+      pol->active_circuit_pqueue[idx].cell_count)
+    ewma_heap_sift_up(pol, idx);
+  else
+    ewma_heap_sift_down(pol, idx);
 }
 
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
+/** Return the first cell_ewma_t from pol's priority queue of active
+ * circuits.  Requires that the priority queue is nonempty. */
 static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
+first_cell_ewma(ewma_policy_data_t *pol)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(pol->n_active_circuits > 0);
+
+  return pol->active_circuit_pqueue[0].ewma;
+}
+
+/** Set the cell count of the first cell_ewma_t in pol's priority queue of
+ * active circuits to <b>cell_count</b>, which must be no smaller than its
+ * current value, and restore heap order. */
+static void
+update_first_cell_ewma(ewma_policy_data_t *pol, double cell_count)
+{
+  ewma_heap_ent_t *ent;
+
+  tor_assert(pol);
+  tor_assert(pol->n_active_circuits > 0);
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  ent = &pol->active_circuit_pqueue[0];
+  ent->cell_count = cell_count;
+  ent->ewma->cell_count = cell_count;
+  ewma_heap_sift_down(pol, 0);
 }
 
 /**
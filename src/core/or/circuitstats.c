@@ -44,6 +44,7 @@
 #include "lib/time/tvdiff.h"
 #include "lib/encoding/confline.h"
 #include "feature/dirauth/authmode.h"
+#include "feature/split/splitdefines.h"
 
 #include "core/or/crypt_path_st.h"
 #include "core/or/origin_circuit_st.h"
@@ -56,6 +57,10 @@ static void cbt_control_event_buildtimeout_set(
                                   const circuit_build_times_t *cbt,
                                   buildtimeout_set_event_t type);
 static void circuit_build_times_scale_circ_counts(circuit_build_times_t *cbt);
+static void circuit_build_times_handle_completed_split_hop(
+                                    origin_circuit_t *circ);
+static int circuit_build_times_set_timeout_worker(circuit_build_times_t *cbt);
+static double circuit_build_times_get_initial_timeout(void);
 
 #define CBT_BIN_TO_MS(bin) ((bin)*CBT_BIN_WIDTH + (CBT_BIN_WIDTH/2))
 
@@ -67,6 +72,13 @@ static void circuit_build_times_scale_circ_counts(circuit_build_times_t *cbt);
 // most likely.
 static circuit_build_times_t circ_times;
 
+/** Circuit build times for split sub-circuits (CIRCUIT_PURPOSE_SPLIT_JOIN).
+ * These are only two hops long, to a middle we already picked, so they get
+ * a model of their own. We don't save it in the state file. */
+static circuit_build_times_t split_circ_times;
+/** True iff split_circ_times has been set up. */
+static int split_circ_times_initialized = 0;
+
 #ifdef TOR_UNIT_TESTS
 /** If set, we're running the unit tests: we should avoid clobbering
  * our state file or accessing get_options() or get_or_state() */
@@ -90,6 +102,32 @@ get_circuit_build_times_mutable(void)
   return &circ_times;
 }
 
+/** Return a mutable pointer to the circuit build time history for split
+ * sub-circuits, setting it up if needed. */
+circuit_build_times_t *
+get_split_circuit_build_times_mutable(void)
+{
+  if (!split_circ_times_initialized) {
+    memset(&split_circ_times, 0, sizeof(split_circ_times));
+    split_circ_times.close_ms = split_circ_times.timeout_ms =
+      circuit_build_times_get_initial_timeout();
+    split_circ_times_initialized = 1;
+  }
+  return &split_circ_times;
+}
+
+/** Return the time to wait before giving up on an under-construction split
+ * sub-circuit, in milliseconds, or a negative value if we haven't learned
+ * one yet. */
+double
+get_split_circuit_build_timeout_ms(void)
+{
+  if (!split_circ_times_initialized ||
+      !split_circ_times.have_computed_timeout)
+    return -1;
+  return split_circ_times.timeout_ms;
+}
+
 /** Return the time to wait before actually closing an under-construction, in
  * milliseconds. */
 double
@@ -548,6 +586,15 @@ STATIC void
 circuit_build_times_reset(circuit_build_times_t *cbt)
 {
   memset(cbt->circuit_build_times, 0, sizeof(cbt->circuit_build_times));
+  memset(cbt->histogram, 0, sizeof(cbt->histogram));
+  memset(cbt->histogram_log_sum, 0, sizeof(cbt->histogram_log_sum));
+  cbt->total_log_sum = 0;
+  cbt->num_in_histogram = 0;
+  memset(cbt->bin_first, 0, sizeof(cbt->bin_first));
+  memset(cbt->bin_next, 0, sizeof(cbt->bin_next));
+  memset(cbt->bin_prev, 0, sizeof(cbt->bin_prev));
+  cbt->num_abandoned = 0;
+  cbt->max_build_time = 0;
   cbt->total_build_times = 0;
   cbt->build_times_idx = 0;
   cbt->have_computed_timeout = 0;
@@ -690,6 +737,12 @@ circuit_build_times_handle_completed_hop(origin_circuit_t *circ)
     return;
   }
 
+  /* Split sub-circuits have a model of their own. */
+  if (circ->base_.purpose == CIRCUIT_PURPOSE_SPLIT_JOIN) {
+    circuit_build_times_handle_completed_split_hop(circ);
+    return;
+  }
+
   /* Is this a circuit for which the timeout applies in a straight-forward
    * way? If so, handle it below. If not, just return (and let
    * circuit_expire_building() eventually take care of it).
@@ -748,6 +801,111 @@ circuit_build_times_handle_completed_hop(origin_circuit_t *circ)
   }
 }
 
+/** Return the histogram bin in which we count build time <b>btime</b>. */
+static inline int
+cbt_histogram_bin(build_time_t btime)
+{
+  return (int) MIN(btime / CBT_BIN_WIDTH,
+                   (build_time_t)(CBT_NHISTOGRAM_BINS - 1));
+}
+
+/** Count <b>btime</b>, which has just been stored at index <b>idx</b> of
+ * <b>cbt</b>'s build times, in the running histogram and estimator sums. */
+static void
+cbt_histogram_note_added(circuit_build_times_t *cbt, int idx,
+                         build_time_t btime)
+{
+  int bin;
+  double lg;
+
+  if (btime == 0) /* 0 <-> uninitialized */
+    return;
+  if (btime == CBT_BUILD_ABANDONED) {
+    cbt->num_abandoned++;
+    return;
+  }
+
+  bin = cbt_histogram_bin(btime);
+  lg = tor_mathlog(btime);
+  cbt->histogram[bin]++;
+  cbt->histogram_log_sum[bin] += lg;
+  cbt->total_log_sum += lg;
+  cbt->num_in_histogram++;
+  if (btime > cbt->max_build_time)
+    cbt->max_build_time = btime;
+
+  cbt->bin_prev[idx] = 0;
+  cbt->bin_next[idx] = cbt->bin_first[bin];
+  if (cbt->bin_first[bin])
+    cbt->bin_prev[cbt->bin_first[bin] - 1] = idx + 1;
+  cbt->bin_first[bin] = idx + 1;
+}
+
+/** Stop counting <b>btime</b>, which has just been overwritten at index
+ * <b>idx</b> of <b>cbt</b>'s build times, in the running histogram and
+ * estimator sums. */
+static void
+cbt_histogram_note_removed(circuit_build_times_t *cbt, int idx,
+                           build_time_t btime)
+{
+  int bin, j;
+  double lg;
+
+  if (btime == 0)
+    return;
+  if (btime == CBT_BUILD_ABANDONED) {
+    if (!BUG(cbt->num_abandoned == 0))
+      cbt->num_abandoned--;
+    return;
+  }
+
+  bin = cbt_histogram_bin(btime);
+  if (BUG(cbt->histogram[bin] == 0))
+    return;
+  lg = tor_mathlog(btime);
+  if (--cbt->histogram[bin] == 0) {
+    /* Don't let rounding errors pile up in empty bins. */
+    cbt->histogram_log_sum[bin] = 0;
+  } else {
+    cbt->histogram_log_sum[bin] -= lg;
+  }
+  cbt->total_log_sum -= lg;
+  cbt->num_in_histogram--;
+
+  if (cbt->bin_prev[idx])
+    cbt->bin_next[cbt->bin_prev[idx] - 1] = cbt->bin_next[idx];
+  else
+    cbt->bin_first[bin] = cbt->bin_next[idx];
+  if (cbt->bin_next[idx])
+    cbt->bin_prev[cbt->bin_next[idx] - 1] = cbt->bin_prev[idx];
+  cbt->bin_next[idx] = cbt->bin_prev[idx] = 0;
+
+  if (btime == cbt->max_build_time) {
+    /* The new largest value is in the highest bin that isn't empty. */
+    cbt->max_build_time = 0;
+    for (; bin >= 0 && !cbt->histogram[bin]; --bin)
+      ;
+    if (bin >= 0) {
+      for (j = cbt->bin_first[bin]; j; j = cbt->bin_next[j - 1]) {
+        if (cbt->circuit_build_times[j - 1] > cbt->max_build_time)
+          cbt->max_build_time = cbt->circuit_build_times[j - 1];
+      }
+    }
+  }
+}
+
+/** Replace the build time in slot <b>idx</b> of <b>cbt</b> with
+ * <b>btime</b>, keeping the histogram up to date. */
+static void
+circuit_build_times_store(circuit_build_times_t *cbt, int idx,
+                          build_time_t btime)
+{
+  build_time_t old = cbt->circuit_build_times[idx];
+  cbt->circuit_build_times[idx] = btime;
+  cbt_histogram_note_removed(cbt, idx, old);
+  cbt_histogram_note_added(cbt, idx, btime);
+}
+
 /**
  * Add a new build time value <b>time</b> to the set of build times. Time
  * units are milliseconds.
@@ -767,12 +925,13 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t btime)
 
   log_debug(LD_CIRC, "Adding circuit build time %u", btime);
 
-  cbt->circuit_build_times[cbt->build_times_idx] = btime;
+  circuit_build_times_store(cbt, cbt->build_times_idx, btime);
   cbt->build_times_idx = (cbt->build_times_idx + 1) % CBT_NCIRCUITS_TO_OBSERVE;
   if (cbt->total_build_times < CBT_NCIRCUITS_TO_OBSERVE)
     cbt->total_build_times++;
 
-  if ((cbt->total_build_times % CBT_SAVE_STATE_EVERY) == 0) {
+  if (cbt == &circ_times &&
+      (cbt->total_build_times % CBT_SAVE_STATE_EVERY) == 0) {
     /* Save state every n circuit builds */
     if (!unit_tests && !get_options()->AvoidDiskWrites)
       or_state_mark_dirty(get_or_state(), 0);
@@ -787,14 +946,7 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t btime)
 static build_time_t
 circuit_build_times_max(const circuit_build_times_t *cbt)
 {
-  int i = 0;
-  build_time_t max_build_time = 0;
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] > max_build_time
-            && cbt->circuit_build_times[i] != CBT_BUILD_ABANDONED)
-      max_build_time = cbt->circuit_build_times[i];
-  }
-  return max_build_time;
+  return cbt->max_build_time;
 }
 
 #if 0
@@ -823,6 +975,9 @@ circuit_build_times_min(circuit_build_times_t *cbt)
  * the frequency of index*CBT_BIN_WIDTH millisecond
  * build times. Also outputs the number of bins in nbins.
  *
+ * Unlike cbt->histogram, this has a bin for every build time, however
+ * large, so we use it for the state file.
+ *
  * The return value must be freed by the caller.
  */
 static uint32_t *
@@ -864,10 +1019,11 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   build_time_t *nth_max_bin;
   int32_t bin_counts=0;
   build_time_t ret = 0;
-  uint32_t *histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  const uint16_t *histogram = cbt->histogram;
   int n=0;
   int num_modes = circuit_build_times_default_num_xm_modes();
 
+  nbins = 1 + cbt_histogram_bin(circuit_build_times_max(cbt));
   tor_assert(nbins > 0);
   tor_assert(num_modes > 0);
 
@@ -917,7 +1073,6 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   ret /= bin_counts;
 
  done:
-  tor_free(histogram);
   tor_free(nth_max_bin);
 
   return ret;
@@ -1030,7 +1185,7 @@ circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
     if (cbt->circuit_build_times[i] > max_timeout) {
       build_time_t replaced = cbt->circuit_build_times[i];
       num_filtered++;
-      cbt->circuit_build_times[i] = CBT_BUILD_ABANDONED;
+      circuit_build_times_store(cbt, i, CBT_BUILD_ABANDONED);
 
       log_debug(LD_CIRC, "Replaced timeout %d with %d", replaced,
                cbt->circuit_build_times[i]);
@@ -1194,7 +1349,8 @@ circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 {
   build_time_t *x=cbt->circuit_build_times;
   double a = 0;
-  int n=0,i=0,abandoned_count=0;
+  int n=0,i=0,abandoned_count=0,xm_bin;
+  int n_below_xm=0;
   build_time_t max_time=0;
 
   /* http://en.wikipedia.org/wiki/Pareto_distribution#Parameter_estimation */
@@ -1208,22 +1364,28 @@ circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 
   tor_assert(cbt->Xm > 0);
 
-  for (i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (!x[i]) {
-      continue;
-    }
-
-    if (x[i] < cbt->Xm) {
-      a += tor_mathlog(cbt->Xm);
-    } else if (x[i] == CBT_BUILD_ABANDONED) {
-      abandoned_count++;
-    } else {
-      a += tor_mathlog(x[i]);
-      if (x[i] > max_time)
-        max_time = x[i];
+  /* Every sample below Xm counts as Xm, every other completed sample as
+   * itself. The running per-bin sums give us the total for all the bins
+   * that lie entirely below or above Xm; only Xm's own bin needs a look at
+   * the samples themselves. */
+  xm_bin = cbt_histogram_bin(cbt->Xm);
+  a = cbt->total_log_sum;
+  for (i = 0; i < xm_bin; i++) {
+    n_below_xm += cbt->histogram[i];
+    a -= cbt->histogram_log_sum[i];
+  }
+  for (i = cbt->bin_first[xm_bin]; i; i = cbt->bin_next[i - 1]) {
+    if (x[i - 1] < cbt->Xm) {
+      n_below_xm++;
+      a -= tor_mathlog(x[i - 1]);
     }
-    n++;
   }
+  a += n_below_xm*tor_mathlog(cbt->Xm);
+
+  abandoned_count = cbt->num_abandoned;
+  n = abandoned_count + cbt->num_in_histogram;
+  if (circuit_build_times_max(cbt) >= cbt->Xm)
+    max_time = circuit_build_times_max(cbt);
 
   /*
    * We are erring and asserting here because this can only happen
@@ -1632,6 +1794,9 @@ circuit_build_times_network_check_changed(circuit_build_times_t *cbt)
   }
 
   circuit_build_times_reset(cbt);
+  /* Whatever changed affects split sub-circuits too. */
+  if (cbt == &circ_times && split_circ_times_initialized)
+    circuit_build_times_reset(&split_circ_times);
   if (cbt->liveness.timeouts_after_firsthop &&
       cbt->liveness.num_recent_circs > 0) {
     memset(cbt->liveness.timeouts_after_firsthop, 0,
@@ -1694,17 +1859,10 @@ circuit_build_times_timeout_rate(const circuit_build_times_t *cbt)
 double
 circuit_build_times_close_rate(const circuit_build_times_t *cbt)
 {
-  int i=0,closed=0;
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED) {
-       closed++;
-    }
-  }
-
   if (!cbt->total_build_times)
     return 0;
 
-  return ((double)closed)/cbt->total_build_times;
+  return ((double)cbt->num_abandoned)/cbt->total_build_times;
 }
 
 /**
@@ -1876,6 +2034,92 @@ circuit_build_times_set_timeout(circuit_build_times_t *cbt)
   }
 }
 
+/**
+ * As circuit_build_times_set_timeout(), for the split sub-circuit model
+ * <b>cbt</b>. Controllers aren't told: BUILDTIMEOUT_SET events describe the
+ * general model.
+ */
+STATIC void
+circuit_build_times_set_split_timeout(circuit_build_times_t *cbt)
+{
+  if (circuit_build_times_disabled(get_options()))
+    return;
+
+  if (!circuit_build_times_set_timeout_worker(cbt))
+    return;
+
+  /* The worker caps the timeout at the largest build time we've seen. Split
+   * sub-circuits slower than our timeout are abandoned before we can measure
+   * them, so that cap would keep the timeout from ever growing: let the
+   * abandoned ones push it up instead, as far as the general close time. */
+  cbt->timeout_ms = MIN(circuit_build_times_calculate_timeout(cbt,
+                                 circuit_build_times_quantile_cutoff()),
+                        get_circuit_build_close_time_ms());
+  if (cbt->timeout_ms < circuit_build_times_min_timeout())
+    cbt->timeout_ms = circuit_build_times_min_timeout();
+
+  log_info(LD_CIRC,
+           "Set split sub-circuit build timeout to %fms (Xm: %d, a: %f, "
+           "r: %f) based on %d circuit times",
+           cbt->timeout_ms, cbt->Xm, cbt->alpha,
+           circuit_build_times_close_rate(cbt), cbt->total_build_times);
+}
+
+/**
+ * Called when the split sub-circuit <b>circ</b> has completed a hop. If it
+ * is now built, add its build time to the split sub-circuit model.
+ */
+static void
+circuit_build_times_handle_completed_split_hop(origin_circuit_t *circ)
+{
+  circuit_build_times_t *cbt;
+  struct timeval end;
+  long timediff;
+
+  if (circ->has_opened ||
+      circuit_get_cpath_opened_len(circ) != SPLIT_DEFAULT_ROUTE_LEN)
+    return;
+
+  tor_gettimeofday(&end);
+  timediff = tv_mdiff(&circ->base_.timestamp_began, &end);
+
+  if (timediff <= 0 ||
+      timediff > 2*get_circuit_build_close_time_ms()+1000) {
+    log_info(LD_CIRC, "Strange value for split sub-circuit build time: "
+             "%ldmsec. Assuming clock jump.", timediff);
+    return;
+  }
+
+  /* Only count circuit times if the network is live */
+  if (!circuit_build_times_network_check_live(get_circuit_build_times()))
+    return;
+
+  cbt = get_split_circuit_build_times_mutable();
+  circuit_build_times_add_time(cbt, (build_time_t)timediff);
+  circuit_build_times_set_split_timeout(cbt);
+}
+
+/**
+ * Note that a split sub-circuit took longer than the split timeout to build,
+ * and is about to be closed. We count it as abandoned, so that the split
+ * model doesn't only learn from the sub-circuits that were fast enough.
+ */
+void
+circuit_build_times_count_split_timeout(void)
+{
+  circuit_build_times_t *cbt;
+
+  if (circuit_build_times_disabled(get_options()))
+    return;
+
+  if (!circuit_build_times_network_check_live(get_circuit_build_times()))
+    return;
+
+  cbt = get_split_circuit_build_times_mutable();
+  circuit_build_times_add_time(cbt, CBT_BUILD_ABANDONED);
+  circuit_build_times_set_split_timeout(cbt);
+}
+
 #ifdef TOR_UNIT_TESTS
 /** Make a note that we're running unit tests (rather than running Tor
  * itself), so we avoid clobbering our state file. */
@@ -16,6 +16,9 @@ const circuit_build_times_t *get_circuit_build_times(void);
 circuit_build_times_t *get_circuit_build_times_mutable(void);
 double get_circuit_build_close_time_ms(void);
 double get_circuit_build_timeout_ms(void);
+circuit_build_times_t *get_split_circuit_build_times_mutable(void);
+double get_split_circuit_build_timeout_ms(void);
+void circuit_build_times_count_split_timeout(void);
 
 int circuit_build_times_disabled(const or_options_t *options);
 int circuit_build_times_disabled_(const or_options_t *options,
@@ -57,6 +60,10 @@ void circuit_build_times_mark_circ_as_measurement_only(origin_circuit_t *circ);
 /** Width of the histogram bins in milliseconds */
 #define CBT_BIN_WIDTH ((build_time_t)50)
 
+/** Number of histogram bins we keep up to date as build times come and go.
+ * Build times too large for the last bin are counted in it. */
+#define CBT_NHISTOGRAM_BINS 4096
+
 /** Number of modes to use in the weighted-avg computation of Xm */
 #define CBT_DEFAULT_NUM_XM_MODES 3
 #define CBT_MIN_NUM_XM_MODES 1
@@ -133,11 +140,16 @@ int32_t circuit_build_times_initial_timeout(void);
 #error "RECENT_CIRCUITS is set too low."
 #endif
 
+#if CBT_NCIRCUITS_TO_OBSERVE >= UINT16_MAX
+#error "CBT_NCIRCUITS_TO_OBSERVE is too large for the histogram bin lists."
+#endif
+
 #ifdef CIRCUITSTATS_PRIVATE
 STATIC double circuit_build_times_calculate_timeout(circuit_build_times_t *cbt,
                                              double quantile);
 STATIC int circuit_build_times_update_alpha(circuit_build_times_t *cbt);
 STATIC void circuit_build_times_reset(circuit_build_times_t *cbt);
+STATIC void circuit_build_times_set_split_timeout(circuit_build_times_t *cbt);
 
 /* Network liveness functions */
 STATIC int circuit_build_times_network_check_changed(
@@ -182,6 +194,27 @@ struct circuit_build_times_s {
   int build_times_idx;
   /** Total number of build times accumulated. Max CBT_NCIRCUITS_TO_OBSERVE */
   int total_build_times;
+  /** Number of circuit_build_times in each CBT_BIN_WIDTH-wide bin, not
+   * counting abandoned circuits. */
+  uint16_t histogram[CBT_NHISTOGRAM_BINS];
+  /** Sum of the natural logarithms of the build times in each bin. */
+  double histogram_log_sum[CBT_NHISTOGRAM_BINS];
+  /** Sum of histogram_log_sum. */
+  double total_log_sum;
+  /** Sum of histogram. */
+  int num_in_histogram;
+  /** The build times in each bin, as doubly linked lists threaded through
+   * circuit_build_times by index.  bin_first[b] is one more than the index
+   * of the first build time in bin b, and bin_next[i] and bin_prev[i] are
+   * one more than the indices of the build times after and before index i
+   * in its bin.  0 marks the end of a list. */
+  uint16_t bin_first[CBT_NHISTOGRAM_BINS];
+  uint16_t bin_next[CBT_NCIRCUITS_TO_OBSERVE];
+  uint16_t bin_prev[CBT_NCIRCUITS_TO_OBSERVE];
+  /** Number of CBT_BUILD_ABANDONED values in circuit_build_times. */
+  int num_abandoned;
+  /** Largest value in circuit_build_times other than CBT_BUILD_ABANDONED. */
+  build_time_t max_build_time;
   /** Information about the state of our local network connection */
   network_liveness_t liveness;
   /** Last time we built a circuit. Used to decide to build new test circs */
@@ -567,7 +567,13 @@ circuit_expire_building(void)
              MAX(get_circuit_build_close_time_ms()*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  SET_CUTOFF(split_join_cutoff, get_circuit_build_timeout_ms() * (3/6.0));
+  /* Split sub-circuits learn a timeout of their own; until they have, scale
+   * the general one by their round trips. */
+  if (get_split_circuit_build_timeout_ms() > 0) {
+    SET_CUTOFF(split_join_cutoff, get_split_circuit_build_timeout_ms());
+  } else {
+    SET_CUTOFF(split_join_cutoff, get_circuit_build_timeout_ms() * (3/6.0));
+  }
 
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
     struct timeval cutoff;
@@ -785,6 +791,9 @@ circuit_expire_building(void)
           circuit_build_times_set_timeout(get_circuit_build_times_mutable());
         }
       }
+
+      if (victim->purpose == CIRCUIT_PURPOSE_SPLIT_JOIN)
+        circuit_build_times_count_split_timeout();
     }
 
     /* If this is a hidden service client circuit which is far enough along in
@@ -780,8 +780,8 @@ connection_or_about_to_close(or_connection_t *or_conn)
 
 /** Return 1 if identity digest <b>id_digest</b> is known to be a
  * currently or recently running relay. Otherwise return 0. */
-int
-connection_or_digest_is_known_relay(const char *id_digest)
+MOCK_IMPL(int,
+connection_or_digest_is_known_relay,(const char *id_digest))
 {
   if (router_get_consensus_status_by_id(id_digest))
     return 1; /* It's in the consensus: "yes" */
@@ -843,6 +843,44 @@ connection_or_update_token_buckets(smartlist_t *conns,
   });
 }
 
+/** How many seconds may an empty OR connection buffer go without traffic
+ * before we free the spare chunk that it keeps for reuse? */
+#define SPARE_CHUNK_IDLE_TIMEOUT 30
+
+/** Free the spare chunks that <b>conn</b>'s buffers keep for reuse, if those
+ * buffers are empty and have seen no traffic for a while. */
+void
+connection_or_release_idle_spare_chunks(or_connection_t *conn, time_t now)
+{
+  connection_t *c = TO_CONN(conn);
+
+  if (c->inbuf && !buf_datalen(c->inbuf) &&
+      c->timestamp_last_read_allowed + SPARE_CHUNK_IDLE_TIMEOUT < now)
+    buf_release_spare_chunk(c->inbuf);
+  if (c->outbuf && !buf_datalen(c->outbuf) &&
+      c->timestamp_last_write_allowed + SPARE_CHUNK_IDLE_TIMEOUT < now)
+    buf_release_spare_chunk(c->outbuf);
+}
+
+/** We're low on memory: free the spare chunks that every OR connection keeps
+ * for reuse, and return the number of bytes that we freed. */
+size_t
+connection_or_release_all_spare_chunks(void)
+{
+  size_t freed = 0;
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type != CONN_TYPE_OR && conn->type != CONN_TYPE_EXT_OR)
+      continue;
+    if (conn->inbuf)
+      freed += buf_release_spare_chunk(conn->inbuf);
+    if (conn->outbuf)
+      freed += buf_release_spare_chunk(conn->outbuf);
+  } SMARTLIST_FOREACH_END(conn);
+
+  return freed;
+}
+
 /* Mark <b>or_conn</b> as canonical if <b>is_canonical</b> is set, and
  * non-canonical otherwise. Adjust idle_timeout accordingly.
  */
@@ -2389,11 +2427,19 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
 
       /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
+       * network-order string).  Unpack straight from the inbuf when the
+       * whole cell is in one chunk, which is nearly always. */
+      const char *head = buf_peek_contiguous(TO_CONN(conn)->inbuf,
+                                             cell_network_size);
+      if (head) {
+        cell_unpack(&cell, head, wide_circ_ids);
+        buf_drain(TO_CONN(conn)->inbuf, cell_network_size);
+      } else {
+        connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
+        cell_unpack(&cell, buf, wide_circ_ids);
+      }
 
       channel_tls_handle_cell(&cell, conn);
     }
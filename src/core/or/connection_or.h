@@ -60,9 +60,13 @@ int connection_or_flushed_some(or_connection_t *conn);
 int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
 void connection_or_about_to_close(or_connection_t *conn);
-int connection_or_digest_is_known_relay(const char *id_digest);
+MOCK_DECL(int, connection_or_digest_is_known_relay,
+          (const char *id_digest));
 void connection_or_update_token_buckets(smartlist_t *conns,
                                         const or_options_t *options);
+void connection_or_release_idle_spare_chunks(or_connection_t *conn,
+                                             time_t now);
+size_t connection_or_release_all_spare_chunks(void);
 
 void connection_or_connect_failed(or_connection_t *conn,
                                   int reason, const char *msg);
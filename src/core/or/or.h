@@ -628,6 +628,10 @@ typedef struct channel_tls_s channel_tls_t;
 
 typedef struct circuitmux_s circuitmux_t;
 
+/* chan_circid_map_t typedef; struct chan_circid_map_t is in circuitlist.c */
+
+typedef struct chan_circid_map_t chan_circid_map_t;
+
 typedef struct cell_t cell_t;
 typedef struct var_cell_t var_cell_t;
 typedef struct packed_cell_t packed_cell_t;
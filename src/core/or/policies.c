@@ -1533,6 +1533,315 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** Largest policy we're willing to compile.  Building the compiled form is
+ * roughly cubic in the number of rules, so past this point we just leave the
+ * policy to be walked linearly. */
+#define MAX_COMPILED_POLICY_LEN 256
+
+/** An IPv4 or IPv6 address in network order, padded with zeros to 16
+ * bytes. */
+typedef uint8_t policy_addr_bytes_t[16];
+
+/** The part of a compiled address policy that covers one address family. The
+ * address space is cut into runs of addresses that every rule treats the same
+ * way; each run has its own map of port runs to accept/reject decisions. */
+typedef struct compiled_family_policy_t {
+  /** Number of address runs. */
+  int n_addr_runs;
+  /** First address of each address run, in network order, padded with
+   * zeros to 16 bytes; sorted, with addr_starts[0] all zeros. */
+  policy_addr_bytes_t *addr_starts;
+  /** For each address run i, its port runs are at indices port_idx[i] up to
+   * port_idx[i+1] in port_starts and port_accept. */
+  int *port_idx;
+  /** First port of each port run; sorted within each address run, and the
+   * first port run of every address run starts at 0. */
+  uint16_t *port_starts;
+  /** True if the corresponding port run is accepted. */
+  uint8_t *port_accept;
+} compiled_family_policy_t;
+
+/** An address policy compiled for O(log n) matching of known addresses and
+ * ports.  See addr_policy_compile(). */
+struct addr_policy_compiled_t {
+  compiled_family_policy_t v4;
+  compiled_family_policy_t v6;
+};
+
+/** Helper for sorting and searching 16-byte addresses. */
+static int
+compare_addr_bytes_(const void **a, const void **b)
+{
+  return fast_memcmp(*a, *b, 16);
+}
+
+/** Set <b>lo</b> and <b>hi</b> to the first and last addresses, <b>len</b>
+ * bytes long and zero-padded to 16, that are matched by <b>rule</b>. */
+static void
+addr_policy_get_addr_range(const addr_policy_t *rule, int len,
+                           uint8_t *lo, uint8_t *hi)
+{
+  uint8_t addr[16];
+  int bits = rule->maskbits, i;
+
+  memset(addr, 0, sizeof(addr));
+  if (len == 4)
+    set_uint32(addr, htonl(tor_addr_to_ipv4h(&rule->addr)));
+  else
+    memcpy(addr, tor_addr_to_in6_addr8(&rule->addr), 16);
+
+  memset(lo, 0, 16);
+  memset(hi, 0, 16);
+  for (i = 0; i < len; ++i) {
+    uint8_t mask;
+    if (bits >= 8) {
+      mask = 0xff;
+      bits -= 8;
+    } else {
+      mask = (uint8_t)(0xff << (8 - bits));
+      bits = 0;
+    }
+    lo[i] = addr[i] & mask;
+    hi[i] = addr[i] | (uint8_t)~mask;
+  }
+}
+
+/** Increment the <b>len</b>-byte address <b>a</b>.  Return false if it
+ * wrapped around. */
+static int
+addr_bytes_increment(uint8_t *a, int len)
+{
+  int i;
+  for (i = len - 1; i >= 0; --i) {
+    if (++a[i])
+      return 1;
+  }
+  return 0;
+}
+
+/** Helper for sorting port numbers. */
+static int
+compare_ports_(const void *a, const void *b)
+{
+  return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/** Compile every rule in <b>policy</b> of address family <b>family</b> into
+ * <b>out</b>. */
+static void
+compile_family_policy(const smartlist_t *policy, sa_family_t family,
+                      compiled_family_policy_t *out)
+{
+  const int len = (family == AF_INET) ? 4 : 16;
+  smartlist_t *rules = smartlist_new();
+  smartlist_t *starts = smartlist_new();
+  policy_addr_bytes_t *lo, *hi;
+  const addr_policy_t **covering;
+  uint16_t *ports;
+  int n_rules, n_ports_alloc, n_ports = 0, i, j;
+
+  SMARTLIST_FOREACH(policy, addr_policy_t *, rule,
+                    if (tor_addr_family(&rule->addr) == family)
+                      smartlist_add(rules, rule));
+  n_rules = smartlist_len(rules);
+  lo = tor_calloc(n_rules + 1, sizeof(*lo));
+  hi = tor_calloc(n_rules + 1, sizeof(*hi));
+  covering = tor_calloc(n_rules + 1, sizeof(addr_policy_t *));
+  ports = tor_calloc(2*n_rules + 1, sizeof(uint16_t));
+
+  /* Every address at which some rule starts or stops matching begins a new
+   * address run. */
+  smartlist_add(starts, tor_malloc_zero(16));
+  for (i = 0; i < n_rules; ++i) {
+    uint8_t *after;
+    addr_policy_get_addr_range(smartlist_get(rules, i), len, lo[i], hi[i]);
+    smartlist_add(starts, tor_memdup(lo[i], 16));
+    after = tor_memdup(hi[i], 16);
+    if (addr_bytes_increment(after, len))
+      smartlist_add(starts, after);
+    else
+      tor_free(after);
+  }
+  smartlist_sort(starts, compare_addr_bytes_);
+  smartlist_uniq(starts, compare_addr_bytes_, tor_free_);
+
+  n_ports_alloc = smartlist_len(starts) * 4;
+  out->addr_starts = tor_calloc(smartlist_len(starts), 16);
+  out->port_idx = tor_calloc(smartlist_len(starts) + 1, sizeof(int));
+  out->port_starts = tor_calloc(n_ports_alloc, sizeof(uint16_t));
+  out->port_accept = tor_calloc(n_ports_alloc, sizeof(uint8_t));
+  out->n_addr_runs = 0;
+
+  SMARTLIST_FOREACH_BEGIN(starts, const uint8_t *, start) {
+    const int first_port = n_ports;
+    int n_covering = 0, n_boundaries = 0;
+
+    /* Find the rules that match this address run, in order. */
+    for (i = 0; i < n_rules; ++i) {
+      if (fast_memcmp(lo[i], start, 16) <= 0 &&
+          fast_memcmp(start, hi[i], 16) <= 0)
+        covering[n_covering++] = smartlist_get(rules, i);
+    }
+
+    /* Likewise cut the ports into runs, and take the first match for each. */
+    ports[n_boundaries++] = 0;
+    for (i = 0; i < n_covering; ++i) {
+      ports[n_boundaries++] = covering[i]->prt_min;
+      if (covering[i]->prt_max < 65535)
+        ports[n_boundaries++] = covering[i]->prt_max + 1;
+    }
+    qsort(ports, n_boundaries, sizeof(uint16_t), compare_ports_);
+
+    for (i = 0; i < n_boundaries; ++i) {
+      uint8_t accept = 1; /* accept all by default. */
+      if (i && ports[i] == ports[i-1])
+        continue;
+      for (j = 0; j < n_covering; ++j) {
+        if (covering[j]->prt_min <= ports[i] &&
+            ports[i] <= covering[j]->prt_max) {
+          accept = covering[j]->policy_type == ADDR_POLICY_ACCEPT;
+          break;
+        }
+      }
+      if (n_ports > first_port && out->port_accept[n_ports-1] == accept)
+        continue;
+      if (n_ports == n_ports_alloc) {
+        n_ports_alloc *= 2;
+        out->port_starts = tor_reallocarray(out->port_starts, n_ports_alloc,
+                                            sizeof(uint16_t));
+        out->port_accept = tor_reallocarray(out->port_accept, n_ports_alloc,
+                                            sizeof(uint8_t));
+      }
+      out->port_starts[n_ports] = ports[i];
+      out->port_accept[n_ports] = accept;
+      ++n_ports;
+    }
+
+    /* If this address run behaves exactly like the previous one, fold them
+     * together. */
+    if (out->n_addr_runs) {
+      const int prev = out->port_idx[out->n_addr_runs-1];
+      const int n_prev = first_port - prev;
+      if (n_prev == n_ports - first_port &&
+          fast_memeq(&out->port_starts[prev], &out->port_starts[first_port],
+                     n_prev * sizeof(uint16_t)) &&
+          fast_memeq(&out->port_accept[prev], &out->port_accept[first_port],
+                     n_prev)) {
+        n_ports = first_port;
+        continue;
+      }
+    }
+    memcpy(out->addr_starts[out->n_addr_runs], start, 16);
+    out->port_idx[out->n_addr_runs] = first_port;
+    ++out->n_addr_runs;
+  } SMARTLIST_FOREACH_END(start);
+  out->port_idx[out->n_addr_runs] = n_ports;
+
+  SMARTLIST_FOREACH(starts, uint8_t *, s, tor_free(s));
+  smartlist_free(starts);
+  smartlist_free(rules);
+  tor_free(lo);
+  tor_free(hi);
+  tor_free(covering);
+  tor_free(ports);
+}
+
+/** Compile <b>policy</b> into a form that
+ * compare_tor_addr_to_compiled_policy() can match in O(log n) time, with
+ * the same results that compare_tor_addr_to_addr_policy() would give for a
+ * known address and port.  Return NULL if the policy is too large to be
+ * worth compiling, or contains rules we can't compile; callers should then
+ * use the policy itself. */
+addr_policy_compiled_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  addr_policy_compiled_t *result;
+
+  if (!policy || smartlist_len(policy) > MAX_COMPILED_POLICY_LEN)
+    return NULL;
+  SMARTLIST_FOREACH(policy, addr_policy_t *, rule, {
+    sa_family_t family = tor_addr_family(&rule->addr);
+    if (family != AF_INET && family != AF_INET6)
+      return NULL;
+  });
+
+  result = tor_malloc_zero(sizeof(addr_policy_compiled_t));
+  compile_family_policy(policy, AF_INET, &result->v4);
+  compile_family_policy(policy, AF_INET6, &result->v6);
+  return result;
+}
+
+/** Release all storage held by <b>f</b>. */
+static void
+compiled_family_policy_clear(compiled_family_policy_t *f)
+{
+  tor_free(f->addr_starts);
+  tor_free(f->port_idx);
+  tor_free(f->port_starts);
+  tor_free(f->port_accept);
+}
+
+/** Release all storage held by <b>compiled</b>. */
+void
+addr_policy_compiled_free_(addr_policy_compiled_t *compiled)
+{
+  if (!compiled)
+    return;
+  compiled_family_policy_clear(&compiled->v4);
+  compiled_family_policy_clear(&compiled->v6);
+  tor_free(compiled);
+}
+
+/** As compare_tor_addr_to_addr_policy(), but use a policy compiled with
+ * addr_policy_compile().  Both <b>addr</b> and <b>port</b> must be known:
+ * <b>addr</b> must not be a null address, and <b>port</b> must not be 0. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const addr_policy_compiled_t *compiled)
+{
+  const compiled_family_policy_t *f;
+  uint8_t key[16];
+  int lo, hi;
+
+  tor_assert(compiled);
+  tor_assert(port);
+  memset(key, 0, sizeof(key));
+  if (tor_addr_family(addr) == AF_INET) {
+    f = &compiled->v4;
+    set_uint32(key, htonl(tor_addr_to_ipv4h(addr)));
+  } else if (tor_addr_family(addr) == AF_INET6) {
+    f = &compiled->v6;
+    memcpy(key, tor_addr_to_in6_addr8(addr), 16);
+  } else {
+    /* No rule can match another family: accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+
+  /* Find the last address run starting at or before addr... */
+  lo = 0;
+  hi = f->n_addr_runs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (fast_memcmp(f->addr_starts[mid], key, 16) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  /* ...then the last port run within it starting at or before port. */
+  hi = f->port_idx[lo+1] - 1;
+  lo = f->port_idx[lo];
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (f->port_starts[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return f->port_accept[lo] ? ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -2696,6 +3005,17 @@ policy_summarize(smartlist_t *policy, sa_family_t family)
   return result;
 }
 
+/** Helper for parse_short_policy(): log <b>msg</b>, followed by the
+ * escaped policy <b>summary</b>.  We don't use escaped() here, since
+ * microdescriptors (and their summaries) can be parsed in a worker thread. */
+static void
+log_bad_short_policy(const char *msg, const char *summary)
+{
+  char *esc = esc_for_log(summary);
+  log_fn(LOG_PROTOCOL_WARN, LD_DIR, "%s %s", msg, esc);
+  tor_free(esc);
+}
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
  * if the string is not well-formed. */
 short_policy_t *
@@ -2704,7 +3024,7 @@ parse_short_policy(const char *summary)
   const char *orig_summary = summary;
   short_policy_t *result;
   int is_accept;
-  int n_entries;
+  int n_entries, i;
   short_policy_entry_t entries[MAX_EXITPOLICY_SUMMARY_LEN]; /* overkill */
   const char *next;
 
@@ -2731,8 +3051,7 @@ parse_short_policy(const char *summary)
     len = comma ? (size_t)(comma - summary) : strlen(summary);
 
     if (n_entries == MAX_EXITPOLICY_SUMMARY_LEN) {
-      log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Impossibly long policy summary %s",
-             escaped(orig_summary));
+      log_bad_short_policy("Impossibly long policy summary", orig_summary);
       return NULL;
     }
 
@@ -2752,20 +3071,19 @@ parse_short_policy(const char *summary)
 
     if (tor_sscanf(ent_buf, "%u-%u%c", &low, &high, &dummy) == 2) {
       if (low<1 || low>65535 || high<1 || high>65535 || low>high) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-               "Found bad entry in policy summary %s", escaped(orig_summary));
+        log_bad_short_policy("Found bad entry in policy summary",
+                             orig_summary);
         return NULL;
       }
     } else if (tor_sscanf(ent_buf, "%u%c", &low, &dummy) == 1) {
       if (low<1 || low>65535) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-               "Found bad entry in policy summary %s", escaped(orig_summary));
+        log_bad_short_policy("Found bad entry in policy summary",
+                             orig_summary);
         return NULL;
       }
       high = low;
     } else {
-      log_fn(LOG_PROTOCOL_WARN, LD_DIR,"Found bad entry in policy summary %s",
-             escaped(orig_summary));
+      log_bad_short_policy("Found bad entry in policy summary", orig_summary);
       return NULL;
     }
 
@@ -2775,8 +3093,8 @@ parse_short_policy(const char *summary)
   }
 
   if (n_entries == 0) {
-    log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-           "Found no port-range entries in summary %s", escaped(orig_summary));
+    log_bad_short_policy("Found no port-range entries in summary",
+                         orig_summary);
     return NULL;
   }
 
@@ -2791,6 +3109,14 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+  /* Summaries we generate are always sorted, but we can't count on it. */
+  result->entries_sorted = 1;
+  for (i = 1; i < n_entries; ++i) {
+    if (entries[i].min_port <= entries[i-1].max_port) {
+      result->entries_sorted = 0;
+      break;
+    }
+  }
   return result;
 }
 
@@ -2848,11 +3174,25 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
       (tor_addr_is_internal(addr, 0) || tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
+  if (policy->entries_sorted) {
+    /* Find the last entry starting at or before port. */
+    int lo = 0, hi = policy->n_entries - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (policy->entries[mid].min_port <= port)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    found_match = policy->entries[lo].min_port <= port &&
+                  port <= policy->entries[lo].max_port;
+  } else {
+    for (i=0; i < policy->n_entries; ++i) {
+      const short_policy_entry_t *e = &policy->entries[i];
+      if (e->min_port <= port && port <= e->max_port) {
+        found_match = 1;
+        break;
+      }
     }
   }
 
@@ -58,8 +58,11 @@ typedef struct short_policy_t {
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
+  /** True if the members of 'entries' are in increasing order and don't
+   * overlap, so that we can binary-search them. */
+  unsigned int entries_sorted : 1;
   /** The actual number of values in 'entries'. */
-  unsigned int n_entries : 31;
+  unsigned int n_entries : 30;
   /** An array of 0 or more short_policy_entry_t values, each describing a
    * range of ports that this policy accepts or rejects (depending on the
    * value of is_accept).
@@ -113,6 +116,14 @@ addr_policy_t *addr_policy_get_canonical_entry(addr_policy_t *ent);
 int addr_policies_eq(const smartlist_t *a, const smartlist_t *b);
 MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
     (const tor_addr_t *addr, uint16_t port, const smartlist_t *policy));
+typedef struct addr_policy_compiled_t addr_policy_compiled_t;
+addr_policy_compiled_t *addr_policy_compile(const smartlist_t *policy);
+void addr_policy_compiled_free_(addr_policy_compiled_t *compiled);
+#define addr_policy_compiled_free(c) \
+  FREE_AND_NULL(addr_policy_compiled_t, addr_policy_compiled_free_, (c))
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                              const tor_addr_t *addr, uint16_t port,
+                              const addr_policy_compiled_t *compiled);
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
@@ -2916,6 +2916,13 @@ cell_queues_check_size(void)
   alloc += geoip_client_cache_total;
   const size_t dns_cache_total = dns_cache_total_allocation();
   alloc += dns_cache_total;
+  if (alloc >= get_options()->MaxMemInQueues) {
+    /* Idle compression states and the spare chunks on OR connections only
+     * save us some setup work, so let them go before we decide that we're
+     * out of memory. */
+    alloc -= tor_compress_handle_oom();
+    alloc -= connection_or_release_all_spare_chunks();
+  }
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
@@ -675,6 +675,10 @@ scheduler_channel_wants_writes(channel_t *chan)
     return;
   }
 
+  if (the_scheduler->on_channel_writable) {
+    the_scheduler->on_channel_writable(chan);
+  }
+
   /* If it's already in waiting_to_write, we can put it in pending */
   if (chan->scheduler_state == SCHED_CHAN_WAITING_TO_WRITE) {
     /*
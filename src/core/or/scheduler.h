@@ -88,6 +88,12 @@ typedef struct scheduler_s {
    * when channels go away, implement this and free it here. */
   void (*on_channel_free)(const channel_t *);
 
+  /* (Optional) To be called when a channel has drained its outbuf into the
+   * kernel and would like to write again. A scheduler that caches
+   * per-socket state can use this as a hint that the socket has freed
+   * space. */
+  void (*on_channel_writable)(const channel_t *);
+
   /* (Optional) To be called whenever Tor is reloading configuration options.
    * For example: SIGHUP was issued and Tor is rereading its torrc. A
    * scheduler should use this as an opportunity to parse and cache torrc
@@ -107,6 +113,8 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Maximum time that KIST may reuse a socket's kernel information (in ms). */
+#define KIST_SOCK_INFO_CACHE_TIME_MAX 1000
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -180,6 +188,11 @@ typedef struct socket_table_ent_s {
   uint64_t written;
   /* Amount that can be written this scheduling run */
   uint64_t limit;
+  /* When we last asked the kernel about this socket, in msec since an
+   * arbitrary epoch. Only used when socket information is cached. */
+  uint64_t last_updated_msec;
+  /* True iff the socket freed space since we last asked the kernel. */
+  unsigned int needs_update:1;
   /* TCP info from the kernel */
   uint32_t cwnd;
   uint32_t unacked;
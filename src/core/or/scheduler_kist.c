@@ -95,6 +95,9 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* For how long (in ms) we may reuse the kernel information of a socket
+ * across scheduling runs. If zero, we ask the kernel on every run. */
+STATIC int sock_info_cache_time = 0;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -332,9 +335,13 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
               chan->global_identifier);
     ent = tor_malloc_zero(sizeof(*ent));
     ent->chan = chan;
+    ent->needs_update = 1;
     HT_INSERT(socket_table_s, table, ent);
   }
-  ent->written = 0;
+  /* When we reuse the limit from an earlier run, keep counting what we wrote
+   * against it; it is reset when we next ask the kernel. */
+  if (!sock_info_cache_time)
+    ent->written = 0;
 }
 
 /* Add chan to the outbuf table if it isn't already in it. If it is, then don't
@@ -399,16 +406,35 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   return kist_limit_space > 0;
 }
 
+/* Return true iff the kernel information we have for the socket in ent is
+ * too old to use at <b>now_msec</b>, or if the socket freed space since we
+ * last asked the kernel about it. */
+static int
+socket_info_is_stale(const socket_table_ent_t *ent, uint64_t now_msec)
+{
+  if (!sock_info_cache_time || ent->needs_update)
+    return 1;
+  return now_msec - ent->last_updated_msec >= (uint64_t) sock_info_cache_time;
+}
+
 /* Update the channel's socket kernel information. */
 static void
 update_socket_info(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
+  uint64_t now_msec;
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+  now_msec = monotime_coarse_absolute_msec();
+  if (!socket_info_is_stale(ent, now_msec)) {
+    return;
+  }
   update_socket_info_impl(ent);
+  ent->written = 0;
+  ent->last_updated_msec = now_msec;
+  ent->needs_update = 0;
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -486,6 +512,15 @@ kist_on_channel_free_fn(const channel_t *chan)
   free_socket_info_by_chan(&socket_table, chan);
 }
 
+/* Function of the scheduler interface: on_channel_writable() */
+static void
+kist_on_channel_writable_fn(const channel_t *chan)
+{
+  socket_table_ent_t *ent = socket_table_search(&socket_table, chan);
+  if (ent)
+    ent->needs_update = 1;
+}
+
 /* Function of the scheduler interface: on_new_consensus() */
 static void
 kist_scheduler_on_new_consensus(void)
@@ -498,6 +533,7 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  sock_info_cache_time = get_options()->KISTSockInfoCacheTime;
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -748,6 +784,7 @@ static scheduler_t kist_scheduler = {
   .type = SCHEDULER_KIST,
   .free_all = kist_free_all,
   .on_channel_free = kist_on_channel_free_fn,
+  .on_channel_writable = kist_on_channel_writable_fn,
   .init = kist_scheduler_init,
   .on_new_consensus = kist_scheduler_on_new_consensus,
   .schedule = kist_scheduler_schedule,
@@ -160,6 +160,7 @@ static scheduler_t vanilla_scheduler = {
   .type = SCHEDULER_VANILLA,
   .free_all = NULL,
   .on_channel_free = NULL,
+  .on_channel_writable = NULL,
   .init = NULL,
   .on_new_consensus = NULL,
   .schedule = vanilla_scheduler_schedule,
@@ -86,6 +86,7 @@
 #include "feature/rend/rendparse.h"
 #include "feature/rend/rendservice.h"
 #include "feature/stats/geoip_stats.h"
+#include "feature/stats/rephist.h"
 #include "feature/stats/predict_ports.h"
 #include "lib/container/buffers.h"
 #include "lib/crypt_ops/crypto_rand.h"
@@ -1856,6 +1857,11 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = tor_strdup(get_version());
   } else if (!strcmp(question, "bw-event-cache")) {
     *answer = get_bw_samples();
+  } else if (!strcmpstart(question, "bw-history/per-second/")) {
+    *answer = rep_hist_get_per_second_bandwidth(
+                         question + strlen("bw-history/per-second/"), 0);
+    if (!*answer)
+      *errmsg = "Unknown bandwidth history";
   } else if (!strcmp(question, "config-file")) {
     const char *a = get_torrc_fname(0);
     if (a)
@@ -3227,6 +3233,9 @@ typedef struct getinfo_item_t {
 static const getinfo_item_t getinfo_items[] = {
   ITEM("version", misc, "The current version of Tor."),
   ITEM("bw-event-cache", misc, "Cached BW events for a short interval."),
+  PREFIX("bw-history/per-second/", misc,
+         "Bytes transferred in each recent second, by kind: read, write, "
+         "dir-read, or dir-write."),
   ITEM("config-file", misc, "Current location of the \"torrc\" file."),
   ITEM("config-defaults-file", misc, "Current location of the defaults file."),
   ITEM("config-text", misc,
@@ -1368,6 +1368,7 @@ handle_get_hs_descriptor_v3(dir_connection_t *conn,
 {
   int retval;
   const char *desc_str = NULL;
+  size_t desc_len = 0;
   const char *pubkey_str = NULL;
   const char *url = args->url;
 
@@ -1383,15 +1384,16 @@ handle_get_hs_descriptor_v3(dir_connection_t *conn,
   tor_assert(!strcmpstart(url, "/tor/hs/3/"));
   pubkey_str = url + strlen("/tor/hs/3/");
   retval = hs_cache_lookup_as_dir(HS_VERSION_THREE,
-                                  pubkey_str, &desc_str);
+                                  pubkey_str, &desc_str, &desc_len);
   if (retval <= 0 || desc_str == NULL) {
     write_short_http_response(conn, 404, "Not found");
     goto done;
   }
 
-  /* Found requested descriptor! Pass it to this nice client. */
-  write_http_response_header(conn, strlen(desc_str), NO_METHOD, 0);
-  connection_buf_add(desc_str, strlen(desc_str), TO_CONN(conn));
+  /* Found requested descriptor! Pass it to this nice client. The cache keeps
+   * it encoded and knows its length, so it goes out as is. */
+  write_http_response_header(conn, desc_len, NO_METHOD, 0);
+  connection_buf_add(desc_str, desc_len, TO_CONN(conn));
 
  done:
   return 0;
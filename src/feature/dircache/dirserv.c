@@ -560,6 +560,41 @@ typedef enum {
   SRFS_DONE
 } spooled_resource_flush_status_t;
 
+/** Helper: for a spooled_resource_t that we send a few K at a time, set
+ * *<b>ptr_out</b> and *<b>len_out</b> to the body that we're sending,
+ * looking it up if we haven't done so yet.  Return 0 on success, or -1 if
+ * the object is absent. */
+static int
+spooled_resource_get_lazy_body(spooled_resource_t *spooled,
+                               const char **ptr_out, int64_t *len_out)
+{
+  cached_dir_t *cached = spooled->cached_dir_ref;
+  consensus_cache_entry_t *cce = spooled->consensus_cache_entry;
+
+  tor_assert(spooled->spool_eagerly == 0);
+  if (cached == NULL && cce == NULL) {
+    /* The cached_dir_t hasn't been materialized yet. So let's look it up. */
+    cached = spooled->cached_dir_ref =
+      spooled_resource_lookup_cached_dir(spooled, NULL);
+    if (!cached)
+      return -1;
+    ++cached->refcnt;
+    tor_assert_nonfatal(spooled->cached_dir_offset == 0);
+  }
+
+  if (BUG(!cached && !cce))
+    return -1;
+
+  if (cached) {
+    *len_out = cached->dir_compressed_len;
+    *ptr_out = cached->dir_compressed;
+  } else {
+    *len_out = spooled->cce_len;
+    *ptr_out = (const char *)spooled->cce_body;
+  }
+  return 0;
+}
+
 /** Flush some or all of the bytes from <b>spooled</b> onto <b>conn</b>.
  * Return SRFS_ERR on error, SRFS_MORE if there are more bytes to flush from
  * this spooled resource, or SRFS_DONE if we are done flushing this spooled
@@ -587,31 +622,11 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     }
     return SRFS_DONE;
   } else {
-    cached_dir_t *cached = spooled->cached_dir_ref;
-    consensus_cache_entry_t *cce = spooled->consensus_cache_entry;
-    if (cached == NULL && cce == NULL) {
-      /* The cached_dir_t hasn't been materialized yet. So let's look it up. */
-      cached = spooled->cached_dir_ref =
-        spooled_resource_lookup_cached_dir(spooled, NULL);
-      if (!cached) {
-        /* Absent objects count as done. */
-        return SRFS_DONE;
-      }
-      ++cached->refcnt;
-      tor_assert_nonfatal(spooled->cached_dir_offset == 0);
-    }
-
-    if (BUG(!cached && !cce))
-      return SRFS_DONE;
-
     int64_t total_len;
     const char *ptr;
-    if (cached) {
-      total_len = cached->dir_compressed_len;
-      ptr = cached->dir_compressed;
-    } else {
-      total_len = spooled->cce_len;
-      ptr = (const char *)spooled->cce_body;
+    if (spooled_resource_get_lazy_body(spooled, &ptr, &total_len) < 0) {
+      /* Absent objects count as done. */
+      return SRFS_DONE;
     }
     /* How many bytes left to flush? */
     int64_t remaining;
@@ -862,6 +877,11 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
 
   while (connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN &&
          smartlist_len(conn->spool)) {
+    if (connection_dirserv_can_write_direct(conn)) {
+      /* connection_handle_write() will send this one straight from the
+       * spool once the outbuf is empty. */
+      return 0;
+    }
     spooled_resource_t *spooled =
       smartlist_get(conn->spool, smartlist_len(conn->spool)-1);
     spooled_resource_flush_status_t status;
@@ -874,7 +894,8 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
     tor_assert(status == SRFS_DONE);
 
     /* If we're here, we're done flushing this resource. */
-    tor_assert(smartlist_pop_last(conn->spool) == spooled);
+    spooled_resource_t *popped = smartlist_pop_last(conn->spool);
+    tor_assert(popped == spooled);
     spooled_resource_free(spooled);
   }
 
@@ -896,6 +917,84 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
   return 0;
 }
 
+/** Return true iff the next bytes that <b>conn</b> should send come from a
+ * large spooled object that we can write straight onto its socket, without
+ * copying them into its outbuf first. That's the case when we're sending a
+ * precompressed object over a real socket: not over a linked (begindir)
+ * connection, and not through a compression state. */
+int
+connection_dirserv_can_write_direct(const dir_connection_t *conn)
+{
+  const connection_t *c = &conn->base_;
+  if (c->state != DIR_CONN_STATE_SERVER_WRITING ||
+      c->linked || !SOCKET_OK(c->s) ||
+      conn->compress_state ||
+      !conn->spool || !smartlist_len(conn->spool))
+    return 0;
+
+  const spooled_resource_t *spooled =
+    smartlist_get(conn->spool, smartlist_len(conn->spool)-1);
+  return !spooled->spool_eagerly;
+}
+
+/**
+ * Write up to <b>max_bytes</b> of <b>conn</b>'s spool straight from the
+ * spooled objects onto its socket.  The caller must have flushed the
+ * outbuf first.  Return the number of bytes written (0 if the socket
+ * would block), or -1 on a socket error.
+ */
+ssize_t
+connection_dirserv_write_direct(dir_connection_t *conn, size_t max_bytes)
+{
+  const tor_socket_t s = TO_CONN(conn)->s;
+  ssize_t total = 0;
+
+  while (max_bytes > 0 && connection_dirserv_can_write_direct(conn)) {
+    spooled_resource_t *spooled =
+      smartlist_get(conn->spool, smartlist_len(conn->spool)-1);
+    const char *ptr;
+    int64_t total_len;
+    int done;
+
+    if (spooled_resource_get_lazy_body(spooled, &ptr, &total_len) < 0) {
+      done = 1;
+    } else {
+      int64_t remaining = total_len - spooled->cached_dir_offset;
+      if (BUG(remaining < 0))
+        return -1;
+      size_t n = (size_t) MIN((int64_t)max_bytes, remaining);
+      if (n) {
+        ssize_t r = tor_socket_send(s, ptr + spooled->cached_dir_offset,
+                                    n, 0);
+        if (r < 0) {
+          int e = tor_socket_errno(s);
+          if (ERRNO_IS_EAGAIN(e))
+            break;
+          return -1;
+        }
+        spooled->cached_dir_offset += r;
+        total += r;
+        max_bytes -= r;
+        if ((size_t)r < n)
+          break; /* The socket is full. */
+      }
+      done = spooled->cached_dir_offset >= (off_t)total_len;
+    }
+
+    if (done) {
+      spooled_resource_t *popped = smartlist_pop_last(conn->spool);
+      tor_assert(popped == spooled);
+      spooled_resource_free(spooled);
+    }
+  }
+
+  if (conn->spool && smartlist_len(conn->spool) == 0) {
+    smartlist_free(conn->spool);
+    conn->spool = NULL;
+  }
+  return total;
+}
+
 /** Remove every element from <b>conn</b>'s outgoing spool, and delete
  * the spool. */
 void
@@ -72,6 +72,9 @@ typedef struct spooled_resource_t {
 } spooled_resource_t;
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+int connection_dirserv_can_write_direct(const dir_connection_t *conn);
+ssize_t connection_dirserv_write_direct(dir_connection_t *conn,
+                                        size_t max_bytes);
 
 int directory_fetches_from_authorities(const or_options_t *options);
 int directory_fetches_dir_info_early(const or_options_t *options);
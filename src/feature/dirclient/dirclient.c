@@ -9,6 +9,7 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/connection_edge.h"
 #include "core/or/policies.h"
@@ -29,6 +30,7 @@
 #include "feature/hs/hs_control.h"
 #include "feature/nodelist/authcert.h"
 #include "feature/nodelist/describe.h"
+#include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -50,6 +52,7 @@
 #include "lib/crypt_ops/crypto_util.h"
 #include "lib/encoding/confline.h"
 #include "lib/err/backtrace.h"
+#include "lib/evloop/workqueue.h"
 
 #include "core/or/entry_connection_st.h"
 #include "feature/dircache/cached_dir_st.h"
@@ -2501,6 +2504,194 @@ handle_response_fetch_desc(dir_connection_t *conn,
   return 0;
 }
 
+/** Microdescriptor responses smaller than this are parsed in the main
+ * thread: the cost of handing them to a cpuworker would exceed the cost of
+ * parsing them. */
+#define MIN_MICRODESC_BODY_LEN_FOR_WORKER (16*1024)
+
+/** State for a microdescriptor response that we're parsing in a cpuworker.
+ * Everything here is owned by the job. */
+typedef struct microdesc_parse_job_t {
+  /** Input: a copy of the response body. Freed by the worker thread once
+   * it has been parsed. */
+  char *body;
+  /** Input: the length of <b>body</b>. */
+  size_t body_len;
+  /** Input: when we received the response. */
+  time_t listed_at;
+  /** Input: the HTTP status code of the response. */
+  int status_code;
+  /** Input: the identity of the directory server we asked. */
+  char identity_digest[DIGEST_LEN];
+  /** Input: the base64-decoded SHA256 digests that we asked for. */
+  smartlist_t *which;
+  /** Output: the microdescriptors that we parsed. */
+  smartlist_t *descriptors;
+  /** Output: the digests of the microdescriptors that failed to parse. */
+  smartlist_t *invalid_digests;
+} microdesc_parse_job_t;
+
+/** List of microdesc_parse_job_t that are waiting for a cpuworker. We keep
+ * track of these so that we don't launch new downloads for the
+ * microdescriptors that they are about to give us. */
+static smartlist_t *microdesc_parse_jobs = NULL;
+
+#define microdesc_parse_job_free(job) \
+  FREE_AND_NULL(microdesc_parse_job_t, microdesc_parse_job_free_, (job))
+
+/** Release all storage held in <b>job</b>. */
+static void
+microdesc_parse_job_free_(microdesc_parse_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->body);
+  if (job->which) {
+    SMARTLIST_FOREACH(job->which, char *, cp, tor_free(cp));
+    smartlist_free(job->which);
+  }
+  if (job->descriptors) {
+    SMARTLIST_FOREACH(job->descriptors, microdesc_t *, md,
+                      microdesc_free(md));
+    smartlist_free(job->descriptors);
+  }
+  if (job->invalid_digests) {
+    SMARTLIST_FOREACH(job->invalid_digests, char *, cp, tor_free(cp));
+    smartlist_free(job->invalid_digests);
+  }
+  tor_free(job);
+}
+
+/** Add the SHA256 digest of every microdescriptor that a cpuworker is
+ * currently parsing for us to <b>result</b>. */
+void
+dir_list_microdescs_being_parsed(digest256map_t *result)
+{
+  if (!microdesc_parse_jobs)
+    return;
+  SMARTLIST_FOREACH_BEGIN(microdesc_parse_jobs,
+                          const microdesc_parse_job_t *, job) {
+    SMARTLIST_FOREACH(job->which, const char *, d,
+                      digest256map_set(result, (const uint8_t *)d,
+                                       (void*)1));
+  } SMARTLIST_FOREACH_END(job);
+}
+
+/** Return the number of microdescriptor responses that a cpuworker is
+ * currently parsing for us. */
+int
+dir_n_microdesc_parse_jobs(void)
+{
+  return microdesc_parse_jobs ? smartlist_len(microdesc_parse_jobs) : 0;
+}
+
+/** We have added the microdescriptors in <b>mds</b> to the cache, out of
+ * the ones in <b>which</b> that we had asked for from the directory server
+ * with identity <b>identity_digest</b>.  Mark the ones we didn't get as
+ * failed, and tell the rest of Tor about the ones we did. Frees
+ * <b>mds</b>. */
+static void
+dir_microdesc_download_finished(smartlist_t *mds, smartlist_t *which,
+                                int status_code,
+                                const char *identity_digest, time_t now)
+{
+  if (smartlist_len(which)) {
+    /* Mark remaining ones as failed. */
+    dir_microdesc_download_failed(which, status_code, identity_digest);
+  }
+  if (mds && smartlist_len(mds)) {
+    control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                           count_loading_descriptors_progress());
+    directory_info_has_arrived(now, 0, 1);
+  }
+  smartlist_free(mds);
+}
+
+/** Worker function: runs in a cpuworker thread, and parses the
+ * microdescriptors in a microdesc_parse_job_t. */
+static workqueue_reply_t
+microdesc_parse_worker_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  microdesc_parse_job_t *job = work_;
+
+  job->invalid_digests = smartlist_new();
+  job->descriptors = microdescs_parse_from_string(job->body,
+                                                  job->body+job->body_len,
+                                                  0, SAVED_NOWHERE,
+                                                  job->invalid_digests);
+  tor_free(job->body);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: runs in the main thread once a cpuworker has parsed a
+ * microdesc_parse_job_t, and adds its results to the microdesc cache. */
+static void
+microdesc_parse_worker_replyfn(void *work_)
+{
+  microdesc_parse_job_t *job = work_;
+  smartlist_t *mds;
+
+  if (microdesc_parse_jobs)
+    smartlist_remove(microdesc_parse_jobs, job);
+
+  mds = microdescs_add_parsed_to_cache(get_microdesc_cache(),
+                                       job->descriptors,
+                                       job->invalid_digests,
+                                       SAVED_NOWHERE, 0,
+                                       job->listed_at, job->which);
+  job->descriptors = job->invalid_digests = NULL;
+  dir_microdesc_download_finished(mds, job->which, job->status_code,
+                                  job->identity_digest, approx_time());
+  microdesc_parse_job_free(job);
+}
+
+/** Try to hand the <b>body_len</b>-byte microdescriptor response in
+ * <b>body</b> to a cpuworker for parsing.  On success, take ownership of
+ * <b>which</b> and return 0.  Return -1 if we should parse the response
+ * ourselves instead. */
+STATIC int
+microdesc_parse_launch_worker(const char *body, size_t body_len,
+                              time_t now, int status_code,
+                              const char *identity_digest,
+                              smartlist_t *which)
+{
+  if (body_len < MIN_MICRODESC_BODY_LEN_FOR_WORKER ||
+      !cpuworker_is_running())
+    return -1;
+
+  microdesc_parse_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->body = tor_memdup_nulterm(body, body_len);
+  job->body_len = body_len;
+  job->listed_at = now;
+  job->status_code = status_code;
+  memcpy(job->identity_digest, identity_digest, DIGEST_LEN);
+  job->which = which;
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW,
+                            microdesc_parse_worker_threadfn,
+                            microdesc_parse_worker_replyfn,
+                            job)) {
+    /* Give <b>which</b> back to our caller. */
+    job->which = NULL;
+    microdesc_parse_job_free(job);
+    return -1;
+  }
+
+  if (!microdesc_parse_jobs)
+    microdesc_parse_jobs = smartlist_new();
+  smartlist_add(microdesc_parse_jobs, job);
+  return 0;
+}
+
+/** Release storage held by the directory client code. Any parse jobs that
+ * are still in flight belong to the threadpool. */
+void
+dirclient_free_all(void)
+{
+  smartlist_free(microdesc_parse_jobs);
+}
+
 /**
  * Handler function: processes a response to a request for a group of
  * microdescriptors
@@ -2540,21 +2731,19 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
   } else {
     smartlist_t *mds;
     time_t now = approx_time();
+    /* Big responses (usually from bootstrapping) get parsed in a cpuworker,
+     * so that we keep relaying cells while we parse them. */
+    if (microdesc_parse_launch_worker(body, body_len, now, status_code,
+                                      conn->identity_digest, which) == 0) {
+      return 0;
+    }
     mds = microdescs_add_to_cache(get_microdesc_cache(),
                                   body, body+body_len, SAVED_NOWHERE, 0,
                                   now, which);
-    if (smartlist_len(which)) {
-      /* Mark remaining ones as failed. */
-      dir_microdesc_download_failed(which, status_code, conn->identity_digest);
-    }
-    if (mds && smartlist_len(mds)) {
-      control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
-                             count_loading_descriptors_progress());
-      directory_info_has_arrived(now, 0, 1);
-    }
+    dir_microdesc_download_finished(mds, which, status_code,
+                                    conn->identity_digest, now);
     SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
     smartlist_free(which);
-    smartlist_free(mds);
   }
 
   return 0;
@@ -90,6 +90,10 @@ MOCK_DECL(void, directory_initiate_request, (directory_request_t *request));
 
 int router_supports_extrainfo(const char *identity_digest, int is_authority);
 
+void dir_list_microdescs_being_parsed(digest256map_t *result);
+int dir_n_microdesc_parse_jobs(void);
+void dirclient_free_all(void);
+
 void connection_dir_client_request_failed(dir_connection_t *conn);
 void connection_dir_client_refetch_hsdesc_if_needed(
                                           dir_connection_t *dir_conn);
@@ -161,6 +165,10 @@ STATIC int handle_response_fetch_hsdesc_v3(dir_connection_t *conn,
                                           const response_handler_args_t *args);
 STATIC int handle_response_fetch_microdesc(dir_connection_t *conn,
                                  const response_handler_args_t *args);
+STATIC int microdesc_parse_launch_worker(const char *body, size_t body_len,
+                                         time_t now, int status_code,
+                                         const char *identity_digest,
+                                         smartlist_t *which);
 
 STATIC int handle_response_fetch_consensus(dir_connection_t *conn,
                                          const response_handler_args_t *args);
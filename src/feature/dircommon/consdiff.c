@@ -27,7 +27,9 @@
  * gen_ed_diff will navigate through the two consensuses identity by identity
  * and will send small couples of slices to calc_changes, keeping the running
  * time near-linear. This is explained in more detail in the gen_ed_diff
- * comments.
+ * comments.  Before doing so, gen_ed_diff hashes every line once and gives
+ * each distinct line an integer ID (see consdiff_assign_line_ids), so that
+ * the inner loops of calc_changes compare integers rather than strings.
  *
  * The allocation strategy tries to save time and memory by avoiding needless
  * copies.  Instead of actually splitting the inputs into separate strings, we
@@ -151,9 +153,97 @@ smartlist_slice(const smartlist_t *list, int start, int end)
   slice->list = list;
   slice->offset = start;
   slice->len = end - start;
+  slice->ids = NULL;
   return slice;
 }
 
+/** Helper: create a slice of the same list as <b>parent</b>, from
+ * <b>start</b> to <b>end</b>, sharing its line IDs if it has any. */
+static smartlist_slice_t *
+smartlist_subslice(const smartlist_slice_t *parent, int start, int end)
+{
+  smartlist_slice_t *slice = smartlist_slice(parent->list, start, end);
+  slice->ids = parent->ids;
+  return slice;
+}
+
+/** Helper: return true iff the line at index <b>i1</b> of
+ * <b>slice1</b>'s list has the same contents as the line at index <b>i2</b>
+ * of <b>slice2</b>'s list. */
+static inline int
+slice_lines_eq(const smartlist_slice_t *slice1, int i1,
+               const smartlist_slice_t *slice2, int i2)
+{
+  if (slice1->ids && slice2->ids)
+    return slice1->ids[i1] == slice2->ids[i2];
+  return lines_eq(smartlist_get(slice1->list, i1),
+                  smartlist_get(slice2->list, i2));
+}
+
+/** An entry in the hash table used by consdiff_assign_line_ids(). */
+typedef struct line_id_ent_t {
+  /** The line, or NULL if this slot is empty. */
+  const cdline_t *line;
+  /** Hash of the line's contents. */
+  uint32_t hash;
+  /** ID assigned to lines with these contents. */
+  uint32_t id;
+} line_id_ent_t;
+
+/** Helper for consdiff_assign_line_ids(): store in <b>ids</b> the ID of
+ * every line in <b>cons</b>, adding new contents to <b>table</b> (which has
+ * <b>mask</b>+1 slots) and assigning them IDs from *<b>next_id</b>. */
+static void
+assign_line_ids_helper(const smartlist_t *cons, uint32_t *ids,
+                       line_id_ent_t *table, uint32_t mask,
+                       uint32_t *next_id)
+{
+  SMARTLIST_FOREACH_BEGIN(cons, const cdline_t *, line) {
+    const uint32_t hash = (uint32_t) siphash24g(line->s, line->len);
+    uint32_t slot = hash & mask;
+    for (;;) {
+      line_id_ent_t *ent = &table[slot];
+      if (!ent->line) {
+        ent->line = line;
+        ent->hash = hash;
+        ent->id = (*next_id)++;
+        break;
+      }
+      if (ent->hash == hash && lines_eq(ent->line, line))
+        break;
+      slot = (slot + 1) & mask;
+    }
+    ids[line_sl_idx] = table[slot].id;
+  } SMARTLIST_FOREACH_END(line);
+}
+
+/** Hash every line of <b>cons1</b> and <b>cons2</b> once, and give each
+ * distinct line contents a small integer ID.  Store newly allocated arrays
+ * of the IDs, parallel to the two lists, in *<b>ids1_out</b> and
+ * *<b>ids2_out</b>.  Lines in either list have the same ID iff they are
+ * equal, so the diff algorithm can compare integers instead of strings.
+ */
+STATIC void
+consdiff_assign_line_ids(const smartlist_t *cons1, const smartlist_t *cons2,
+                         uint32_t **ids1_out, uint32_t **ids2_out)
+{
+  const int len1 = smartlist_len(cons1), len2 = smartlist_len(cons2);
+  uint32_t n_slots = 16, next_id = 0;
+  line_id_ent_t *table;
+
+  /* Keep the table at most half full. */
+  while (n_slots < 2 * ((uint32_t)len1 + (uint32_t)len2))
+    n_slots <<= 1;
+  table = tor_calloc(n_slots, sizeof(line_id_ent_t));
+
+  *ids1_out = tor_calloc(len1 ? len1 : 1, sizeof(uint32_t));
+  *ids2_out = tor_calloc(len2 ? len2 : 1, sizeof(uint32_t));
+  assign_line_ids_helper(cons1, *ids1_out, table, n_slots - 1, &next_id);
+  assign_line_ids_helper(cons2, *ids2_out, table, n_slots - 1, &next_id);
+
+  tor_free(table);
+}
+
 /** Helper: Compute the longest common subsequence lengths for the two slices.
  * Used as part of the diff generation to find the column at which to split
  * slice2 while still having the optimal solution.
@@ -169,8 +259,8 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
 
   /* Resulting lcs lengths. */
   int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = tor_malloc(a_size);
+  /* The lcs lengths from the last iteration. */
+  int *prev = tor_malloc_zero(a_size);
 
   tor_assert(direction == 1 || direction == -1);
 
@@ -181,15 +271,31 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
 
   for (int i = 0; i < slice1->len; ++i, si+=direction) {
 
-    const cdline_t *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
+    /* The last results become the previous row. */
+    int *tmp = prev;
+    prev = result;
+    result = tmp;
 
     int sj = slice2->offset;
     if (direction == -1) {
       sj += (slice2->len-1);
     }
 
+    if (slice1->ids && slice2->ids) {
+      /* Fast path: compare line IDs. */
+      const uint32_t id1 = slice1->ids[si];
+      const uint32_t *ids2 = slice2->ids;
+      for (int j = 0; j < slice2->len; ++j, sj+=direction) {
+        if (id1 == ids2[sj]) {
+          result[j + 1] = prev[j] + 1;
+        } else {
+          result[j + 1] = MAX(result[j], prev[j + 1]);
+        }
+      }
+      continue;
+    }
+
+    const cdline_t *line1 = smartlist_get(slice1->list, si);
     for (int j = 0; j < slice2->len; ++j, sj+=direction) {
 
       const cdline_t *line2 = smartlist_get(slice2->list, sj);
@@ -213,9 +319,7 @@ STATIC void
 trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
 {
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, slice1->offset);
-    const cdline_t *line2 = smartlist_get(slice2->list, slice2->offset);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, slice1->offset, slice2, slice2->offset)) {
       break;
     }
     slice1->offset++; slice1->len--;
@@ -226,9 +330,7 @@ trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
   int i2 = (slice2->offset+slice2->len)-1;
 
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, i1);
-    const cdline_t *line2 = smartlist_get(slice2->list, i2);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, i1, slice2, i2)) {
       break;
     }
     i1--;
@@ -268,8 +370,20 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   tor_assert(slice1->len == 0 || slice1->len == 1);
 
   if (slice1->len == 1) {
-    const cdline_t *line_common = smartlist_get(slice1->list, slice1->offset);
-    toskip = smartlist_slice_string_pos(slice2, line_common);
+    if (slice1->ids && slice2->ids) {
+      const uint32_t id = slice1->ids[slice1->offset];
+      const int end = slice2->offset + slice2->len;
+      for (int i = slice2->offset; i < end; ++i) {
+        if (slice2->ids[i] == id) {
+          toskip = i;
+          break;
+        }
+      }
+    } else {
+      const cdline_t *line_common = smartlist_get(slice1->list,
+                                                  slice1->offset);
+      toskip = smartlist_slice_string_pos(slice2, line_common);
+    }
     if (toskip == -1) {
       bitarray_set(changed1, slice1->offset);
     }
@@ -342,14 +456,14 @@ calc_changes(smartlist_slice_t *slice1,
 
     /* Split the first slice in half. */
     int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
+    top = smartlist_subslice(slice1, slice1->offset, slice1->offset+mid);
+    bot = smartlist_subslice(slice1, slice1->offset+mid,
         slice1->offset+slice1->len);
 
     /* Split the second slice by the optimal column. */
     int mid2 = optimal_column_to_split(top, bot, slice2);
-    left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
-    right = smartlist_slice(slice2->list, slice2->offset+mid2,
+    left = smartlist_subslice(slice2, slice2->offset, slice2->offset+mid2);
+    right = smartlist_subslice(slice2, slice2->offset+mid2,
         slice2->offset+slice2->len);
 
     calc_changes(top, left, changed1, changed2);
@@ -642,6 +756,11 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   bitarray_t *changed1 = bitarray_init_zero(len1);
   bitarray_t *changed2 = bitarray_init_zero(len2);
   int i1=-1, i2=-1;
+
+  /* Hash every line once up front, so that calc_changes can compare lines
+   * by ID. */
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+  consdiff_assign_line_ids(cons1, cons2, &ids1, &ids2);
   int start1=0, start2=0;
 
   /* To check that hashes are ordered properly */
@@ -735,6 +854,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
+    cons1_sl->ids = ids1;
+    cons2_sl->ids = ids2;
     calc_changes(cons1_sl, cons2_sl, changed1, changed2);
     tor_free(cons1_sl);
     tor_free(cons2_sl);
@@ -812,6 +933,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   return result;
 
@@ -820,6 +943,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   smartlist_free(result);
 
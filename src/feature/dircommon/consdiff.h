@@ -54,6 +54,12 @@ typedef struct smartlist_slice_t {
   int offset;
   /** Length of the slice, i.e. the number of elements it holds. */
   int len;
+  /**
+   * Optionally, an array of line IDs parallel to <b>list</b>, as computed by
+   * consdiff_assign_line_ids().  Two lines have the same ID iff they have the
+   * same contents, so that we can compare them without touching the text.
+   */
+  const uint32_t *ids;
 } smartlist_slice_t;
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
@@ -65,6 +71,10 @@ STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
+STATIC void consdiff_assign_line_ids(const smartlist_t *cons1,
+                                     const smartlist_t *cons2,
+                                     uint32_t **ids1_out,
+                                     uint32_t **ids2_out);
 STATIC int next_router(const smartlist_t *cons, int cur);
 STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
                         const smartlist_slice_t *slice2,
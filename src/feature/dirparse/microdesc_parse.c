@@ -101,7 +101,11 @@ find_start_of_next_microdesc(const char *s, const char *eos)
  * Return all newly parsed microdescriptors in a newly allocated
  * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
  * microdesc digest to it for every microdesc that we found to be badly
- * formed. (This may cause duplicates) */
+ * formed. (This may cause duplicates)
+ *
+ * This function only reads constant tables and never uses the static
+ * buffers behind escaped() or fmt_addr(), so it is safe to call from a
+ * cpuworker thread.  Keep it, and everything it calls, that way. */
 smartlist_t *
 microdescs_parse_from_string(const char *s, const char *eos,
                              int allow_annotations,
@@ -226,8 +230,10 @@ microdescs_parse_from_string(const char *s, const char *eos,
       md->family = smartlist_new();
       for (i=0;i<tok->n_args;++i) {
         if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
-          log_warn(LD_DIR, "Illegal nickname %s in family line",
-                   escaped(tok->args[i]));
+          /* Not escaped(): we may be running in a worker thread. */
+          char *esc = esc_for_log(tok->args[i]);
+          log_warn(LD_DIR, "Illegal nickname %s in family line", esc);
+          tor_free(esc);
           goto next;
         }
         smartlist_add_strdup(md->family, tok->args[i]);
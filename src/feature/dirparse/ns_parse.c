@@ -193,27 +193,79 @@ router_get_networkstatus_v3_hashes(const char *s, common_digests_t *digests)
 /** Helper: given a string <b>s</b>, return the start of the next router-status
  * object (starting with "r " at the start of a line).  If none is found,
  * return the start of the directory footer, or the next directory signature.
- * If none is found, return the end of the string. */
+ * If none is found, return the end of the string.
+ *
+ * We look at the start of each line exactly once, so that finding the end
+ * of every entry in a consensus takes a single pass over the document. */
 static inline const char *
 find_start_of_next_routerstatus(const char *s)
 {
-  const char *eos, *footer, *sig;
-  if ((eos = strstr(s, "\nr ")))
-    ++eos;
-  else
-    eos = s + strlen(s);
+  const char *line = s;
+  while ((line = strchr(line, '\n'))) {
+    ++line;
+    if (line[0] == 'r' && line[1] == ' ')
+      return line;
+    if (line[0] == 'd' &&
+        (!strcmpstart(line, "directory-footer") ||
+         !strcmpstart(line, "directory-signature")))
+      return line;
+  }
+  return s + strlen(s);
+}
 
-  footer = tor_memstr(s, eos-s, "\ndirectory-footer");
-  sig = tor_memstr(s, eos-s, "\ndirectory-signature");
+/** Look at just the header of the consensus in <b>s</b>, without
+ * tokenizing it or parsing any of its routerstatus entries, and find its
+ * flavor and valid-after time.  On success, store them in *<b>flav_out</b>
+ * and *<b>valid_after_out</b> and return 0.  Return -1 if they can't be
+ * found.
+ *
+ * This is meant for deciding quickly whether a consensus is worth parsing
+ * at all; it doesn't validate anything else about the document. */
+int
+networkstatus_parse_consensus_preamble(const char *s,
+                                       consensus_flavor_t *flav_out,
+                                       time_t *valid_after_out)
+{
+  const char *end_of_header, *eol, *va;
+  char buf[ISO_TIME_LEN+1];
+  const size_t version_len = strlen("network-status-version 3");
 
-  if (footer && sig)
-    return MIN(footer, sig) + 1;
-  else if (footer)
-    return footer+1;
-  else if (sig)
-    return sig+1;
-  else
-    return eos;
+  tor_assert(s);
+  if (strcmpstart(s, "network-status-version 3"))
+    return -1;
+  end_of_header = find_start_of_next_routerstatus(s);
+
+  /* The flavor, if any, follows the version on the first line. */
+  eol = memchr(s, '\n', end_of_header - s);
+  if (!eol)
+    return -1;
+  *flav_out = FLAV_NS;
+  if (eol > s + version_len + 1 && s[version_len] == ' ') {
+    char flavor[32];
+    const size_t flavor_len = eol - (s + version_len + 1);
+    int flav;
+    if (flavor_len >= sizeof(flavor))
+      return -1;
+    memcpy(flavor, s + version_len + 1, flavor_len);
+    flavor[flavor_len] = '\0';
+    if ((flav = networkstatus_parse_flavor_name(flavor)) < 0)
+      return -1;
+    *flav_out = flav;
+  } else if (eol != s + version_len) {
+    return -1;
+  }
+
+  va = tor_memstr(s, end_of_header - s, "\nvalid-after ");
+  if (!va)
+    return -1;
+  va += strlen("\nvalid-after ");
+  if (end_of_header - va < ISO_TIME_LEN)
+    return -1;
+  memcpy(buf, va, ISO_TIME_LEN);
+  buf[ISO_TIME_LEN] = '\0';
+  if (parse_iso_time(buf, valid_after_out) < 0)
+    return -1;
+  return 0;
 }
 
 /** Parse the GuardFraction string from a consensus or vote.
@@ -1418,6 +1470,12 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     extract_shared_random_srvs(ns, tokens);
   }
 
+  /* We're done with the header tokens: release them before parsing the
+   * routerstatus entries, so that they don't add to our peak memory. */
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(tokens);
+  memarea_clear(area);
+
   /* Parse routerstatus lines. */
   rs_tokens = smartlist_new();
   rs_area = memarea_new();
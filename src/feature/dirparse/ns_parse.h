@@ -26,6 +26,9 @@ enum networkstatus_type_t;
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            const char **eos_out,
                                            enum networkstatus_type_t ns_type);
+int networkstatus_parse_consensus_preamble(const char *s,
+                                           consensus_flavor_t *flav_out,
+                                           time_t *valid_after_out);
 
 #ifdef NS_PARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
@@ -29,23 +29,83 @@ static int cached_client_descriptor_has_expired(time_t now,
 
 /********************** Directory HS cache ******************/
 
-/* Directory descriptor cache. Map indexed by blinded key. */
-static digest256map_t *hs_cache_v3_dir;
+/* One shard of the directory descriptor cache. */
+typedef struct hs_cache_dir_shard_t {
+  /* Map indexed by blinded key. */
+  digest256map_t *map;
+  /* The same descriptors, oldest first by created_ts, so that expiring old
+   * entries never has to look at the ones we keep. */
+  TOR_TAILQ_HEAD(hs_cache_dir_descriptor_q, hs_cache_dir_descriptor_t) by_age;
+  /* Total size in bytes of the entries in this shard. */
+  size_t allocation;
+} hs_cache_dir_shard_t;
+
+/* Directory descriptor cache, split by blinded key. Blinded keys are
+ * uniformly distributed so any of their bytes picks a shard evenly. */
+static hs_cache_dir_shard_t hs_cache_v3_dir[HS_CACHE_DIR_N_SHARDS];
+
+/* Return the cache shard that holds the descriptor for <b>key</b>. */
+static inline hs_cache_dir_shard_t *
+dir_shard_for_key(const uint8_t *key)
+{
+  return &hs_cache_v3_dir[key[0] & (HS_CACHE_DIR_N_SHARDS - 1)];
+}
+
+/* Return the size of a cache entry in bytes. */
+static size_t
+cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+{
+  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
+          + entry->encoded_desc_len);
+}
 
 /* Remove a given descriptor from our cache. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
+  hs_cache_dir_shard_t *shard;
+  size_t entry_size;
+
   tor_assert(desc);
-  digest256map_remove(hs_cache_v3_dir, desc->key);
+  shard = dir_shard_for_key(desc->key);
+  digest256map_remove(shard->map, desc->key);
+  TOR_TAILQ_REMOVE(&shard->by_age, desc, age_node);
+
+  entry_size = cache_get_dir_entry_size(desc);
+  tor_assert_nonfatal(shard->allocation >= entry_size);
+  shard->allocation -= MIN(shard->allocation, entry_size);
+  /* Update our total cache size for the OOM. This uses the old HS protocol
+   * cache subsystem for which we are tied with. */
+  rend_cache_decrement_allocation(entry_size);
 }
 
 /* Store a given descriptor in our cache. */
 static void
 store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
+  hs_cache_dir_shard_t *shard;
+  hs_cache_dir_descriptor_t *after;
+  size_t entry_size;
+
   tor_assert(desc);
-  digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  shard = dir_shard_for_key(desc->key);
+  digest256map_set(shard->map, desc->key, desc);
+
+  /* New entries are almost always the youngest, unless the clock jumped
+   * backwards: find the place that keeps by_age sorted, from the end. */
+  after = TOR_TAILQ_LAST(&shard->by_age, hs_cache_dir_descriptor_q);
+  while (after && after->created_ts > desc->created_ts) {
+    after = TOR_TAILQ_PREV(after, hs_cache_dir_descriptor_q, age_node);
+  }
+  if (after) {
+    TOR_TAILQ_INSERT_AFTER(&shard->by_age, after, desc, age_node);
+  } else {
+    TOR_TAILQ_INSERT_HEAD(&shard->by_age, desc, age_node);
+  }
+
+  entry_size = cache_get_dir_entry_size(desc);
+  shard->allocation += entry_size;
+  rend_cache_increment_allocation(entry_size);
 }
 
 /* Query our cache and return the entry or NULL if not found. */
@@ -53,7 +113,7 @@ static hs_cache_dir_descriptor_t *
 lookup_v3_desc_as_dir(const uint8_t *key)
 {
   tor_assert(key);
-  return digest256map_get(hs_cache_v3_dir, key);
+  return digest256map_get(dir_shard_for_key(key)->map, key);
 }
 
 #define cache_dir_desc_free(val) \
@@ -92,7 +152,9 @@ cache_dir_desc_new(const char *desc)
   dir_desc = tor_malloc_zero(sizeof(hs_cache_dir_descriptor_t));
   dir_desc->plaintext_data =
     tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
-  dir_desc->encoded_desc = tor_strdup(desc);
+  dir_desc->encoded_desc_len = strlen(desc);
+  dir_desc->encoded_desc = tor_memdup_nulterm(desc,
+                                              dir_desc->encoded_desc_len);
 
   if (hs_desc_decode_plaintext(desc, dir_desc->plaintext_data) < 0) {
     log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
@@ -101,7 +163,7 @@ cache_dir_desc_new(const char *desc)
 
   /* The blinded pubkey is the indexed key. */
   dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
-  dir_desc->created_ts = time(NULL);
+  dir_desc->created_ts = approx_time();
   return dir_desc;
 
  err:
@@ -109,14 +171,6 @@ cache_dir_desc_new(const char *desc)
   return NULL;
 }
 
-/* Return the size of a cache entry in bytes. */
-static size_t
-cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
-{
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
-}
-
 /* Try to store a valid version 3 descriptor in the directory cache. Return 0
  * on success else a negative value is returned indicating that we have a
  * newer version in our cache. On error, caller is responsible to free the
@@ -147,7 +201,6 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
      * remove the entry we currently have from our cache so we can then
      * store the new one. */
     remove_v3_desc_as_dir(cache_entry);
-    rend_cache_decrement_allocation(cache_get_dir_entry_size(cache_entry));
     cache_dir_desc_free(cache_entry);
   }
   /* Store the descriptor we just got. We are sure here that either we
@@ -155,10 +208,6 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
    * has been removed from the cache. */
   store_v3_desc_as_dir(desc);
 
-  /* Update our total cache size with this entry for the OOM. This uses the
-   * old HS protocol cache subsystem for which we are tied with. */
-  rend_cache_increment_allocation(cache_get_dir_entry_size(desc));
-
   /* XXX: Update HS statistics. We should have specific stats for v3. */
 
   return 0;
@@ -169,11 +218,13 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
 
 /* Using the query which is the base64 encoded blinded key of a version 3
  * descriptor, lookup in our directory cache the entry. If found, 1 is
- * returned and desc_out is populated with a newly allocated string being the
- * encoded descriptor. If not found, 0 is returned and desc_out is untouched.
- * On error, a negative value is returned and desc_out is untouched. */
+ * returned and desc_out is populated with a pointer to the encoded descriptor
+ * held by the cache, and desc_len_out, if not NULL, with its length. If not
+ * found, 0 is returned and the outputs are untouched. On error, a negative
+ * value is returned and the outputs are untouched. */
 static int
-cache_lookup_v3_as_dir(const char *query, const char **desc_out)
+cache_lookup_v3_as_dir(const char *query, const char **desc_out,
+                       size_t *desc_len_out)
 {
   int found = 0;
   ed25519_public_key_t blinded_key;
@@ -194,6 +245,9 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
     if (desc_out) {
       *desc_out = entry->encoded_desc;
     }
+    if (desc_len_out) {
+      *desc_len_out = entry->encoded_desc_len;
+    }
   }
 
   return found;
@@ -202,56 +256,88 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   return -1;
 }
 
+/* Remove <b>entry</b> from the v3 directory cache and free it. Return the
+ * number of bytes it used. */
+static size_t
+cache_expire_v3_dir_entry(hs_cache_dir_descriptor_t *entry)
+{
+  size_t entry_size = cache_get_dir_entry_size(entry);
+  char key_b64[BASE64_DIGEST256_LEN + 1];
+
+  digest256_to_base64(key_b64, (const char *) entry->key);
+  log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
+           safe_str_client(key_b64));
+
+  remove_v3_desc_as_dir(entry);
+  /* Entry is not in the cache anymore, destroy it. */
+  cache_dir_desc_free(entry);
+  return entry_size;
+}
+
 /* Clean the v3 cache by removing any entry that has expired using the
  * <b>global_cutoff</b> value. If <b>global_cutoff</b> is 0, the cleaning
  * process will use the lifetime found in the plaintext data section. Return
- * the number of bytes cleaned. */
+ * the number of bytes cleaned.
+ *
+ * With a <b>global_cutoff</b>, only the expired entries are visited, which
+ * keeps the OOM handler cheap on a busy HSDir. */
 STATIC size_t
 cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
 {
   size_t bytes_removed = 0;
+  int i;
 
   /* Code flow error if this ever happens. */
   tor_assert(global_cutoff >= 0);
 
-  if (!hs_cache_v3_dir) { /* No cache to clean. Just return. */
-    return 0;
-  }
+  for (i = 0; i < HS_CACHE_DIR_N_SHARDS; i++) {
+    hs_cache_dir_shard_t *shard = &hs_cache_v3_dir[i];
+    hs_cache_dir_descriptor_t *entry, *next;
 
-  DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
-                              hs_cache_dir_descriptor_t *, entry) {
-    size_t entry_size;
-    time_t cutoff = global_cutoff;
-    if (!cutoff) {
-      /* Cutoff is the lifetime of the entry found in the descriptor. */
-      cutoff = now - entry->plaintext_data->lifetime_sec;
+    if (!shard->map) { /* No cache to clean. */
+      continue;
     }
 
-    /* If the entry has been created _after_ the cutoff, not expired so
-     * continue to the next entry in our v3 cache. */
-    if (entry->created_ts > cutoff) {
+    if (global_cutoff) {
+      /* Entries are sorted by age: stop at the first one created after the
+       * cutoff. */
+      while ((entry = TOR_TAILQ_FIRST(&shard->by_age)) &&
+             entry->created_ts <= global_cutoff) {
+        bytes_removed += cache_expire_v3_dir_entry(entry);
+      }
       continue;
     }
-    /* Here, our entry has expired, remove and free. */
-    MAP_DEL_CURRENT(key);
-    entry_size = cache_get_dir_entry_size(entry);
-    bytes_removed += entry_size;
-    /* Entry is not in the cache anymore, destroy it. */
-    cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    rend_cache_decrement_allocation(entry_size);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
-               safe_str_client(key_b64));
+
+    /* Each descriptor has its own lifetime, so look at all of them. */
+    TOR_TAILQ_FOREACH_SAFE(entry, &shard->by_age, age_node, next) {
+      /* Cutoff is the lifetime of the entry found in the descriptor. If the
+       * entry has been created _after_ the cutoff, not expired so continue
+       * to the next entry in our v3 cache. */
+      if (entry->created_ts > now - entry->plaintext_data->lifetime_sec) {
+        continue;
+      }
+      bytes_removed += cache_expire_v3_dir_entry(entry);
     }
-  } DIGEST256MAP_FOREACH_END;
+  }
 
   return bytes_removed;
 }
 
+#ifdef TOR_UNIT_TESTS
+/* Return the total size in bytes of the v3 directory cache entries. */
+STATIC size_t
+cache_get_v3_dir_allocation(void)
+{
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < HS_CACHE_DIR_N_SHARDS; i++) {
+    total += hs_cache_v3_dir[i].allocation;
+  }
+  return total;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /* Given an encoded descriptor, store it in the directory cache depending on
  * which version it is. Return a negative value on error. On success, 0 is
  * returned. */
@@ -288,13 +374,14 @@ hs_cache_store_as_dir(const char *desc)
 }
 
 /* Using the query, lookup in our directory cache the entry. If found, 1 is
- * returned and desc_out is populated with a newly allocated string being
- * the encoded descriptor. If not found, 0 is returned and desc_out is
- * untouched. On error, a negative value is returned and desc_out is
- * untouched. */
+ * returned and desc_out is populated with a pointer to the encoded
+ * descriptor owned by the cache, and desc_len_out, if not NULL, with its
+ * length, so it can be written out as is. If not found, 0 is returned and
+ * the outputs are untouched. On error, a negative value is returned and the
+ * outputs are untouched. */
 int
 hs_cache_lookup_as_dir(uint32_t version, const char *query,
-                       const char **desc_out)
+                       const char **desc_out, size_t *desc_len_out)
 {
   int found;
 
@@ -305,7 +392,7 @@ hs_cache_lookup_as_dir(uint32_t version, const char *query,
   switch (version) {
   case HS_VERSION_THREE:
   default:
-    found = cache_lookup_v3_as_dir(query, desc_out);
+    found = cache_lookup_v3_as_dir(query, desc_out, desc_len_out);
     break;
   }
 
@@ -959,9 +1046,15 @@ hs_cache_get_max_descriptor_size(void)
 void
 hs_cache_init(void)
 {
+  int i;
+
   /* Calling this twice is very wrong code flow. */
-  tor_assert(!hs_cache_v3_dir);
-  hs_cache_v3_dir = digest256map_new();
+  for (i = 0; i < HS_CACHE_DIR_N_SHARDS; i++) {
+    tor_assert(!hs_cache_v3_dir[i].map);
+    hs_cache_v3_dir[i].map = digest256map_new();
+    TOR_TAILQ_INIT(&hs_cache_v3_dir[i].by_age);
+    hs_cache_v3_dir[i].allocation = 0;
+  }
 
   tor_assert(!hs_cache_v3_client);
   hs_cache_v3_client = digest256map_new();
@@ -974,8 +1067,14 @@ hs_cache_init(void)
 void
 hs_cache_free_all(void)
 {
-  digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
-  hs_cache_v3_dir = NULL;
+  int i;
+
+  for (i = 0; i < HS_CACHE_DIR_N_SHARDS; i++) {
+    digest256map_free(hs_cache_v3_dir[i].map, cache_dir_desc_free_void);
+    hs_cache_v3_dir[i].map = NULL;
+    TOR_TAILQ_INIT(&hs_cache_v3_dir[i].by_age);
+    hs_cache_v3_dir[i].allocation = 0;
+  }
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
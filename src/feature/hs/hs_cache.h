@@ -15,6 +15,7 @@
 #include "feature/hs/hs_descriptor.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/torcert.h"
+#include "tor_queue.h"
 
 struct ed25519_public_key_t;
 
@@ -61,6 +62,11 @@ typedef struct hs_cache_dir_descriptor_t {
   /* Encoded descriptor which is basically in text form. It's a NUL terminated
    * string thus safe to strlen(). */
   char *encoded_desc;
+  /* Length of encoded_desc, so we can serve it without measuring it. */
+  size_t encoded_desc_len;
+
+  /* Entry in the cache shard's list of descriptors sorted by created_ts. */
+  TOR_TAILQ_ENTRY(hs_cache_dir_descriptor_t) age_node;
 } hs_cache_dir_descriptor_t;
 
 /* Public API */
@@ -77,7 +83,7 @@ unsigned int hs_cache_get_max_descriptor_size(void);
  * right function. */
 int hs_cache_store_as_dir(const char *desc);
 int hs_cache_lookup_as_dir(uint32_t version, const char *query,
-                           const char **desc_out);
+                           const char **desc_out, size_t *desc_len_out);
 
 const hs_descriptor_t *
 hs_cache_lookup_as_client(const struct ed25519_public_key_t *key);
@@ -120,7 +126,14 @@ typedef struct hs_cache_client_descriptor_t {
   char *encoded_desc;
 } hs_cache_client_descriptor_t;
 
+/* Number of shards in the directory descriptor cache. Must be a power of
+ * two. */
+#define HS_CACHE_DIR_N_SHARDS 16
+
 STATIC size_t cache_clean_v3_as_dir(time_t now, time_t global_cutoff);
+#ifdef TOR_UNIT_TESTS
+STATIC size_t cache_get_v3_dir_allocation(void);
+#endif /* defined(TOR_UNIT_TESTS) */
 
 STATIC hs_cache_client_descriptor_t *
 lookup_v3_desc_as_client(const uint8_t *key);
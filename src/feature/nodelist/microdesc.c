@@ -8,11 +8,14 @@
  *  less-frequently-changing router information.
  */
 
+#define MICRODESC_PRIVATE
 #include "core/or/or.h"
 
+#include "lib/evloop/workqueue.h"
 #include "lib/fdio/fdio.h"
 
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/policies.h"
 #include "feature/client/entrynodes.h"
@@ -66,9 +69,74 @@ struct microdesc_cache_t {
 
   /** True iff we have loaded this cache from disk ever. */
   int is_loaded;
+
+  /** If a cpuworker is writing a new cache file for this cache, the job
+   * that it's working on. */
+  struct microdesc_rebuild_job_t *rebuild_job;
+};
+
+typedef struct microdesc_rebuild_job_t microdesc_rebuild_job_t;
+
+/** One microdescriptor that a microdesc_rebuild_job_t is going to write
+ * into a new cache file. */
+typedef struct md_rebuild_entry_t {
+  /** SHA256 digest of the body, so that we can find the microdesc_t again
+   * once the job is done. */
+  char digest[DIGEST256_LEN];
+  /** The body to write. Points either into the old cache file's mmap, or to
+   * <b>body_copy</b>. */
+  const char *body;
+  /** If the body was not in the old cache file, a copy of it that we own. */
+  char *body_copy;
+  /** Length of <b>body</b>. */
+  size_t bodylen;
+  /** Value to write in the @last-listed annotation, or 0 for none. */
+  time_t last_listed;
+  /** Output: the offset of the body within the new cache file. */
+  off_t off;
+} md_rebuild_entry_t;
+
+/** State for rewriting the cache file of a microdesc_cache_t.  We take a
+ * snapshot of the descriptors to keep in the main thread, write them out
+ * in a cpuworker, and then swap the new file in from the main thread. */
+struct microdesc_rebuild_job_t {
+  /** The cache that we're rebuilding. */
+  microdesc_cache_t *cache;
+  /** The queued work for this job, so that we can cancel it. */
+  workqueue_entry_t *work;
+  /** True iff the cache was cleared while we were working, so that we
+   * should throw away the new file instead of swapping it in. */
+  int orphaned;
+  /** If the cache was cleared while we were working, the old mmap of the
+   * cache file, which our entries may still point into. */
+  tor_mmap_t *orphaned_content;
+  /** The new cache file, which we write under a temporary name and rename
+   * into place when we're done. */
+  open_file_t *open_file;
+  /** File descriptor for <b>open_file</b>. */
+  int fd;
+  /** The descriptors that we're going to write. */
+  md_rebuild_entry_t *entries;
+  /** Number of elements in <b>entries</b>. */
+  int n_entries;
+  /** Value of cache->bytes_dropped when we took our snapshot. */
+  size_t bytes_dropped_at_start;
+  /** Bytes used on disk by the cache and journal when we started. */
+  size_t orig_size;
+  /** Output: true iff we failed to write the new cache file. */
+  int failed;
+  /** Protects <b>done</b>. */
+  tor_mutex_t lock;
+  /** Signalled when <b>done</b> becomes true. */
+  tor_cond_t done_cond;
+  /** True once the worker function has finished with this job. */
+  int done;
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
+static void microdesc_rebuild_job_free_(microdesc_rebuild_job_t *job);
+#define microdesc_rebuild_job_free(job) \
+  FREE_AND_NULL(microdesc_rebuild_job_t, microdesc_rebuild_job_free_, (job))
 
 /** Helper: computes a hash of <b>md</b> to place it in a hash table. */
 static inline unsigned int
@@ -287,17 +355,39 @@ microdescs_add_to_cache(microdesc_cache_t *cache,
                         int no_save, time_t listed_at,
                         smartlist_t *requested_digests256)
 {
-  void * const DIGEST_REQUESTED = (void*)1;
-  void * const DIGEST_RECEIVED = (void*)2;
-  void * const DIGEST_INVALID = (void*)3;
-
-  smartlist_t *descriptors, *added;
+  smartlist_t *descriptors;
   const int allow_annotations = (where != SAVED_NOWHERE);
   smartlist_t *invalid_digests = smartlist_new();
 
   descriptors = microdescs_parse_from_string(s, eos,
                                              allow_annotations,
                                              where, invalid_digests);
+  return microdescs_add_parsed_to_cache(cache, descriptors, invalid_digests,
+                                        where, no_save, listed_at,
+                                        requested_digests256);
+}
+
+/** As microdescs_add_to_cache, but takes the output of
+ * microdescs_parse_from_string(): the list of parsed microdescriptors in
+ * <b>descriptors</b>, and the digests of the ones that failed to parse in
+ * <b>invalid_digests</b>.  Takes ownership of both lists, and frees them.
+ *
+ * This lets us parse microdescriptors somewhere other than the main thread,
+ * and then add them to the cache from the main thread. */
+smartlist_t *
+microdescs_add_parsed_to_cache(microdesc_cache_t *cache,
+                               smartlist_t *descriptors,
+                               smartlist_t *invalid_digests,
+                               saved_location_t where,
+                               int no_save, time_t listed_at,
+                               smartlist_t *requested_digests256)
+{
+  void * const DIGEST_REQUESTED = (void*)1;
+  void * const DIGEST_RECEIVED = (void*)2;
+  void * const DIGEST_INVALID = (void*)3;
+
+  smartlist_t *added;
+
   if (listed_at != (time_t)-1) {
     SMARTLIST_FOREACH(descriptors, microdesc_t *, md,
                       md->last_listed = listed_at);
@@ -458,6 +548,23 @@ microdesc_cache_clear(microdesc_cache_t *cache)
 {
   microdesc_t **entry, **next;
 
+  if (cache->rebuild_job) {
+    microdesc_rebuild_job_t *job = cache->rebuild_job;
+    if (workqueue_entry_cancel(job->work)) {
+      /* No worker ever saw it, so we can throw it away now. */
+      cache->rebuild_job = NULL;
+      microdesc_rebuild_job_free(job);
+    } else if (!job->orphaned) {
+      /* The job might still be reading bodies out of the cache file, so it
+       * gets to unmap it when it's done.  It stays our rebuild_job until
+       * its reply arrives, so that nobody starts a second rebuild into the
+       * same temporary file. */
+      job->orphaned = 1;
+      job->orphaned_content = cache->cache_content;
+      cache->cache_content = NULL;
+    }
+  }
+
   for (entry = HT_START(microdesc_map, &cache->map); entry; entry = next) {
     microdesc_t *md = *entry;
     next = HT_NEXT_RMV(microdesc_map, &cache->map, entry);
@@ -665,77 +772,199 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
-/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
- * and update every microdesc_t in the cache with pointers to its new
- * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
-int
-microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+/** Release all storage held by <b>job</b>, discarding any cache file that it
+ * was writing. */
+static void
+microdesc_rebuild_job_free_(microdesc_rebuild_job_t *job)
 {
-  open_file_t *open_file;
-  int fd = -1, res;
-  microdesc_t **mdp;
-  smartlist_t *wrote;
-  ssize_t size;
-  off_t off = 0, off_real;
-  int orig_size, new_size;
-
-  if (cache == NULL) {
-    cache = the_microdesc_cache;
-    if (cache == NULL)
-      return 0;
+  int i;
+  if (!job)
+    return;
+  for (i = 0; i < job->n_entries; ++i)
+    tor_free(job->entries[i].body_copy);
+  tor_free(job->entries);
+  if (job->open_file)
+    abort_writing_to_file(job->open_file);
+  if (job->orphaned_content) {
+    if (tor_munmap_file(job->orphaned_content) != 0) {
+      log_warn(LD_FS, "Failed to unmap old microdescriptor cache.");
+    }
   }
+  tor_cond_uninit(&job->done_cond);
+  tor_mutex_uninit(&job->lock);
+  tor_free(job);
+}
 
-  /* Remove dead descriptors */
-  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
-
-  if (!force && !should_rebuild_md_cache(cache))
-    return 0;
-
-  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+/** Block until the worker function has finished with <b>job</b>. */
+static void
+microdesc_rebuild_job_wait(microdesc_rebuild_job_t *job)
+{
+  tor_mutex_acquire(&job->lock);
+  while (!job->done)
+    tor_cond_wait(&job->done_cond, &job->lock, NULL);
+  tor_mutex_release(&job->lock);
+}
 
-  orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
-  orig_size += (int)cache->journal_len;
+/** Start rebuilding the cache file for <b>cache</b>: open the new file and
+ * take a snapshot of every microdescriptor that we want to keep.  Return
+ * the new job on success, or NULL if we couldn't open the file. */
+static microdesc_rebuild_job_t *
+microdesc_rebuild_job_new(microdesc_cache_t *cache)
+{
+  microdesc_rebuild_job_t *job;
+  microdesc_t **mdp;
+  open_file_t *open_file;
+  int fd, n = 0;
 
   fd = start_writing_to_file(cache->cache_fname,
                              OPEN_FLAGS_REPLACE|O_BINARY,
                              0600, &open_file);
   if (fd < 0)
-    return -1;
-
-  wrote = smartlist_new();
+    return NULL;
+
+  job = tor_malloc_zero(sizeof(*job));
+  tor_mutex_init_for_cond(&job->lock);
+  tor_cond_init(&job->done_cond);
+  job->cache = cache;
+  job->open_file = open_file;
+  job->fd = fd;
+  job->bytes_dropped_at_start = cache->bytes_dropped;
+  job->orig_size = cache->cache_content ? cache->cache_content->size : 0;
+  job->orig_size += cache->journal_len;
+  job->entries = tor_calloc(HT_SIZE(&cache->map), sizeof(md_rebuild_entry_t));
 
   HT_FOREACH(mdp, microdesc_map, &cache->map) {
     microdesc_t *md = *mdp;
-    size_t annotation_len;
+    md_rebuild_entry_t *ent;
     if (md->no_save || !md->body)
       continue;
+    ent = &job->entries[n++];
+    memcpy(ent->digest, md->digest, DIGEST256_LEN);
+    /* Bodies in the cache file stay put until we swap in the new file;
+     * anything else might get freed while we're working. */
+    if (md->saved_location == SAVED_IN_CACHE) {
+      ent->body = md->body;
+    } else {
+      ent->body = ent->body_copy = tor_memdup(md->body, md->bodylen);
+    }
+    ent->bodylen = md->bodylen;
+    ent->last_listed = md->last_listed;
+  }
+  job->n_entries = n;
 
-    size = dump_microdescriptor(fd, md, &annotation_len);
-    if (size < 0) {
-      microdesc_wipe_body(md);
+  return job;
+}
 
-      /* rewind, in case it was a partial write. */
-      tor_fd_setpos(fd, off);
-      continue;
+/** Worker function: write every entry in a microdesc_rebuild_job_t to its
+ * new cache file.  This doesn't touch the cache, so it's safe to run in a
+ * cpuworker. */
+static workqueue_reply_t
+microdesc_rebuild_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  microdesc_rebuild_job_t *job = work_;
+  off_t off = 0;
+  int i;
+
+  for (i = 0; i < job->n_entries; ++i) {
+    md_rebuild_entry_t *ent = &job->entries[i];
+    if (ent->last_listed) {
+      char buf[ISO_TIME_LEN+1];
+      char annotation[ISO_TIME_LEN+32];
+      size_t annotation_len;
+      format_iso_time(buf, ent->last_listed);
+      tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
+      annotation_len = strlen(annotation);
+      if (write_all_to_fd(job->fd, annotation, annotation_len) !=
+          (ssize_t)annotation_len)
+        goto err;
+      off += annotation_len;
     }
-    tor_assert(((size_t)size) == annotation_len + md->bodylen);
-    md->off = off + annotation_len;
-    off += size;
-    off_real = tor_fd_getpos(fd);
-    if (off_real != off) {
-      log_warn(LD_BUG, "Discontinuity in position in microdescriptor cache."
-               "By my count, I'm at %"PRId64
-               ", but I should be at %"PRId64,
-               (int64_t)(off), (int64_t)(off_real));
-      if (off_real >= 0)
-        off = off_real;
+    if (write_all_to_fd(job->fd, ent->body, ent->bodylen) !=
+        (ssize_t)ent->bodylen)
+      goto err;
+    ent->off = off;
+    off += ent->bodylen;
+  }
+  goto done;
+
+ err:
+  job->failed = 1;
+ done:
+  tor_mutex_acquire(&job->lock);
+  job->done = 1;
+  tor_cond_signal_all(&job->done_cond);
+  tor_mutex_release(&job->lock);
+  return WQ_RPL_REPLY;
+}
+
+/** Rewrite the journal of <b>cache</b> to hold only the microdescriptors
+ * that are still saved in it.  These are the ones that arrived after we
+ * started rebuilding the cache file. */
+static void
+microdesc_cache_rewrite_journal(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  open_file_t *open_file;
+  size_t journal_len = 0;
+  int fd, any = 0;
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_JOURNAL) {
+      any = 1;
+      break;
     }
-    if (md->saved_location != SAVED_IN_CACHE) {
-      tor_free(md->body);
-      md->saved_location = SAVED_IN_CACHE;
+  }
+  if (!any) {
+    write_str_to_file(cache->journal_fname, "", 1);
+    cache->journal_len = 0;
+    return;
+  }
+
+  fd = start_writing_to_file(cache->journal_fname,
+                             OPEN_FLAGS_REPLACE|O_BINARY,
+                             0600, &open_file);
+  if (fd < 0) {
+    /* The old journal is still there; we'll just reload some duplicates. */
+    return;
+  }
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    size_t annotation_len;
+    ssize_t size;
+    if (md->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    size = dump_microdescriptor(fd, md, &annotation_len);
+    if (size < 0) {
+      abort_writing_to_file(open_file);
+      return;
     }
-    smartlist_add(wrote, md);
+    journal_len += size;
+  }
+  if (finish_writing_to_file(open_file) < 0) {
+    log_warn(LD_DIR, "Error rewriting microdescriptor journal: %s",
+             strerror(errno));
+    return;
+  }
+  cache->journal_len = journal_len;
+}
+
+/** Finish rebuilding <b>cache</b> from <b>job</b>: swap the new cache file
+ * into place, map it, point every microdesc_t we wrote at its new body, and
+ * rewrite the journal.  Return 0 on success, -1 on failure. */
+static int
+microdesc_rebuild_finish(microdesc_cache_t *cache,
+                         microdesc_rebuild_job_t *job)
+{
+  microdesc_t **mdp;
+  open_file_t *open_file;
+  size_t new_size;
+  int i, res;
+
+  if (job->failed) {
+    log_warn(LD_DIR, "Couldn't write new microdescriptor cache to %s",
+             cache->cache_fname);
+    return -1;
   }
 
   /* We must do this unmap _before_ we call finish_writing_to_file(), or
@@ -748,62 +977,153 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     }
     cache->cache_content = NULL;
   }
+  /* Nothing may point into the old file any more. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE)
+      (*mdp)->body = NULL;
+  }
 
+  open_file = job->open_file;
+  job->open_file = NULL;
   if (finish_writing_to_file(open_file) < 0) {
     log_warn(LD_DIR, "Error rebuilding microdescriptor cache: %s",
              strerror(errno));
-    /* Okay. Let's prevent from making things worse elsewhere. */
-    cache->cache_content = NULL;
-    HT_FOREACH(mdp, microdesc_map, &cache->map) {
-      microdesc_t *md = *mdp;
-      if (md->saved_location == SAVED_IN_CACHE) {
-        microdesc_wipe_body(md);
-      }
-    }
-    smartlist_free(wrote);
-    return -1;
+    goto wipe;
   }
 
   cache->cache_content = tor_mmap_file(cache->cache_fname);
-
-  if (!cache->cache_content && smartlist_len(wrote)) {
+  if (!cache->cache_content && job->n_entries) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
             cache->cache_fname);
-    smartlist_free(wrote);
-    return -1;
+    goto wipe;
   }
-  SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
-    tor_assert(md->saved_location == SAVED_IN_CACHE);
-    md->body = (char*)cache->cache_content->data + md->off;
-    if (PREDICT_UNLIKELY(
-             md->bodylen < 9 || fast_memneq(md->body, "onion-key", 9) != 0)) {
-      /* XXXX once bug 2022 is solved, we can kill this block and turn it
-       * into just the tor_assert(fast_memeq) */
-      off_t avail = cache->cache_content->size - md->off;
-      char *bad_str;
-      tor_assert(avail >= 0);
-      bad_str = tor_strndup(md->body, MIN(128, (size_t)avail));
-      log_err(LD_BUG, "After rebuilding microdesc cache, offsets seem wrong. "
-              " At offset %d, I expected to find a microdescriptor starting "
-              " with \"onion-key\".  Instead I got %s.",
-              (int)md->off, escaped(bad_str));
-      tor_free(bad_str);
-      tor_assert(fast_memeq(md->body, "onion-key", 9));
-    }
-  } SMARTLIST_FOREACH_END(md);
 
-  smartlist_free(wrote);
+  for (i = 0; i < job->n_entries; ++i) {
+    const md_rebuild_entry_t *ent = &job->entries[i];
+    microdesc_t search, *md;
+    memcpy(search.digest, ent->digest, DIGEST256_LEN);
+    md = HT_FIND(microdesc_map, &cache->map, &search);
+    if (!md || md->no_save || md->bodylen != ent->bodylen)
+      continue; /* Removed or replaced while we were working. */
+    if (md->saved_location != SAVED_IN_CACHE && !md->body)
+      continue;
+    if (BUG((size_t)ent->off + ent->bodylen > cache->cache_content->size))
+      continue;
+    if (md->saved_location != SAVED_IN_CACHE)
+      tor_free(md->body);
+    md->body = (char*)cache->cache_content->data + ent->off;
+    md->off = ent->off;
+    md->saved_location = SAVED_IN_CACHE;
+    tor_assert(fast_memeq(md->body, "onion-key", 9));
+  }
 
-  write_str_to_file(cache->journal_fname, "", 1);
-  cache->journal_len = 0;
-  cache->bytes_dropped = 0;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE && !md->body)
+      microdesc_wipe_body(md);
+  }
 
-  new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
+  microdesc_cache_rewrite_journal(cache);
+  if (cache->bytes_dropped > job->bytes_dropped_at_start)
+    cache->bytes_dropped -= job->bytes_dropped_at_start;
+  else
+    cache->bytes_dropped = 0;
+
+  new_size = cache->cache_content ? cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
            "Saved %d bytes; %d still used.",
-           orig_size-new_size, new_size);
+           (int)job->orig_size - (int)new_size, (int)new_size);
 
   return 0;
+
+ wipe:
+  /* Okay. Let's prevent from making things worse elsewhere. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE) {
+      microdesc_wipe_body(md);
+    }
+  }
+  return -1;
+}
+
+/** Reply function: runs in the main thread once a cpuworker has written the
+ * new cache file for a microdesc_rebuild_job_t. */
+static void
+microdesc_rebuild_replyfn(void *work_)
+{
+  microdesc_rebuild_job_t *job = work_;
+  tor_assert(job->cache->rebuild_job == job);
+  job->cache->rebuild_job = NULL;
+  if (!job->orphaned)
+    microdesc_rebuild_finish(job->cache, job);
+  microdesc_rebuild_job_free(job);
+}
+
+/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
+ * and update every microdesc_t in the cache with pointers to its new
+ * location.  If <b>force</b> is true, do this unconditionally.  If
+ * <b>force</b> is false, do it only if we expect to save space on disk.
+ *
+ * When <b>force</b> is false and we have cpuworkers, the new file is
+ * written in a worker and swapped in later: until then, the old cache file
+ * and the journal stay in use. */
+int
+microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+{
+  if (cache == NULL) {
+    cache = the_microdesc_cache;
+    if (cache == NULL)
+      return 0;
+  }
+
+  if (cache->rebuild_job) {
+    /* We're already on it. */
+    return 0;
+  }
+
+  /* Remove dead descriptors */
+  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
+
+  if (!force && !should_rebuild_md_cache(cache))
+    return 0;
+
+  return microdesc_cache_launch_rebuild(cache,
+                                        !force && cpuworker_is_running());
+}
+
+/** Helper for microdesc_cache_rebuild(): write a new cache file for
+ * <b>cache</b>.  If <b>background</b> is true, try to do it in a cpuworker.
+ * Return 0 on success (or once the work is queued), -1 on failure. */
+STATIC int
+microdesc_cache_launch_rebuild(microdesc_cache_t *cache, int background)
+{
+  microdesc_rebuild_job_t *job;
+  int r;
+
+  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+
+  job = microdesc_rebuild_job_new(cache);
+  if (!job)
+    return -1;
+
+  if (background) {
+    job->work = cpuworker_queue_work(WQ_PRI_LOW,
+                                     microdesc_rebuild_threadfn,
+                                     microdesc_rebuild_replyfn,
+                                     job);
+    if (job->work) {
+      cache->rebuild_job = job;
+      return 0;
+    }
+    log_info(LD_DIR, "Couldn't queue microdescriptor cache rebuild; "
+             "doing it now.");
+  }
+
+  microdesc_rebuild_threadfn(NULL, job);
+  r = microdesc_rebuild_finish(cache, job);
+  microdesc_rebuild_job_free(job);
+  return r;
 }
 
 /** Make sure that the reference count of every microdescriptor in cache is
@@ -900,6 +1220,13 @@ microdesc_free_all(void)
 {
   if (the_microdesc_cache) {
     microdesc_cache_clear(the_microdesc_cache);
+    if (the_microdesc_cache->rebuild_job) {
+      /* A worker is still writing a new cache file.  We're shutting down,
+       * so its reply will never be processed: wait for the worker, then
+       * discard the file ourselves. */
+      microdesc_rebuild_job_wait(the_microdesc_cache->rebuild_job);
+      microdesc_rebuild_job_free(the_microdesc_cache->rebuild_job);
+    }
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
     tor_free(the_microdesc_cache);
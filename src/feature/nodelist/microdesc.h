@@ -20,6 +20,12 @@ smartlist_t *microdescs_add_to_cache(microdesc_cache_t *cache,
                         const char *s, const char *eos, saved_location_t where,
                         int no_save, time_t listed_at,
                         smartlist_t *requested_digests256);
+smartlist_t *microdescs_add_parsed_to_cache(microdesc_cache_t *cache,
+                                           smartlist_t *descriptors,
+                                           smartlist_t *invalid_digests,
+                                           saved_location_t where,
+                                           int no_save, time_t listed_at,
+                                           smartlist_t *requested_digests256);
 smartlist_t *microdescs_add_list_to_cache(microdesc_cache_t *cache,
                         smartlist_t *descriptors, saved_location_t where,
                         int no_save);
@@ -56,5 +62,10 @@ void microdesc_note_outdated_dirserver(const char *relay_digest);
 int microdesc_relay_is_outdated_dirserver(const char *relay_digest);
 void microdesc_reset_outdated_dirservers_list(void);
 
+#ifdef MICRODESC_PRIVATE
+STATIC int microdesc_cache_launch_rebuild(microdesc_cache_t *cache,
+                                          int background);
+#endif
+
 #endif /* !defined(TOR_MICRODESC_H) */
 
@@ -1868,6 +1868,28 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
+  /* Before we parse every routerstatus entry in it, make sure that we
+   * wouldn't discard this consensus anyway because we already have it or a
+   * newer one.  This happens often enough (for example, when we load an
+   * unverified consensus from our cache at startup) to be worth checking. */
+  {
+    consensus_flavor_t pre_flav;
+    time_t pre_valid_after;
+    const networkstatus_t *current;
+    if (networkstatus_parse_consensus_preamble(consensus, &pre_flav,
+                                               &pre_valid_after) == 0 &&
+        (!require_flavor || (int)pre_flav == flav)) {
+      current = pre_flav == FLAV_NS ? current_ns_consensus :
+        current_md_consensus;
+      if (current && pre_valid_after <= current->valid_after) {
+        log_info(LD_DIR, "Got a %s consensus at least as old as the one we "
+                 "have; not parsing it.",
+                 networkstatus_get_flavor_name(pre_flav));
+        goto done;
+      }
+    }
+  }
+
   /* Make sure it's parseable. */
   c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
   if (!c) {
@@ -31,6 +31,7 @@
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/ctime/di_ops.h"
 #include "lib/math/fp.h"
 
 #include "feature/dirclient/dir_server_st.h"
@@ -804,6 +805,156 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** A table of the weight of every node in the nodelist under one
+ * bandwidth_weight_rule_t.  Node weights don't depend on which other nodes
+ * are candidates, so we compute them once per directory change and then pick
+ * from the whole nodelist, throwing away draws that fail the caller's
+ * restrictions. */
+typedef struct node_weight_table_t {
+  /** The nodelist, in order, as of when this table was built.  We only
+   * compare these pointers against the current nodelist; we never dereference
+   * them, since the nodes may have been freed since. */
+  const node_t **nodes;
+  /** Weight of each node in <b>nodes</b>, scaled to uint64_t. */
+  uint64_t *weights;
+  /** Number of entries in <b>nodes</b> and <b>weights</b>. */
+  int n_nodes;
+  /** Sum of all entries in <b>weights</b>. */
+  uint64_t total;
+  /** True iff this table reflects our current directory information. */
+  unsigned int is_valid:1;
+} node_weight_table_t;
+
+/** One weight table for each bandwidth_weight_rule_t. */
+static node_weight_table_t node_weight_tables[WEIGHT_FOR_DIR+1];
+
+/** How many random draws do we make from a weight table before giving up and
+ * building the full candidate list instead? */
+#define MAX_NODE_WEIGHT_TABLE_DRAWS 32
+
+/** Release all storage held in <b>table</b>, and mark it invalid. */
+static void
+node_weight_table_clear(node_weight_table_t *table)
+{
+  tor_free(table->nodes);
+  tor_free(table->weights);
+  table->n_nodes = 0;
+  table->total = 0;
+  table->is_valid = 0;
+}
+
+/** Return the weight table for <b>rule</b>, rebuilding it from the nodelist
+ * if our directory information has changed.  Return NULL if there is nothing
+ * to choose from. */
+static node_weight_table_t *
+node_weight_table_get(bandwidth_weight_rule_t rule)
+{
+  node_weight_table_t *table = &node_weight_tables[rule];
+  const smartlist_t *nodes = nodelist_get_list();
+  double *bandwidths = NULL;
+  int i;
+
+  if (table->is_valid && table->n_nodes == smartlist_len(nodes))
+    return table;
+
+  node_weight_table_clear(table);
+  if (compute_weighted_bandwidths(nodes, rule, &bandwidths, NULL) < 0)
+    return NULL;
+
+  table->n_nodes = smartlist_len(nodes);
+  table->nodes = tor_calloc(table->n_nodes, sizeof(node_t *));
+  table->weights = tor_calloc(table->n_nodes, sizeof(uint64_t));
+  SMARTLIST_FOREACH(nodes, const node_t *, node,
+                    table->nodes[node_sl_idx] = node);
+  scale_array_elements_to_u64(table->weights, bandwidths, table->n_nodes,
+                              NULL);
+  for (i = 0; i < table->n_nodes; ++i)
+    table->total += table->weights[i];
+  tor_free(bandwidths);
+
+  table->is_valid = 1;
+  return table;
+}
+
+/** Forget all our precomputed node weights: the nodelist or the consensus
+ * weights have changed. */
+void
+node_select_weights_changed(void)
+{
+  int i;
+  for (i = 0; i < (int)ARRAY_LENGTH(node_weight_tables); ++i)
+    node_weight_tables[i].is_valid = 0;
+}
+
+/** Free all storage held by the node weight tables. */
+void
+node_select_free_all(void)
+{
+  int i;
+  for (i = 0; i < (int)ARRAY_LENGTH(node_weight_tables); ++i)
+    node_weight_table_clear(&node_weight_tables[i]);
+}
+
+/** Try to pick a node as router_choose_random_node_impl() would with no
+ * restrictedset, by drawing from the precomputed weight table for
+ * <b>rule</b> and rejecting nodes that fail the restrictions in
+ * <b>flags</b> or appear in <b>excludednodes</b>, <b>excludedsmartlist</b> or
+ * <b>excludedset</b>.  Since a node's weight doesn't depend on the rest of the
+ * candidate list, this picks from the same distribution as building that list
+ * and weighting it.  Return NULL if we ran out of draws, in which case the
+ * caller should do it the slow way. */
+STATIC const node_t *
+router_choose_random_node_from_table(const smartlist_t *excludednodes,
+                                     const smartlist_t *excludedsmartlist,
+                                     const routerset_t *excludedset,
+                                     router_crn_flags_t flags,
+                                     bandwidth_weight_rule_t rule)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  node_weight_table_t *table = node_weight_table_get(rule);
+  int i;
+
+  if (!table || table->total == 0)
+    return NULL;
+
+  for (i = 0; i < MAX_NODE_WEIGHT_TABLE_DRAWS; ++i) {
+    int idx = select_array_member_cumulative_timei(
+                           table->weights, table->n_nodes, table->total,
+                           crypto_rand_uint64(table->total));
+    const node_t *node = smartlist_get(nodes, idx);
+
+    if (node != table->nodes[idx]) {
+      /* The nodelist changed under us without node_select_weights_changed()
+       * being called; this happens in tests that build their own nodelist.
+       * Let the caller take the slow path. */
+      node_weight_table_clear(table);
+      return NULL;
+    }
+    if (!router_node_is_running_candidate(node,
+                                  (flags & CRN_NEED_UPTIME) != 0,
+                                  (flags & CRN_NEED_CAPACITY) != 0,
+                                  (flags & CRN_NEED_GUARD) != 0,
+                                  (flags & CRN_NEED_GUARD_STRICT) != 0,
+                                  (flags & CRN_NEED_DESC) != 0,
+                                  (flags & CRN_PREF_ADDR) != 0,
+                                  (flags & CRN_DIRECT_CONN) != 0))
+      continue;
+    if (node_allows_single_hop_exits(node))
+      continue;
+    if ((flags & CRN_RENDEZVOUS_V3) &&
+        !node_supports_v3_rendezvous_point(node))
+      continue;
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedsmartlist && smartlist_contains(excludedsmartlist, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    return node;
+  }
+  return NULL;
+}
+
 /** Given a <b>router</b>, add every node_t in its family (including the
  * node itself!) to <b>sl</b>.
  *
@@ -862,8 +1013,7 @@ router_choose_random_node_impl(smartlist_t *excludedsmartlist,
   const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
   const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  smartlist_t *sl, *excludednodes=smartlist_new();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -872,6 +1022,26 @@ router_choose_random_node_impl(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  /* If the node_t is not found we won't be to exclude ourself but we
+   * won't be able to pick ourself in router_choose_random_node() so
+   * this is fine to at least try with our routerinfo_t object. */
+  if ((r = router_get_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  /* Usually most nodes are acceptable, so a few draws from the precomputed
+   * weights will find one.  A restrictedset tends to be small, so don't
+   * bother trying there. */
+  if (!restrictedset) {
+    choice = router_choose_random_node_from_table(excludednodes,
+                                                  excludedsmartlist,
+                                                  excludedset, flags, rule);
+    if (choice) {
+      smartlist_free(excludednodes);
+      return choice;
+    }
+  }
+
+  sl = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), node_t *, node) {
     if (node_allows_single_hop_exits(node)) {
       /* Exclude relays that allow single hop exit circuits. This is an
@@ -886,12 +1056,6 @@ router_choose_random_node_impl(smartlist_t *excludedsmartlist,
     }
   } SMARTLIST_FOREACH_END(node);
 
-  /* If the node_t is not found we won't be to exclude ourself but we
-   * won't be able to pick ourself in router_choose_random_node() so
-   * this is fine to at least try with our routerinfo_t object. */
-  if ((r = router_get_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
   router_add_running_nodes_to_smartlist(sl, need_uptime, need_capacity,
                                         need_guard, need_guard_strict, need_desc,
                                         pref_addr, direct_conn);
@@ -88,6 +88,9 @@ const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
 
+void node_select_weights_changed(void);
+void node_select_free_all(void);
+
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
@@ -105,6 +108,12 @@ STATIC const routerstatus_t *router_pick_directory_server_impl(
                                            int *n_busy_out);
 STATIC int router_is_already_dir_fetching(const tor_addr_port_t *ap,
                                           int serverdesc, int microdesc);
+STATIC const node_t *router_choose_random_node_from_table(
+                                   const smartlist_t *excludednodes,
+                                   const smartlist_t *excludedsmartlist,
+                                   const struct routerset_t *excludedset,
+                                   router_crn_flags_t flags,
+                                   bandwidth_weight_rule_t rule);
 #endif
 
 #endif
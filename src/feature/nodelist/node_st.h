@@ -82,6 +82,18 @@ struct node_t {
    * XX/teor - can this become out of date if the torrc changes? */
   unsigned int ipv6_preferred:1;
 
+  /** True iff the rs_*_hash fields below describe the routerstatus this node
+   * was last given by nodelist_set_consensus(). */
+  unsigned int rs_hashes_set:1;
+
+  /** Hashes of the address, descriptor digest, and remaining status fields
+   * of this node's last routerstatus.  nodelist_set_consensus() compares
+   * them to the new consensus entry so that it only recomputes derived state
+   * for nodes whose entry actually changed. */
+  uint64_t rs_addr_hash;
+  uint64_t rs_desc_hash;
+  uint64_t rs_status_hash;
+
   /** According to the geoip db what country is this router in? */
   /* XXXprop186 what is this suppose to mean with multiple OR ports? */
   country_t country;
@@ -113,6 +113,21 @@ static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
 static void node_add_to_address_set(const node_t *node);
 
+/** The inputs, other than a node's ed25519 identity, that its hsdir indices
+ * are derived from.  These only depend on the consensus and the current time
+ * period, so nodelist_set_consensus() computes them once per consensus and
+ * can tell from them whether unchanged nodes need new indices at all. */
+typedef struct hsdir_index_params_t {
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  /** True iff we are in the segment between TP#N and SRV#N+1. */
+  uint8_t in_period_between_tp_and_srv;
+} hsdir_index_params_t;
+
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
  * is currently in the routerlist, or currently in the consensus we're using.
@@ -138,6 +153,11 @@ typedef struct nodelist_t {
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* The hsdir index inputs that the last call to nodelist_set_consensus()
+   * used, valid iff have_hsdir_params is set. */
+  hsdir_index_params_t hsdir_params;
+  unsigned int have_hsdir_params:1;
 } nodelist_t;
 
 static inline unsigned int
@@ -252,6 +272,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  node_select_weights_changed();
 
   node->country = -1;
 
@@ -346,34 +367,24 @@ node_add_to_ed25519_map(node_t *node)
   return 1;
 }
 
-/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
- * for the node, both current and next if possible. This can only fails if the
- * node_t ed25519 identity key can't be found which would be a bug. */
-STATIC void
-node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+/** Fill <b>params</b> with the hsdir index inputs for the consensus
+ * <b>ns</b> at time <b>now</b>.  Return 0 on success, or -1 if <b>ns</b>
+ * isn't live, in which case we must not set any hsdir index from it. */
+static int
+hsdir_index_params_init(hsdir_index_params_t *params,
+                        const networkstatus_t *ns, time_t now)
 {
-  time_t now = approx_time();
-  const ed25519_public_key_t *node_identity_pk;
-  uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
+  uint8_t *fetch_srv, *store_first_srv, *store_second_srv;
   uint64_t next_time_period_num, current_time_period_num;
-  uint64_t fetch_tp, store_first_tp, store_second_tp;
 
-  tor_assert(node);
-  tor_assert(ns);
+  /* Zero the padding too, so that params can be compared with tor_memeq. */
+  memset(params, 0, sizeof(*params));
 
   if (!networkstatus_is_live(ns, now)) {
     static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
     log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
                    "Not setting hsdir index with a non-live consensus.");
-    goto done;
-  }
-
-  node_identity_pk = node_get_ed25519_id(node);
-  if (node_identity_pk == NULL) {
-    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
-                          "trying to build the hsdir indexes for node %s",
-              node_describe(node));
-    goto done;
+    return -1;
   }
 
   /* Get the current and next time period number. */
@@ -381,55 +392,94 @@ node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
   next_time_period_num = hs_get_next_time_period_num(0);
 
   /* We always use the current time period for fetching descs */
-  fetch_tp = current_time_period_num;
+  params->fetch_tp = current_time_period_num;
 
   /* Now extract the needed SRVs and time periods for building hsdir indices */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
-    fetch_srv = hs_get_current_srv(fetch_tp, ns);
+  params->in_period_between_tp_and_srv =
+    !! hs_in_period_between_tp_and_srv(ns, now);
+  if (params->in_period_between_tp_and_srv) {
+    fetch_srv = hs_get_current_srv(params->fetch_tp, ns);
 
-    store_first_tp = hs_get_previous_time_period_num(0);
-    store_second_tp = current_time_period_num;
+    params->store_first_tp = hs_get_previous_time_period_num(0);
+    params->store_second_tp = current_time_period_num;
   } else {
-    fetch_srv = hs_get_previous_srv(fetch_tp, ns);
+    fetch_srv = hs_get_previous_srv(params->fetch_tp, ns);
 
-    store_first_tp = current_time_period_num;
-    store_second_tp = next_time_period_num;
+    params->store_first_tp = current_time_period_num;
+    params->store_second_tp = next_time_period_num;
   }
 
   /* We always use the old SRV for storing the first descriptor and the latest
    * SRV for storing the second descriptor */
-  store_first_srv = hs_get_previous_srv(store_first_tp, ns);
-  store_second_srv = hs_get_current_srv(store_second_tp, ns);
+  store_first_srv = hs_get_previous_srv(params->store_first_tp, ns);
+  store_second_srv = hs_get_current_srv(params->store_second_tp, ns);
+
+  memcpy(params->fetch_srv, fetch_srv, DIGEST256_LEN);
+  memcpy(params->store_first_srv, store_first_srv, DIGEST256_LEN);
+  memcpy(params->store_second_srv, store_second_srv, DIGEST256_LEN);
+
+  tor_free(fetch_srv);
+  tor_free(store_first_srv);
+  tor_free(store_second_srv);
+  return 0;
+}
+
+/** Set the hsdir indices of <b>node</b> from <b>params</b>. */
+static void
+node_set_hsdir_index_from_params(node_t *node,
+                                 const hsdir_index_params_t *params)
+{
+  const ed25519_public_key_t *node_identity_pk;
+
+  node_identity_pk = node_get_ed25519_id(node);
+  if (node_identity_pk == NULL) {
+    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
+                          "trying to build the hsdir indexes for node %s",
+              node_describe(node));
+    return;
+  }
 
   /* Build the fetch index. */
-  hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
+  hs_build_hsdir_index(node_identity_pk, params->fetch_srv, params->fetch_tp,
                        node->hsdir_index.fetch);
 
   /* If we are in the time segment between SRV#N and TP#N, the fetch index is
      the same as the first store index */
-  if (!hs_in_period_between_tp_and_srv(ns, now)) {
+  if (!params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index.store_first, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_first));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_first_srv, store_first_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_first_srv,
+                         params->store_first_tp,
                          node->hsdir_index.store_first);
   }
 
   /* If we are in the time segment between TP#N and SRV#N+1, the fetch index is
      the same as the second store index */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
+  if (params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index.store_second, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_second));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_second_srv, store_second_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_second_srv,
+                         params->store_second_tp,
                          node->hsdir_index.store_second);
   }
+}
 
- done:
-  tor_free(fetch_srv);
-  tor_free(store_first_srv);
-  tor_free(store_second_srv);
-  return;
+/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
+ * for the node, both current and next if possible. This can only fails if the
+ * node_t ed25519 identity key can't be found which would be a bug. */
+STATIC void
+node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+{
+  hsdir_index_params_t params;
+
+  tor_assert(node);
+  tor_assert(ns);
+
+  if (hsdir_index_params_init(&params, ns, approx_time()) < 0)
+    return;
+  node_set_hsdir_index_from_params(node, &params);
 }
 
 /** Called when a node's address changes. */
@@ -593,16 +643,139 @@ get_estimated_address_per_node, (void))
   return ESTIMATED_ADDRESS_PER_NODE;
 }
 
+/** Flag for node_note_routerstatus_hashes(): the node is newly listed in
+ * the consensus. */
+#define NODE_CHANGED_ADDED  (1u<<0)
+/** Flag for node_note_routerstatus_hashes(): the node's listed addresses or
+ * ports changed. */
+#define NODE_CHANGED_ADDR   (1u<<1)
+/** Flag for node_note_routerstatus_hashes(): the node's descriptor digest
+ * changed. */
+#define NODE_CHANGED_DESC   (1u<<2)
+/** Flag for node_note_routerstatus_hashes(): any other part of the node's
+ * consensus entry (flags, bandwidth, nickname, exit summary, protocols)
+ * changed. */
+#define NODE_CHANGED_STATUS (1u<<3)
+
+/** Compute hashes of the parts of <b>rs</b> that the nodelist derives node
+ * state from: its addresses and ports into *<b>addr_hash_out</b>, its
+ * descriptor digest into *<b>desc_hash_out</b>, and everything else that
+ * comes from the consensus into *<b>status_hash_out</b>.  Fields that are
+ * our own local state (download status and so on) are left out. */
+static void
+routerstatus_get_hashes(const routerstatus_t *rs,
+                        uint64_t *addr_hash_out,
+                        uint64_t *desc_hash_out,
+                        uint64_t *status_hash_out)
+{
+  uint8_t addr_buf[4 + 2 + 2 + 16 + 2];
+  uint8_t status_buf[MAX_NICKNAME_LEN + 1 + 4 + 4 + 4 + 4 + 8];
+  uint32_t flags = 0, pv = 0;
+  uint64_t exitsummary_hash = 0;
+  size_t off;
+  int n = 0;
+
+  memset(addr_buf, 0, sizeof(addr_buf));
+  set_uint32(addr_buf, rs->addr);
+  set_uint16(addr_buf+4, rs->or_port);
+  set_uint16(addr_buf+6, rs->dir_port);
+  if (tor_addr_family(&rs->ipv6_addr) == AF_INET6)
+    memcpy(addr_buf+8, tor_addr_to_in6_addr8(&rs->ipv6_addr), 16);
+  set_uint16(addr_buf+24, rs->ipv6_orport);
+  *addr_hash_out = siphash24g(addr_buf, sizeof(addr_buf));
+
+  *desc_hash_out = siphash24g(rs->descriptor_digest, DIGEST256_LEN);
+
+#define ADD_BIT(field) (flags |= ((uint32_t)!!(field)) << (n++))
+  ADD_BIT(rs->is_authority);
+  ADD_BIT(rs->is_exit);
+  ADD_BIT(rs->is_stable);
+  ADD_BIT(rs->is_fast);
+  ADD_BIT(rs->is_flagged_running);
+  ADD_BIT(rs->is_named);
+  ADD_BIT(rs->is_unnamed);
+  ADD_BIT(rs->is_valid);
+  ADD_BIT(rs->is_possible_guard);
+  ADD_BIT(rs->is_bad_exit);
+  ADD_BIT(rs->is_hs_dir);
+  ADD_BIT(rs->is_v2_dir);
+  ADD_BIT(rs->has_bandwidth);
+  ADD_BIT(rs->has_exitsummary);
+  ADD_BIT(rs->bw_is_unmeasured);
+  ADD_BIT(rs->has_guardfraction);
+#undef ADD_BIT
+#define ADD_BIT(field) (pv |= ((uint32_t)!!(rs->pv.field)) << (n++))
+  n = 0;
+  ADD_BIT(protocols_known);
+  ADD_BIT(supports_extend2_cells);
+  ADD_BIT(supports_ed25519_link_handshake_compat);
+  ADD_BIT(supports_ed25519_link_handshake_any);
+  ADD_BIT(supports_ed25519_hs_intro);
+  ADD_BIT(supports_v3_hsdir);
+  ADD_BIT(supports_v3_rendezvous_point);
+#undef ADD_BIT
+
+  if (rs->exitsummary)
+    exitsummary_hash = siphash24g(rs->exitsummary, strlen(rs->exitsummary));
+
+  memset(status_buf, 0, sizeof(status_buf));
+  strlcpy((char *)status_buf, rs->nickname, MAX_NICKNAME_LEN + 1);
+  off = MAX_NICKNAME_LEN + 1;
+  set_uint32(status_buf+off, flags);
+  set_uint32(status_buf+off+4, pv);
+  set_uint32(status_buf+off+8, rs->bandwidth_kb);
+  set_uint32(status_buf+off+12, rs->guardfraction_percentage);
+  set_uint64(status_buf+off+16, exitsummary_hash);
+  *status_hash_out = siphash24g(status_buf, sizeof(status_buf));
+}
+
+/** Remember the hashes of <b>rs</b>, the new routerstatus for <b>node</b>,
+ * and return a bitwise OR of the NODE_CHANGED_* flags that describe how it
+ * differs from the routerstatus the node had before. */
+static unsigned int
+node_note_routerstatus_hashes(node_t *node, const routerstatus_t *rs)
+{
+  uint64_t addr_hash, desc_hash, status_hash;
+  unsigned int what = 0;
+
+  routerstatus_get_hashes(rs, &addr_hash, &desc_hash, &status_hash);
+  if (!node->rs_hashes_set) {
+    what = NODE_CHANGED_ADDED;
+  } else {
+    if (addr_hash != node->rs_addr_hash)
+      what |= NODE_CHANGED_ADDR;
+    if (desc_hash != node->rs_desc_hash)
+      what |= NODE_CHANGED_DESC;
+    if (status_hash != node->rs_status_hash)
+      what |= NODE_CHANGED_STATUS;
+  }
+  node->rs_addr_hash = addr_hash;
+  node->rs_desc_hash = desc_hash;
+  node->rs_status_hash = status_hash;
+  node->rs_hashes_set = 1;
+  return what;
+}
+
 /** Tell the nodelist that the current usable consensus is <b>ns</b>.
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * Most relays' entries don't change from one consensus to the next, so
+ * derived state that is expensive to compute (hsdir indices, countries, the
+ * address set) is only recomputed for nodes whose entries changed, unless
+ * the inputs it depends on changed for every node.
  */
 void
 nodelist_set_consensus(networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
+  hsdir_index_params_t hsdir_params;
+  int have_hsdir_params, hsdir_params_changed;
+  int rebuild_addrs;
+  int n_changed = 0, n_removed = 0;
+  smartlist_t *touched = smartlist_new();
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
@@ -611,14 +784,22 @@ nodelist_set_consensus(networkstatus_t *ns)
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
-  /* Conservatively estimate that every node will have 2 addresses. */
-  const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
-                                  get_estimated_address_per_node();
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  /* Every hsdir index depends on these, so if they changed, all of them have
+   * to be recomputed. */
+  have_hsdir_params =
+    hsdir_index_params_init(&hsdir_params, ns, approx_time()) == 0;
+  hsdir_params_changed = have_hsdir_params &&
+    (! the_nodelist->have_hsdir_params ||
+     tor_memneq(&hsdir_params, &the_nodelist->hsdir_params,
+                sizeof(hsdir_params)));
+
+  /* If we have never built an address set, we have to build it now. */
+  rebuild_addrs = (the_nodelist->node_addrs == NULL);
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    unsigned int what = node_note_routerstatus_hashes(node, rs);
+    int md_changed = 0;
     node->rs = rs;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
@@ -631,13 +812,22 @@ nodelist_set_consensus(networkstatus_t *ns)
         if (node->md)
           node->md->held_by_nodes++;
         node_add_to_ed25519_map(node);
+        md_changed = 1;
       }
     }
 
-    if (rs->pv.supports_v3_hsdir) {
-      node_set_hsdir_index(node, ns);
+    if (rs->pv.supports_v3_hsdir && have_hsdir_params &&
+        (hsdir_params_changed || what || md_changed)) {
+      node_set_hsdir_index_from_params(node, &hsdir_params);
     }
-    node_set_country(node);
+    if ((what & (NODE_CHANGED_ADDED|NODE_CHANGED_ADDR)) ||
+        node->country == -1) {
+      node_set_country(node);
+    }
+    /* A bloom filter can't forget addresses, so if one went away we need a
+     * new address set. */
+    if (what & NODE_CHANGED_ADDR)
+      rebuild_addrs = 1;
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -656,15 +846,41 @@ nodelist_set_consensus(networkstatus_t *ns)
         node->ipv6_preferred = 1;
     }
 
+    if (what)
+      ++n_changed;
+    if (what || md_changed)
+      smartlist_add(touched, node);
   } SMARTLIST_FOREACH_END(rs);
 
-  nodelist_purge();
-
-  /* Now add all the nodes we have to the address set. */
+  /* Any node that had a routerstatus before and didn't get one now has been
+   * dropped from the consensus. */
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-    node_add_to_address_set(node);
+    if (!node->rs && node->rs_hashes_set) {
+      ++n_removed;
+      node->rs_hashes_set = 0;
+      rebuild_addrs = 1;
+    }
   } SMARTLIST_FOREACH_END(node);
 
+  nodelist_purge();
+
+  if (rebuild_addrs) {
+    /* Conservatively estimate that every node will have 2 addresses. */
+    const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
+                                    get_estimated_address_per_node();
+    address_set_free(the_nodelist->node_addrs);
+    the_nodelist->node_addrs = address_set_new(estimated_addresses);
+
+    /* Now add all the nodes we have to the address set. */
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+      node_add_to_address_set(node);
+    } SMARTLIST_FOREACH_END(node);
+  } else {
+    /* Nobody lost an address, so only the changed nodes can add any. */
+    SMARTLIST_FOREACH(touched, node_t *, node,
+                      node_add_to_address_set(node));
+  }
+
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
       /* We have no routerstatus for this router. Clear flags so we can skip
@@ -683,11 +899,28 @@ nodelist_set_consensus(networkstatus_t *ns)
     } SMARTLIST_FOREACH_END(node);
   }
 
+  if (have_hsdir_params) {
+    memcpy(&the_nodelist->hsdir_params, &hsdir_params, sizeof(hsdir_params));
+    the_nodelist->have_hsdir_params = 1;
+  } else {
+    /* Nodes that changed or joined under this consensus got no hsdir index,
+     * so the next live consensus has to recompute every index. */
+    the_nodelist->have_hsdir_params = 0;
+  }
+
   /* If the consensus is live, note down the consensus valid-after that formed
    * the nodelist. */
   if (networkstatus_is_live(ns, approx_time())) {
     the_nodelist->live_consensus_valid_after = ns->valid_after;
   }
+
+  /* Flags, bandwidths and weights may all have changed. */
+  node_select_weights_changed();
+
+  log_info(LD_DIR, "New consensus changed %d nodes and removed %d.",
+           n_changed, n_removed);
+
+  smartlist_free(touched);
 }
 
 /** Return 1 iff <b>node</b> has Exit flag and no BadExit flag.
@@ -758,6 +991,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  node_select_weights_changed();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -841,6 +1075,7 @@ nodelist_free_all(void)
   the_nodelist->node_addrs = NULL;
 
   tor_free(the_nodelist);
+  node_select_free_all();
 }
 
 /** Check that the nodelist is internally consistent, and consistent with
@@ -2190,6 +2425,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_weights_changed();
   rend_hsdir_routers_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
@@ -55,6 +55,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** <b>exit_policy</b>, compiled for fast matching.  Only set for our own
+   * routerinfo, and NULL if the policy couldn't be compiled. */
+  struct addr_policy_compiled_t *exit_policy_compiled;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
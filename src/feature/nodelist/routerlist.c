@@ -498,6 +498,62 @@ routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2)
     r1->ipv6_orport == r2->ipv6_orport;
 }
 
+/** Helper for router_add_running_nodes_to_smartlist(): return true iff
+ * <b>node</b> is suitable for a circuit under the given restrictions.
+ * <b>check_reach</b> is true iff we must check the node's OR address against
+ * our firewall rules when <b>direct_conn</b> is set. */
+static int
+router_node_is_running_candidate_impl(const node_t *node, int need_uptime,
+                                      int need_capacity, int need_guard,
+                                      int need_guard_strict, int need_desc,
+                                      int pref_addr, int direct_conn,
+                                      int check_reach)
+{
+  if (!node->is_running || !node->is_valid)
+    return 0;
+  if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  if (need_guard_strict && (!node_is_possible_guard(node) ||
+      !node_passes_guard_filter(get_options(),node)))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
+  if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do ntor. */
+  if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
+    return 0;
+  /* Choose a node with an OR address that matches the firewall rules */
+  if (direct_conn && check_reach &&
+      !fascist_firewall_allows_node(node,
+                                    FIREWALL_OR_CONNECTION,
+                                    pref_addr))
+    return 0;
+
+  return 1;
+}
+
+/** Return true iff <b>node</b> is one that
+ * router_add_running_nodes_to_smartlist() would add to its list when called
+ * with the same arguments. */
+int
+router_node_is_running_candidate(const node_t *node, int need_uptime,
+                                 int need_capacity, int need_guard,
+                                 int need_guard_strict, int need_desc,
+                                 int pref_addr, int direct_conn)
+{
+  const int check_reach = !router_skip_or_reachability(get_options(),
+                                                       pref_addr);
+  return router_node_is_running_candidate_impl(node, need_uptime,
+                                               need_capacity, need_guard,
+                                               need_guard_strict, need_desc,
+                                               pref_addr, direct_conn,
+                                               check_reach);
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -511,31 +567,12 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                                        pref_addr);
   /* XXXX MOVE */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running || !node->is_valid)
-      continue;
-    if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
-    if (need_guard_strict && (!node_is_possible_guard(node) ||
-        !node_passes_guard_filter(get_options(),node)))
-      continue;
-    /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
-    if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
-      continue;
-    /* Don't choose nodes if we are certain they can't do ntor. */
-    if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
-      continue;
-    /* Choose a node with an OR address that matches the firewall rules */
-    if (direct_conn && check_reach &&
-        !fascist_firewall_allows_node(node,
-                                      FIREWALL_OR_CONNECTION,
-                                      pref_addr))
-      continue;
-
-    smartlist_add(sl, (void *)node);
+    if (router_node_is_running_candidate_impl(node, need_uptime,
+                                              need_capacity, need_guard,
+                                              need_guard_strict, need_desc,
+                                              pref_addr, direct_conn,
+                                              check_reach))
+      smartlist_add(sl, (void *)node);
   } SMARTLIST_FOREACH_END(node);
 }
 
@@ -856,6 +893,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  addr_policy_compiled_free(router->exit_policy_compiled);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -2312,6 +2350,8 @@ void
 list_pending_microdesc_downloads(digest256map_t *result)
 {
   list_pending_downloads(NULL, result, DIR_PURPOSE_FETCH_MICRODESC, "d/");
+  /* Responses that we have received but not yet parsed count too. */
+  dir_list_microdescs_being_parsed(result);
 }
 
 /** Launch downloads for all the descriptors whose digests or digests256
@@ -55,6 +55,10 @@ void router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                            int need_capacity, int need_guard,
                                            int need_guard_strict, int need_desc,
                                            int pref_addr, int direct_conn);
+int router_node_is_running_candidate(const node_t *node, int need_uptime,
+                                     int need_capacity, int need_guard,
+                                     int need_guard_strict, int need_desc,
+                                     int pref_addr, int direct_conn);
 
 const routerinfo_t *routerlist_find_my_routerinfo(void);
 uint32_t router_get_advertised_bandwidth(const routerinfo_t *router);
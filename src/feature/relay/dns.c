@@ -65,6 +65,7 @@
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/sandbox/sandbox.h"
 
 #include "core/or/edge_connection_st.h"
@@ -75,6 +76,12 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/dns.h>
@@ -97,7 +104,6 @@ static char *resolv_conf_fname = NULL;
  * the nameservers?  Used to check whether we need to reconfigure. */
 static time_t resolv_conf_mtime = 0;
 
-static void purge_expired_resolves(time_t now);
 static void dns_found_answer(const char *address, uint8_t query_type,
                              int dns_answer,
                              const tor_addr_t *addr,
@@ -108,7 +114,6 @@ static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
-static void make_pending_resolve_cached(cached_resolve_t *cached);
 
 #ifdef DEBUG_DNS_CACHE
 static void assert_cache_ok_(void);
@@ -118,8 +123,40 @@ static void assert_cache_ok_(void);
 #endif /* defined(DEBUG_DNS_CACHE) */
 static void assert_resolve_ok(cached_resolve_t *resolve);
 
-/** Hash table of cached_resolve objects. */
-static HT_HEAD(cache_map, cached_resolve_t) cache_root;
+/** How many hash tables do we split the DNS cache into?  Must be a power of
+ * two. */
+#define DNS_CACHE_N_SHARDS 16
+/** An address goes into the shard given by this many bits at the top of
+ * its hash. */
+#define DNS_CACHE_SHARD_BITS 4
+
+/** Hash tables of cached_resolve objects.  We keep several small tables
+ * rather than one big one, so that growing any of them only rehashes a
+ * fraction of the cache at a time. */
+static HT_HEAD(cache_map, cached_resolve_t) cache_shards[DNS_CACHE_N_SHARDS];
+
+/** How many one-second slots are there in the expiry wheel?  Must be a power
+ * of two, and should be longer than any expiry we set, so that each slot
+ * mostly holds entries that expire during the current lap. */
+#define DNS_WHEEL_SLOTS 4096
+
+/** Expiry wheel: slot (t % DNS_WHEEL_SLOTS) holds every cached_resolve_t
+ * that expires at time t (or, if it was already due when we set its expiry,
+ * at the first second we haven't purged yet). */
+static TOR_LIST_HEAD(dns_wheel_slot_t, cached_resolve_t)
+  dns_wheel[DNS_WHEEL_SLOTS];
+/** The last time we passed to purge_expired_resolves().  Every slot up to
+ * and including this time has been purged. */
+static time_t dns_wheel_last_purge = 0;
+
+/** Every cached answer that has no successful lookup in it, oldest first. */
+static TOR_TAILQ_HEAD(dns_negative_list_t, cached_resolve_t)
+  dns_negative_list = TOR_TAILQ_HEAD_INITIALIZER(dns_negative_list);
+/** How many entries are there in dns_negative_list? */
+static int dns_n_negative = 0;
+
+/** Counters describing how well the cache is doing. */
+static dns_cache_stats_t dns_stats;
 
 /** Global: how many IPv6 requests have we made in all? */
 static uint64_t n_ipv6_requests_made = 0;
@@ -138,11 +175,18 @@ cached_resolves_eq(cached_resolve_t *a, cached_resolve_t *b)
   return !strncmp(a->address, b->address, MAX_ADDRESSLEN);
 }
 
+/** Return the hash we use to find <b>address</b> in the cache. */
+static inline unsigned int
+dns_address_hash(const char *address)
+{
+  return (unsigned) siphash24g((const uint8_t*)address, strlen(address));
+}
+
 /** Hash function for cached_resolve objects */
 static inline unsigned int
 cached_resolve_hash(cached_resolve_t *a)
 {
-  return (unsigned) siphash24g((const uint8_t*)a->address, strlen(a->address));
+  return a->addr_hash;
 }
 
 HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
@@ -150,11 +194,46 @@ HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
 HT_GENERATE2(cache_map, cached_resolve_t, node, cached_resolve_hash,
              cached_resolves_eq, 0.6, tor_reallocarray_, tor_free_)
 
+/** Return the cache shard that holds (or would hold) <b>resolve</b>. */
+static inline struct cache_map *
+cache_shard_for(const cached_resolve_t *resolve)
+{
+  unsigned idx = resolve->addr_hash >> (32 - DNS_CACHE_SHARD_BITS);
+  return &cache_shards[idx & (DNS_CACHE_N_SHARDS - 1)];
+}
+
+/** Return the cache entry whose address matches that of <b>search</b>, or
+ * NULL if there is none.  Sets the addr_hash field of <b>search</b>. */
+static cached_resolve_t *
+cache_find(cached_resolve_t *search)
+{
+  search->addr_hash = dns_address_hash(search->address);
+  return HT_FIND(cache_map, cache_shard_for(search), search);
+}
+
+/** Add <b>resolve</b>, whose addr_hash must already be set, to the
+ * cache. */
+static void
+cache_insert(cached_resolve_t *resolve)
+{
+  HT_INSERT(cache_map, cache_shard_for(resolve), resolve);
+}
+
+/** Remove <b>resolve</b> from the cache, and return whatever entry was
+ * removed. */
+static cached_resolve_t *
+cache_remove(cached_resolve_t *resolve)
+{
+  return HT_REMOVE(cache_map, cache_shard_for(resolve), resolve);
+}
+
 /** Initialize the DNS cache. */
 static void
 init_cache_map(void)
 {
-  HT_INIT(cache_map, &cache_root);
+  int i;
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i)
+    HT_INIT(cache_map, &cache_shards[i]);
 }
 
 /** Helper: called by eventdns when eventdns wants to log something. */
@@ -301,24 +380,61 @@ free_cached_resolve_(cached_resolve_t *r)
   tor_free(r);
 }
 
-/** Compare two cached_resolve_t pointers by expiry time, and return
- * less-than-zero, zero, or greater-than-zero as appropriate. Used for
- * the priority queue implementation. */
-static int
-compare_cached_resolves_by_expiry_(const void *_a, const void *_b)
+/** Remove <b>resolve</b> from the expiry wheel, if it is there. */
+static void
+wheel_remove(cached_resolve_t *resolve)
 {
-  const cached_resolve_t *a = _a, *b = _b;
-  if (a->expire < b->expire)
-    return -1;
-  else if (a->expire == b->expire)
-    return 0;
-  else
-    return 1;
+  if (resolve->wheel_slot < 0)
+    return;
+  TOR_LIST_REMOVE(resolve, wheel_node);
+  resolve->wheel_slot = -1;
+}
+
+/** Remove <b>resolve</b> from the list of negative answers, if it is
+ * there. */
+static void
+negative_remove(cached_resolve_t *resolve)
+{
+  if (!resolve->is_negative)
+    return;
+  TOR_TAILQ_REMOVE(&dns_negative_list, resolve, negative_node);
+  resolve->is_negative = 0;
+  --dns_n_negative;
+}
+
+/** Remove the cached answer <b>resolve</b> from the cache and from all of
+ * our indices, and free it. */
+static void
+dns_cache_evict(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed;
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  tor_assert(!resolve->pending_connections);
+
+  removed = cache_remove(resolve);
+  tor_assert(removed == resolve);
+  wheel_remove(resolve);
+  negative_remove(resolve);
+  free_cached_resolve_(resolve);
 }
 
-/** Priority queue of cached_resolve_t objects to let us know when they
- * will expire. */
-static smartlist_t *cached_resolve_pqueue = NULL;
+/** Add the cached answer <b>resolve</b> to the list of negative answers.
+ * If that makes the list too long, forget the oldest one.
+ *
+ * Anybody can make us cache a failure by asking for random names, so we
+ * keep these in a FIFO of their own: a flood of junk lookups can't push the
+ * real answers out of the cache. */
+static void
+negative_add(cached_resolve_t *resolve)
+{
+  tor_assert(!resolve->is_negative);
+  resolve->is_negative = 1;
+  TOR_TAILQ_INSERT_TAIL(&dns_negative_list, resolve, negative_node);
+  if (++dns_n_negative > DNS_MAX_NEGATIVE_ENTRIES) {
+    dns_cache_evict(TOR_TAILQ_FIRST(&dns_negative_list));
+    ++dns_stats.n_negative_evicted;
+  }
+}
 
 static void
 cached_resolve_add_answer(cached_resolve_t *resolve,
@@ -381,121 +497,156 @@ cached_resolve_have_all_answers(const cached_resolve_t *resolve)
 }
 
 /** Set an expiry time for a cached_resolve_t, and add it to the expiry
- * priority queue */
-static void
+ * wheel. */
+STATIC void
 set_expiry(cached_resolve_t *resolve, time_t expires)
 {
+  time_t slot_time;
   tor_assert(resolve && resolve->expire == 0);
-  if (!cached_resolve_pqueue)
-    cached_resolve_pqueue = smartlist_new();
+  tor_assert(resolve->wheel_slot < 0);
   resolve->expire = expires;
-  smartlist_pqueue_add(cached_resolve_pqueue,
-                       compare_cached_resolves_by_expiry_,
-                       offsetof(cached_resolve_t, minheap_idx),
-                       resolve);
+  /* Don't put it in a slot we've already purged: it would sit there until
+   * the wheel came all the way around. */
+  slot_time = MAX(expires, dns_wheel_last_purge + 1);
+  resolve->wheel_slot = (int)(slot_time & (DNS_WHEEL_SLOTS - 1));
+  TOR_LIST_INSERT_HEAD(&dns_wheel[resolve->wheel_slot], resolve, wheel_node);
 }
 
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
 {
-  cached_resolve_t **ptr, **next, *item;
+  cached_resolve_t **ptr, **next, *item, *tmp;
+  int i;
   assert_cache_ok();
-  if (cached_resolve_pqueue) {
-    SMARTLIST_FOREACH(cached_resolve_pqueue, cached_resolve_t *, res,
-      {
-        if (res->state == CACHE_STATE_DONE)
-          free_cached_resolve_(res);
-      });
-  }
-  for (ptr = HT_START(cache_map, &cache_root); ptr != NULL; ptr = next) {
-    item = *ptr;
-    next = HT_NEXT_RMV(cache_map, &cache_root, ptr);
-    free_cached_resolve_(item);
-  }
-  HT_CLEAR(cache_map, &cache_root);
-  smartlist_free(cached_resolve_pqueue);
-  cached_resolve_pqueue = NULL;
+  for (i = 0; i < DNS_WHEEL_SLOTS; ++i) {
+    TOR_LIST_FOREACH_SAFE(item, &dns_wheel[i], wheel_node, tmp) {
+      if (item->state == CACHE_STATE_DONE)
+        free_cached_resolve_(item);
+    }
+    TOR_LIST_INIT(&dns_wheel[i]);
+  }
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i) {
+    struct cache_map *shard = &cache_shards[i];
+    for (ptr = HT_START(cache_map, shard); ptr != NULL; ptr = next) {
+      item = *ptr;
+      next = HT_NEXT_RMV(cache_map, shard, ptr);
+      free_cached_resolve_(item);
+    }
+    HT_CLEAR(cache_map, shard);
+  }
+  TOR_TAILQ_INIT(&dns_negative_list);
+  dns_n_negative = 0;
+  dns_wheel_last_purge = 0;
+  memset(&dns_stats, 0, sizeof(dns_stats));
   tor_free(resolv_conf_fname);
 }
 
-/** Remove every cached_resolve whose <b>expire</b> time is before or
- * equal to <b>now</b> from the cache. */
+/** Remove the expired cached_resolve <b>resolve</b> from the cache and from
+ * the expiry wheel, close any connections still waiting for it, and free
+ * it. */
 static void
-purge_expired_resolves(time_t now)
+purge_expired_resolve(cached_resolve_t *resolve)
 {
-  cached_resolve_t *resolve, *removed;
+  cached_resolve_t *removed;
   pending_connection_t *pend;
   edge_connection_t *pendconn;
 
-  assert_cache_ok();
-  if (!cached_resolve_pqueue)
-    return;
-
-  while (smartlist_len(cached_resolve_pqueue)) {
-    resolve = smartlist_get(cached_resolve_pqueue, 0);
-    if (resolve->expire > now)
-      break;
-    smartlist_pqueue_pop(cached_resolve_pqueue,
-                         compare_cached_resolves_by_expiry_,
-                         offsetof(cached_resolve_t, minheap_idx));
-
-    if (resolve->state == CACHE_STATE_PENDING) {
-      log_debug(LD_EXIT,
-                "Expiring a dns resolve %s that's still pending. Forgot to "
-                "cull it? DNS resolve didn't tell us about the timeout?",
-                escaped_safe_str(resolve->address));
-    } else if (resolve->state == CACHE_STATE_CACHED) {
-      log_debug(LD_EXIT,
-                "Forgetting old cached resolve (address %s, expires %lu)",
-                escaped_safe_str(resolve->address),
-                (unsigned long)resolve->expire);
-      tor_assert(!resolve->pending_connections);
-    } else {
-      tor_assert(resolve->state == CACHE_STATE_DONE);
-      tor_assert(!resolve->pending_connections);
-    }
+  wheel_remove(resolve);
+  negative_remove(resolve);
+
+  if (resolve->state == CACHE_STATE_PENDING) {
+    log_debug(LD_EXIT,
+              "Expiring a dns resolve %s that's still pending. Forgot to "
+              "cull it? DNS resolve didn't tell us about the timeout?",
+              escaped_safe_str(resolve->address));
+  } else if (resolve->state == CACHE_STATE_CACHED) {
+    log_debug(LD_EXIT,
+              "Forgetting old cached resolve (address %s, expires %lu)",
+              escaped_safe_str(resolve->address),
+              (unsigned long)resolve->expire);
+    tor_assert(!resolve->pending_connections);
+  } else {
+    tor_assert(resolve->state == CACHE_STATE_DONE);
+    tor_assert(!resolve->pending_connections);
+  }
 
-    if (resolve->pending_connections) {
-      log_debug(LD_EXIT,
-                "Closing pending connections on timed-out DNS resolve!");
-      while (resolve->pending_connections) {
-        pend = resolve->pending_connections;
-        resolve->pending_connections = pend->next;
-        /* Connections should only be pending if they have no socket. */
-        tor_assert(!SOCKET_OK(pend->conn->base_.s));
-        pendconn = pend->conn;
-        /* Prevent double-remove */
-        pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
-        if (!pendconn->base_.marked_for_close) {
-          connection_edge_end(pendconn, END_STREAM_REASON_TIMEOUT);
-          circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
-          connection_free_(TO_CONN(pendconn));
-        }
-        tor_free(pend);
+  if (resolve->pending_connections) {
+    log_debug(LD_EXIT,
+              "Closing pending connections on timed-out DNS resolve!");
+    while (resolve->pending_connections) {
+      pend = resolve->pending_connections;
+      resolve->pending_connections = pend->next;
+      /* Connections should only be pending if they have no socket. */
+      tor_assert(!SOCKET_OK(pend->conn->base_.s));
+      pendconn = pend->conn;
+      /* Prevent double-remove */
+      pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
+      if (!pendconn->base_.marked_for_close) {
+        connection_edge_end(pendconn, END_STREAM_REASON_TIMEOUT);
+        circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
+        connection_free_(TO_CONN(pendconn));
       }
+      tor_free(pend);
     }
+  }
 
-    if (resolve->state == CACHE_STATE_CACHED ||
-        resolve->state == CACHE_STATE_PENDING) {
-      removed = HT_REMOVE(cache_map, &cache_root, resolve);
-      if (removed != resolve) {
-        log_err(LD_BUG, "The expired resolve we purged didn't match any in"
-                " the cache. Tried to purge %s (%p); instead got %s (%p).",
-                resolve->address, (void*)resolve,
-                removed ? removed->address : "NULL", (void*)removed);
-      }
-      tor_assert(removed == resolve);
-    } else {
-      /* This should be in state DONE. Make sure it's not in the cache. */
-      cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
-      tor_assert(tmp != resolve);
+  if (resolve->state == CACHE_STATE_CACHED ||
+      resolve->state == CACHE_STATE_PENDING) {
+    removed = cache_remove(resolve);
+    if (removed != resolve) {
+      log_err(LD_BUG, "The expired resolve we purged didn't match any in"
+              " the cache. Tried to purge %s (%p); instead got %s (%p).",
+              resolve->address, (void*)resolve,
+              removed ? removed->address : "NULL", (void*)removed);
     }
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      tor_free(resolve->result_ptr.hostname);
-    resolve->magic = 0xF0BBF0BB;
-    tor_free(resolve);
+    tor_assert(removed == resolve);
+    ++dns_stats.n_expired;
+  } else {
+    /* This should be in state DONE. Make sure it's not in the cache. */
+    cached_resolve_t *tmp = HT_FIND(cache_map, cache_shard_for(resolve),
+                                    resolve);
+    tor_assert(tmp != resolve);
+  }
+  if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
+    tor_free(resolve->result_ptr.hostname);
+  resolve->magic = 0xF0BBF0BB;
+  tor_free(resolve);
+}
+
+/** Purge every cached_resolve in slot <b>slot</b> of the expiry wheel whose
+ * <b>expire</b> time is before or equal to <b>now</b>. */
+static void
+purge_wheel_slot(int slot, time_t now)
+{
+  cached_resolve_t *resolve, *next;
+  TOR_LIST_FOREACH_SAFE(resolve, &dns_wheel[slot], wheel_node, next) {
+    if (resolve->expire <= now)
+      purge_expired_resolve(resolve);
+  }
+}
+
+/** Remove every cached_resolve whose <b>expire</b> time is before or
+ * equal to <b>now</b> from the cache. */
+STATIC void
+purge_expired_resolves(time_t now)
+{
+  time_t t;
+  int i;
+
+  assert_cache_ok();
+
+  if (now < dns_wheel_last_purge ||
+      now - dns_wheel_last_purge >= DNS_WHEEL_SLOTS) {
+    /* The clock jumped, or we haven't looked in a long time: check every
+     * slot. */
+    for (i = 0; i < DNS_WHEEL_SLOTS; ++i)
+      purge_wheel_slot(i, now);
+  } else {
+    for (t = dns_wheel_last_purge + 1; t <= now; ++t)
+      purge_wheel_slot((int)(t & (DNS_WHEEL_SLOTS - 1)), now);
   }
+  dns_wheel_last_purge = now;
 
   assert_cache_ok();
 }
@@ -794,10 +945,11 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
 
   /* now check the hash table to see if 'address' is already there. */
   strlcpy(search.address, exitconn->base_.address, sizeof(search.address));
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = cache_find(&search);
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
       case CACHE_STATE_PENDING:
+        ++dns_stats.n_coalesced;
         /* add us to the pending list */
         pending_connection = tor_malloc_zero(
                                       sizeof(pending_connection_t));
@@ -814,6 +966,10 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   "cached answer for %s",
                   exitconn->base_.s,
                   escaped_safe_str(resolve->address));
+        if (resolve->is_negative)
+          ++dns_stats.n_negative_hits;
+        else
+          ++dns_stats.n_hits;
 
         *resolve_out = resolve;
 
@@ -825,12 +981,14 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
     tor_assert(0);
   }
   tor_assert(!resolve);
+  ++dns_stats.n_misses;
   /* not there, need to add it */
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
-  resolve->minheap_idx = -1;
+  resolve->wheel_slot = -1;
   strlcpy(resolve->address, exitconn->base_.address, sizeof(resolve->address));
+  resolve->addr_hash = search.addr_hash;
 
   /* add this connection to the pending list */
   pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
@@ -838,8 +996,8 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   resolve->pending_connections = pending_connection;
   *made_connection_pending_out = 1;
 
-  /* Add this resolve to the cache and priority queue. */
-  HT_INSERT(cache_map, &cache_root, resolve);
+  /* Add this resolve to the cache and the expiry wheel. */
+  cache_insert(resolve);
   set_expiry(resolve, now + RESOLVE_MAX_TIMEOUT);
 
   log_debug(LD_EXIT,"Launching %s.",
@@ -971,7 +1129,7 @@ assert_connection_edge_not_dns_pending(edge_connection_t *conn)
 #if 1
   cached_resolve_t *resolve;
   strlcpy(search.address, conn->base_.address, sizeof(search.address));
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = cache_find(&search);
   if (!resolve)
     return;
   for (pend = resolve->pending_connections; pend; pend = pend->next) {
@@ -979,9 +1137,12 @@ assert_connection_edge_not_dns_pending(edge_connection_t *conn)
   }
 #else /* !(1) */
   cached_resolve_t **resolve;
-  HT_FOREACH(resolve, cache_map, &cache_root) {
-    for (pend = (*resolve)->pending_connections; pend; pend = pend->next) {
-      tor_assert(pend->conn != conn);
+  int i;
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i) {
+    HT_FOREACH(resolve, cache_map, &cache_shards[i]) {
+      for (pend = (*resolve)->pending_connections; pend; pend = pend->next) {
+        tor_assert(pend->conn != conn);
+      }
     }
   }
 #endif /* 1 */
@@ -994,14 +1155,17 @@ assert_all_pending_dns_resolves_ok(void)
 {
   pending_connection_t *pend;
   cached_resolve_t **resolve;
-
-  HT_FOREACH(resolve, cache_map, &cache_root) {
-    for (pend = (*resolve)->pending_connections;
-         pend;
-         pend = pend->next) {
-      assert_connection_ok(TO_CONN(pend->conn), 0);
-      tor_assert(!SOCKET_OK(pend->conn->base_.s));
-      tor_assert(!connection_in_array(TO_CONN(pend->conn)));
+  int i;
+
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i) {
+    HT_FOREACH(resolve, cache_map, &cache_shards[i]) {
+      for (pend = (*resolve)->pending_connections;
+           pend;
+           pend = pend->next) {
+        assert_connection_ok(TO_CONN(pend->conn), 0);
+        tor_assert(!SOCKET_OK(pend->conn->base_.s));
+        tor_assert(!connection_in_array(TO_CONN(pend->conn)));
+      }
     }
   }
 }
@@ -1020,7 +1184,7 @@ connection_dns_remove(edge_connection_t *conn)
 
   strlcpy(search.address, conn->base_.address, sizeof(search.address));
 
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = cache_find(&search);
   if (!resolve) {
     log_notice(LD_BUG, "Address %s is not pending. Dropping.",
                escaped_safe_str(conn->base_.address));
@@ -1074,7 +1238,7 @@ dns_cancel_pending_resolve,(const char *address))
 
   strlcpy(search.address, address, sizeof(search.address));
 
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = cache_find(&search);
   if (!resolve)
     return;
 
@@ -1122,7 +1286,7 @@ dns_cancel_pending_resolve,(const char *address))
     tor_free(pend);
   }
 
-  tmp = HT_REMOVE(cache_map, &cache_root, resolve);
+  tmp = cache_remove(resolve);
   if (tmp != resolve) {
     log_err(LD_BUG, "The cancelled resolve we purged didn't match any in"
             " the cache. Tried to purge %s (%p); instead got %s (%p).",
@@ -1166,7 +1330,7 @@ dns_found_answer(const char *address, uint8_t query_type,
 
   strlcpy(search.address, address, sizeof(search.address));
 
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = cache_find(&search);
   if (!resolve) {
     int is_test_addr = is_test_address(address);
     if (!is_test_addr)
@@ -1290,13 +1454,13 @@ inform_pending_connections(cached_resolve_t *resolve)
  * This function is only necessary because of the perversity of our
  * cache timeout code; see inline comment for ideas on eliminating it.
  **/
-static void
+STATIC void
 make_pending_resolve_cached(cached_resolve_t *resolve)
 {
   cached_resolve_t *removed;
 
   resolve->state = CACHE_STATE_DONE;
-  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  removed = cache_remove(resolve);
   if (removed != resolve) {
     log_err(LD_BUG, "The pending resolve we found wasn't removable from"
             " the cache. Tried to purge %s (%p); instead got %s (%p).",
@@ -1305,7 +1469,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
   }
   assert_resolve_ok(resolve);
   assert_cache_ok();
-  /* The resolve will eventually just hit the time-out in the expiry queue and
+  /* The resolve will eventually just hit the time-out in the expiry wheel and
   * expire. See fd0bafb0dedc7e2 for a brief explanation of how this got that
   * way.  XXXXX we could do better!*/
 
@@ -1314,6 +1478,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
                                                sizeof(cached_resolve_t));
     uint32_t ttl = UINT32_MAX;
     new_resolve->expire = 0; /* So that set_expiry won't croak. */
+    new_resolve->wheel_slot = -1; /* The original is still on the wheel. */
     if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
       new_resolve->result_ptr.hostname =
         tor_strdup(resolve->result_ptr.hostname);
@@ -1321,7 +1486,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
     new_resolve->state = CACHE_STATE_CACHED;
 
     assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
+    cache_insert(new_resolve);
 
     if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
          resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
@@ -1339,6 +1504,11 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
       ttl = resolve->ttl_hostname;
 
     set_expiry(new_resolve, time(NULL) + dns_clip_ttl(ttl));
+
+    if (resolve->res_status_ipv4 != RES_STATUS_DONE_OK &&
+        resolve->res_status_ipv6 != RES_STATUS_DONE_OK &&
+        resolve->res_status_hostname != RES_STATUS_DONE_OK)
+      negative_add(new_resolve);
   }
 
   assert_cache_ok();
@@ -1624,6 +1794,219 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
   tor_free(arg_);
 }
 
+/* Resolver threads.
+ *
+ * If ServerDNSResolverThreads is set, the lookups we make on behalf of
+ * clients go to a pool of threads that make blocking getaddrinfo() and
+ * getnameinfo() calls, rather than to our evdns_base.  A nameserver that is
+ * slow to answer then only ties up the thread that is waiting for it, and
+ * our lookup rate isn't limited by what one event loop can drive.  Answers
+ * come back to the main thread on the pool's reply queue, and then go
+ * through evdns_callback() just as if eventdns had given them to us.
+ *
+ * Our own hijacking and correctness checks still go through eventdns.
+ */
+
+/** How many lookups may be waiting for each resolver thread before we send
+ * new ones to eventdns instead? */
+#define DNS_THREAD_MAX_PENDING_PER_THREAD 64
+
+/** Queue on which the resolver threads send us their answers. */
+static replyqueue_t *dns_replyqueue = NULL;
+/** The resolver threads, or NULL if we haven't started them. */
+static threadpool_t *dns_threadpool = NULL;
+/** How many threads are there in dns_threadpool? */
+static int dns_n_threads = 0;
+/** How many lookups have we queued for the resolver threads, and not yet
+ * had an answer for? */
+static int dns_n_thread_jobs_pending = 0;
+/** True iff we tried to start the resolver threads and failed. */
+static int dns_threads_failed = 0;
+
+/** Return the DNS_ERR_* value that best describes the getaddrinfo() or
+ * getnameinfo() return value <b>err</b>. */
+STATIC int
+dns_err_from_eai(int err)
+{
+  if (err == 0)
+    return DNS_ERR_NONE;
+  if (err == EAI_NONAME)
+    return DNS_ERR_NOTEXIST;
+#ifdef EAI_NODATA
+  if (err == EAI_NODATA)
+    return DNS_ERR_NOTEXIST;
+#endif
+  if (err == EAI_AGAIN)
+    return DNS_ERR_TIMEOUT;
+  if (err == EAI_FAIL)
+    return DNS_ERR_SERVERFAILED;
+  return DNS_ERR_UNKNOWN;
+}
+
+/** Perform the blocking lookup described by <b>job</b>, and store the
+ * outcome in it.  Runs in a resolver thread: it must not touch any state
+ * outside <b>job</b>. */
+STATIC void
+dns_thread_do_lookup(dns_thread_job_t *job)
+{
+  int err;
+
+  if (job->query_type == DNS_PTR) {
+    struct sockaddr_storage ss;
+    char host[MAX_ADDRESSLEN];
+    socklen_t sl = tor_addr_to_sockaddr(&job->ptr_address, 0,
+                                        (struct sockaddr *)&ss, sizeof(ss));
+    if (!sl) {
+      job->result = DNS_ERR_FORMAT;
+      return;
+    }
+    err = getnameinfo((struct sockaddr *)&ss, sl, host, sizeof(host),
+                      NULL, 0, NI_NAMEREQD);
+    job->result = dns_err_from_eai(err);
+    if (!err)
+      job->hostname = tor_strdup(host);
+  } else {
+    struct addrinfo hints, *res = NULL, *ai;
+    int family = (job->query_type == DNS_IPv6_AAAA) ? AF_INET6 : AF_INET;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(job->lookup_name, NULL, &hints, &res);
+    job->result = dns_err_from_eai(err);
+    for (ai = res; !err && ai; ai = ai->ai_next) {
+      if (ai->ai_family == family &&
+          tor_addr_from_sockaddr(&job->answer, ai->ai_addr, NULL) == 0)
+        break;
+    }
+    if (res)
+      freeaddrinfo(res);
+  }
+}
+
+/** Worker-thread callback: perform the lookup in <b>work_</b>. */
+static workqueue_reply_t
+dns_thread_lookup_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  dns_thread_do_lookup(work_);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback: a resolver thread has finished the lookup in
+ * <b>work_</b>.  Pass the answer on as eventdns would, and free the job. */
+static void
+dns_thread_lookup_replyfn(void *work_)
+{
+  dns_thread_job_t *job = work_;
+  int family = tor_addr_family(&job->answer);
+
+  tor_assert(dns_n_thread_jobs_pending > 0);
+  --dns_n_thread_jobs_pending;
+
+  /* We don't learn TTLs from getaddrinfo(), so we say 0: that gets the
+   * shorter of our two cache lifetimes. */
+  if (job->query_type == DNS_IPv4_A && family == AF_INET) {
+    uint32_t a = tor_addr_to_ipv4n(&job->answer);
+    evdns_callback(job->result, DNS_IPv4_A, 1, 0, &a, job->arg);
+  } else if (job->query_type == DNS_IPv6_AAAA && family == AF_INET6) {
+    struct in6_addr a;
+    memcpy(&a, tor_addr_to_in6(&job->answer), sizeof(a));
+    evdns_callback(job->result, DNS_IPv6_AAAA, 1, 0, &a, job->arg);
+  } else if (job->query_type == DNS_PTR && job->hostname) {
+    char *names[1] = { job->hostname };
+    evdns_callback(job->result, DNS_PTR, 1, 0, names, job->arg);
+  } else {
+    evdns_callback(job->result, job->query_type, 0, 0, NULL, job->arg);
+  }
+  /* evdns_callback() has freed job->arg. */
+  tor_free(job->lookup_name);
+  tor_free(job->hostname);
+  tor_free(job);
+}
+
+/** Resolver threads keep no state of their own. */
+static void *
+dns_thread_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+/** Resolver threads keep no state of their own. */
+static void
+dns_thread_state_free(void *state)
+{
+  (void)state;
+}
+
+/** Return true iff we should give our next client lookup to a resolver
+ * thread, starting the resolver threads first if we need to. */
+static int
+dns_threads_can_take_work(void)
+{
+  const or_options_t *options = get_options();
+
+  if (!options->ServerDNSResolverThreads || dns_threads_failed)
+    return 0;
+
+  if (!dns_threadpool) {
+    /* The number of threads is fixed once we start them. */
+    dns_n_threads = (int) options->ServerDNSResolverThreads;
+    dns_replyqueue = replyqueue_new(0);
+    dns_threadpool = threadpool_new(dns_n_threads, dns_replyqueue,
+                                    dns_thread_state_new,
+                                    dns_thread_state_free, NULL);
+    if (!dns_threadpool ||
+        threadpool_register_reply_event(dns_threadpool, NULL) < 0) {
+      log_warn(LD_EXIT, "Couldn't start DNS resolver threads. Using "
+               "eventdns for every lookup.");
+      dns_threads_failed = 1;
+      return 0;
+    }
+    log_notice(LD_EXIT, "Using %d threads to resolve names for clients.",
+               dns_n_threads);
+  }
+
+  return dns_n_threads > 0 &&
+    dns_n_thread_jobs_pending <
+      dns_n_threads * DNS_THREAD_MAX_PENDING_PER_THREAD;
+}
+
+/** Hand a lookup to the resolver threads.  <b>arg</b> is the argument we
+ * would have passed to eventdns; on success, we take ownership of it.
+ * If <b>use_search</b> is false, don't let the system resolver append its
+ * search domains.  Return 0 on success, -1 on failure. */
+static int
+dns_thread_launch(char *arg, uint8_t query_type,
+                  const tor_addr_t *ptr_address, int use_search)
+{
+  dns_thread_job_t *job = tor_malloc_zero(sizeof(dns_thread_job_t));
+  const char *address = arg + 1;
+  size_t len = strlen(address);
+
+  job->query_type = query_type;
+  job->arg = arg;
+  if (ptr_address)
+    tor_addr_copy(&job->ptr_address, ptr_address);
+  /* A trailing dot makes the name absolute, so that the system resolver
+   * won't try it under its search domains. */
+  if (!use_search && len && address[len-1] != '.')
+    tor_asprintf(&job->lookup_name, "%s.", address);
+  else
+    job->lookup_name = tor_strdup(address);
+
+  if (!threadpool_queue_work_priority(dns_threadpool, WQ_PRI_HIGH,
+                                      dns_thread_lookup_threadfn,
+                                      dns_thread_lookup_replyfn, job)) {
+    tor_free(job->lookup_name);
+    tor_free(job);
+    return -1;
+  }
+  ++dns_n_thread_jobs_pending;
+  return 0;
+}
+
 /** Start a single DNS resolve for <b>address</b> (if <b>query_type</b> is
  * DNS_IPv4_A or DNS_IPv6_AAAA) <b>ptr_address</b> (if <b>query_type</b> is
  * DNS_PTR). Return 0 if we launched the request, -1 otherwise. */
@@ -1639,6 +2022,14 @@ launch_one_resolve(const char *address, uint8_t query_type,
   addr[0] = (char) query_type;
   memcpy(addr+1, address, addr_len + 1);
 
+  if (dns_threads_can_take_work() &&
+      dns_thread_launch(addr, query_type, ptr_address,
+                        !(options & DNS_QUERY_NO_SEARCH)) == 0) {
+    if (query_type == DNS_IPv6_AAAA)
+      ++n_ipv6_requests_made;
+    return 0;
+  }
+
   switch (query_type) {
   case DNS_IPv4_A:
     req = evdns_base_resolve_ipv4(the_evdns_base,
@@ -2076,20 +2467,36 @@ assert_resolve_ok(cached_resolve_t *resolve)
 }
 
 /** Return the number of DNS cache entries as an int */
-static int
+STATIC int
 dns_cache_entry_count(void)
 {
-   return HT_SIZE(&cache_root);
+  int i, n = 0;
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i)
+    n += HT_SIZE(&cache_shards[i]);
+  return n;
 }
 
 /* Return the total size in bytes of the DNS cache. */
 size_t
 dns_cache_total_allocation(void)
 {
+  size_t table_mem = 0;
+  int i;
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i)
+    table_mem += HT_MEM_USAGE(&cache_shards[i]);
   return sizeof(struct cached_resolve_t) * dns_cache_entry_count() +
-         HT_MEM_USAGE(&cache_root);
+         table_mem;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the counters describing how well the DNS cache is doing. */
+STATIC const dns_cache_stats_t *
+dns_get_cache_stats(void)
+{
+  return &dns_stats;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Log memory information about our internal DNS cache at level 'severity'. */
 void
 dump_dns_mem_usage(int severity)
@@ -2098,41 +2505,64 @@ dump_dns_mem_usage(int severity)
   int hash_count = dns_cache_entry_count();
   size_t hash_mem = dns_cache_total_allocation();
 
-  /* Print out the count and estimated size of our &cache_root.  It undercounts
-     hostnames in cached reverse resolves.
+  /* Print out the count and estimated size of our cache shards.  It
+     undercounts hostnames in cached reverse resolves.
    */
-  tor_log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
+  tor_log(severity, LD_MM, "Our DNS cache has %d entries, %d of them "
+          "negative.", hash_count, dns_n_negative);
   tor_log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
+  tor_log(severity, LD_MM, "DNS cache lookups: %"PRIu64" hits, "
+          "%"PRIu64" negative hits, %"PRIu64" joined pending resolves, "
+          "%"PRIu64" misses.",
+          (dns_stats.n_hits), (dns_stats.n_negative_hits),
+          (dns_stats.n_coalesced), (dns_stats.n_misses));
+  tor_log(severity, LD_MM, "DNS cache removals: %"PRIu64" expired, "
+          "%"PRIu64" negative answers over the limit, %"PRIu64" for "
+          "memory pressure.",
+          (dns_stats.n_expired), (dns_stats.n_negative_evicted),
+          (dns_stats.n_oom_evicted));
 }
 
 /* Do a round of OOM cleanup on all DNS entries. Return the amount of removed
  * bytes. It is possible that the returned value is lower than min_remove_bytes
- * if the caches get emptied out so the caller should be aware of this. */
+ * if the caches get emptied out so the caller should be aware of this.
+ *
+ * We drop expired entries first, then negative answers (oldest first), then
+ * positive answers in the order they would expire.  Resolves that streams
+ * are still waiting on are left alone. */
 size_t
 dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
 {
-  time_t time_inc = 0;
-  size_t total_bytes_removed = 0;
+  size_t total_bytes_removed;
   size_t current_size = dns_cache_total_allocation();
+  cached_resolve_t *resolve, *next;
+  time_t t;
 
-  do {
-    /* If no DNS entries left, break loop. */
-    if (!dns_cache_entry_count())
-      break;
-
-    /* Get cutoff interval and remove entries. */
-    time_t cutoff = now + time_inc;
-    purge_expired_resolves(cutoff);
+  purge_expired_resolves(now);
+  total_bytes_removed = current_size - dns_cache_total_allocation();
 
-    /* Update amount of bytes removed and array size. */
-    size_t bytes_removed = current_size - dns_cache_total_allocation();
-    current_size -= bytes_removed;
-    total_bytes_removed += bytes_removed;
+  while (total_bytes_removed < min_remove_bytes &&
+         !TOR_TAILQ_EMPTY(&dns_negative_list)) {
+    dns_cache_evict(TOR_TAILQ_FIRST(&dns_negative_list));
+    ++dns_stats.n_oom_evicted;
+    total_bytes_removed += sizeof(cached_resolve_t);
+  }
 
-    /* Increase time_inc by a reasonable fraction. */
-    time_inc += (MAX_DNS_TTL_AT_EXIT / 4);
-  } while (total_bytes_removed < min_remove_bytes);
+  for (t = now + 1;
+       t < now + DNS_WHEEL_SLOTS && total_bytes_removed < min_remove_bytes;
+       ++t) {
+    int slot = (int)(t & (DNS_WHEEL_SLOTS - 1));
+    TOR_LIST_FOREACH_SAFE(resolve, &dns_wheel[slot], wheel_node, next) {
+      if (resolve->state != CACHE_STATE_CACHED || resolve->expire > t)
+        continue;
+      dns_cache_evict(resolve);
+      ++dns_stats.n_oom_evicted;
+      total_bytes_removed += sizeof(cached_resolve_t);
+      if (total_bytes_removed >= min_remove_bytes)
+        break;
+    }
+  }
 
   return total_bytes_removed;
 }
@@ -2142,34 +2572,41 @@ dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
 static void
 assert_cache_ok_(void)
 {
-  cached_resolve_t **resolve;
-  int bad_rep = HT_REP_IS_BAD_(cache_map, &cache_root);
-  if (bad_rep) {
-    log_err(LD_BUG, "Bad rep type %d on dns cache hash table", bad_rep);
-    tor_assert(!bad_rep);
-  }
+  cached_resolve_t **resolve, *res;
+  int i, n_negative = 0;
+
+  for (i = 0; i < DNS_CACHE_N_SHARDS; ++i) {
+    int bad_rep = HT_REP_IS_BAD_(cache_map, &cache_shards[i]);
+    if (bad_rep) {
+      log_err(LD_BUG, "Bad rep type %d on dns cache hash table", bad_rep);
+      tor_assert(!bad_rep);
+    }
 
-  HT_FOREACH(resolve, cache_map, &cache_root) {
-    assert_resolve_ok(*resolve);
-    tor_assert((*resolve)->state != CACHE_STATE_DONE);
+    HT_FOREACH(resolve, cache_map, &cache_shards[i]) {
+      assert_resolve_ok(*resolve);
+      tor_assert((*resolve)->state != CACHE_STATE_DONE);
+      tor_assert(cache_shard_for(*resolve) == &cache_shards[i]);
+    }
   }
-  if (!cached_resolve_pqueue)
-    return;
-
-  smartlist_pqueue_assert_ok(cached_resolve_pqueue,
-                             compare_cached_resolves_by_expiry_,
-                             offsetof(cached_resolve_t, minheap_idx));
 
-  SMARTLIST_FOREACH(cached_resolve_pqueue, cached_resolve_t *, res,
-    {
+  for (i = 0; i < DNS_WHEEL_SLOTS; ++i) {
+    TOR_LIST_FOREACH(res, &dns_wheel[i], wheel_node) {
+      cached_resolve_t *found = HT_FIND(cache_map, cache_shard_for(res), res);
+      tor_assert(res->wheel_slot == i);
       if (res->state == CACHE_STATE_DONE) {
-        cached_resolve_t *found = HT_FIND(cache_map, &cache_root, res);
         tor_assert(!found || found != res);
       } else {
-        cached_resolve_t *found = HT_FIND(cache_map, &cache_root, res);
         tor_assert(found);
       }
-    });
+    }
+  }
+
+  TOR_TAILQ_FOREACH(res, &dns_negative_list, negative_node) {
+    tor_assert(res->is_negative);
+    tor_assert(res->state == CACHE_STATE_CACHED);
+    ++n_negative;
+  }
+  tor_assert(n_negative == dns_n_negative);
 }
 
 #endif /* defined(DEBUG_DNS_CACHE) */
@@ -2177,11 +2614,12 @@ assert_cache_ok_(void)
 cached_resolve_t *
 dns_get_cache_entry(cached_resolve_t *query)
 {
-  return HT_FIND(cache_map, &cache_root, query);
+  return cache_find(query);
 }
 
 void
 dns_insert_cache_entry(cached_resolve_t *new_entry)
 {
-  HT_INSERT(cache_map, &cache_root, new_entry);
+  new_entry->addr_hash = dns_address_hash(new_entry->address);
+  cache_insert(new_entry);
 }
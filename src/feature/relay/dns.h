@@ -45,6 +45,10 @@ size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
 #ifdef DNS_PRIVATE
 #include "feature/relay/dns_structs.h"
 
+/** How many cached answers with no successful lookup in them do we keep,
+ * at most? */
+#define DNS_MAX_NEGATIVE_ENTRIES 8192
+
 MOCK_DECL(STATIC int,dns_resolve_impl,(edge_connection_t *exitconn,
 int is_resolve,or_circuit_t *oncirc, char **hostname_out,
 int *made_connection_pending_out, cached_resolve_t **resolve_out));
@@ -66,6 +70,16 @@ set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
 MOCK_DECL(STATIC int,
 launch_resolve,(cached_resolve_t *resolve));
 
+STATIC void set_expiry(cached_resolve_t *resolve, time_t expires);
+STATIC void purge_expired_resolves(time_t now);
+STATIC void make_pending_resolve_cached(cached_resolve_t *resolve);
+STATIC int dns_err_from_eai(int err);
+STATIC void dns_thread_do_lookup(dns_thread_job_t *job);
+STATIC int dns_cache_entry_count(void);
+#ifdef TOR_UNIT_TESTS
+STATIC const dns_cache_stats_t *dns_get_cache_stats(void);
+#endif
+
 #endif /* defined(DNS_PRIVATE) */
 
 #endif /* !defined(TOR_DNS_H) */
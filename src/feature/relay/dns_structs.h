@@ -13,6 +13,8 @@
 #ifndef TOR_DNS_STRUCTS_H
 #define TOR_DNS_STRUCTS_H
 
+#include "tor_queue.h"
+
 /** Longest hostname we're willing to resolve. */
 #define MAX_ADDRESSLEN 256
 
@@ -61,6 +63,9 @@ typedef struct cached_resolve_t {
   HT_ENTRY(cached_resolve_t) node;
   uint32_t magic;  /**< Must be CACHED_RESOLVE_MAGIC */
   char address[MAX_ADDRESSLEN]; /**< The hostname to be resolved. */
+  /** Hash of <b>address</b>: picks the cache shard, and the bucket within
+   * it. */
+  unsigned int addr_hash;
 
   union {
     uint32_t addr_ipv4; /**< IPv4 addr for <b>address</b>, if successful.
@@ -94,9 +99,53 @@ typedef struct cached_resolve_t {
   uint32_t ttl_hostname; /**< What TTL did the nameserver tell us? */
   /** Connections that want to know when we get an answer for this resolve. */
   pending_connection_t *pending_connections;
-  /** Position of this element in the heap*/
-  int minheap_idx;
+  /** Slot of the expiry wheel that holds this element, or -1 if it isn't
+   * on the wheel. */
+  int wheel_slot;
+  /** Links for this element's slot of the expiry wheel. */
+  TOR_LIST_ENTRY(cached_resolve_t) wheel_node;
+  /** True iff this is a cached answer with no successful lookup in it. */
+  unsigned int is_negative : 1;
+  /** Links in the list of negative answers, oldest first. */
+  TOR_TAILQ_ENTRY(cached_resolve_t) negative_node;
 } cached_resolve_t;
 
+/** A lookup that we have handed to a resolver thread. */
+typedef struct dns_thread_job_t {
+  /** One of DNS_IPv4_A, DNS_IPv6_AAAA, or DNS_PTR. */
+  uint8_t query_type;
+  /** The query type followed by the address we're looking up, in the form
+   * that evdns_callback() takes as its argument. */
+  char *arg;
+  /** The name to pass to getaddrinfo(). */
+  char *lookup_name;
+  /** For a PTR lookup, the address whose name we want. */
+  tor_addr_t ptr_address;
+  /** Output: DNS_ERR_NONE, or another DNS_ERR_* value on failure. */
+  int result;
+  /** Output: the address we found for an A or AAAA lookup, if any. */
+  tor_addr_t answer;
+  /** Output: the hostname we found for a PTR lookup, if any. */
+  char *hostname;
+} dns_thread_job_t;
+
+/** Counters describing how well the exit DNS cache is doing. */
+typedef struct dns_cache_stats_t {
+  /** Lookups answered from a cached positive answer. */
+  uint64_t n_hits;
+  /** Lookups answered from a cached negative answer. */
+  uint64_t n_negative_hits;
+  /** Lookups that joined a resolve that was already in flight. */
+  uint64_t n_coalesced;
+  /** Lookups that made us launch a new resolve. */
+  uint64_t n_misses;
+  /** Entries removed because they expired. */
+  uint64_t n_expired;
+  /** Negative answers dropped to keep their number bounded. */
+  uint64_t n_negative_evicted;
+  /** Entries dropped because we were low on memory. */
+  uint64_t n_oom_evicted;
+} dns_cache_stats_t;
+
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
 
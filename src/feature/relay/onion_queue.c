@@ -19,6 +19,9 @@
  *  <ul>
  *  <li> Queueing incoming onionskins on the relay side before passing
  *      them to worker threads.
+ *   <li>Ordering queued onionskins by deadline, so that requests from
+ *     known relays (and, while split circuits are waiting for subcircuits,
+ *     requests that may be such subcircuits) overtake the rest.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
  * </ul>
@@ -30,36 +33,78 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/cpuworker.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/connection_or.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/split/splitor.h"
 
 #include "core/or/or_circuit_st.h"
 
+/** Priority classes for queued create requests, from most to least
+ * urgent. */
+typedef enum onion_queue_priority_t {
+  /** A create request from another relay while some split circuit on this
+   * relay is waiting for subcircuits to join it.  Subcircuits only identify
+   * themselves once they are built, so this is the closest we can get to
+   * spotting a joining subcircuit at CREATE time. */
+  ONION_QUEUE_PRIO_SPLIT_JOIN = 0,
+  /** A create request from a channel to a relay that we know about. */
+  ONION_QUEUE_PRIO_KNOWN_GOOD = 1,
+  /** Everything else: clients and peers we can't identify. */
+  ONION_QUEUE_PRIO_NORMAL = 2,
+} onion_queue_priority_t;
+
+/** Number of values in onion_queue_priority_t. */
+#define ONION_QUEUE_N_PRIORITIES 3
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
   or_circuit_t *circ;
   uint16_t handshake_type;
+  onion_queue_priority_t priority;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** Monotonic time (msec) by which we'd like to hand this request to a
+   * cpuworker.  Of the requests of a single handshake type, we always
+   * process the one with the earliest target first. */
+  uint64_t target_msec;
+  /** Monotonic time (msec) after which this request is too old to be worth
+   * answering. */
+  uint64_t deadline_msec;
 } onion_queue_t;
 
-/** 5 seconds on the onion queue til we just send back a destroy */
-#define ONIONQUEUE_WAIT_CUTOFF 5
+/** 5 seconds on the onion queue til we just send back a destroy, even for
+ * our most important requests. */
+#define ONIONQUEUE_WAIT_CUTOFF_MSEC (5*1000)
+
+/** When deciding whether we have room for another onionskin, assume that
+ * each queued onionskin will cost this percentile of the recent handshake
+ * times measured by our cpuworkers. */
+#define ONIONQUEUE_COST_PERCENTILE 90
 
-/** Array of queues of circuits waiting for CPU workers. An element is NULL
- * if that queue is empty.*/
+/** Array of queues of circuits waiting for CPU workers, indexed by handshake
+ * type and priority class. */
 static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
-              ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
-{ TOR_TAILQ_HEAD_INITIALIZER(ol_list[0]), /* tap */
-  TOR_TAILQ_HEAD_INITIALIZER(ol_list[1]), /* fast */
-  TOR_TAILQ_HEAD_INITIALIZER(ol_list[2]), /* ntor */
+              ol_list[MAX_ONION_HANDSHAKE_TYPE+1][ONION_QUEUE_N_PRIORITIES] =
+{
+#define OL_LIST_INIT(t) \
+  { TOR_TAILQ_HEAD_INITIALIZER(ol_list[t][0]), \
+    TOR_TAILQ_HEAD_INITIALIZER(ol_list[t][1]), \
+    TOR_TAILQ_HEAD_INITIALIZER(ol_list[t][2]) }
+  OL_LIST_INIT(0), /* tap */
+  OL_LIST_INIT(1), /* fast */
+  OL_LIST_INIT(2), /* ntor */
+#undef OL_LIST_INIT
 };
 
-/** Number of entries of each type currently in each element of ol_list[]. */
+/** Number of entries of each type currently in each row of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Number of entries of each type and priority currently in ol_list[]. */
+static int ol_entries_prio[MAX_ONION_HANDSHAKE_TYPE+1]
+                          [ONION_QUEUE_N_PRIORITIES];
 
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
@@ -71,46 +116,116 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
  * MAX_ONIONSKIN_CHALLENGE/REPLY_LEN."  Also, make sure that we can pass
  * over-large values via EXTEND2/EXTENDED2, for future-compatibility.*/
 
+/** Return the priority class for a create request arriving on
+ * <b>circ</b>. Only channels from relays we know about get a better class:
+ * anybody can authenticate with a freshly generated identity key. */
+static onion_queue_priority_t
+onion_queue_classify(const or_circuit_t *circ)
+{
+  const channel_t *chan = circ->p_chan;
+
+  if (!chan || channel_is_client(chan) ||
+      !connection_or_digest_is_known_relay(chan->identity_digest))
+    return ONION_QUEUE_PRIO_NORMAL;
+  if (split_num_pending_joins() > 0)
+    return ONION_QUEUE_PRIO_SPLIT_JOIN;
+  return ONION_QUEUE_PRIO_KNOWN_GOOD;
+}
+
+/** Return how many msec after its arrival we'd like a request of class
+ * <b>prio</b> to be processed. Less important requests get a later target,
+ * so that more important ones overtake them. */
+static uint64_t
+onion_queue_target_delay_msec(onion_queue_priority_t prio)
+{
+  const uint64_t max_delay = get_options()->MaxOnionQueueDelay;
+
+  switch (prio) {
+    case ONION_QUEUE_PRIO_SPLIT_JOIN:
+      return 0;
+    case ONION_QUEUE_PRIO_KNOWN_GOOD:
+      return max_delay / 4;
+    case ONION_QUEUE_PRIO_NORMAL:
+    default:
+      return max_delay / 2;
+  }
+}
+
+/** Return how many msec after its arrival a request of class <b>prio</b> is
+ * no longer worth answering. */
+static uint64_t
+onion_queue_deadline_delay_msec(onion_queue_priority_t prio)
+{
+  const uint64_t max_delay = get_options()->MaxOnionQueueDelay;
+
+  /* Ordinary requests are dropped as soon as they have waited longer than
+   * we promised; more important ones get the benefit of the doubt. */
+  if (prio == ONION_QUEUE_PRIO_NORMAL)
+    return max_delay;
+  return MAX(max_delay, ONIONQUEUE_WAIT_CUTOFF_MSEC);
+}
+
+/** Return the number of queued requests of type <b>type</b> that would be
+ * processed before a new request of class <b>prio</b>. */
+static int
+onion_num_pending_ahead(uint16_t type, onion_queue_priority_t prio)
+{
+  int p, n = 0;
+  for (p = 0; p <= (int)prio; ++p)
+    n += ol_entries_prio[type][p];
+  return n;
+}
+
 /** Return true iff we have room to queue another onionskin of type
- * <b>type</b>. */
+ * <b>type</b> and priority class <b>prio</b>. */
 static int
-have_room_for_onionskin(uint16_t type)
+have_room_for_onionskin(uint16_t type, onion_queue_priority_t prio)
 {
   const or_options_t *options = get_options();
   int num_cpus;
+  uint64_t tap_cost, ntor_cost;
   uint64_t tap_usec, ntor_usec;
   uint64_t ntor_during_tap_usec, tap_during_ntor_usec;
+  int tap_ahead, ntor_ahead;
 
   /* If we've got fewer than 50 entries, we always have room for one more. */
   if (ol_entries[type] < 50)
     return 1;
   num_cpus = get_num_cpus(options);
-  /* Compute how many microseconds we'd expect to need to clear all
+
+  /* Rather than the mean handshake time, use a high percentile of the
+   * handshake times our cpuworkers have recently seen: that follows load
+   * changes faster, and leaves room for stragglers. */
+  tap_cost = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_TAP,
+                                               ONIONQUEUE_COST_PERCENTILE);
+  ntor_cost = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR,
+                                                ONIONQUEUE_COST_PERCENTILE);
+
+  /* Within a handshake type, only requests of the same or a more important
+   * class get processed before this one. */
+  tap_ahead = onion_num_pending_ahead(ONION_HANDSHAKE_TYPE_TAP, prio);
+  ntor_ahead = onion_num_pending_ahead(ONION_HANDSHAKE_TYPE_NTOR, prio);
+
+  /* Compute how many microseconds we'd expect to need to clear all those
    * onionskins in various combinations of the queues. */
 
-  /* How long would it take to process all the TAP cells in the queue? */
-  tap_usec  = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+  /* How long would it take to process the TAP cells ahead of us? */
+  tap_usec  = tap_cost * tap_ahead / num_cpus;
 
-  /* How long would it take to process all the NTor cells in the queue? */
-  ntor_usec = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+  /* How long would it take to process the NTor cells ahead of us? */
+  ntor_usec = ntor_cost * ntor_ahead / num_cpus;
 
   /* How long would it take to process the tap cells that we expect to
    * process while draining the ntor queue? */
-  tap_during_ntor_usec  = estimated_usec_for_onionskins(
+  tap_during_ntor_usec  = tap_cost *
     MIN(ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-        ol_entries[ONION_HANDSHAKE_TYPE_NTOR] / num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+        ntor_ahead / num_ntors_per_tap()) / num_cpus;
 
   /* How long would it take to process the ntor cells that we expect to
    * process while draining the tap queue? */
-  ntor_during_tap_usec  = estimated_usec_for_onionskins(
+  ntor_during_tap_usec  = ntor_cost *
     MIN(ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-        ol_entries[ONION_HANDSHAKE_TYPE_TAP] * num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+        tap_ahead * num_ntors_per_tap()) / num_cpus;
 
   /* See whether that exceeds MaxOnionQueueDelay. If so, we can't queue
    * this. */
@@ -127,20 +242,47 @@ have_room_for_onionskin(uint16_t type)
   /* If we support the ntor handshake, then don't let TAP handshakes use
    * more than 2/3 of the space on the queue. */
   if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
+      tap_cost * ol_entries[ONION_HANDSHAKE_TYPE_TAP] / num_cpus / 1000 >
+      (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
     return 0;
 
   return 1;
 }
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
+/** Remove every request of type <b>type</b> whose deadline is no later
+ * than <b>now</b> from the queue, and close its circuit. */
+static void
+onion_queue_cull(uint16_t type, uint64_t now)
+{
+  int p;
+
+  for (p = 0; p < ONION_QUEUE_N_PRIORITIES; ++p) {
+    onion_queue_t *head;
+    /* Within a single class, deadlines are in arrival order. */
+    while ((head = TOR_TAILQ_FIRST(&ol_list[type][p])) &&
+           head->deadline_msec <= now) {
+      or_circuit_t *circ = head->circ;
+      circ->onionqueue_entry = NULL;
+      onion_queue_entry_remove(head);
+      log_info(LD_CIRC,
+            "Circuit create request is too old; canceling due to overload.");
+      if (! TO_CIRCUIT(circ)->marked_for_close) {
+        circuit_mark_for_close(TO_CIRCUIT(circ),
+                               END_CIRC_REASON_RESOURCELIMIT);
+      }
+    }
+  }
+}
+
+/** Add <b>circ</b> to the end of its queue in ol_list and return 0, except
  * if ol_list is too long, in which case do nothing and return -1.
  */
 int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  onion_queue_priority_t prio;
+  uint64_t now = monotime_coarse_absolute_msec();
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -151,13 +293,11 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     /* LCOV_EXCL_STOP */
   }
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->handshake_type = onionskin->handshake_type;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  /* Make room by dropping anything that's already too late. */
+  onion_queue_cull(onionskin->handshake_type, now);
 
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  prio = onion_queue_classify(circ);
+  if (!have_room_for_onionskin(onionskin->handshake_type, prio)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -171,34 +311,28 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
     return -1;
   }
 
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->handshake_type = onionskin->handshake_type;
+  tmp->priority = prio;
+  tmp->onionskin = onionskin;
+  tmp->target_msec = now + onion_queue_target_delay_msec(prio);
+  tmp->deadline_msec = now + onion_queue_deadline_delay_msec(prio);
+
   ++ol_entries[onionskin->handshake_type];
-  log_info(LD_OR, "New create (%s). Queues now ntor=%d and tap=%d.",
+  ++ol_entries_prio[onionskin->handshake_type][prio];
+  log_info(LD_OR, "New create (%s, class %d). Queues now ntor=%d and tap=%d.",
     onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
+    (int)prio,
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
 
   circ->onionqueue_entry = tmp;
-  TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
-
-  /* cull elderly requests. */
-  while (1) {
-    onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
-      break;
-
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    if (! TO_CIRCUIT(circ)->marked_for_close) {
-      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-    }
-  }
+  TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type][prio], tmp, next);
+
   return 0;
 }
 
@@ -265,8 +399,25 @@ or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint16_t handshake_to_choose, type;
+  onion_queue_priority_t prio;
+  onion_queue_t *head = NULL;
+  uint64_t now = monotime_coarse_absolute_msec();
+  int i;
+
+  /* Don't waste a cpuworker on a request nobody is waiting for anymore. */
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i)
+    onion_queue_cull(i, now);
+
+  handshake_to_choose = decide_next_handshake_type();
+
+  /* Take whichever class has the earliest target.  On a tie, the more
+   * important class wins. */
+  for (i = 0; i < ONION_QUEUE_N_PRIORITIES; ++i) {
+    onion_queue_t *cand = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose][i]);
+    if (cand && (!head || cand->target_msec < head->target_msec))
+      head = cand;
+  }
 
   if (!head)
     return NULL; /* no onions pending, we're done */
@@ -277,17 +428,19 @@ onion_next_task(create_cell_t **onionskin_out)
 /* XXX I only commented out the above line to make the unit tests
  * more manageable. That's probably not good long-term. -RD */
   circ = head->circ;
-  if (head->onionskin)
-    --ol_entries[head->handshake_type];
-  log_info(LD_OR, "Processing create (%s). Queues now ntor=%d and tap=%d.",
-    head->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
-    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-    ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
+  type = head->handshake_type;
+  prio = head->priority;
 
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
   circ->onionqueue_entry = NULL;
   onion_queue_entry_remove(head);
+
+  log_info(LD_OR, "Processing create (%s, class %d). Queues now ntor=%d "
+    "and tap=%d.",
+    type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap", (int)prio,
+    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
+    ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
   return circ;
 }
 
@@ -332,13 +485,14 @@ onion_queue_entry_remove(onion_queue_t *victim)
     /* LCOV_EXCL_STOP */
   }
 
-  TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
+  TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type][victim->priority],
+                   victim, next);
 
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
 
-  if (victim->onionskin)
-    --ol_entries[victim->handshake_type];
+  --ol_entries[victim->handshake_type];
+  --ol_entries_prio[victim->handshake_type][victim->priority];
 
   tor_free(victim->onionskin);
   tor_free(victim);
@@ -349,13 +503,16 @@ void
 clear_pending_onions(void)
 {
   onion_queue_t *victim, *next;
-  int i;
+  int i, p;
   for (i=0; i<=MAX_ONION_HANDSHAKE_TYPE; i++) {
-    for (victim = TOR_TAILQ_FIRST(&ol_list[i]); victim; victim = next) {
-      next = TOR_TAILQ_NEXT(victim,next);
-      onion_queue_entry_remove(victim);
+    for (p=0; p<ONION_QUEUE_N_PRIORITIES; p++) {
+      for (victim = TOR_TAILQ_FIRST(&ol_list[i][p]); victim; victim = next) {
+        next = TOR_TAILQ_NEXT(victim,next);
+        onion_queue_entry_remove(victim);
+      }
+      tor_assert(TOR_TAILQ_EMPTY(&ol_list[i][p]));
     }
-    tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_entries_prio, 0, sizeof(ol_entries_prio));
 }
@@ -1575,6 +1575,10 @@ split_max_buffered_cell_age(const circuit_t* circ, uint32_t now)
   if (CIRCUIT_IS_ORIGIN(circ)) {
     crypt_path_t* cpath = CONST_TO_ORIGIN_CIRCUIT(circ)->cpath;
 
+    /* circuits that have not been extended yet have no cpath at all */
+    if (!cpath)
+      return 0;
+
     do {
       tor_assert(cpath);
 
@@ -1612,6 +1616,9 @@ split_marked_circuit_free_buffer(circuit_t* circ)
   if (CIRCUIT_IS_ORIGIN(circ)) {
       crypt_path_t* cpath = TO_ORIGIN_CIRCUIT(circ)->cpath;
 
+      if (!cpath)
+        return 0;
+
       do {
         tor_assert(cpath);
 
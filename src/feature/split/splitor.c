@@ -224,6 +224,15 @@ split_data_cookie_make_invalid(split_data_t* split_data)
             split_data->split_data_or);
 }
 
+/** Return the number of split circuits on this relay that currently hold
+ * a valid cookie, i.e. that are waiting for further subcircuits to join.
+ */
+unsigned int
+split_num_pending_joins(void)
+{
+  return HT_SIZE(&split_data_or_cookie_map);
+}
+
 /** Find and return the split_data structure which has the given
  * <b>cookie</b> as SPLIT_COOKIE_STATE_VALID cookie.
  * Return NULL, if no such split_data structure can be found.
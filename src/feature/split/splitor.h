@@ -16,6 +16,8 @@ void split_decrease_remaining_relay_early(or_circuit_t* circ);
 
 void split_rewrite_relay_early(or_circuit_t* circ, cell_t* cell);
 
+unsigned int split_num_pending_joins(void);
+
 #else /* HAVE_MODULE_SPLIT */
 
 static inline void
@@ -30,6 +32,12 @@ split_rewrite_relay_early(or_circuit_t* circ, cell_t* cell)
   (void)circ; (void)cell; return;
 }
 
+static inline unsigned int
+split_num_pending_joins(void)
+{
+  return 0;
+}
+
 #endif /* HAVE_MODULE_SPLIT */
 
 /*** Internal functions (only use within the 'split' module) ***/
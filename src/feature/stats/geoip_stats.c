@@ -48,38 +48,6 @@ static size_t n_v3_ns_requests_len = 0;
  * received from that country */
 static uint32_t *n_v3_ns_requests;
 
-/* Total size in bytes of the geoip client history cache. Used by the OOM
- * handler. */
-static size_t geoip_client_history_cache_size;
-
-/* Increment the geoip client history cache size counter with the given bytes.
- * This prevents an overflow and set it to its maximum in that case. */
-static inline void
-geoip_increment_client_history_cache_size(size_t bytes)
-{
-  /* This is shockingly high, lets log it so it can be reported. */
-  IF_BUG_ONCE(geoip_client_history_cache_size > (SIZE_MAX - bytes)) {
-    geoip_client_history_cache_size = SIZE_MAX;
-    return;
-  }
-  geoip_client_history_cache_size += bytes;
-}
-
-/* Decrement the geoip client history cache size counter with the given bytes.
- * This prevents an underflow and set it to 0 in that case. */
-static inline void
-geoip_decrement_client_history_cache_size(size_t bytes)
-{
-  /* Going below 0 means that we either allocated an entry without
-   * incrementing the counter or we have different sizes when allocating and
-   * freeing. It shouldn't happened so log it. */
-  IF_BUG_ONCE(geoip_client_history_cache_size < bytes) {
-    geoip_client_history_cache_size = 0;
-    return;
-  }
-  geoip_client_history_cache_size -= bytes;
-}
-
 /** Add 1 to the count of v3 ns requests received from <b>country</b>. */
 static void
 increment_v3_ns_request(country_t country)
@@ -119,105 +87,294 @@ should_record_bridge_info(const or_options_t *options)
  */
 #define MAX_LAST_SEEN_IN_MINUTES 0X3FFFFFFFu
 
-/** Map from client IP address to last time seen. */
-static HT_HEAD(clientmap, clientmap_entry_t) client_history =
-     HT_INITIALIZER();
+/** Map from client IP address to last time seen.
+ *
+ * This is an open-addressing hash table with linear probing: the entries
+ * live directly in the array, and an entry whose <b>hash</b> is 0 is an empty
+ * slot.  A guard can see hundreds of thousands of client addresses, and
+ * keeping them inline costs far less memory, and far fewer cache misses per
+ * lookup, than allocating each entry separately. */
+static clientmap_entry_t *client_history = NULL;
+/** Number of slots in client_history.  Always 0 or a power of two. */
+static unsigned client_history_capacity = 0;
+/** Number of entries in use in client_history. */
+static unsigned client_history_n_entries = 0;
+
+/** Smallest number of slots we'll allocate for client_history. */
+#define CLIENT_HISTORY_MIN_CAPACITY 64
+
+/** Names of the pluggable transports that clients have used.  An entry's
+ * transport_idx is its transport's position in this list, plus one. */
+static smartlist_t *client_transport_names = NULL;
+/** Total length of the names in client_transport_names. */
+static size_t client_transport_names_len = 0;
+
+/** Return the index we use for <b>transport_name</b> in clientmap entries,
+ * or -1 if we have never seen it.  If <b>create</b> is true, remember the
+ * name if we haven't seen it yet. */
+static int
+client_transport_idx(const char *transport_name, int create)
+{
+  int pos;
 
-/** Hashtable helper: compute a hash of a clientmap_entry_t. */
-static inline unsigned
-clientmap_entry_hash(const clientmap_entry_t *a)
+  if (!transport_name)
+    return 0;
+  if (!client_transport_names)
+    client_transport_names = smartlist_new();
+
+  pos = smartlist_string_pos(client_transport_names, transport_name);
+  if (pos >= 0)
+    return pos + 1;
+  if (!create)
+    return -1;
+  if (BUG(smartlist_len(client_transport_names) >= UINT16_MAX))
+    return -1;
+
+  smartlist_add_strdup(client_transport_names, transport_name);
+  client_transport_names_len += strlen(transport_name);
+  return smartlist_len(client_transport_names);
+}
+
+/** Return the name of the pluggable transport used by the client in
+ * <b>ent</b>, or NULL if it used none. */
+static const char *
+clientmap_entry_transport_name(const clientmap_entry_t *ent)
 {
-  unsigned h = (unsigned) tor_addr_hash(&a->addr);
+  if (!ent->transport_idx)
+    return NULL;
+  return smartlist_get(client_transport_names, ent->transport_idx - 1);
+}
 
-  if (a->transport_name)
-    h += (unsigned) siphash24g(a->transport_name, strlen(a->transport_name));
+/** Return the hash we use to find the entry for <b>addr</b> with transport
+ * index <b>transport_idx</b> and action <b>action</b>.  Never returns 0. */
+static inline uint32_t
+clientmap_key_hash(const tor_addr_t *addr, int transport_idx,
+                   geoip_client_action_t action)
+{
+  uint32_t h = (uint32_t) tor_addr_hash(addr);
+  h += (uint32_t)transport_idx * 0x9e3779b1u;
+  h ^= (uint32_t)action << 31;
+  return h ? h : 1;
+}
+
+/** Return the index of the slot holding the entry for <b>addr</b>,
+ * <b>transport_idx</b>, and <b>action</b>, whose hash is <b>hash</b>; or -1
+ * if there is no such entry. */
+static int
+client_history_find(const tor_addr_t *addr, int transport_idx,
+                    geoip_client_action_t action, uint32_t hash)
+{
+  unsigned mask = client_history_capacity - 1;
+  unsigned i;
 
-  return h;
+  if (!client_history_n_entries)
+    return -1;
+
+  for (i = hash & mask; client_history[i].hash; i = (i + 1) & mask) {
+    const clientmap_entry_t *ent = &client_history[i];
+    if (ent->hash == hash &&
+        ent->action == action &&
+        ent->transport_idx == transport_idx &&
+        !tor_addr_compare(&ent->addr, addr, CMP_EXACT))
+      return (int) i;
+  }
+  return -1;
 }
-/** Hashtable helper: compare two clientmap_entry_t values for equality. */
-static inline int
-clientmap_entries_eq(const clientmap_entry_t *a, const clientmap_entry_t *b)
+
+/** Put <b>ent</b> in the first free slot of client_history, starting at
+ * its home slot, and return a pointer to it there.  There must be a free
+ * slot. */
+static clientmap_entry_t *
+client_history_place(const clientmap_entry_t *ent)
 {
-  if (strcmp_opt(a->transport_name, b->transport_name))
-    return 0;
+  unsigned mask = client_history_capacity - 1;
+  unsigned i;
 
-  return !tor_addr_compare(&a->addr, &b->addr, CMP_EXACT) &&
-         a->action == b->action;
+  for (i = ent->hash & mask; client_history[i].hash; i = (i + 1) & mask)
+    ;
+  memcpy(&client_history[i], ent, sizeof(*ent));
+  return &client_history[i];
 }
 
-HT_PROTOTYPE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
-             clientmap_entries_eq)
-HT_GENERATE2(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
-             clientmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
+/** Move every entry in client_history into a new table with
+ * <b>capacity</b> slots.  If <b>capacity</b> is 0, free the table. */
+static void
+client_history_resize(unsigned capacity)
+{
+  clientmap_entry_t *old = client_history;
+  unsigned old_capacity = client_history_capacity;
+  unsigned i;
+
+  tor_assert(capacity == 0 || (capacity & (capacity - 1)) == 0);
+  tor_assert(capacity == 0 || client_history_n_entries * 4 < capacity * 3);
+  tor_assert(capacity || !client_history_n_entries);
+
+  client_history = capacity ?
+    tor_calloc(capacity, sizeof(clientmap_entry_t)) : NULL;
+  client_history_capacity = capacity;
+  for (i = 0; i < old_capacity; ++i) {
+    if (old[i].hash)
+      client_history_place(&old[i]);
+  }
+  tor_free(old);
+}
 
-#define clientmap_entry_free(ent) \
-  FREE_AND_NULL(clientmap_entry_t, clientmap_entry_free_, ent)
+/** If client_history is much bigger than it needs to be, shrink it. */
+static void
+client_history_maybe_shrink(void)
+{
+  unsigned capacity = client_history_capacity;
 
-/** Return the size of a client map entry. */
-static inline size_t
-clientmap_entry_size(const clientmap_entry_t *ent)
+  if (!client_history_n_entries) {
+    client_history_resize(0);
+    return;
+  }
+  while (capacity > CLIENT_HISTORY_MIN_CAPACITY &&
+         client_history_n_entries * 8 < capacity)
+    capacity /= 2;
+  if (capacity != client_history_capacity)
+    client_history_resize(capacity);
+}
+
+/** Return true iff a table with <b>capacity</b> slots can hold
+ * <b>n_entries</b> entries while staying under 3/4 full. */
+static inline int
+client_history_fits(unsigned n_entries, unsigned capacity)
 {
-  tor_assert(ent);
-  return (sizeof(clientmap_entry_t) +
-          (ent->transport_name ? strlen(ent->transport_name) : 0));
+  return (uint64_t)n_entries * 4 < (uint64_t)capacity * 3;
 }
 
-/** Free all storage held by <b>ent</b>. */
+/** Shrink client_history to the smallest table that keeps it under 3/4
+ * full.  Unlike client_history_maybe_shrink(), this doesn't leave any room
+ * to grow: it's for when we need the memory back. */
 static void
-clientmap_entry_free_(clientmap_entry_t *ent)
+client_history_shrink_to_fit(void)
 {
-  if (!ent)
+  unsigned capacity = client_history_capacity;
+
+  if (!client_history_n_entries) {
+    client_history_resize(0);
     return;
+  }
+  while (capacity > CLIENT_HISTORY_MIN_CAPACITY &&
+         client_history_fits(client_history_n_entries, capacity / 2))
+    capacity /= 2;
+  if (capacity != client_history_capacity)
+    client_history_resize(capacity);
+}
+
+/** Remove the entry in slot <b>i</b> of client_history, and move later
+ * entries from the same run of full slots back so that lookups can still
+ * find them. */
+static void
+client_history_remove_at(unsigned i)
+{
+  unsigned mask = client_history_capacity - 1;
+  unsigned j = i;
+
+  tor_assert(client_history[i].hash);
 
   /* This entry is about to be freed so pass it to the DoS subsystem to see if
    * any actions can be taken about it. */
-  dos_geoip_entry_about_to_free(ent);
-  geoip_decrement_client_history_cache_size(clientmap_entry_size(ent));
+  dos_geoip_entry_about_to_free(&client_history[i]);
 
-  tor_free(ent->transport_name);
-  tor_free(ent);
+  for (;;) {
+    unsigned home;
+    j = (j + 1) & mask;
+    if (!client_history[j].hash)
+      break;
+    home = client_history[j].hash & mask;
+    /* The entry in j may fill the hole at i only if i lies between its home
+     * slot and j. */
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      memcpy(&client_history[i], &client_history[j],
+             sizeof(clientmap_entry_t));
+      i = j;
+    }
+  }
+  memset(&client_history[i], 0, sizeof(clientmap_entry_t));
+  --client_history_n_entries;
+}
+
+/** Remove every entry in client_history for which <b>fn</b>(entry,
+ * <b>arg</b>) returns true.  Return the number of entries removed.  Doesn't
+ * shrink the table. */
+static unsigned
+client_history_remove_matching(int (*fn)(const clientmap_entry_t *, void *),
+                               void *arg)
+{
+  unsigned i = 0, n_removed = 0;
+
+  while (i < client_history_capacity) {
+    if (client_history[i].hash && fn(&client_history[i], arg)) {
+      /* Removing shifts a later entry into slot i; look at it next. */
+      client_history_remove_at(i);
+      ++n_removed;
+    } else {
+      ++i;
+    }
+  }
+  return n_removed;
 }
 
-/* Return a newly allocated clientmap entry with the given action and address
- * that are mandatory. The transport_name can be optional. This can't fail. */
+/** Add a new entry for <b>addr</b>, <b>transport_idx</b> and
+ * <b>action</b>, whose hash is <b>hash</b>, to client_history, and return
+ * a pointer to it. */
 static clientmap_entry_t *
-clientmap_entry_new(geoip_client_action_t action, const tor_addr_t *addr,
-                    const char *transport_name)
+client_history_insert(const tor_addr_t *addr, int transport_idx,
+                      geoip_client_action_t action, uint32_t hash)
 {
-  clientmap_entry_t *entry;
+  clientmap_entry_t ent;
 
   tor_assert(action == GEOIP_CLIENT_CONNECT ||
              action == GEOIP_CLIENT_NETWORKSTATUS);
   tor_assert(addr);
 
-  entry = tor_malloc_zero(sizeof(clientmap_entry_t));
-  entry->action = action;
-  tor_addr_copy(&entry->addr, addr);
-  if (transport_name) {
-    entry->transport_name = tor_strdup(transport_name);
+  if ((client_history_n_entries + 1) * 4 >= client_history_capacity * 3) {
+    client_history_resize(client_history_capacity ?
+                          client_history_capacity * 2 :
+                          CLIENT_HISTORY_MIN_CAPACITY);
   }
 
-  /* Allocated and initialized, note down its size for the OOM handler. */
-  geoip_increment_client_history_cache_size(clientmap_entry_size(entry));
+  memset(&ent, 0, sizeof(ent));
+  tor_addr_copy(&ent.addr, addr);
+  ent.hash = hash;
+  ent.transport_idx = (uint16_t) transport_idx;
+  ent.action = action;
+  ++client_history_n_entries;
+  return client_history_place(&ent);
+}
 
-  return entry;
+/** client_history_remove_matching() helper: match entries whose action is
+ * *<b>arg</b>. */
+static int
+client_has_action_helper_(const clientmap_entry_t *ent, void *arg)
+{
+  return ent->action == *(geoip_client_action_t *)arg;
+}
+
+/** client_history_remove_matching() helper: match every entry. */
+static int
+client_any_helper_(const clientmap_entry_t *ent, void *arg)
+{
+  (void)ent;
+  (void)arg;
+  return 1;
+}
+
+/** Forget every client we've seen for <b>action</b>. */
+static void
+client_history_remove_action(geoip_client_action_t action)
+{
+  client_history_remove_matching(client_has_action_helper_, &action);
+  client_history_maybe_shrink();
 }
 
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void
 client_history_clear(void)
 {
-  clientmap_entry_t **ent, **next, *this;
-  for (ent = HT_START(clientmap, &client_history); ent != NULL;
-       ent = next) {
-    if ((*ent)->action == GEOIP_CLIENT_CONNECT) {
-      this = *ent;
-      next = HT_NEXT_RMV(clientmap, &client_history, ent);
-      clientmap_entry_free(this);
-    } else {
-      next = HT_NEXT(clientmap, &client_history, ent);
-    }
-  }
+  client_history_remove_action(GEOIP_CLIENT_CONNECT);
 }
 
 /** Note that we've seen a client connect from the IP <b>addr</b>
@@ -251,10 +408,18 @@ geoip_note_client_seen(geoip_client_action_t action,
             safe_str_client(fmt_addr((addr))),
             transport_name ? transport_name : "<no transport>");
 
-  ent = geoip_lookup_client(addr, transport_name, action);
-  if (! ent) {
-    ent = clientmap_entry_new(action, addr, transport_name);
-    HT_INSERT(clientmap, &client_history, ent);
+  {
+    int transport_idx = client_transport_idx(transport_name, 1);
+    uint32_t hash;
+    int idx;
+    if (transport_idx < 0)
+      return;
+    hash = clientmap_key_hash(addr, transport_idx, action);
+    idx = client_history_find(addr, transport_idx, action, hash);
+    if (idx >= 0)
+      ent = &client_history[idx];
+    else
+      ent = client_history_insert(addr, transport_idx, action, hash);
   }
   if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
     ent->last_seen_in_minutes = (unsigned)(now/60);
@@ -272,67 +437,53 @@ geoip_note_client_seen(geoip_client_action_t action,
   }
 }
 
-/** HT_FOREACH helper: remove a clientmap_entry_t from the hashtable if it's
- * older than a certain time. */
+/** client_history_remove_matching() helper: match entries that we haven't
+ * seen since the time in minutes at <b>arg</b>. */
 static int
-remove_old_client_helper_(struct clientmap_entry_t *ent, void *_cutoff)
+client_older_than_helper_(const clientmap_entry_t *ent, void *arg)
 {
-  time_t cutoff = *(time_t*)_cutoff / 60;
-  if (ent->last_seen_in_minutes < cutoff) {
-    clientmap_entry_free(ent);
-    return 1;
-  } else {
-    return 0;
-  }
+  return ent->last_seen_in_minutes < *(unsigned *)arg;
 }
 
 /** Forget about all clients that haven't connected since <b>cutoff</b>. */
 void
 geoip_remove_old_clients(time_t cutoff)
 {
-  clientmap_HT_FOREACH_FN(&client_history,
-                          remove_old_client_helper_,
-                          &cutoff);
+  unsigned cutoff_minutes = (unsigned)(cutoff / 60);
+  client_history_remove_matching(client_older_than_helper_, &cutoff_minutes);
+  client_history_maybe_shrink();
 }
 
 /* Return a client entry object matching the given address, transport name and
  * geoip action from the clientmap. NULL if not found. The transport_name can
- * be NULL. */
+ * be NULL.
+ *
+ * The entry lives inside the client table: the pointer is only good until
+ * the next time we add or remove a client. */
 clientmap_entry_t *
 geoip_lookup_client(const tor_addr_t *addr, const char *transport_name,
                     geoip_client_action_t action)
 {
-  clientmap_entry_t lookup;
+  int transport_idx, idx;
 
   tor_assert(addr);
 
-  /* We always look for a client connection with no transport. */
-  tor_addr_copy(&lookup.addr, addr);
-  lookup.action = action;
-  lookup.transport_name = (char *) transport_name;
-
-  return HT_FIND(clientmap, &client_history, &lookup);
+  transport_idx = client_transport_idx(transport_name, 0);
+  if (transport_idx < 0)
+    return NULL;
+  idx = client_history_find(addr, transport_idx, action,
+                            clientmap_key_hash(addr, transport_idx, action));
+  return idx < 0 ? NULL : &client_history[idx];
 }
 
 /* Cleanup client entries older than the cutoff. Used for the OOM. Return the
- * number of bytes freed. If 0 is returned, nothing was freed. */
-static size_t
+ * number of entries removed. If 0 is returned, nothing was removed. */
+static unsigned
 oom_clean_client_entries(time_t cutoff)
 {
-  size_t bytes = 0;
-  clientmap_entry_t **ent, **ent_next;
-
-  for (ent = HT_START(clientmap, &client_history); ent; ent = ent_next) {
-    clientmap_entry_t *entry = *ent;
-    if (entry->last_seen_in_minutes < (cutoff / 60)) {
-      ent_next = HT_NEXT_RMV(clientmap, &client_history, ent);
-      bytes += clientmap_entry_size(entry);
-      clientmap_entry_free(entry);
-    } else {
-      ent_next = HT_NEXT(clientmap, &client_history, ent);
-    }
-  }
-  return bytes;
+  unsigned cutoff_minutes = (unsigned)(cutoff / 60);
+  return client_history_remove_matching(client_older_than_helper_,
+                                        &cutoff_minutes);
 }
 
 /* Below this minimum lifetime, the OOM won't cleanup any entries. */
@@ -343,23 +494,42 @@ oom_clean_client_entries(time_t cutoff)
 /* Cleanup the geoip client history cache called from the OOM handler. Return
  * the amount of bytes removed. This can return a value below or above
  * min_remove_bytes but will stop as oon as the min_remove_bytes has been
- * reached. */
+ * reached.
+ *
+ * Memory only comes back when the table shrinks, so we work out the table
+ * size that would free min_remove_bytes, and remove old entries until what
+ * is left fits in a table of that size. */
 size_t
 geoip_client_cache_handle_oom(time_t now, size_t min_remove_bytes)
 {
   time_t k;
-  size_t bytes_removed = 0;
+  size_t allocation_before = geoip_client_cache_total_allocation();
+  size_t allocation_after;
+  size_t table_bytes = client_history_capacity * sizeof(clientmap_entry_t);
+  unsigned target_capacity = 0;
 
   /* Our OOM handler called with 0 bytes to remove is a code flow error. */
   tor_assert(min_remove_bytes != 0);
 
+  /* Find the biggest table that is at least min_remove_bytes smaller than
+   * the one we have. */
+  if (table_bytes > min_remove_bytes) {
+    size_t max_slots = (table_bytes - min_remove_bytes) /
+      sizeof(clientmap_entry_t);
+    target_capacity = client_history_capacity;
+    while (target_capacity > max_slots)
+      target_capacity /= 2;
+    /* We never shrink below the minimum size, only to nothing at all. */
+    if (target_capacity < CLIENT_HISTORY_MIN_CAPACITY)
+      target_capacity = 0;
+  }
+
   /* Set k to the initial cutoff of an entry. We then going to move it by step
    * to try to remove as much as we can. */
   k = WRITE_STATS_INTERVAL;
 
-  do {
-    time_t cutoff;
-
+  while (client_history_n_entries &&
+         !client_history_fits(client_history_n_entries, target_capacity)) {
     /* If k has reached the minimum lifetime, we have to stop else we might
      * remove every single entries which would be pretty bad for the DoS
      * mitigation subsystem if by just filling the geoip cache, it was enough
@@ -368,19 +538,22 @@ geoip_client_cache_handle_oom(time_t now, size_t min_remove_bytes)
       break;
     }
 
-    cutoff = now - k;
-    bytes_removed += oom_clean_client_entries(cutoff);
+    oom_clean_client_entries(now - k);
     k -= GEOIP_CLIENT_CACHE_OOM_STEP;
-  } while (bytes_removed < min_remove_bytes);
+  }
 
-  return bytes_removed;
+  client_history_shrink_to_fit();
+  allocation_after = geoip_client_cache_total_allocation();
+  return allocation_before > allocation_after ?
+    allocation_before - allocation_after : 0;
 }
 
 /* Return the total size in bytes of the client history cache. */
 size_t
 geoip_client_cache_total_allocation(void)
 {
-  return geoip_client_history_cache_size;
+  return client_history_capacity * sizeof(clientmap_entry_t) +
+         client_transport_names_len;
 }
 
 /** How many responses are we giving to clients requesting v3 network
@@ -589,12 +762,12 @@ geoip_get_transport_history(void)
      names, so this string will never collide with a real transport. */
   static const char* no_transport_str = "<OR>";
 
-  clientmap_entry_t **ent;
+  unsigned i;
   smartlist_t *string_chunks = smartlist_new();
   char *the_string = NULL;
 
   /* If we haven't seen any clients yet, return NULL. */
-  if (HT_EMPTY(&client_history))
+  if (!client_history_n_entries)
     goto done;
 
   /** We do the following steps to form the transport history string:
@@ -609,13 +782,17 @@ geoip_get_transport_history(void)
    */
 
   log_debug(LD_GENERAL,"Starting iteration for transport history. %d clients.",
-            HT_SIZE(&client_history));
+            (int)client_history_n_entries);
 
   /* Loop through all clients. */
-  HT_FOREACH(ent, clientmap, &client_history) {
+  for (i = 0; i < client_history_capacity; ++i) {
+    const clientmap_entry_t *ent = &client_history[i];
     uintptr_t val;
     void *ptr;
-    const char *transport_name = (*ent)->transport_name;
+    const char *transport_name;
+    if (!ent->hash)
+      continue;
+    transport_name = clientmap_entry_transport_name(ent);
     if (!transport_name)
       transport_name = no_transport_str;
 
@@ -632,7 +809,7 @@ geoip_get_transport_history(void)
 
     log_debug(LD_GENERAL, "Client from '%s' with transport '%s'. "
               "I've now seen %d clients.",
-              safe_str_client(fmt_addr(&(*ent)->addr)),
+              safe_str_client(fmt_addr(&ent->addr)),
               transport_name ? transport_name : "<no transport>",
               (int)val);
   }
@@ -786,7 +963,7 @@ geoip_get_client_history(geoip_client_action_t action,
   smartlist_t *entries = NULL;
   int n_countries = geoip_get_n_countries();
   int i;
-  clientmap_entry_t **cm_ent;
+  unsigned idx;
   unsigned *counts = NULL;
   unsigned total = 0;
   unsigned ipv4_count = 0, ipv6_count = 0;
@@ -795,17 +972,18 @@ geoip_get_client_history(geoip_client_action_t action,
     return -1;
 
   counts = tor_calloc(n_countries, sizeof(unsigned));
-  HT_FOREACH(cm_ent, clientmap, &client_history) {
+  for (idx = 0; idx < client_history_capacity; ++idx) {
+    const clientmap_entry_t *cm_ent = &client_history[idx];
     int country;
-    if ((*cm_ent)->action != (int)action)
+    if (!cm_ent->hash || cm_ent->action != (int)action)
       continue;
-    country = geoip_get_country_by_addr(&(*cm_ent)->addr);
+    country = geoip_get_country_by_addr(&cm_ent->addr);
     if (country < 0)
       country = 0; /** unresolved requests are stored at index 0. */
     tor_assert(0 <= country && country < n_countries);
     ++counts[country];
     ++total;
-    switch (tor_addr_family(&(*cm_ent)->addr)) {
+    switch (tor_addr_family(&cm_ent->addr)) {
     case AF_INET:
       ipv4_count++;
       break;
@@ -926,19 +1104,7 @@ geoip_reset_dirreq_stats(time_t now)
 {
   memset(n_v3_ns_requests, 0,
          n_v3_ns_requests_len * sizeof(uint32_t));
-  {
-    clientmap_entry_t **ent, **next, *this;
-    for (ent = HT_START(clientmap, &client_history); ent != NULL;
-         ent = next) {
-      if ((*ent)->action == GEOIP_CLIENT_NETWORKSTATUS) {
-        this = *ent;
-        next = HT_NEXT_RMV(clientmap, &client_history, ent);
-        clientmap_entry_free(this);
-      } else {
-        next = HT_NEXT(clientmap, &client_history, ent);
-      }
-    }
-  }
+  client_history_remove_action(GEOIP_CLIENT_NETWORKSTATUS);
   memset(ns_v3_responses, 0, sizeof(ns_v3_responses));
   {
     dirreq_map_entry_t **ent, **next, *this;
@@ -1207,18 +1373,19 @@ format_client_stats_heartbeat(time_t now)
   const int n_hours = 6;
   char *out = NULL;
   int n_clients = 0;
-  clientmap_entry_t **ent;
+  unsigned i;
   unsigned cutoff = (unsigned)( (now-n_hours*3600)/60 );
 
   if (!start_of_bridge_stats_interval)
     return NULL; /* Not initialized. */
 
   /* count unique IPs */
-  HT_FOREACH(ent, clientmap, &client_history) {
+  for (i = 0; i < client_history_capacity; ++i) {
+    const clientmap_entry_t *ent = &client_history[i];
     /* only count directly connecting clients */
-    if ((*ent)->action != GEOIP_CLIENT_CONNECT)
+    if (!ent->hash || ent->action != GEOIP_CLIENT_CONNECT)
       continue;
-    if ((*ent)->last_seen_in_minutes < cutoff)
+    if (ent->last_seen_in_minutes < cutoff)
       continue;
     n_clients++;
   }
@@ -1401,15 +1568,13 @@ geoip_entry_stats_write(time_t now)
 void
 geoip_stats_free_all(void)
 {
-  {
-    clientmap_entry_t **ent, **next, *this;
-    for (ent = HT_START(clientmap, &client_history); ent != NULL; ent = next) {
-      this = *ent;
-      next = HT_NEXT_RMV(clientmap, &client_history, ent);
-      clientmap_entry_free(this);
-    }
-    HT_CLEAR(clientmap, &client_history);
+  client_history_remove_matching(client_any_helper_, NULL);
+  client_history_resize(0);
+  if (client_transport_names) {
+    SMARTLIST_FOREACH(client_transport_names, char *, cp, tor_free(cp));
+    smartlist_free(client_transport_names);
   }
+  client_transport_names_len = 0;
   {
     dirreq_map_entry_t **ent, **next, *this;
     for (ent = HT_START(dirreqmap, &dirreq_map); ent != NULL; ent = next) {
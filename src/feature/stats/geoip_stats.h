@@ -74,13 +74,18 @@ typedef enum {
 
 /** Entry in a map from IP address to the last time we've seen an incoming
  * connection from that IP address. Used by bridges only to track which
- * countries have them blocked, or the DoS mitigation subsystem if enabled. */
+ * countries have them blocked, or the DoS mitigation subsystem if enabled.
+ *
+ * Entries are stored inline in an open-addressing table, so they move
+ * whenever a client is added or removed. */
 typedef struct clientmap_entry_t {
-  HT_ENTRY(clientmap_entry_t) node;
   tor_addr_t addr;
-  /* Name of pluggable transport used by this client. NULL if no
-     pluggable transport was used. */
-  char *transport_name;
+  /** Hash of this entry's key, or 0 if this table slot is empty. */
+  uint32_t hash;
+  /* Index of the pluggable transport used by this client in geoip_stats.c's
+     list of transport names, plus one. 0 if no pluggable transport was
+     used. */
+  uint16_t transport_idx;
 
   /** Time when we last saw this IP address, in MINUTES since the epoch.
    *
@@ -973,9 +973,12 @@ rep_hist_load_mtbf_data(time_t now)
   return r;
 }
 
-/** For how many seconds do we keep track of individual per-second bandwidth
- * totals? */
+/** Over how many seconds do we measure the bandwidth we compare against
+ * our maxima? */
 #define NUM_SECS_ROLLING_MEASURE 10
+/** For how many seconds do we keep track of individual per-second bandwidth
+ * totals? Must be at least NUM_SECS_ROLLING_MEASURE. */
+#define NUM_SECS_OBS_HISTORY (60*60)
 /** How large are the intervals for which we track and report bandwidth use? */
 #define NUM_SECS_BW_SUM_INTERVAL (24*60*60)
 /** How far in the past do we remember and publish bandwidth use? */
@@ -988,12 +991,14 @@ rep_hist_load_mtbf_data(time_t now)
  */
 struct bw_array_t {
   /** Observation array: Total number of bytes transferred in each of the last
-   * NUM_SECS_ROLLING_MEASURE seconds. This is used as a circular array. */
-  uint64_t obs[NUM_SECS_ROLLING_MEASURE];
+   * NUM_SECS_OBS_HISTORY seconds. This is used as a circular array. */
+  uint64_t obs[NUM_SECS_OBS_HISTORY];
   int cur_obs_idx; /**< Current position in obs. */
+  int num_obs_set; /**< How many values in obs are real observations,
+                    * including obs[cur_obs_idx]? */
   time_t cur_obs_time; /**< Time represented in obs[cur_obs_idx] */
-  uint64_t total_obs; /**< Total for all members of obs except
-                       * obs[cur_obs_idx] */
+  uint64_t total_obs; /**< Total for the NUM_SECS_ROLLING_MEASURE-1 members
+                       * of obs before obs[cur_obs_idx] */
   uint64_t max_total; /**< Largest value that total_obs has taken on in the
                        * current period. */
   uint64_t total_in_period; /**< Total bytes transferred in the current
@@ -1049,12 +1054,17 @@ advance_obs(bw_array_t *b)
     b->max_total = total;
 
   nextidx = b->cur_obs_idx+1;
-  if (nextidx == NUM_SECS_ROLLING_MEASURE)
+  if (nextidx == NUM_SECS_OBS_HISTORY)
     nextidx = 0;
 
-  b->total_obs = total - b->obs[nextidx];
+  /* The oldest second in the rolling measure drops out of it. */
+  b->total_obs = total - b->obs[(nextidx + NUM_SECS_OBS_HISTORY -
+                                 NUM_SECS_ROLLING_MEASURE) %
+                                NUM_SECS_OBS_HISTORY];
   b->obs[nextidx]=0;
   b->cur_obs_idx = nextidx;
+  if (b->num_obs_set < NUM_SECS_OBS_HISTORY)
+    ++b->num_obs_set;
 
   if (++b->cur_obs_time >= b->next_period)
     commit_max(b);
@@ -1092,6 +1102,7 @@ bw_array_new(void)
   rephist_total_alloc += sizeof(bw_array_t);
   start = time(NULL);
   b->cur_obs_time = start;
+  b->num_obs_set = 1;
   b->next_period = start + NUM_SECS_BW_SUM_INTERVAL;
   return b;
 }
@@ -1332,6 +1343,62 @@ rep_hist_get_bandwidth_lines(void)
   return buf;
 }
 
+/** Return a newly allocated string holding the number of bytes <b>b</b>
+ * saw in each of the last <b>n_secs</b> complete seconds that we know about,
+ * oldest first, comma separated. */
+static char *
+bw_array_format_per_second(const bw_array_t *b, int n_secs)
+{
+  smartlist_t *elements = smartlist_new();
+  char *result;
+  int idx;
+
+  /* The current second isn't over yet. */
+  n_secs = MIN(n_secs, b->num_obs_set - 1);
+  idx = (b->cur_obs_idx + NUM_SECS_OBS_HISTORY - n_secs) %
+    NUM_SECS_OBS_HISTORY;
+  while (n_secs-- > 0) {
+    smartlist_add_asprintf(elements, "%"PRIu64, b->obs[idx]);
+    if (++idx == NUM_SECS_OBS_HISTORY)
+      idx = 0;
+  }
+
+  result = smartlist_join_strings(elements, ",", 0, NULL);
+  SMARTLIST_FOREACH(elements, char *, cp, tor_free(cp));
+  smartlist_free(elements);
+  return result;
+}
+
+/** Return a newly allocated string holding our per-second bandwidth history
+ * of kind <b>which</b> ("read", "write", "dir-read", or "dir-write"), for up
+ * to the last <b>n_secs</b> complete seconds, or for as long as we remember
+ * if <b>n_secs</b> is 0. Return NULL if <b>which</b> isn't a kind we know.
+ *
+ * The history starts with the second ending <i>k</i> seconds ago, where
+ * <i>k</i> is the number of values in the string. */
+char *
+rep_hist_get_per_second_bandwidth(const char *which, int n_secs)
+{
+  const bw_array_t *b;
+
+  if (!strcmp(which, "read"))
+    b = read_array;
+  else if (!strcmp(which, "write"))
+    b = write_array;
+  else if (!strcmp(which, "dir-read"))
+    b = dir_read_array;
+  else if (!strcmp(which, "dir-write"))
+    b = dir_write_array;
+  else
+    return NULL;
+
+  if (n_secs <= 0 || n_secs > NUM_SECS_OBS_HISTORY)
+    n_secs = NUM_SECS_OBS_HISTORY;
+  if (!b)
+    return tor_strdup("");
+  return bw_array_format_per_second(b, n_secs);
+}
+
 /** Write a single bw_array_t into the Values, Ends, Interval, and Maximum
  * entries of an or_state_t. Done before writing out a new state file. */
 static void
@@ -1430,7 +1497,7 @@ rep_hist_load_bwhist_state_section(bw_array_t *b,
   time_t start;
 
   uint64_t v, mv;
-  int i,ok,ok_m = 0;
+  int ok,ok_m = 0;
   int have_maxima = s_maxima && s_values &&
     (smartlist_len(s_values) == smartlist_len(s_maxima));
 
@@ -1484,10 +1551,10 @@ rep_hist_load_bwhist_state_section(bw_array_t *b,
     } SMARTLIST_FOREACH_END(cp);
   }
 
-  /* Clean up maxima and observed */
-  for (i=0; i<NUM_SECS_ROLLING_MEASURE; ++i) {
-    b->obs[i] = 0;
-  }
+  /* Clean up maxima and observed: the per-second values we just made up
+   * aren't real observations. */
+  memset(b->obs, 0, sizeof(b->obs));
+  b->num_obs_set = 1;
   b->total_obs = 0;
 
   return retval;
@@ -670,6 +670,21 @@ tor_compress_init(void)
   tor_zstd_init();
 }
 
+/** We're low on memory: release any compression state that we're keeping
+ * around for reuse, and return the number of bytes that we freed. */
+size_t
+tor_compress_handle_oom(void)
+{
+  return tor_zlib_release_idle_states();
+}
+
+/** Release any compression state that we're keeping around for reuse. */
+void
+tor_compress_free_all(void)
+{
+  tor_zlib_free_all();
+}
+
 /** Warn if we had any problems while setting up our compression libraries.
  *
  * (This isn't part of tor_compress_init, since the logs aren't set up yet.)
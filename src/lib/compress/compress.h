@@ -62,6 +62,7 @@ const char *tor_compress_version_str(compress_method_t method);
 const char *tor_compress_header_version_str(compress_method_t method);
 
 size_t tor_compress_get_total_allocation(void);
+size_t tor_compress_handle_oom(void);
 
 /** Return values from tor_compress_process; see that function's documentation
  * for details. */
@@ -90,6 +91,7 @@ void tor_compress_free_(tor_compress_state_t *state);
 size_t tor_compress_state_size(const tor_compress_state_t *state);
 
 void tor_compress_init(void);
+void tor_compress_free_all(void);
 void tor_compress_log_init_warnings(void);
 
 struct buf_t;
@@ -17,6 +17,7 @@
 #include "lib/log/util_bug.h"
 #include "lib/compress/compress.h"
 #include "lib/compress/compress_zlib.h"
+#include "lib/lock/compat_mutex.h"
 #include "lib/thread/threads.h"
 
 /* zlib 1.2.4 and 1.2.5 do some "clever" things with macros.  Instead of
@@ -47,6 +48,7 @@
 
 static size_t tor_zlib_state_size_precalc(int inflate,
                                           int windowbits, int memlevel);
+static void tor_zlib_compress_free_unpooled(tor_zlib_compress_state_t *state);
 
 /** Total number of bytes allocated for zlib state */
 static atomic_counter_t total_zlib_allocation;
@@ -118,8 +120,81 @@ struct tor_zlib_compress_state_t {
 
   /** Approximate number of bytes allocated for this object. */
   size_t allocation;
+
+  /** The window bits and memory level that we passed to zlib. Together
+   * with <b>compress</b>, these say which requests this state can be reused
+   * for. */
+  int bits;
+  int memlevel;
 };
 
+/** How many idle zlib states do we keep around for reuse? */
+#define ZLIB_STATE_POOL_SIZE 4
+
+/** Idle zlib states, already reset, that tor_zlib_compress_new() can hand
+ * out instead of setting up a new stream.  Setting up a deflate stream
+ * allocates and clears a few hundred kilobytes, which is a lot of work
+ * next to compressing a small directory object. */
+static tor_zlib_compress_state_t *zlib_state_pool[ZLIB_STATE_POOL_SIZE];
+/** Number of elements in zlib_state_pool. */
+static int n_zlib_states_pooled = 0;
+/** Lock protecting zlib_state_pool: we compress in cpuworkers too. */
+static tor_mutex_t zlib_state_pool_lock;
+/** True iff zlib_state_pool_lock has been initialized. */
+static int zlib_state_pool_initialized = 0;
+
+/** If there is an idle state in the pool that matches <b>compress_</b>,
+ * <b>bits</b>, and <b>memlevel</b>, remove it from the pool and return it.
+ * Otherwise return NULL. */
+static tor_zlib_compress_state_t *
+zlib_state_pool_take(int compress_, int bits, int memlevel)
+{
+  tor_zlib_compress_state_t *result = NULL;
+  int i;
+
+  if (!zlib_state_pool_initialized)
+    return NULL;
+
+  tor_mutex_acquire(&zlib_state_pool_lock);
+  for (i = 0; i < n_zlib_states_pooled; ++i) {
+    tor_zlib_compress_state_t *st = zlib_state_pool[i];
+    if (st->compress == compress_ && st->bits == bits &&
+        st->memlevel == memlevel) {
+      result = st;
+      zlib_state_pool[i] = zlib_state_pool[--n_zlib_states_pooled];
+      zlib_state_pool[n_zlib_states_pooled] = NULL;
+      break;
+    }
+  }
+  tor_mutex_release(&zlib_state_pool_lock);
+  return result;
+}
+
+/** Try to reset <b>state</b> and keep it for reuse.  Return true if we did,
+ * and false if the caller should free it. */
+static int
+zlib_state_pool_put(tor_zlib_compress_state_t *state)
+{
+  int kept = 0;
+
+  if (!zlib_state_pool_initialized)
+    return 0;
+
+  int r = state->compress ? deflateReset(&state->stream)
+                          : inflateReset(&state->stream);
+  if (r != Z_OK)
+    return 0; // LCOV_EXCL_LINE
+  state->input_so_far = state->output_so_far = 0;
+
+  tor_mutex_acquire(&zlib_state_pool_lock);
+  if (n_zlib_states_pooled < ZLIB_STATE_POOL_SIZE) {
+    zlib_state_pool[n_zlib_states_pooled++] = state;
+    kept = 1;
+  }
+  tor_mutex_release(&zlib_state_pool_lock);
+  return kept;
+}
+
 /** Return an approximate number of bytes used in RAM to hold a state with
  * window bits <b>windowBits</b> and compression level 'memlevel' */
 static size_t
@@ -168,13 +243,19 @@ tor_zlib_compress_new(int compress_,
     compression_level = BEST_COMPRESSION;
   }
 
+  bits = method_bits(method, compression_level);
+  memlevel = memory_level(compression_level);
+  out = zlib_state_pool_take(compress_, bits, memlevel);
+  if (out)
+    return out;
+
   out = tor_malloc_zero(sizeof(tor_zlib_compress_state_t));
   out->stream.zalloc = Z_NULL;
   out->stream.zfree = Z_NULL;
   out->stream.opaque = NULL;
   out->compress = compress_;
-  bits = method_bits(method, compression_level);
-  memlevel = memory_level(compression_level);
+  out->bits = bits;
+  out->memlevel = memlevel;
   if (compress_) {
     if (deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
                      bits, memlevel,
@@ -264,13 +345,23 @@ tor_zlib_compress_process(tor_zlib_compress_state_t *state,
     }
 }
 
-/** Deallocate <b>state</b>. */
+/** Deallocate <b>state</b>, or keep it around for reuse. */
 void
 tor_zlib_compress_free_(tor_zlib_compress_state_t *state)
 {
   if (state == NULL)
     return;
 
+  if (zlib_state_pool_put(state))
+    return;
+
+  tor_zlib_compress_free_unpooled(state);
+}
+
+/** Really deallocate <b>state</b>. */
+static void
+tor_zlib_compress_free_unpooled(tor_zlib_compress_state_t *state)
+{
   atomic_counter_sub(&total_zlib_allocation, state->allocation);
 
   if (state->compress)
@@ -301,4 +392,36 @@ void
 tor_zlib_init(void)
 {
   atomic_counter_init(&total_zlib_allocation);
+  if (!zlib_state_pool_initialized) {
+    tor_mutex_init_nonrecursive(&zlib_state_pool_lock);
+    zlib_state_pool_initialized = 1;
+  }
+}
+
+/** Release every idle zlib state that we're keeping for reuse.  Return the
+ * number of bytes that we freed. */
+size_t
+tor_zlib_release_idle_states(void)
+{
+  size_t freed = 0;
+
+  if (!zlib_state_pool_initialized)
+    return 0;
+
+  tor_mutex_acquire(&zlib_state_pool_lock);
+  while (n_zlib_states_pooled > 0) {
+    tor_zlib_compress_state_t *st = zlib_state_pool[--n_zlib_states_pooled];
+    zlib_state_pool[n_zlib_states_pooled] = NULL;
+    freed += st->allocation;
+    tor_zlib_compress_free_unpooled(st);
+  }
+  tor_mutex_release(&zlib_state_pool_lock);
+  return freed;
+}
+
+/** Release every idle zlib state that we're keeping for reuse. */
+void
+tor_zlib_free_all(void)
+{
+  tor_zlib_release_idle_states();
 }
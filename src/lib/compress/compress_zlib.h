@@ -41,6 +41,8 @@ size_t tor_zlib_compress_state_size(const tor_zlib_compress_state_t *state);
 size_t tor_zlib_get_total_allocation(void);
 
 void tor_zlib_init(void);
+size_t tor_zlib_release_idle_states(void);
+void tor_zlib_free_all(void);
 
 #endif /* !defined(TOR_COMPRESS_ZLIB_H) */
 
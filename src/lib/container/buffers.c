@@ -136,6 +136,30 @@ buf_chunk_free_unchecked(chunk_t *chunk)
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
   tor_free(chunk);
 }
+
+/** Every chunk should take up at least this many bytes. */
+#define MIN_CHUNK_ALLOC 256
+/** No chunk should take up more than this many bytes. */
+#define MAX_CHUNK_ALLOC 65536
+
+/** Dispose of <b>chunk</b>, which has just been removed from <b>buf</b>: keep
+ * it as <b>buf</b>'s spare chunk if <b>buf</b> reuses chunks, has no spare
+ * yet, and <b>chunk</b> is no bigger than <b>buf</b>'s default chunk size.
+ * Free it otherwise. */
+static void
+buf_chunk_release(buf_t *buf, chunk_t *chunk)
+{
+  if (buf->reuse_chunks && !buf->spare &&
+      CHUNK_ALLOC_SIZE(chunk->memlen) <= buf->default_chunk_size) {
+    chunk->next = NULL;
+    chunk->datalen = 0;
+    chunk->data = &chunk->mem[0];
+    buf->spare = chunk;
+    return;
+  }
+  buf_chunk_free_unchecked(chunk);
+}
+
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
@@ -176,11 +200,6 @@ chunk_grow(chunk_t *chunk, size_t sz)
   return chunk;
 }
 
-/** Every chunk should take up at least this many bytes. */
-#define MIN_CHUNK_ALLOC 256
-/** No chunk should take up more than this many bytes. */
-#define MAX_CHUNK_ALLOC 65536
-
 /** Return the allocation size we'd like to use to hold <b>target</b>
  * bytes. */
 size_t
@@ -259,7 +278,7 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
       dest->next = src->next;
       if (buf->tail == src)
         buf->tail = dest;
-      buf_chunk_free_unchecked(src);
+      buf_chunk_release(buf, src);
     } else {
       memcpy(CHUNK_WRITE_PTR(dest), src->data, n);
       dest->datalen += n;
@@ -342,12 +361,37 @@ buf_drain(buf_t *buf, size_t n)
       buf->head = victim->next;
       if (buf->tail == victim)
         buf->tail = NULL;
-      buf_chunk_free_unchecked(victim);
+      buf_chunk_release(buf, victim);
     }
   }
   check();
 }
 
+/** Make <b>buf</b> hold on to one drained chunk rather than freeing it,
+ * and hand that chunk back out the next time it needs space.  Buffers with
+ * steady traffic, like those on OR connections, then cycle through the same
+ * memory instead of calling malloc and free for every chunk's worth of
+ * cells. */
+void
+buf_enable_chunk_reuse(buf_t *buf)
+{
+  buf->reuse_chunks = 1;
+}
+
+/** Free the spare chunk that <b>buf</b> is keeping for reuse, if any.
+ * Return the number of bytes that we freed. */
+size_t
+buf_release_spare_chunk(buf_t *buf)
+{
+  size_t freed;
+  if (!buf->spare)
+    return 0;
+  freed = CHUNK_ALLOC_SIZE(buf->spare->memlen);
+  buf_chunk_free_unchecked(buf->spare);
+  buf->spare = NULL;
+  return freed;
+}
+
 /** Create and return a new buf with default chunk capacity <b>size</b>.
  */
 buf_t *
@@ -385,6 +429,7 @@ buf_clear(buf_t *buf)
     buf_chunk_free_unchecked(chunk);
   }
   buf->head = buf->tail = NULL;
+  buf_release_spare_chunk(buf);
 }
 
 /** Return the number of bytes stored in <b>buf</b> */
@@ -403,6 +448,8 @@ buf_allocation(const buf_t *buf)
   for (chunk = buf->head; chunk; chunk = chunk->next) {
     total += CHUNK_ALLOC_SIZE(chunk->memlen);
   }
+  if (buf->spare)
+    total += CHUNK_ALLOC_SIZE(buf->spare->memlen);
   return total;
 }
 
@@ -474,7 +521,12 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
 {
   chunk_t *chunk;
 
-  if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
+  /* A capped caller takes whatever room the chunk has, so the spare chunk
+   * always does for them. */
+  if (buf->spare && (capped || capacity <= buf->spare->memlen)) {
+    chunk = buf->spare;
+    buf->spare = NULL;
+  } else if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
     chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
   } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
     chunk = chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
@@ -600,6 +652,17 @@ buf_extract(buf_t *buf, size_t *sz_out)
   return result;
 }
 
+/** If the first <b>n</b> bytes of <b>buf</b> are stored contiguously, return
+ * a pointer to them without copying; otherwise return NULL.  The pointer is
+ * only valid until <b>buf</b> is next modified. */
+const char *
+buf_peek_contiguous(const buf_t *buf, size_t n)
+{
+  if (buf->head && buf->head->datalen >= n)
+    return buf->head->data;
+  return NULL;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -23,6 +23,8 @@ typedef struct buf_t buf_t;
 
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
+void buf_enable_chunk_reuse(buf_t *buf);
+size_t buf_release_spare_chunk(buf_t *buf);
 size_t buf_get_default_chunk_size(const buf_t *buf);
 void buf_free_(buf_t *buf);
 #define buf_free(b) FREE_AND_NULL(buf_t, buf_free_, (b))
@@ -45,6 +47,7 @@ void buf_add_vprintf(buf_t *buf, const char *format, va_list args)
 int buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 void buf_move_all(buf_t *buf_out, buf_t *buf_in);
 void buf_peek(const buf_t *buf, char *string, size_t string_len);
+const char *buf_peek_contiguous(const buf_t *buf, size_t n);
 void buf_drain(buf_t *buf, size_t n);
 int buf_get_bytes(buf_t *buf, char *string, size_t string_len);
 int buf_get_line(buf_t *buf, char *data_out, size_t *data_len);
@@ -94,6 +97,12 @@ struct buf_t {
                               * this for this buffer. */
   chunk_t *head; /**< First chunk in the list, or NULL for none. */
   chunk_t *tail; /**< Last chunk in the list, or NULL for none. */
+  /** A drained chunk kept around for reuse, or NULL for none.  Only set if
+   * reuse_chunks is true. */
+  chunk_t *spare;
+  /** True iff we should keep drained chunks in <b>spare</b> rather than
+   * freeing them. */
+  unsigned int reuse_chunks:1;
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
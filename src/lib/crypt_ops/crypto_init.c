@@ -63,6 +63,7 @@ crypto_early_init(void)
 
     if (crypto_seed_rng() < 0)
       return -1;
+    crypto_rand_fast_init();
     if (crypto_init_siphash_key() < 0)
       return -1;
 
@@ -105,6 +106,7 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 void
 crypto_thread_cleanup(void)
 {
+  destroy_thread_fast_rng();
 #ifdef ENABLE_OPENSSL
   crypto_openssl_thread_cleanup();
 #endif
@@ -118,6 +120,7 @@ int
 crypto_global_cleanup(void)
 {
   crypto_dh_free_all();
+  crypto_rand_fast_shutdown();
 
 #ifdef ENABLE_OPENSSL
   crypto_openssl_global_cleanup();
@@ -149,6 +152,7 @@ crypto_prefork(void)
 void
 crypto_postfork(void)
 {
+  crypto_rand_fast_postfork();
 #ifdef ENABLE_NSS
   crypto_nss_postfork();
 #endif
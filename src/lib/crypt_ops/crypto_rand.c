@@ -470,18 +470,34 @@ crypto_seed_rng(void)
  * Write <b>n</b> bytes of strong random data to <b>to</b>. Supports mocking
  * for unit tests.
  *
+ * The bytes come from this thread's buffered generator (see
+ * crypto_rand_fast.c), which makes small requests far cheaper than asking
+ * our crypto library each time.
+ *
  * This function is not allowed to fail; if it would fail to generate strong
  * entropy, it must terminate the process instead.
  **/
 MOCK_IMPL(void,
 crypto_rand, (char *to, size_t n))
 {
-  crypto_rand_unmocked(to, n);
+  crypto_fast_rng_t *rng;
+
+  if (n == 0)
+    return;
+
+  rng = get_thread_fast_rng();
+  if (PREDICT_UNLIKELY(!rng)) {
+    /* Too early (or too late) to use the per-thread generators. */
+    crypto_rand_unmocked(to, n);
+    return;
+  }
+  crypto_fast_rng_getbytes(rng, (uint8_t*)to, n);
 }
 
 /**
- * Write <b>n</b> bytes of strong random data to <b>to</b>.  Most callers
- * will want crypto_rand instead.
+ * Write <b>n</b> bytes of strong random data from our crypto library's PRNG
+ * to <b>to</b>.  Most callers will want crypto_rand instead; this is what
+ * seeds it.
  *
  * This function is not allowed to fail; if it would fail to generate strong
  * entropy, it must terminate the process instead.
@@ -35,6 +35,19 @@ void crypto_seed_weak_rng(struct tor_weak_rng_t *rng);
 char *crypto_random_hostname(int min_rand_len, int max_rand_len,
                              const char *prefix, const char *suffix);
 
+typedef struct crypto_fast_rng_t crypto_fast_rng_t;
+crypto_fast_rng_t *crypto_fast_rng_new(void);
+void crypto_fast_rng_free_(crypto_fast_rng_t *rng);
+#define crypto_fast_rng_free(rng) \
+  FREE_AND_NULL(crypto_fast_rng_t, crypto_fast_rng_free_, (rng))
+void crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out,
+                              size_t n);
+crypto_fast_rng_t *get_thread_fast_rng(void);
+void destroy_thread_fast_rng(void);
+void crypto_rand_fast_init(void);
+void crypto_rand_fast_shutdown(void);
+void crypto_rand_fast_postfork(void);
+
 struct smartlist_t;
 void *smartlist_choose(const struct smartlist_t *sl);
 void smartlist_shuffle(struct smartlist_t *sl);
@@ -50,4 +63,8 @@ extern int break_strongest_rng_fallback;
 #endif
 #endif /* defined(CRYPTO_RAND_PRIVATE) */
 
+#ifdef CRYPTO_RAND_FAST_PRIVATE
+STATIC crypto_fast_rng_t *crypto_fast_rng_new_from_seed(const uint8_t *seed);
+#endif
+
 #endif /* !defined(TOR_CRYPTO_RAND_H) */
@@ -0,0 +1,249 @@
+/* Copyright (c) 2001, Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.c
+ *
+ * \brief A fast, buffered, per-thread strong PRNG that sits behind
+ * crypto_rand().
+ *
+ * Asking our crypto library's PRNG for a handful of bytes at a time is
+ * expensive: every call goes through locking and bookkeeping inside the
+ * library.  Many of our callers (circuit ID selection, padding timers,
+ * smartlist_choose(), split instruction generation) want only a few bytes
+ * at a time, but want them very often.
+ *
+ * So instead, each thread keeps a crypto_fast_rng_t: a buffer of AES-CTR
+ * keystream, generated from a seed.  Whenever the buffer runs out we
+ * generate a new one, and use its first bytes as the next seed.  Bytes are
+ * erased from the buffer as soon as we hand them out, so that compromising
+ * the state later doesn't reveal earlier outputs.  Every so often, and
+ * after a fork, we mix fresh bytes from the crypto library's PRNG into the
+ * seed.
+ **/
+
+#define CRYPTO_RAND_FAST_PRIVATE
+
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_cipher.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/intmath/cmp.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/thread/threads.h"
+
+#include <string.h>
+
+/** Number of bytes of seed we use to key our stream cipher. */
+#define SEED_LEN (CIPHER256_KEY_LEN + CIPHER_IV_LEN)
+/** Number of bytes of keystream we generate at a time, including the next
+ * seed. */
+#define BUFLEN 4096
+/** Number of times we refill the buffer from our own seed before we mix in
+ * fresh entropy from the crypto library. */
+#define RESEED_AFTER 16
+
+struct crypto_fast_rng_t {
+  /** How many more refills before we mix in fresh entropy? */
+  int16_t n_till_reseed;
+  /** How many bytes are left unused at the end of buf.bytes? */
+  uint16_t bytes_left;
+  /** The value of fast_rng_fork_generation when we last reseeded. */
+  unsigned fork_generation;
+  /** The current keystream buffer. */
+  struct cbuf {
+    /** The seed for the next refill. */
+    uint8_t seed[SEED_LEN];
+    /** Bytes that we have yet to hand out. */
+    uint8_t bytes[BUFLEN - SEED_LEN];
+  } buf;
+};
+
+/** Incremented every time we fork, so that each thread's generator knows to
+ * stop sharing a stream with the other process. */
+static unsigned fast_rng_fork_generation = 0;
+
+/** Thread-local pointer to each thread's crypto_fast_rng_t. */
+static tor_threadlocal_t thread_rng;
+/** True iff thread_rng has been initialized. */
+static int thread_rng_initialized = 0;
+
+/** Return a new crypto_fast_rng_t whose first buffer is generated from
+ * <b>seed</b>, which must hold SEED_LEN bytes. */
+STATIC crypto_fast_rng_t *
+crypto_fast_rng_new_from_seed(const uint8_t *seed)
+{
+  crypto_fast_rng_t *rng = tor_malloc_zero(sizeof(*rng));
+  memcpy(rng->buf.seed, seed, SEED_LEN);
+  rng->n_till_reseed = RESEED_AFTER;
+  rng->fork_generation = fast_rng_fork_generation;
+  return rng;
+}
+
+/** Return a new crypto_fast_rng_t, seeded from our crypto library's
+ * PRNG. */
+crypto_fast_rng_t *
+crypto_fast_rng_new(void)
+{
+  uint8_t seed[SEED_LEN];
+  crypto_fast_rng_t *rng;
+
+  crypto_rand_unmocked((char*)seed, sizeof(seed));
+  rng = crypto_fast_rng_new_from_seed(seed);
+  memwipe(seed, 0, sizeof(seed));
+  return rng;
+}
+
+/** Release all storage held by <b>rng</b>. */
+void
+crypto_fast_rng_free_(crypto_fast_rng_t *rng)
+{
+  if (!rng)
+    return;
+  memwipe(rng, 0, sizeof(*rng));
+  tor_free(rng);
+}
+
+/** Fill <b>out</b> with <b>n</b> bytes of AES-CTR keystream, keyed with
+ * the SEED_LEN bytes at <b>seed</b>. */
+static void
+fill_from_seed(const uint8_t *seed, uint8_t *out, size_t n)
+{
+  crypto_cipher_t *c = crypto_cipher_new_with_iv_and_bits(
+                                 seed, seed + CIPHER256_KEY_LEN, 256);
+  memset(out, 0, n);
+  crypto_cipher_crypt_inplace(c, (char*)out, n);
+  crypto_cipher_free(c);
+}
+
+/** Replace the contents of <b>rng</b>'s buffer with fresh keystream,
+ * reseeding it first if it is due. */
+static void
+crypto_fast_rng_refill(crypto_fast_rng_t *rng)
+{
+  uint8_t seed[SEED_LEN];
+
+  if (--rng->n_till_reseed <= 0 ||
+      rng->fork_generation != fast_rng_fork_generation) {
+    uint8_t fresh[SEED_LEN];
+    int i;
+    crypto_rand_unmocked((char*)fresh, sizeof(fresh));
+    for (i = 0; i < SEED_LEN; ++i)
+      rng->buf.seed[i] ^= fresh[i];
+    memwipe(fresh, 0, sizeof(fresh));
+    rng->n_till_reseed = RESEED_AFTER;
+    rng->fork_generation = fast_rng_fork_generation;
+  }
+
+  /* The old seed gets overwritten by the first bytes of the new buffer. */
+  memcpy(seed, rng->buf.seed, SEED_LEN);
+  fill_from_seed(seed, (uint8_t*)&rng->buf, sizeof(rng->buf));
+  memwipe(seed, 0, sizeof(seed));
+  rng->bytes_left = sizeof(rng->buf.bytes);
+}
+
+/** Write <b>n</b> strong random bytes from <b>rng</b> to <b>out</b>.
+ *
+ * Small requests are served out of <b>rng</b>'s buffer.  Requests too big
+ * for the buffer are filled directly with keystream under a one-time seed
+ * taken from the buffer, without any copying. */
+void
+crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n)
+{
+  tor_assert(rng);
+  tor_assert(out || n == 0);
+
+  if (PREDICT_UNLIKELY(rng->fork_generation != fast_rng_fork_generation)) {
+    /* Don't hand out anything the other side of the fork may also have. */
+    rng->bytes_left = 0;
+  }
+
+  if (n > sizeof(rng->buf.bytes)) {
+    uint8_t seed[SEED_LEN];
+    crypto_fast_rng_getbytes(rng, seed, sizeof(seed));
+    fill_from_seed(seed, out, n);
+    memwipe(seed, 0, sizeof(seed));
+    return;
+  }
+
+  while (n) {
+    size_t k;
+    uint8_t *p;
+    if (!rng->bytes_left)
+      crypto_fast_rng_refill(rng);
+    k = MIN(n, (size_t)rng->bytes_left);
+    p = rng->buf.bytes + sizeof(rng->buf.bytes) - rng->bytes_left;
+    memcpy(out, p, k);
+    memwipe(p, 0, k);
+    out += k;
+    n -= k;
+    rng->bytes_left -= k;
+  }
+}
+
+/** Set up the per-thread generators.  Called from crypto_early_init(). */
+void
+crypto_rand_fast_init(void)
+{
+  if (thread_rng_initialized)
+    return;
+  tor_threadlocal_init(&thread_rng);
+  thread_rng_initialized = 1;
+}
+
+/** Free the current thread's generator, and stop using per-thread
+ * generators.  Called from crypto_global_cleanup(). */
+void
+crypto_rand_fast_shutdown(void)
+{
+  if (!thread_rng_initialized)
+    return;
+  destroy_thread_fast_rng();
+  tor_threadlocal_destroy(&thread_rng);
+  thread_rng_initialized = 0;
+}
+
+/** Note that we have just forked: every generator must reseed before it
+ * hands out any more bytes. */
+void
+crypto_rand_fast_postfork(void)
+{
+  ++fast_rng_fork_generation;
+}
+
+/** Return the current thread's generator, creating it if necessary.  Return
+ * NULL if the per-thread generators haven't been set up yet. */
+crypto_fast_rng_t *
+get_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+
+  if (PREDICT_UNLIKELY(!thread_rng_initialized))
+    return NULL;
+
+  rng = tor_threadlocal_get(&thread_rng);
+  if (PREDICT_UNLIKELY(rng == NULL)) {
+    rng = crypto_fast_rng_new();
+    tor_threadlocal_set(&thread_rng, rng);
+  }
+  return rng;
+}
+
+/** Free the current thread's generator, if it has one.  Called from
+ * crypto_thread_cleanup(). */
+void
+destroy_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+
+  if (!thread_rng_initialized)
+    return;
+  rng = tor_threadlocal_get(&thread_rng);
+  if (!rng)
+    return;
+  crypto_fast_rng_free(rng);
+  tor_threadlocal_set(&thread_rng, NULL);
+}
@@ -9,13 +9,22 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process and
+ * a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in compat_threads.c.
+ * The main thread hands each new piece of work to one worker's queues, and
+ * wakes an idle worker (if there is one) with that worker's own condition
+ * variable.  A worker looking for work picks the highest priority that has
+ * any pending work anywhere in the pool, and takes it from its own queues
+ * if it can, or else steals it from another worker's.  So no single lock is
+ * shared by every worker, and no worker runs low-priority work while
+ * higher-priority work waits on somebody else's queue.
+ *
+ * The workers inform the main process of completed work by pushing it onto
+ * the reply queue (without locking, where we have C11 atomics), and by using
+ * an alert_sockets_t object, as implemented in compat_threads.c, only when
+ * the reply queue goes from empty to nonempty.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -49,22 +58,30 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_s {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This array is filled in before any thread starts, and doesn't
+   * change afterwards, so the threads can read it without locking. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Index of the thread whose queues should get the next piece of work.
+   * Only used from the main thread. */
+  int next_thread;
 
-  /** Weak RNG, used to decide when to ignore priority. */
-  tor_weak_rng_t weak_rng;
+  /** Number of threads that are waiting for work.  Each thread's
+   * contribution changes only while that thread's lock is held; this is
+   * just a hint that lets us avoid looking at every thread when none of
+   * them is idle. */
+  atomic_counter_t n_idle;
+
+  /** Number of entries waiting on each priority's queues, summed over every
+   * thread.  Each thread's contribution changes only while that thread's
+   * lock is held.  Workers use these to decide which priority to take work
+   * from without locking every thread. */
+  atomic_counter_t n_pending[WORKQUEUE_N_PRIORITIES];
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * incremented with <b>lock</b> held. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -78,7 +95,7 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields above. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -96,14 +113,20 @@ struct threadpool_s {
 #define WORKQUEUE_PRIORITY_BITS 2
 
 struct workqueue_entry_s {
-  /** The next workqueue_entry_t that's pending on the same thread or
-   * reply queue. */
+  /** The next workqueue_entry_t that's pending on the same thread. */
   TOR_TAILQ_ENTRY(workqueue_entry_s) next_work;
+  /** The workqueue_entry_t that was put on the reply queue before this
+   * one. */
+  struct workqueue_entry_s *next_reply;
   /** The threadpool to which this workqueue_entry_t was assigned. This field
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The thread whose queues this entry was put on.  Workers may steal the
+   * entry from those queues, but it is never moved to another queue. */
+  struct workerthread_s *on_thread;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by the lock of <b>on_thread</b>. */
   uint8_t pending;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
@@ -116,10 +139,16 @@ struct workqueue_entry_s {
 };
 
 struct replyqueue_s {
+  /** Stack of answers that the reply queue needs to handle, newest first,
+   * linked with their next_reply fields.  Workers push onto it; the main
+   * thread takes the whole stack at once. */
+#ifdef HAVE_WORKING_STDATOMIC
+  _Atomic(workqueue_entry_t *) answers;
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
+  workqueue_entry_t *answers;
   /** Mutex to protect the answers field */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -137,9 +166,25 @@ typedef struct workerthread_s {
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+  /** Weak RNG, used to decide when to ignore priority.  Only used by this
+   * thread. */
+  tor_weak_rng_t weak_rng;
+
+  /** Mutex to protect work, idle, and the pending fields of the entries in
+   * work. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when somebody gives us work or an update. */
+  tor_cond_t condition;
+  /** Queues of pending work given to this thread. The queue with priority
+   * <b>p</b> is work[p].  Other threads may steal from these queues. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** True iff this thread is waiting on its condition variable, or about to
+   * do so. */
+  unsigned int idle:1;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -190,19 +235,21 @@ workqueue_entry_free_(workqueue_entry_t *ent)
  * This function will have no effect if the worker thread has already executed
  * or begun to execute the work item.  In that case, it will return NULL.
  */
-void *
-workqueue_entry_cancel(workqueue_entry_t *ent)
+MOCK_IMPL(void *,
+workqueue_entry_cancel,(workqueue_entry_t *ent))
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&thread->in_pool->n_pending[prio], 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -210,54 +257,117 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff <b>thread</b> has an update to run. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+worker_thread_has_update(workerthread_t *thread)
 {
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
-  }
-  return thread->generation != thread->in_pool->generation;
+  return thread->generation !=
+    atomic_counter_get(&thread->in_pool->generation);
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Return the priority from which <b>thread</b> should take its next
+ * piece of work, or -1 if no thread in the pool has any pending work.
  *
- * The caller must hold the lock. */
-static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+ * Usually this is the highest priority with any pending work.  But with a
+ * small probability, we keep looking for lower-priority work, so that we
+ * don't ignore our low-priority queues entirely. */
+static int
+worker_thread_choose_priority(workerthread_t *thread)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
+  int prio = -1;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
-      if (! tor_weak_random_one_in_n(&pool->weak_rng,
-                                     thread->lower_priority_chance)) {
-        /* Usually we'll just break now, so that we can get out of the loop
-         * and use the queue where we found work. But with a small
-         * probability, we'll keep looking for lower priority work, so that
-         * we don't ignore our low-priority queues entirely. */
-        break;
-      }
+    if (atomic_counter_get(&pool->n_pending[i]) == 0)
+      continue;
+    prio = i;
+    if (! tor_weak_random_one_in_n(&thread->weak_rng,
+                                   thread->lower_priority_chance)) {
+      break;
     }
   }
+  return prio;
+}
 
-  if (queue == NULL)
+/** Remove the first workqueue_entry_t from <b>victim</b>'s queue of
+ * priority <b>prio</b>, mark it as non-pending, and return it.  Return NULL
+ * if that queue is empty.
+ *
+ * The caller must hold victim's lock. */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *victim,
+                                workqueue_priority_t prio)
+{
+  work_tailq_t *queue = &victim->work[prio];
+  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
+  if (work == NULL)
     return NULL;
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
   TOR_TAILQ_REMOVE(queue, work, next_work);
+  atomic_counter_sub(&victim->in_pool->n_pending[prio], 1);
   work->pending = 0;
   return work;
 }
 
+/** Find the next workqueue_entry_t for <b>thread</b> to run: the oldest
+ * entry of the chosen priority on its own queues if there is one, or else
+ * the oldest one on another thread's.  Return NULL if there is no pending
+ * work anywhere in the pool. */
+static workqueue_entry_t *
+worker_thread_get_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int prio, i;
+
+  while ((prio = worker_thread_choose_priority(thread)) >= 0) {
+    /* Start with ourself, then look at the threads after us, so that idle
+     * threads don't all pile onto the same victim. */
+    for (i = 0; i < pool->n_threads; ++i) {
+      workerthread_t *victim =
+        pool->threads[(thread->index + i) % pool->n_threads];
+      tor_mutex_acquire(&victim->lock);
+      work = worker_thread_extract_next_work(victim, prio);
+      tor_mutex_release(&victim->lock);
+      if (work)
+        return work;
+    }
+    /* Another thread took the work we saw counted before we got to it, so
+     * look again. */
+  }
+  return NULL;
+}
+
+/** If <b>thread</b> is idle, wake it up and return 1.  Otherwise return 0.
+ *
+ * The caller must hold thread's lock. */
+static int
+worker_thread_wake_locked(workerthread_t *thread)
+{
+  if (!thread->idle)
+    return 0;
+  thread->idle = 0;
+  atomic_counter_sub(&thread->in_pool->n_idle, 1);
+  tor_cond_signal_one(&thread->condition);
+  return 1;
+}
+
+/** Run the update function of <b>thread</b>'s pool in <b>thread</b>, and
+ * return its result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  tor_mutex_acquire(&pool->lock);
+  void *arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -269,54 +379,54 @@ worker_thread_main(void *thread_)
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
-
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
-
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
+    if (worker_thread_has_update(thread)) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY)
         return;
+      continue;
+    }
+
+    work = worker_thread_get_work(thread);
+    if (!work) {
+      /* Say that we're idle before we look again, so that anybody who gives
+       * out work or an update after our second look will see that they need
+       * to wake us up. */
+      tor_mutex_acquire(&thread->lock);
+      thread->idle = 1;
+      atomic_counter_add(&pool->n_idle, 1);
+      tor_mutex_release(&thread->lock);
+
+      if (!worker_thread_has_update(thread))
+        work = worker_thread_get_work(thread);
+
+      tor_mutex_acquire(&thread->lock);
+      if (work || worker_thread_has_update(thread)) {
+        if (thread->idle) {
+          thread->idle = 0;
+          atomic_counter_sub(&pool->n_idle, 1);
+        }
+      } else {
+        /* Okay. Now, wait till somebody has work for us. */
+        while (thread->idle) {
+          if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+            log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+          }
+        }
       }
-      tor_mutex_acquire(&pool->lock);
+      tor_mutex_release(&thread->lock);
+      if (!work)
+        continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
+
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
@@ -326,38 +436,49 @@ worker_thread_main(void *thread_)
 static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
-  int was_empty;
+  workqueue_entry_t *head;
+#ifdef HAVE_WORKING_STDATOMIC
+  head = atomic_load(&queue->answers);
+  do {
+    work->next_reply = head;
+  } while (! atomic_compare_exchange_weak(&queue->answers, &head, work));
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
   tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  head = queue->answers;
+  work->next_reply = head;
+  queue->answers = work;
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
-  if (was_empty) {
+  /* The main thread takes every answer on the queue each time it wakes up,
+   * so we only need to wake it for the first answer in a batch. */
+  if (head == NULL) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  The thread isn't started until
+ * threadpool_start_threads() starts it. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i, seed;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  thr->generation = atomic_counter_get(&pool->generation);
+  crypto_rand((void*)&seed, sizeof(seed));
+  tor_init_weak_random(&thr->weak_rng, seed);
+  tor_mutex_init_for_cond(&thr->lock);
+  tor_cond_init(&thr->condition);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
   }
 
   return thr;
@@ -384,6 +505,8 @@ workerthread_new(int32_t lower_priority_chance,
  *
  * Note that because of priorities and thread behavior, work items may not
  * be executed strictly in order.
+ *
+ * Work must only be queued from the main thread.
  */
 workqueue_entry_t *
 threadpool_queue_work_priority(threadpool_t *pool,
@@ -396,17 +519,35 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread;
+  int woke, i;
   ent->on_pool = pool;
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  /* Spread the work over the threads' queues, so that busy threads don't
+   * all contend for one lock. */
+  thread = pool->threads[pool->next_thread];
+  pool->next_thread = (pool->next_thread + 1) % pool->n_threads;
+  ent->on_thread = thread;
+
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  atomic_counter_add(&pool->n_pending[prio], 1);
+  woke = worker_thread_wake_locked(thread);
+  tor_mutex_release(&thread->lock);
+
+  /* If that thread is busy, wake up some idle thread to steal the work.  We
+   * look at n_idle only after queueing the work: a thread that becomes idle
+   * after this point will find the work itself before it sleeps. */
+  for (i = 1; !woke && i < pool->n_threads &&
+         atomic_counter_get(&pool->n_idle) > 0; ++i) {
+    workerthread_t *other =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    tor_mutex_acquire(&other->lock);
+    woke = worker_thread_wake_locked(other);
+    tor_mutex_release(&other->lock);
+  }
 
   return ent;
 }
@@ -464,12 +605,17 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
-
-  tor_cond_signal_all(&pool->condition);
+  atomic_counter_add(&pool->generation, 1);
 
   tor_mutex_release(&pool->lock);
 
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    worker_thread_wake_locked(thread);
+    tor_mutex_release(&thread->lock);
+  }
+
   if (old_args) {
     for (i = 0; i < n_threads; ++i) {
       if (old_args[i] && old_args_free_fn)
@@ -492,43 +638,46 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch <b>n</b> threads.  Since the threads look at each other's queues
+ * without locking the pool, this can only be done once per pool.  On
+ * failure, some threads may already be running: the pool must not be
+ * freed. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
-  if (BUG(n < 0))
+  int i;
+  if (BUG(n < 1))
+    return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
-  tor_mutex_acquire(&pool->lock);
-
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
-  while (pool->n_threads < n) {
+  for (i = 0; i < n; ++i) {
     /* For half of our threads, we'll choose lower priorities permissively;
      * for the other half, we'll stick more strictly to higher priorities.
      * This keeps slow low-priority tasks from taking over completely. */
-    int32_t chance = (pool->n_threads & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
+    int32_t chance = (i & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
 
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = i;
+    pool->threads[i] = thr;
+  }
+  pool->n_threads = n;
 
-    if (!thr) {
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
-  tor_mutex_release(&pool->lock);
 
   return 0;
 }
@@ -548,18 +697,13 @@ threadpool_new(int n_threads,
                void *arg)
 {
   threadpool_t *pool;
+  int i;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
-  {
-    unsigned seed;
-    crypto_rand((void*)&seed, sizeof(seed));
-    tor_init_weak_random(&pool->weak_rng, seed);
-  }
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->generation);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i)
+    atomic_counter_init(&pool->n_pending[i]);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -569,9 +713,9 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
-    tor_mutex_uninit(&pool->lock);
-    tor_free(pool);
+    /* Some of the threads may already be running, and they look at the
+     * pool and at each other's queues, so we can't free any of it.  Nobody
+     * will ever give them work, so they just stay idle. */
     return NULL;
     //LCOV_EXCL_STOP
   }
@@ -603,8 +747,12 @@ replyqueue_new(uint32_t alertsocks_flags)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_init(&rq->answers, NULL);
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
   tor_mutex_init(&rq->lock);
-  TOR_TAILQ_INIT(&rq->answers);
+  rq->answers = NULL;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
   return rq;
 }
@@ -664,19 +812,32 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  /* Take every answer at once.  Any answer queued after this will wake us
+   * up again. */
+  workqueue_entry_t *work, *next, *batch = NULL;
+#ifdef HAVE_WORKING_STDATOMIC
+  work = atomic_exchange(&queue->answers, NULL);
+#else /* !(defined(HAVE_WORKING_STDATOMIC)) */
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  work = queue->answers;
+  queue->answers = NULL;
+  tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
+  /* The answers are newest-first; handle them in the order they arrived. */
+  while (work) {
+    next = work->next_reply;
+    work->next_reply = batch;
+    batch = work;
+    work = next;
+  }
+
+  while (batch) {
+    work = batch;
+    batch = work->next_reply;
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
@@ -10,6 +10,7 @@
 #define TOR_WORKQUEUE_H
 
 #include "lib/cc/torint.h"
+#include "lib/testsupport/testsupport.h"
 
 /** A replyqueue is used to tell the main thread about the outcome of
  * work that we queued for the workers. */
@@ -52,7 +53,8 @@ int threadpool_queue_update(threadpool_t *pool,
                             workqueue_reply_t (*fn)(void *, void *),
                             void (*free_fn)(void *),
                             void *arg);
-void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
+MOCK_DECL(void *, workqueue_entry_cancel,
+          (workqueue_entry_t *pending_work));
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
                              void *(*new_thread_state_fn)(void*),
@@ -13,14 +13,16 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip lookup tables are implemented as sorted arrays of address
+ * range starts, parallel to arrays of country indices; see geoip_table_t.
+ * The country objects are also indexed by their names in a hashtable.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
- * function.  For more information on the file format they read, see that
- * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * function, either by parsing a text file or by mapping a binary database
+ * that geoip_write_binary_file() generated from one.  For more information
+ * on the text format, see geoip_load_file().  See the scripts and the
+ * README file in src/config for more information about how the text files
+ * are generated.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -35,7 +37,9 @@
 #include "lib/crypt_ops/crypto_digest.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
+#include "lib/arch/bytes.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -47,22 +51,72 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 static void init_geoip_countries(void);
 
-/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
-typedef struct geoip_ipv4_entry_t {
-  uint32_t ip_low; /**< The lowest IP in the range, in host order */
-  uint32_t ip_high; /**< The highest IP in the range, in host order */
+/** Magic string at the start of a binary GeoIP database. */
+#define GEOIP_BIN_MAGIC "TORGEOIP"
+/** Length of GEOIP_BIN_MAGIC. */
+#define GEOIP_BIN_MAGIC_LEN 8
+/** Version of the binary GeoIP database format that we read and write. */
+#define GEOIP_BIN_VERSION 1
+
+/* Offsets of the fields in the header of a binary GeoIP database. All
+ * multi-byte integers in the database are in network order. */
+#define GEOIP_BIN_OFF_VERSION 8
+#define GEOIP_BIN_OFF_FAMILY 9
+#define GEOIP_BIN_OFF_N_COUNTRIES 10
+#define GEOIP_BIN_OFF_N_ENTRIES 12
+#define GEOIP_BIN_OFF_DIGEST 16
+#define GEOIP_BIN_OFF_SRC_SIZE (GEOIP_BIN_OFF_DIGEST + DIGEST_LEN)
+#define GEOIP_BIN_OFF_SRC_MTIME (GEOIP_BIN_OFF_SRC_SIZE + 8)
+#define GEOIP_BIN_HEADER_LEN (GEOIP_BIN_OFF_SRC_MTIME + 8)
+
+/** Length of one address in a GeoIP table for <b>family</b>. */
+#define GEOIP_ADDR_LEN(family) ((family) == AF_INET ? 4 : 16)
+
+/** An entry parsed from a GeoIP text file: maps an IPv4 or IPv6 range to a
+ * country.  These only live until we have built a geoip_table_t from them.
+ */
+typedef struct geoip_pending_entry_t {
+  uint8_t ip_low[16]; /**< The lowest IP in the range, in network order. */
+  uint8_t ip_high[16]; /**< The highest IP in the range, in network order. */
   intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv4_entry_t;
+} geoip_pending_entry_t;
 
-/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country. */
-typedef struct geoip_ipv6_entry_t {
-  struct in6_addr ip_low; /**< The lowest IP in the range, in host order */
-  struct in6_addr ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv6_entry_t;
+/** A GeoIP lookup table for one address family.
+ *
+ * The table is a binary GeoIP database image: a header, the two-letter
+ * codes of the countries it uses, and two parallel arrays.  The first array
+ * holds the start of every address range, in network order and strictly
+ * increasing; the second holds the index (into the image's own country list)
+ * of the country for each range.  Every range runs until the start of the
+ * next one, so gaps in the source data are stored as ranges mapping to the
+ * unknown country, and adjacent ranges with the same country are merged.
+ *
+ * The image is either built in memory from a text file or mapped directly
+ * from a binary file on disk. */
+typedef struct geoip_table_t {
+  /** Number of ranges in the table. */
+  uint32_t n_entries;
+  /** Array of n_entries range starts, GEOIP_ADDR_LEN bytes each. */
+  const uint8_t *starts;
+  /** Array of n_entries 2-byte country indices into country_map. */
+  const uint8_t *countries;
+  /** Map from the image's country indices to indices in geoip_countries. */
+  country_t *country_map;
+  /** The whole database image. */
+  const uint8_t *image;
+  /** Length of <b>image</b>. */
+  size_t image_len;
+  /** If the image was built in memory, the buffer holding it. */
+  uint8_t *image_buf;
+  /** If the image was mapped from disk, the mapping holding it. */
+  tor_mmap_t *map;
+} geoip_table_t;
 
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
@@ -70,9 +124,14 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
- * by their respective ip_low. */
-static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
+/** Lists of geoip_pending_entry_t that have been parsed, but not yet built
+ * into the IPv4 and IPv6 tables. */
+static smartlist_t *geoip_ipv4_pending = NULL, *geoip_ipv6_pending = NULL;
+/** True iff the corresponding pending list has changed since we last built
+ * a table from it. */
+static int geoip_ipv4_dirty = 0, geoip_ipv6_dirty = 0;
+/** The IPv4 and IPv6 lookup tables, or NULL if none is loaded. */
+static geoip_table_t *geoip_ipv4_table = NULL, *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
@@ -105,20 +164,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it to the list if we have not seen it before. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -135,19 +188,37 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  geoip_pending_entry_t *ent;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  ent = tor_malloc_zero(sizeof(geoip_pending_entry_t));
+  ent->country = geoip_get_or_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
-    geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
-    ent->ip_low = tor_addr_to_ipv4h(low);
-    ent->ip_high = tor_addr_to_ipv4h(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv4_entries, ent);
+    set_uint32(ent->ip_low, htonl(tor_addr_to_ipv4h(low)));
+    set_uint32(ent->ip_high, htonl(tor_addr_to_ipv4h(high)));
+    smartlist_add(geoip_ipv4_pending, ent);
+    geoip_ipv4_dirty = 1;
   } else if (tor_addr_family(low) == AF_INET6) {
-    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
-    ent->ip_low = *tor_addr_to_in6_assert(low);
-    ent->ip_high = *tor_addr_to_in6_assert(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv6_entries, ent);
+    memcpy(ent->ip_low, tor_addr_to_in6_assert(low)->s6_addr, 16);
+    memcpy(ent->ip_high, tor_addr_to_in6_assert(high)->s6_addr, 16);
+    smartlist_add(geoip_ipv6_pending, ent);
+    geoip_ipv6_dirty = 1;
+  } else {
+    tor_free(ent);
   }
 }
 
@@ -163,11 +234,15 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (!geoip_countries)
     init_geoip_countries();
   if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
-      geoip_ipv4_entries = smartlist_new();
+    if (!geoip_ipv4_pending) {
+      geoip_ipv4_pending = smartlist_new();
+      geoip_ipv4_dirty = 1;
+    }
   } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
-      geoip_ipv6_entries = smartlist_new();
+    if (!geoip_ipv6_pending) {
+      geoip_ipv6_pending = smartlist_new();
+      geoip_ipv6_dirty = 1;
+    }
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -220,62 +295,13 @@ geoip_parse_entry(const char *line, sa_family_t family)
   return -1;
 }
 
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv4_entry_t */
+/** Sorting helper: return -1, 1, or 0 based on comparison of the low ends
+ * of two geoip_pending_entry_t. */
 static int
-geoip_ipv4_compare_entries_(const void **_a, const void **_b)
+geoip_compare_pending_entries_(const void **_a, const void **_b)
 {
-  const geoip_ipv4_entry_t *a = *_a, *b = *_b;
-  if (a->ip_low < b->ip_low)
-    return -1;
-  else if (a->ip_low > b->ip_low)
-    return 1;
-  else
-    return 0;
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_entries_(const void **_a, const void **_b)
-{
-  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
-  return fast_memcmp(a->ip_low.s6_addr, b->ip_low.s6_addr,
-                     sizeof(struct in6_addr));
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
+  const geoip_pending_entry_t *a = *_a, *b = *_b;
+  return fast_memcmp(a->ip_low, b->ip_low, sizeof(a->ip_low));
 }
 
 /** Set up a new list of geoip countries with no countries (yet) set in it,
@@ -296,10 +322,304 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Release all storage held by <b>table</b>. */
+static void
+geoip_table_free_(geoip_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->country_map);
+  tor_free(table->image_buf);
+  if (table->map)
+    tor_munmap_file(table->map);
+  tor_free(table);
+}
+#define geoip_table_free(t) \
+  FREE_AND_NULL(geoip_table_t, geoip_table_free_, (t))
+
+/** Release all the geoip_pending_entry_t in *<b>lst</b>, and the list
+ * itself. */
+static void
+geoip_pending_free(smartlist_t **lst)
+{
+  if (!*lst)
+    return;
+  SMARTLIST_FOREACH(*lst, geoip_pending_entry_t *, e, tor_free(e));
+  smartlist_free(*lst);
+  *lst = NULL;
+}
+
+/** Add one to the <b>len</b>-byte network-order address <b>addr</b>.
+ * Return 0 on success, or -1 if it wrapped around to zero. */
+static int
+geoip_addr_incr(uint8_t *addr, size_t len)
+{
+  while (len--) {
+    if (++addr[len] != 0)
+      return 0;
+  }
+  return -1;
+}
+
+/** Check that <b>image</b> of length <b>len</b> is a well-formed binary
+ * GeoIP database for <b>family</b>.  On success, return a new
+ * geoip_table_t pointing into <b>image</b> (but not owning it), and
+ * register any countries it uses.  On failure, return NULL. */
+static geoip_table_t *
+geoip_table_from_image(sa_family_t family, const uint8_t *image, size_t len)
+{
+  const size_t alen = GEOIP_ADDR_LEN(family);
+  geoip_table_t *table = NULL;
+  unsigned n_countries;
+  uint32_t n_entries, i;
+  uint64_t expected_len;
+
+  if (len < GEOIP_BIN_HEADER_LEN ||
+      tor_memneq(image, GEOIP_BIN_MAGIC, GEOIP_BIN_MAGIC_LEN) ||
+      image[GEOIP_BIN_OFF_VERSION] != GEOIP_BIN_VERSION ||
+      image[GEOIP_BIN_OFF_FAMILY] != (family == AF_INET ? 4 : 6))
+    return NULL;
+
+  n_countries = ntohs(get_uint16(image + GEOIP_BIN_OFF_N_COUNTRIES));
+  n_entries = ntohl(get_uint32(image + GEOIP_BIN_OFF_N_ENTRIES));
+  expected_len = GEOIP_BIN_HEADER_LEN + 2 * (uint64_t)n_countries +
+    (alen + 2) * (uint64_t)n_entries;
+  if (n_countries == 0 || expected_len != len)
+    return NULL;
+
+  table = tor_malloc_zero(sizeof(geoip_table_t));
+  table->image = image;
+  table->image_len = len;
+  table->n_entries = n_entries;
+  table->starts = image + GEOIP_BIN_HEADER_LEN + 2 * n_countries;
+  table->countries = table->starts + alen * n_entries;
+
+  for (i = 1; i < n_entries; ++i) {
+    if (fast_memcmp(table->starts + alen * (i-1),
+                    table->starts + alen * i, alen) >= 0)
+      goto err;
+  }
+  for (i = 0; i < n_entries; ++i) {
+    if (ntohs(get_uint16(table->countries + 2 * i)) >= n_countries)
+      goto err;
+  }
+
+  table->country_map = tor_calloc(n_countries, sizeof(country_t));
+  for (i = 0; i < n_countries; ++i) {
+    char cc[3];
+    memcpy(cc, image + GEOIP_BIN_HEADER_LEN + 2 * i, 2);
+    cc[2] = '\0';
+    if (strlen(cc) != 2)
+      goto err;
+    table->country_map[i] = (country_t) geoip_get_or_add_country(cc);
+  }
+
+  return table;
+ err:
+  geoip_table_free(table);
+  return NULL;
+}
+
+/** Build a binary GeoIP database image for <b>family</b> out of the
+ * geoip_pending_entry_t in <b>pending</b>, recording <b>digest</b>,
+ * <b>src_size</b> and <b>src_mtime</b> as the digest, size and
+ * modification time of the text file they came from.  Set *<b>len_out</b>
+ * to the length of the image, and return it. */
+static uint8_t *
+geoip_build_image(sa_family_t family, smartlist_t *pending,
+                  const char *digest, uint64_t src_size, uint64_t src_mtime,
+                  size_t *len_out)
+{
+  const size_t alen = GEOIP_ADDR_LEN(family);
+  const int n_countries = smartlist_len(geoip_countries);
+  const size_t max_entries = 2 * (size_t)smartlist_len(pending) + 1;
+  uint8_t *starts = tor_malloc(alen * max_entries);
+  uint16_t *countries = tor_calloc(max_entries, sizeof(uint16_t));
+  uint8_t next[16];
+  int have_prev = 0, next_valid = 0;
+  uint32_t n = 0, i;
+  uint8_t *image, *cp;
+  size_t len;
+
+  tor_assert(n_countries <= UINT16_MAX);
+
+  /* Append a range starting at <b>a</b> and mapping to <b>c</b>, unless it
+   * just continues the previous range. */
+#define ADD_RANGE(a, c) STMT_BEGIN                              \
+    if (n == 0 || countries[n-1] != (c)) {                      \
+      memcpy(starts + alen * n, (a), alen);                     \
+      countries[n++] = (c);                                     \
+    }                                                           \
+  STMT_END
+
+  smartlist_sort(pending, geoip_compare_pending_entries_);
+  SMARTLIST_FOREACH_BEGIN(pending, const geoip_pending_entry_t *, ent) {
+    const uint8_t *start = ent->ip_low;
+    if (have_prev) {
+      /* The previous range went to the end of the address space. */
+      if (!next_valid)
+        break;
+      if (fast_memcmp(start, next, alen) < 0) {
+        /* Overlapping ranges: the earlier one wins. */
+        if (fast_memcmp(ent->ip_high, next, alen) < 0)
+          continue;
+        start = next;
+      } else if (fast_memcmp(start, next, alen) > 0) {
+        ADD_RANGE(next, 0);
+      }
+    }
+    ADD_RANGE(start, (uint16_t)ent->country);
+    memcpy(next, ent->ip_high, alen);
+    next_valid = geoip_addr_incr(next, alen) == 0;
+    have_prev = 1;
+  } SMARTLIST_FOREACH_END(ent);
+  if (have_prev && next_valid)
+    ADD_RANGE(next, 0);
+#undef ADD_RANGE
+
+  len = GEOIP_BIN_HEADER_LEN + 2 * n_countries + (alen + 2) * n;
+  cp = image = tor_malloc_zero(len);
+  memcpy(cp, GEOIP_BIN_MAGIC, GEOIP_BIN_MAGIC_LEN);
+  cp[GEOIP_BIN_OFF_VERSION] = GEOIP_BIN_VERSION;
+  cp[GEOIP_BIN_OFF_FAMILY] = family == AF_INET ? 4 : 6;
+  set_uint16(cp + GEOIP_BIN_OFF_N_COUNTRIES, htons((uint16_t)n_countries));
+  set_uint32(cp + GEOIP_BIN_OFF_N_ENTRIES, htonl(n));
+  memcpy(cp + GEOIP_BIN_OFF_DIGEST, digest, DIGEST_LEN);
+  set_uint64(cp + GEOIP_BIN_OFF_SRC_SIZE, tor_htonll(src_size));
+  set_uint64(cp + GEOIP_BIN_OFF_SRC_MTIME, tor_htonll(src_mtime));
+  cp += GEOIP_BIN_HEADER_LEN;
+  SMARTLIST_FOREACH_BEGIN(geoip_countries, const geoip_country_t *, c) {
+    memcpy(cp, c->countrycode, 2);
+    cp += 2;
+  } SMARTLIST_FOREACH_END(c);
+  memcpy(cp, starts, alen * n);
+  cp += alen * n;
+  for (i = 0; i < n; ++i) {
+    set_uint16(cp, htons(countries[i]));
+    cp += 2;
+  }
+  tor_assert(cp == image + len);
+
+  tor_free(starts);
+  tor_free(countries);
+  *len_out = len;
+  return image;
+}
+
+/** Make <b>table</b> the GeoIP table for <b>family</b>, replacing any
+ * existing one, and remember the source file digest recorded in it. */
+static void
+geoip_set_table(sa_family_t family, geoip_table_t *table)
+{
+  const uint8_t *digest = table->image + GEOIP_BIN_OFF_DIGEST;
+  if (family == AF_INET) {
+    geoip_table_free(geoip_ipv4_table);
+    geoip_ipv4_table = table;
+    memcpy(geoip_digest, digest, DIGEST_LEN);
+  } else {
+    geoip_table_free(geoip_ipv6_table);
+    geoip_ipv6_table = table;
+    memcpy(geoip6_digest, digest, DIGEST_LEN);
+  }
+}
+
+/** Build the GeoIP table for <b>family</b> from its pending entries, using
+ * the source file properties as for geoip_build_image(). */
+static void
+geoip_build_table(sa_family_t family, const char *digest,
+                  uint64_t src_size, uint64_t src_mtime)
+{
+  smartlist_t *pending;
+  geoip_table_t *table;
+  uint8_t *image;
+  size_t len;
+
+  pending = family == AF_INET ? geoip_ipv4_pending : geoip_ipv6_pending;
+  tor_assert(pending);
+  image = geoip_build_image(family, pending, digest, src_size, src_mtime,
+                            &len);
+  table = geoip_table_from_image(family, image, len);
+  tor_assert(table);
+  table->image_buf = image;
+  geoip_set_table(family, table);
+  if (family == AF_INET)
+    geoip_ipv4_dirty = 0;
+  else
+    geoip_ipv6_dirty = 0;
+}
+
+/** Return the current GeoIP table for <b>family</b>, building it first if
+ * entries have been added since it was last built.  Return NULL if no
+ * GeoIP information is available for <b>family</b>. */
+static const geoip_table_t *
+geoip_get_table(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_dirty)
+      geoip_build_table(AF_INET, geoip_digest, 0, 0);
+    return geoip_ipv4_table;
+  } else {
+    if (geoip_ipv6_dirty)
+      geoip_build_table(AF_INET6, geoip6_digest, 0, 0);
+    return geoip_ipv6_table;
+  }
+}
+
+/** Try to map <b>filename</b> as a binary GeoIP database for <b>family</b>.
+ * If <b>src_size</b> or <b>src_mtime</b> is nonzero, the database must have
+ * been built from a text file with that size or modification time.  On
+ * success, replace the current table for <b>family</b> and return 0.  On
+ * failure, return -1 and leave the current table alone. */
+static int
+geoip_load_binary_file(sa_family_t family, const char *filename,
+                       uint64_t src_size, uint64_t src_mtime, int severity)
+{
+  tor_mmap_t *map;
+  geoip_table_t *table;
+  const uint8_t *image;
+
+  if (!(map = tor_mmap_file(filename)))
+    return -1;
+  image = (const uint8_t *) map->data;
+  if (map->size >= GEOIP_BIN_HEADER_LEN &&
+      ((src_size && src_size !=
+        tor_ntohll(get_uint64(image + GEOIP_BIN_OFF_SRC_SIZE))) ||
+       (src_mtime && src_mtime !=
+        tor_ntohll(get_uint64(image + GEOIP_BIN_OFF_SRC_MTIME))))) {
+    log_info(LD_GENERAL, "Binary GEOIP file %s is out of date.", filename);
+    tor_munmap_file(map);
+    return -1;
+  }
+  if (!(table = geoip_table_from_image(family, image, map->size))) {
+    log_fn(severity, LD_GENERAL, "Binary GEOIP file %s is malformed.",
+           filename);
+    tor_munmap_file(map);
+    return -1;
+  }
+  table->map = map;
+
+  if (family == AF_INET) {
+    geoip_pending_free(&geoip_ipv4_pending);
+    geoip_ipv4_dirty = 0;
+  } else {
+    geoip_pending_free(&geoip_ipv6_pending);
+    geoip_ipv6_dirty = 0;
+  }
+  geoip_set_table(family, table);
+  log_notice(LD_GENERAL, "Mapped binary GEOIP %s file %s (%u ranges).",
+             (family == AF_INET) ? "IPv4" : "IPv6", filename,
+             (unsigned) table->n_entries);
+  return 0;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
  *
+ * The file may be a binary database, as written by
+ * geoip_write_binary_file(), in which case we map it into memory and use it
+ * as it is.  Otherwise, it is a text file.
+ *
  * Recognized line formats for IPv4 are:
  *   INTIPLOW,INTIPHIGH,CC
  * and
@@ -319,6 +639,10 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
   crypto_digest_t *geoip_digest_env = NULL;
+  char magic[GEOIP_BIN_MAGIC_LEN];
+  char digest[DIGEST_LEN];
+  uint64_t src_size = 0, src_mtime = 0;
+  struct stat st;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -330,20 +654,23 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   if (!geoip_countries)
     init_geoip_countries();
 
+  if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+      fast_memeq(magic, GEOIP_BIN_MAGIC, GEOIP_BIN_MAGIC_LEN)) {
+    fclose(f);
+    return geoip_load_binary_file(family, filename, 0, 0, severity);
+  }
+  rewind(f);
+  if (fstat(fileno(f), &st) == 0) {
+    src_size = (uint64_t) st.st_size;
+    src_mtime = (uint64_t) st.st_mtime;
+  }
+
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
-    geoip_ipv4_entries = smartlist_new();
+    geoip_pending_free(&geoip_ipv4_pending);
+    geoip_ipv4_pending = smartlist_new();
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
-    geoip_ipv6_entries = smartlist_new();
+    geoip_pending_free(&geoip_ipv6_pending);
+    geoip_ipv6_pending = smartlist_new();
   }
   geoip_digest_env = crypto_digest_new();
 
@@ -360,21 +687,76 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
-  if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  } else {
-    /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
-  }
+  /* Build the lookup table, remembering the file digest so that we can
+   * include it in our extra-info descriptors.  We don't need the parsed
+   * entries any more once the table is built. */
+  crypto_digest_get_digest(geoip_digest_env, digest, DIGEST_LEN);
   crypto_digest_free(geoip_digest_env);
+  geoip_build_table(family, digest, src_size, src_mtime);
+  if (family == AF_INET)
+    geoip_pending_free(&geoip_ipv4_pending);
+  else
+    geoip_pending_free(&geoip_ipv6_pending);
+
+  return 0;
+}
+
+/** As geoip_load_file(), but first try to map the binary database
+ * <b>cache_fname</b>, provided that it was built from the current version
+ * of <b>filename</b>.  If we have to parse <b>filename</b> instead, write
+ * the resulting database to <b>cache_fname</b> for next time. */
+int
+geoip_load_file_with_cache(sa_family_t family, const char *filename,
+                           const char *cache_fname, int severity)
+{
+  struct stat st;
+  const geoip_table_t *table;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+
+  if (stat(filename, &st) == 0 && st.st_size > 0 && st.st_mtime > 0) {
+    if (!geoip_countries)
+      init_geoip_countries();
+    if (geoip_load_binary_file(family, cache_fname, (uint64_t) st.st_size,
+                               (uint64_t) st.st_mtime, LOG_INFO) == 0)
+      return 0;
+  }
+
+  if (geoip_load_file(family, filename, severity) < 0)
+    return -1;
 
+  table = geoip_get_table(family);
+  if (table && !table->map) {
+    if (geoip_write_binary_file(family, cache_fname) < 0)
+      log_info(LD_GENERAL, "Couldn't write binary GEOIP file %s.",
+               cache_fname);
+  }
   return 0;
 }
 
+/** Write the current GeoIP table for <b>family</b> to <b>filename</b> as
+ * a binary database that geoip_load_file() can map directly.  Return 0 on
+ * success, -1 on failure. */
+int
+geoip_write_binary_file(sa_family_t family, const char *filename)
+{
+  const geoip_table_t *table;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+  if (!(table = geoip_get_table(family)))
+    return -1;
+  return write_bytes_to_file(filename, (const char *) table->image,
+                             table->image_len, 1);
+}
+
+/** Return the country index (into geoip_countries) of the <b>idx</b>th
+ * range in <b>table</b>. */
+static inline int
+geoip_table_country(const geoip_table_t *table, uint32_t idx)
+{
+  return table->country_map[ntohs(get_uint16(table->countries + 2 * idx))];
+}
+
 /** Given an IP address in host order, return a number representing the
  * country to which that address belongs, -1 for "No geoip information
  * available", or 0 for the 'unknown country'.  The return value will always
@@ -384,12 +766,28 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  const geoip_table_t *table = geoip_get_table(AF_INET);
+  const uint8_t *starts;
+  uint32_t base = 0, n;
+
+  if (!table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (table->n_entries == 0)
+    return 0;
+  /* Find the last range starting at or before ipaddr.  The loop always
+   * runs the same number of times for a given table, and its body compiles
+   * to a conditional move rather than a branch. */
+  starts = table->starts;
+  n = table->n_entries;
+  while (n > 1) {
+    uint32_t half = n / 2;
+    if (ntohl(get_uint32(starts + 4 * (base + half))) <= ipaddr)
+      base += half;
+    n -= half;
+  }
+  if (ntohl(get_uint32(starts + 4 * base)) > ipaddr)
+    return 0;
+  return geoip_table_country(table, base);
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -400,13 +798,26 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
+  const geoip_table_t *table = geoip_get_table(AF_INET6);
+  const uint8_t *starts;
+  uint32_t base = 0, n;
 
-  if (!geoip_ipv6_entries)
+  if (!table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (table->n_entries == 0)
+    return 0;
+  /* As in geoip_get_country_by_ipv4(). */
+  starts = table->starts;
+  n = table->n_entries;
+  while (n > 1) {
+    uint32_t half = n / 2;
+    if (fast_memcmp(starts + 16 * (base + half), addr->s6_addr, 16) <= 0)
+      base += half;
+    n -= half;
+  }
+  if (fast_memcmp(starts + 16 * base, addr->s6_addr, 16) > 0)
+    return 0;
+  return geoip_table_country(table, base);
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -455,9 +866,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL || geoip_ipv4_pending != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL || geoip_ipv6_pending != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -483,20 +894,13 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_pending_free(&geoip_ipv4_pending);
+  geoip_pending_free(&geoip_ipv6_pending);
+  geoip_table_free(geoip_ipv4_table);
+  geoip_table_free(geoip_ipv6_table);
+  geoip_ipv4_dirty = geoip_ipv6_dirty = 0;
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -535,7 +535,10 @@ tor_addr_to_PTR_name(char *out, size_t outlen,
  *  If 'flags & TAPMP_EXTENDED_STAR' and 'flags & TAPMP_STAR_IPV6_ONLY' are
  *  both true, then the wildcard address '*' yields an IPv6 wildcard.
  *
- * TAPMP_STAR_IPV4_ONLY and TAPMP_STAR_IPV6_ONLY are mutually exclusive. */
+ * TAPMP_STAR_IPV4_ONLY and TAPMP_STAR_IPV6_ONLY are mutually exclusive.
+ *
+ * This function is called while parsing microdescriptors in worker
+ * threads, so it must not use escaped() or fmt_addr(). */
 int
 tor_addr_parse_mask_ports(const char *s,
                           unsigned flags,
@@ -562,7 +565,9 @@ tor_addr_parse_mask_ports(const char *s,
 #define MAX_ADDRESS_LENGTH (TOR_ADDR_BUF_LEN+2+(1+INET_NTOA_BUF_LEN)+12+1)
 
   if (strlen(s) > MAX_ADDRESS_LENGTH) {
-    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", escaped(s));
+    char *esc = esc_for_log(s);
+    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", esc);
+    tor_free(esc);
     goto err;
   }
   base = tor_strdup(s);
@@ -637,8 +642,10 @@ tor_addr_parse_mask_ports(const char *s,
     family = AF_INET;
     tor_addr_from_in(addr_out, &in_tmp);
   } else {
+    char *esc = esc_for_log(address);
     log_warn(LD_GENERAL, "Malformed IP %s in address pattern; rejecting.",
-             escaped(address));
+             esc);
+    tor_free(esc);
     goto err;
   }
 
@@ -663,15 +670,18 @@ tor_addr_parse_mask_ports(const char *s,
         if (tor_inet_pton(AF_INET, mask, &v4mask) > 0) {
           bits = addr_mask_get_bits(ntohl(v4mask.s_addr));
           if (bits < 0) {
+            char *esc = esc_for_log(mask);
             log_warn(LD_GENERAL,
                      "IPv4-style mask %s is not a prefix address; rejecting.",
-                     escaped(mask));
+                     esc);
+            tor_free(esc);
             goto err;
           }
         } else { /* Not IPv4; we don't do address-style IPv6 masks. */
+          char *esc = esc_for_log(s);
           log_warn(LD_GENERAL,
-                   "Malformed mask on address range %s; rejecting.",
-                   escaped(s));
+                   "Malformed mask on address range %s; rejecting.", esc);
+          tor_free(esc);
           goto err;
         }
       }
@@ -701,8 +711,10 @@ tor_addr_parse_mask_ports(const char *s,
     *maskbits_out = (maskbits_t) bits;
   } else {
     if (mask) {
+      char *esc = esc_for_log(s);
       log_warn(LD_GENERAL,
-               "Unexpected mask in address %s; rejecting", escaped(s));
+               "Unexpected mask in address %s; rejecting", esc);
+      tor_free(esc);
       goto err;
     }
   }
@@ -724,8 +736,10 @@ tor_addr_parse_mask_ports(const char *s,
     }
   } else {
     if (port) {
+      char *esc = esc_for_log(s);
       log_warn(LD_GENERAL,
-               "Unexpected ports in address %s; rejecting", escaped(s));
+               "Unexpected ports in address %s; rejecting", esc);
+      tor_free(esc);
       goto err;
     }
   }
@@ -1824,6 +1838,7 @@ addr_mask_get_bits(uint32_t mask)
 
 /** Parse a string <b>s</b> in the format of (*|port(-maxport)?)?, setting the
  * various *out pointers as appropriate.  Return 0 on success, -1 on failure.
+ * Like tor_addr_parse_mask_ports(), this must not use escaped().
  */
 int
 parse_port_range(const char *port, uint16_t *port_min_out,
@@ -1840,18 +1855,20 @@ parse_port_range(const char *port, uint16_t *port_min_out,
     char *endptr = NULL;
     port_min = (int)tor_parse_long(port, 10, 0, 65535, &ok, &endptr);
     if (!ok) {
+      char *esc = esc_for_log(port);
       log_warn(LD_GENERAL,
-               "Malformed port %s on address range; rejecting.",
-               escaped(port));
+               "Malformed port %s on address range; rejecting.", esc);
+      tor_free(esc);
       return -1;
     } else if (endptr && *endptr == '-') {
       port = endptr+1;
       endptr = NULL;
       port_max = (int)tor_parse_long(port, 10, 1, 65535, &ok, &endptr);
       if (!ok) {
+        char *esc = esc_for_log(port);
         log_warn(LD_GENERAL,
-                 "Malformed port %s on address range; rejecting.",
-                 escaped(port));
+                 "Malformed port %s on address range; rejecting.", esc);
+        tor_free(esc);
         return -1;
       }
     } else {
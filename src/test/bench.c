@@ -23,6 +23,8 @@
 #endif
 
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
@@ -552,6 +554,58 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+static void
+bench_cmux_ewma(void)
+{
+  const int iters = 1<<20;
+  const int n_circs_list[] = { 16, 1000, 10000, 50000 };
+  unsigned i;
+  int j;
+  uint64_t start, end;
+  /* The policy only uses the cmux and circuit pointers as identifiers. */
+  circuitmux_t *cmux = (circuitmux_t *) tor_malloc_zero(1);
+
+  cmux_ewma_set_options(NULL, NULL);
+
+  for (i = 0; i < ARRAY_LENGTH(n_circs_list); ++i) {
+    const int n_circs = n_circs_list[i];
+    circuitmux_policy_data_t *pol_data = ewma_policy.alloc_cmux_data(cmux);
+    circuit_t **circs = tor_calloc(n_circs, sizeof(circuit_t *));
+    circuitmux_policy_circ_data_t **cdata =
+      tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+
+    for (j = 0; j < n_circs; ++j) {
+      circs[j] = tor_malloc_zero(sizeof(circuit_t));
+      /* Remember where this circuit's policy data lives. */
+      circs[j]->n_circ_id = j;
+      cdata[j] = ewma_policy.alloc_circ_data(cmux, pol_data, circs[j],
+                                             CELL_DIRECTION_OUT, 1);
+      ewma_policy.notify_circ_active(cmux, pol_data, circs[j], cdata[j]);
+    }
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < iters; ++j) {
+      circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol_data);
+      ewma_policy.notify_xmit_cells(cmux, pol_data, circ,
+                                    cdata[circ->n_circ_id], 1);
+    }
+    end = perftime();
+    printf("%d active circuits: %.2f ns per pick and transmit\n",
+           n_circs, NANOCOUNT(start, end, iters));
+
+    for (j = 0; j < n_circs; ++j) {
+      ewma_policy.notify_circ_inactive(cmux, pol_data, circs[j], cdata[j]);
+      ewma_policy.free_circ_data(cmux, pol_data, circs[j], cdata[j]);
+      tor_free(circs[j]);
+    }
+    ewma_policy.free_cmux_data(cmux, pol_data);
+    tor_free(circs);
+    tor_free(cdata);
+  }
+  tor_free(cmux);
+}
+
 static void
 bench_dh(void)
 {
@@ -660,6 +714,7 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cmux_ewma),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -34,6 +34,7 @@
 #define CIRCUITLIST_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
+#define CPUWORKER_PRIVATE
 
 #include "core/or/or.h"
 #include "lib/err/backtrace.h"
@@ -64,6 +65,11 @@
 #include "feature/rend/rend_intro_point_st.h"
 #include "feature/rend/rend_service_descriptor_st.h"
 #include "feature/relay/onion_queue.h"
+#include "core/mainloop/cpuworker.h"
+#include "lib/evloop/workqueue.h"
+#include "core/or/channel.h"
+#include "core/or/connection_or.h"
+#include "test/fakechans.h"
 
 /** Run unit tests for the onion handshake code. */
 static void
@@ -354,6 +360,418 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+static create_cell_t *
+new_ntor_create_cell(void)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  return cc;
+}
+
+/** Identity digest that mock_connection_or_digest_is_known_relay()
+ * recognises. */
+static char known_relay_digest[DIGEST_LEN];
+
+static int
+mock_connection_or_digest_is_known_relay(const char *id_digest)
+{
+  return tor_memeq(id_digest, known_relay_digest, DIGEST_LEN);
+}
+
+static void
+test_onion_queue_priority(void *arg)
+{
+  channel_t *relay_chan = new_fake_channel();
+  or_circuit_t *circ_a = or_circuit_new(0, NULL);
+  or_circuit_t *circ_b = or_circuit_new(0, NULL);
+  or_circuit_t *circ_c = or_circuit_new(0, NULL);
+  or_circuit_t *circ_d = or_circuit_new(0, NULL);
+  create_cell_t *onionskin = NULL;
+  (void)arg;
+
+  MOCK(connection_or_digest_is_known_relay,
+       mock_connection_or_digest_is_known_relay);
+  memset(known_relay_digest, 'R', DIGEST_LEN);
+  memcpy(relay_chan->identity_digest, known_relay_digest, DIGEST_LEN);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(10) * 1000000000);
+  get_options_mutable()->MaxOnionQueueDelay = 1000;
+
+  /* circ_a comes from a client; the others from a known relay. */
+  tt_assert(! channel_is_client(relay_chan));
+  circ_b->p_chan = circ_c->p_chan = circ_d->p_chan = relay_chan;
+
+  /* A relay's request overtakes a client's that arrived a little earlier. */
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_a, new_ntor_create_cell()));
+  monotime_coarse_set_mock_time_nsec(INT64_C(10100) * 1000000);
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_b, new_ntor_create_cell()));
+  tt_int_op(2, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_ptr_op(circ_b, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+
+  /* ... but not one that has been waiting for a long time. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(10600) * 1000000);
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_b, new_ntor_create_cell()));
+  tt_ptr_op(circ_a, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_ptr_op(circ_b, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* Past MaxOnionQueueDelay, a client's request is dropped; a relay's
+   * request is still worth answering. */
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_a, new_ntor_create_cell()));
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_c, new_ntor_create_cell()));
+  /* Keep the culled circuit out of the real close machinery. */
+  TO_CIRCUIT(circ_a)->marked_for_close = 1;
+  monotime_coarse_set_mock_time_nsec(INT64_C(11700) * 1000000);
+  tt_ptr_op(circ_c, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_ptr_op(NULL, OP_EQ, circ_a->onionqueue_entry);
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* Even a relay's request expires eventually. */
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_d, new_ntor_create_cell()));
+  TO_CIRCUIT(circ_d)->marked_for_close = 1;
+  monotime_coarse_set_mock_time_nsec(INT64_C(17000) * 1000000);
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  tor_free(onionskin);
+  circ_b->p_chan = circ_c->p_chan = circ_d->p_chan = NULL;
+  circuit_free_(TO_CIRCUIT(circ_a));
+  circuit_free_(TO_CIRCUIT(circ_b));
+  circuit_free_(TO_CIRCUIT(circ_c));
+  circuit_free_(TO_CIRCUIT(circ_d));
+  free_fake_channel(relay_chan);
+  monotime_disable_test_mocking();
+  UNMOCK(connection_or_digest_is_known_relay);
+}
+
+static void
+test_onion_queue_unknown_relay(void *arg)
+{
+  channel_t *client_chan = new_fake_channel();
+  channel_t *unknown_chan = new_fake_channel();
+  or_circuit_t *circ_a = or_circuit_new(0, NULL);
+  or_circuit_t *circ_b = or_circuit_new(0, NULL);
+  create_cell_t *onionskin = NULL;
+  (void)arg;
+
+  MOCK(connection_or_digest_is_known_relay,
+       mock_connection_or_digest_is_known_relay);
+  memset(known_relay_digest, 'R', DIGEST_LEN);
+  memset(unknown_chan->identity_digest, 'X', DIGEST_LEN);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(10) * 1000000000);
+  get_options_mutable()->MaxOnionQueueDelay = 1000;
+
+  /* circ_b's peer authenticated with an identity key, but not one that
+   * belongs to any relay we know of: it gets no better treatment than a
+   * client. */
+  channel_mark_client(client_chan);
+  tt_assert(! channel_is_client(unknown_chan));
+  circ_a->p_chan = client_chan;
+  circ_b->p_chan = unknown_chan;
+
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_a, new_ntor_create_cell()));
+  monotime_coarse_set_mock_time_nsec(INT64_C(10100) * 1000000);
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_b, new_ntor_create_cell()));
+  tt_ptr_op(circ_a, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_ptr_op(circ_b, OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+
+  /* It is also dropped as soon as MaxOnionQueueDelay has passed. */
+  tt_int_op(0, OP_EQ, onion_pending_add(circ_b, new_ntor_create_cell()));
+  TO_CIRCUIT(circ_b)->marked_for_close = 1;
+  monotime_coarse_set_mock_time_nsec(INT64_C(11200) * 1000000);
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+  tt_ptr_op(NULL, OP_EQ, circ_b->onionqueue_entry);
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  tor_free(onionskin);
+  circ_a->p_chan = circ_b->p_chan = NULL;
+  circuit_free_(TO_CIRCUIT(circ_a));
+  circuit_free_(TO_CIRCUIT(circ_b));
+  free_fake_channel(client_chan);
+  free_fake_channel(unknown_chan);
+  monotime_disable_test_mocking();
+  UNMOCK(connection_or_digest_is_known_relay);
+}
+
+static void
+test_onion_queue_latency_hist(void *arg)
+{
+  uint64_t q;
+  int i;
+  (void)arg;
+
+  onionskin_hist_clear();
+
+  /* Without enough samples, fall back to the mean-based estimate. */
+  for (i = 0; i < 50; ++i)
+    onionskin_hist_note(ONION_HANDSHAKE_TYPE_NTOR, 1000);
+  tt_u64_op(estimated_usec_for_onionskins(1, ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ,
+            estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR,
+                                                  50));
+
+  for (i = 0; i < 50; ++i)
+    onionskin_hist_note(ONION_HANDSHAKE_TYPE_NTOR, 1000);
+  for (i = 0; i < 10; ++i)
+    onionskin_hist_note(ONION_HANDSHAKE_TYPE_NTOR, 100000);
+
+  /* The median is a fast handshake; the tail is a slow one. */
+  q = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR, 50);
+  tt_u64_op(q, OP_GE, 512);
+  tt_u64_op(q, OP_LT, 1024);
+  q = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR, 95);
+  tt_u64_op(q, OP_GE, 65536);
+  tt_u64_op(q, OP_LT, 131072);
+  q = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR, 100);
+  tt_u64_op(q, OP_EQ, 131072);
+
+  /* Old samples decay away once the histogram fills up. */
+  for (i = 0; i < 4096; ++i)
+    onionskin_hist_note(ONION_HANDSHAKE_TYPE_NTOR, 1000);
+  q = estimated_usec_quantile_for_onionskin(ONION_HANDSHAKE_TYPE_NTOR, 99);
+  tt_u64_op(q, OP_LT, 1024);
+
+ done:
+  onionskin_hist_clear();
+}
+
+/* Machinery for the cpuworker batching tests: a pretend threadpool that
+ * remembers what was queued on it, and never runs anything. */
+
+/** A piece of work queued on the pretend threadpool. */
+typedef struct fake_queued_work_t {
+  void (*reply_fn)(void *);
+  void *arg;
+  /** True iff this work has been cancelled. */
+  int cancelled;
+} fake_queued_work_t;
+
+/** Every fake_queued_work_t we've queued, in order. */
+static smartlist_t *fake_queued = NULL;
+/** Every circuit that has been marked for close. */
+static smartlist_t *closed_circs = NULL;
+
+static int
+mock_cpuworker_is_running(void)
+{
+  return 1;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  fake_queued_work_t *w = tor_malloc_zero(sizeof(*w));
+  (void)priority;
+  (void)fn;
+  w->reply_fn = reply_fn;
+  w->arg = arg;
+  smartlist_add(fake_queued, w);
+  /* Only workqueue.c looks inside a workqueue_entry_t. */
+  return (workqueue_entry_t *)w;
+}
+
+static void *
+mock_workqueue_entry_cancel(workqueue_entry_t *ent)
+{
+  fake_queued_work_t *w = (fake_queued_work_t *)ent;
+  if (w->cancelled)
+    return NULL;
+  w->cancelled = 1;
+  return w->arg;
+}
+
+static void
+mock_circuit_mark_for_close_record(circuit_t *circ, int reason, int line,
+                                   const char *file)
+{
+  (void)reason;
+  (void)line;
+  (void)file;
+  smartlist_add(closed_circs, circ);
+}
+
+/** Pretend that a worker thread failed every handshake in the batch queued
+ * as <b>w</b>, and handle the replies. */
+static void
+fake_reply_to_batch(fake_queued_work_t *w)
+{
+  cpuworker_batch_t *batch = w->arg;
+  int i;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_reply_t *rpl = &batch->jobs[i]->u.reply;
+    memset(rpl, 0, sizeof(*rpl));
+    rpl->magic = CPUWORKER_REPLY_MAGIC;
+    rpl->success = 0;
+  }
+  w->reply_fn(batch);
+}
+
+static void
+setup_fake_cpuworkers(void)
+{
+  fake_queued = smartlist_new();
+  closed_circs = smartlist_new();
+  MOCK(cpuworker_is_running, mock_cpuworker_is_running);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(workqueue_entry_cancel, mock_workqueue_entry_cancel);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_record);
+}
+
+static void
+teardown_fake_cpuworkers(void)
+{
+  UNMOCK(cpuworker_is_running);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(workqueue_entry_cancel);
+  UNMOCK(circuit_mark_for_close_);
+  SMARTLIST_FOREACH(fake_queued, fake_queued_work_t *, w, tor_free(w));
+  smartlist_free(fake_queued);
+  smartlist_free(closed_circs);
+}
+
+static void
+test_cpuworker_batches(void *arg)
+{
+#define N_CIRCS 11
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *circs[N_CIRCS];
+  fake_queued_work_t *w;
+  cpuworker_batch_t *batch;
+  int i;
+  (void)arg;
+
+  setup_fake_cpuworkers();
+  for (i = 0; i < N_CIRCS; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = chan;
+  }
+
+  /* While the workers have room, an onionskin goes to them on its own. */
+  tt_int_op(0, OP_EQ,
+            assign_onionskin_to_cpuworker(circs[0], new_ntor_create_cell()));
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 1);
+  w = smartlist_get(fake_queued, 0);
+  batch = w->arg;
+  tt_int_op(batch->n_jobs, OP_EQ, 1);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, w);
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 1);
+
+  /* With one worker thread, a backlog of ten goes out as a full batch and
+   * then the rest. */
+  for (i = 1; i < N_CIRCS; ++i) {
+    tt_int_op(0, OP_EQ, onion_pending_add(circs[i], new_ntor_create_cell()));
+  }
+  queue_pending_tasks();
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 3);
+  batch = ((fake_queued_work_t *)smartlist_get(fake_queued, 1))->arg;
+  tt_int_op(batch->n_jobs, OP_EQ, CPUWORKER_MAX_BATCH_SIZE);
+  batch = ((fake_queued_work_t *)smartlist_get(fake_queued, 2))->arg;
+  tt_int_op(batch->n_jobs, OP_EQ, N_CIRCS - 1 - CPUWORKER_MAX_BATCH_SIZE);
+  for (i = 1; i < N_CIRCS; ++i) {
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ,
+              smartlist_get(fake_queued,
+                            i <= CPUWORKER_MAX_BATCH_SIZE ? 1 : 2));
+  }
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, N_CIRCS);
+
+  /* Every circuit in a batch gets its own answer. */
+  SMARTLIST_FOREACH(fake_queued, fake_queued_work_t *, fw,
+                    fake_reply_to_batch(fw));
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 0);
+  tt_int_op(smartlist_len(closed_circs), OP_EQ, N_CIRCS);
+  for (i = 0; i < N_CIRCS; ++i) {
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, NULL);
+    tt_assert(smartlist_contains(closed_circs, circs[i]));
+  }
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < N_CIRCS; ++i) {
+    circs[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  tor_free(chan);
+  teardown_fake_cpuworkers();
+#undef N_CIRCS
+}
+
+static void
+test_cpuworker_cancel_batch(void *arg)
+{
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *circs[3];
+  fake_queued_work_t *w;
+  cpuworker_batch_t *batch;
+  int i;
+  (void)arg;
+
+  setup_fake_cpuworkers();
+  for (i = 0; i < 3; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = chan;
+    tt_int_op(0, OP_EQ, onion_pending_add(circs[i], new_ntor_create_cell()));
+  }
+  queue_pending_tasks();
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 1);
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 3);
+
+  /* Cancelling one circuit queues the rest of its batch again. */
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 2);
+  w = smartlist_get(fake_queued, 1);
+  batch = w->arg;
+  tt_int_op(batch->n_jobs, OP_EQ, 2);
+  for (i = 0; i < batch->n_jobs; ++i)
+    tt_ptr_op(batch->jobs[i]->circ, OP_NE, circs[1]);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, w);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, w);
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 2);
+
+  /* The rest still get their answers. */
+  fake_reply_to_batch(w);
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 0);
+  tt_int_op(smartlist_len(closed_circs), OP_EQ, 2);
+  tt_assert(! smartlist_contains(closed_circs, circs[1]));
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, NULL);
+
+  /* Cancelling the only circuit in a batch frees the batch instead. */
+  tt_int_op(0, OP_EQ,
+            assign_onionskin_to_cpuworker(circs[1], new_ntor_create_cell()));
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 3);
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_int_op(smartlist_len(fake_queued), OP_EQ, 3);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(cpuworker_get_n_pending_tasks(), OP_EQ, 0);
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < 3; ++i) {
+    circs[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  tor_free(chan);
+  teardown_fake_cpuworkers();
+}
+
 static crypto_cipher_t *crypto_rand_aes_cipher = NULL;
 
 // Mock replacement for crypto_rand: Generates bytes from a provided AES_CTR
@@ -820,6 +1238,11 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_priority),
+  FORK(onion_queue_unknown_relay),
+  ENT(onion_queue_latency_hist),
+  FORK(cpuworker_batches),
+  FORK(cpuworker_cancel_batch),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -795,6 +795,75 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+static void
+test_buffer_chunk_reuse(void *arg)
+{
+  buf_t *buf = NULL;
+  char data[4096], out[4096];
+  const chunk_t *chunk;
+  size_t memlen;
+  (void)arg;
+
+  crypto_rand(data, sizeof(data));
+  buf = buf_new();
+  buf_enable_chunk_reuse(buf);
+
+  /* Fill exactly one 4k chunk, then spill into a second. */
+  buf_add(buf, data, 100);
+  chunk = buf->head;
+  memlen = chunk->memlen;
+  buf_add(buf, data, memlen - 100);
+  buf_add(buf, data, 100);
+  tt_int_op(buf_allocation(buf), OP_EQ, 8192);
+
+  /* Draining the first chunk keeps it as a spare, still counted. */
+  buf_drain(buf, memlen);
+  tt_ptr_op(buf->spare, OP_EQ, chunk);
+  tt_int_op(buf_allocation(buf), OP_EQ, 8192);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8192);
+
+  /* Once the second chunk fills up, the spare gets used again. */
+  buf_add(buf, data, memlen - 100);
+  tt_ptr_op(buf->spare, OP_EQ, chunk);
+  buf_add(buf, data, 1);
+  tt_ptr_op(buf->spare, OP_EQ, NULL);
+  tt_ptr_op(buf->tail, OP_EQ, chunk);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8192);
+
+  /* Whole runs of data in the head chunk can be read in place. */
+  tt_ptr_op(buf_peek_contiguous(buf, 100), OP_EQ, buf->head->data);
+  tt_mem_op(buf_peek_contiguous(buf, 100), OP_EQ, data, 100);
+  tt_ptr_op(buf_peek_contiguous(buf, buf->head->datalen + 1), OP_EQ, NULL);
+  buf_get_bytes(buf, out, 100);
+  tt_mem_op(out, OP_EQ, data, 100);
+
+  /* Clearing the buffer releases the spare too. */
+  buf_clear(buf);
+  tt_ptr_op(buf->spare, OP_EQ, NULL);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+  /* A chunk bigger than the default size is freed, not kept. */
+  buf_add_chunk_with_capacity(buf, 16384, 0);
+  buf_add(buf, data, 1);
+  tt_int_op(buf_allocation(buf), OP_GT, 16384);
+  buf_drain(buf, 1);
+  tt_ptr_op(buf->head, OP_EQ, NULL);
+  tt_ptr_op(buf->spare, OP_EQ, NULL);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+  /* The spare can be given back on its own. */
+  buf_add(buf, data, 1);
+  buf_drain(buf, 1);
+  tt_ptr_op(buf->spare, OP_NE, NULL);
+  tt_int_op(buf_release_spare_chunk(buf), OP_EQ, 4096);
+  tt_ptr_op(buf->spare, OP_EQ, NULL);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_release_spare_chunk(buf), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -803,6 +872,7 @@ struct testcase_t buffer_tests[] = {
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
+  { "chunk_reuse", test_buffer_chunk_reuse, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
@@ -387,6 +387,45 @@ test_pick_circid(void *arg)
   UNMOCK(channel_dump_statistics);
 }
 
+/** Make sure that a channel's circuit ID map stays consistent as it grows
+ * and as entries are removed from the middle of probe runs. */
+static void
+test_clist_circid_map(void *arg)
+{
+  channel_t *chan1 = new_fake_channel();
+  channel_t *chan2 = new_fake_channel();
+  circid_t circid;
+  (void)arg;
+
+  for (circid = 1; circid <= 3000; ++circid) {
+    channel_mark_circid_unusable(chan1, circid);
+    channel_mark_circid_unusable(chan1, circid << 16);
+  }
+  tt_int_op(circuit_id_in_use_on_channel(1, chan1), OP_EQ, 2);
+  tt_int_op(circuit_id_in_use_on_channel(3000, chan1), OP_EQ, 2);
+  tt_int_op(circuit_id_in_use_on_channel(3001, chan1), OP_EQ, 0);
+  /* Maps are per channel. */
+  tt_int_op(circuit_id_in_use_on_channel(1, chan2), OP_EQ, 0);
+
+  for (circid = 1; circid <= 3000; circid += 2) {
+    channel_mark_circid_usable(chan1, circid);
+    channel_mark_circid_usable(chan1, circid << 16);
+  }
+  for (circid = 1; circid <= 3000; ++circid) {
+    int expected = (circid & 1) ? 0 : 2;
+    tt_int_op(circuit_id_in_use_on_channel(circid, chan1), OP_EQ, expected);
+    tt_int_op(circuit_id_in_use_on_channel(circid << 16, chan1), OP_EQ,
+              expected);
+  }
+  tt_ptr_op(circuit_get_by_circid_channel(2, chan1), OP_EQ, NULL);
+
+ done:
+  channel_free_circid_map(chan1);
+  channel_free_circid_map(chan2);
+  tor_free(chan1);
+  tor_free(chan2);
+}
+
 /** Test that the circuit pools of our HS circuitmap are isolated based on
  *  their token type. */
 static void
@@ -468,6 +507,7 @@ struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "circid_map", test_clist_circid_map, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
   END_OF_TESTCASES
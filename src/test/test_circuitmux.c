@@ -13,6 +13,7 @@
 #include "core/or/scheduler.h"
 #include "test/test.h"
 
+#include "core/or/circuit_st.h"
 #include "core/or/destroy_cell_queue_st.h"
 
 #include <math.h>
@@ -125,9 +126,94 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+/** Make sure that the EWMA policy always picks the active circuit with the
+ * lowest cell count, including after circuits leave the middle of the
+ * queue and after the queue is rescaled. */
+static void
+test_cmux_ewma_order(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+#define N_EWMA_CIRCS 100
+  circuitmux_t *cmux = (circuitmux_t *) tor_malloc_zero(1);
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t *circs[N_EWMA_CIRCS + 1];
+  circuitmux_policy_circ_data_t *cdata[N_EWMA_CIRCS + 1];
+  int i, expected;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(cdata, 0, sizeof(cdata));
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  cmux_ewma_set_options(NULL, NULL);
+
+  pol_data = ewma_policy.alloc_cmux_data(cmux);
+  for (i = 0; i <= N_EWMA_CIRCS; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol_data, circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+  }
+
+  /* Give circuit i a cell count of ((i * 37) % N) + 1: a freshly activated
+   * circuit has sent nothing, so it is at the head of the queue. */
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    ewma_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+    tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol_data), OP_EQ,
+              circs[i]);
+    ewma_policy.notify_xmit_cells(cmux, pol_data, circs[i], cdata[i],
+                                  ((i * 37) % N_EWMA_CIRCS) + 1);
+  }
+
+  /* Take out every circuit with an even cell count. */
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    if ((((i * 37) % N_EWMA_CIRCS) + 1) % 2 == 0)
+      ewma_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+  }
+
+  /* Five hours later, sending a single cell needs a rescale of the queue. */
+  monotime_coarse_set_mock_time_nsec(START_NS + NS_PER_S * 5 * 3600);
+  ewma_policy.notify_circ_active(cmux, pol_data, circs[N_EWMA_CIRCS],
+                                 cdata[N_EWMA_CIRCS]);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol_data), OP_EQ,
+            circs[N_EWMA_CIRCS]);
+  ewma_policy.notify_xmit_cells(cmux, pol_data, circs[N_EWMA_CIRCS],
+                                cdata[N_EWMA_CIRCS], 1);
+
+  /* The old circuits come out in order of their cell counts, and the new
+   * one comes last, since its cell was sent much more recently. */
+  for (expected = 1; expected <= N_EWMA_CIRCS; expected += 2) {
+    circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol_data);
+    for (i = 0; i < N_EWMA_CIRCS; ++i) {
+      if (((i * 37) % N_EWMA_CIRCS) + 1 == expected)
+        break;
+    }
+    tt_ptr_op(circ, OP_EQ, circs[i]);
+    ewma_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+  }
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol_data), OP_EQ,
+            circs[N_EWMA_CIRCS]);
+  ewma_policy.notify_circ_inactive(cmux, pol_data, circs[N_EWMA_CIRCS],
+                                   cdata[N_EWMA_CIRCS]);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+ done:
+  for (i = 0; i <= N_EWMA_CIRCS; ++i) {
+    if (cdata[i])
+      ewma_policy.free_circ_data(cmux, pol_data, circs[i], cdata[i]);
+    tor_free(circs[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol_data);
+  tor_free(cmux);
+  monotime_disable_test_mocking();
+#undef N_EWMA_CIRCS
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "ewma_order", test_cmux_ewma_order, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -16,6 +16,8 @@
 #include "core/or/circuitstats.h"
 #include "core/or/circuituse.h"
 #include "core/or/channel.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/math/fp.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_st.h"
@@ -196,11 +198,133 @@ test_circuitstats_hoplen(void *arg)
   circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
 }
 
+/** Compute alpha for <b>cbt</b> the way we did before we kept the histogram
+ * up to date: with one pass over every build time we've seen. */
+static double
+alpha_by_rescanning(const circuit_build_times_t *cbt)
+{
+  const build_time_t *x = cbt->circuit_build_times;
+  double a = 0;
+  int n = 0, i, abandoned_count = 0;
+  build_time_t max_time = 0;
+
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+    if (!x[i])
+      continue;
+    if (x[i] < cbt->Xm) {
+      a += tor_mathlog(cbt->Xm);
+    } else if (x[i] == CBT_BUILD_ABANDONED) {
+      abandoned_count++;
+    } else {
+      a += tor_mathlog(x[i]);
+      if (x[i] > max_time)
+        max_time = x[i];
+    }
+    n++;
+  }
+
+  a += abandoned_count*tor_mathlog(max_time);
+  a -= n*tor_mathlog(cbt->Xm);
+  return (n-abandoned_count)/a;
+}
+
+static void
+test_circuitstats_histogram(void *arg)
+{
+  circuit_build_times_t *cbt = tor_malloc_zero(sizeof(*cbt));
+  uint32_t counts[CBT_NHISTOGRAM_BINS];
+  build_time_t max_time = 0;
+  double expected_alpha;
+  int i, n_abandoned = 0;
+  (void)arg;
+
+  /* Go around the ring more than once, so that times get evicted. */
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE * 3 + 17; i++) {
+    build_time_t btime;
+    if (i % 23 == 0)
+      btime = CBT_BUILD_ABANDONED;
+    else if (i % 101 == 0)
+      btime = 250000 + crypto_rand_int(1000); /* past the last bin */
+    else
+      btime = 200 + crypto_rand_int(3000);
+    tt_int_op(circuit_build_times_add_time(cbt, btime), OP_EQ, 0);
+  }
+
+  /* The counts we keep must match the times in the ring. */
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+    build_time_t btime = cbt->circuit_build_times[i];
+    if (btime == CBT_BUILD_ABANDONED) {
+      n_abandoned++;
+      continue;
+    }
+    counts[MIN(btime / CBT_BIN_WIDTH, CBT_NHISTOGRAM_BINS - 1)]++;
+    max_time = MAX(max_time, btime);
+  }
+  for (i = 0; i < CBT_NHISTOGRAM_BINS; i++) {
+    uint32_t n_listed = 0;
+    int j, prev = 0;
+    tt_int_op(cbt->histogram[i], OP_EQ, counts[i]);
+    /* Each bin's list holds exactly the build times in that bin. */
+    for (j = cbt->bin_first[i]; j; j = cbt->bin_next[j - 1]) {
+      build_time_t btime = cbt->circuit_build_times[j - 1];
+      tt_int_op(cbt->bin_prev[j - 1], OP_EQ, prev);
+      tt_int_op(MIN(btime / CBT_BIN_WIDTH, CBT_NHISTOGRAM_BINS - 1),
+                OP_EQ, i);
+      prev = j;
+      tt_int_op(++n_listed, OP_LE, counts[i]);
+    }
+    tt_int_op(n_listed, OP_EQ, counts[i]);
+  }
+  tt_int_op(cbt->num_abandoned, OP_EQ, n_abandoned);
+  tt_int_op(cbt->max_build_time, OP_EQ, max_time);
+
+  tt_int_op(circuit_build_times_update_alpha(cbt), OP_EQ, 1);
+  expected_alpha = alpha_by_rescanning(cbt);
+  tt_double_op(cbt->alpha, OP_GT, expected_alpha * (1 - 1e-9));
+  tt_double_op(cbt->alpha, OP_LT, expected_alpha * (1 + 1e-9));
+
+ done:
+  tor_free(cbt);
+}
+
+static void
+test_circuitstats_split_timeout(void *arg)
+{
+  circuit_build_times_t *cbt;
+  int i;
+  (void)arg;
+
+  circuit_build_times_init(get_circuit_build_times_mutable());
+  tt_double_op(get_split_circuit_build_timeout_ms(), OP_LT, 0);
+
+  cbt = get_split_circuit_build_times_mutable();
+  tt_ptr_op(cbt, OP_NE, get_circuit_build_times());
+  for (i = 0; i < CBT_DEFAULT_MIN_CIRCUITS_TO_OBSERVE; i++) {
+    tt_int_op(circuit_build_times_add_time(cbt,
+                                           300 + crypto_rand_int(400)),
+              OP_EQ, 0);
+  }
+  circuit_build_times_set_split_timeout(cbt);
+
+  tt_assert(cbt->have_computed_timeout);
+  tt_double_op(get_split_circuit_build_timeout_ms(), OP_GT, 0);
+  tt_double_op(get_split_circuit_build_timeout_ms(), OP_LE,
+               get_circuit_build_close_time_ms());
+  /* The general model hasn't learned anything. */
+  tt_int_op(get_circuit_build_times()->total_build_times, OP_EQ, 0);
+
+ done:
+  circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
+}
+
 #define TEST_CIRCUITSTATS(name, flags) \
     { #name, test_##name, (flags), NULL, NULL }
 
 struct testcase_t circuitstats_tests[] = {
   TEST_CIRCUITSTATS(circuitstats_hoplen, TT_FORK),
+  TEST_CIRCUITSTATS(circuitstats_histogram, TT_FORK),
+  TEST_CIRCUITSTATS(circuitstats_split_timeout, TT_FORK),
   END_OF_TESTCASES
 };
 
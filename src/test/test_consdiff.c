@@ -310,6 +310,81 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_line_ids(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  bitarray_t *changed1_ids = NULL, *changed2_ids = NULL;
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+  memarea_t *area = memarea_new();
+  int i, j;
+
+  (void)arg;
+  consensus_split_lines(sl1, "a\nb\nc\nd\ne\nf\na\nb\nq\nc\n", area);
+  consensus_split_lines(sl2, "x\nb\nd\nc\na\ne\nf\ng\nb\nc\nab\n", area);
+
+  /* Equal lines get equal IDs, and different lines get different ones. */
+  consdiff_assign_line_ids(sl1, sl2, &ids1, &ids2);
+  for (i = 0; i < smartlist_len(sl1); ++i) {
+    for (j = 0; j < smartlist_len(sl2); ++j) {
+      tt_int_op(lines_eq(smartlist_get(sl1, i), smartlist_get(sl2, j)),
+                OP_EQ, ids1[i] == ids2[j]);
+    }
+    for (j = 0; j < smartlist_len(sl1); ++j) {
+      tt_int_op(lines_eq(smartlist_get(sl1, i), smartlist_get(sl1, j)),
+                OP_EQ, ids1[i] == ids1[j]);
+    }
+  }
+
+  /* calc_changes finds the same changes whether it compares lines by ID or
+   * by contents. */
+  changed1 = bitarray_init_zero(smartlist_len(sl1));
+  changed2 = bitarray_init_zero(smartlist_len(sl2));
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes(sls1, sls2, changed1, changed2);
+  tor_free(sls1);
+  tor_free(sls2);
+
+  changed1_ids = bitarray_init_zero(smartlist_len(sl1));
+  changed2_ids = bitarray_init_zero(smartlist_len(sl2));
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  sls1->ids = ids1;
+  sls2->ids = ids2;
+  calc_changes(sls1, sls2, changed1_ids, changed2_ids);
+
+  for (i = 0; i < smartlist_len(sl1); ++i) {
+    tt_int_op(!!bitarray_is_set(changed1, i), OP_EQ,
+              !!bitarray_is_set(changed1_ids, i));
+  }
+  for (i = 0; i < smartlist_len(sl2); ++i) {
+    tt_int_op(!!bitarray_is_set(changed2, i), OP_EQ,
+              !!bitarray_is_set(changed2_ids, i));
+  }
+  /* "q" is gone; "x", "g" and "ab" are new. */
+  tt_assert(bitarray_is_set(changed1, 8));
+  tt_assert(bitarray_is_set(changed2, 0));
+  tt_assert(bitarray_is_set(changed2, 7));
+  tt_assert(bitarray_is_set(changed2, 10));
+
+ done:
+  tor_free(sls1);
+  tor_free(sls2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  bitarray_free(changed1_ids);
+  bitarray_free(changed2_ids);
+  tor_free(ids1);
+  tor_free(ids2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -1172,6 +1247,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(line_ids),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
@@ -6,9 +6,11 @@
 #include "orconfig.h"
 #define CRYPTO_CURVE25519_PRIVATE
 #define CRYPTO_RAND_PRIVATE
+#define CRYPTO_RAND_FAST_PRIVATE
 #include "core/or/or.h"
 #include "test/test.h"
 #include "lib/crypt_ops/aes.h"
+#include "lib/crypt_ops/crypto_cipher.h"
 #include "siphash.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
@@ -306,6 +308,71 @@ test_crypto_rng(void *arg)
   tor_free(h);
 }
 
+/** Check the buffered per-thread generator behind crypto_rand(). */
+static void
+test_crypto_fast_rng(void *arg)
+{
+  uint8_t seed[CIPHER256_KEY_LEN + CIPHER_IV_LEN];
+  uint8_t *a = tor_malloc_zero(10000), *b = tor_malloc_zero(10000);
+  uint8_t zero[64];
+  crypto_fast_rng_t *r1 = NULL, *r2 = NULL;
+  int i;
+  (void)arg;
+
+  memset(zero, 0, sizeof(zero));
+  crypto_rand((char*)seed, sizeof(seed));
+
+  /* Two generators with the same seed agree, whether we ask for bytes one
+   * at a time or in chunks that cross buffer boundaries. */
+  r1 = crypto_fast_rng_new_from_seed(seed);
+  r2 = crypto_fast_rng_new_from_seed(seed);
+  for (i = 0; i < 10000; ++i)
+    crypto_fast_rng_getbytes(r1, a + i, 1);
+  for (i = 0; i < 10000; i += 2500)
+    crypto_fast_rng_getbytes(r2, b + i, 2500);
+  tt_mem_op(a, OP_EQ, b, 10000);
+  tt_mem_op(a + 9936, OP_NE, zero, 64);
+
+  /* Bulk requests are filled straight from the keystream, but still keep
+   * the generators in step. */
+  crypto_fast_rng_getbytes(r1, a, 10000);
+  crypto_fast_rng_getbytes(r2, b, 10000);
+  tt_mem_op(a, OP_EQ, b, 10000);
+  tt_mem_op(a, OP_NE, a + 5000, 64);
+  tt_mem_op(a + 9936, OP_NE, zero, 64);
+  crypto_fast_rng_free(r1);
+  crypto_fast_rng_free(r2);
+
+  /* After a fork, a generator reseeds before handing out anything else. */
+  r1 = crypto_fast_rng_new_from_seed(seed);
+  r2 = crypto_fast_rng_new_from_seed(seed);
+  crypto_fast_rng_getbytes(r1, a, 16);
+  crypto_fast_rng_getbytes(r2, b, 16);
+  tt_mem_op(a, OP_EQ, b, 16);
+  crypto_rand_fast_postfork();
+  crypto_fast_rng_getbytes(r1, a, 16);
+  crypto_fast_rng_getbytes(r2, b, 16);
+  tt_mem_op(a, OP_NE, b, 16);
+
+  /* Enough output to force several reseeds still isn't constant. */
+  for (i = 0; i < 100; ++i)
+    crypto_fast_rng_getbytes(r1, a, 10000);
+  tt_mem_op(a + 9936, OP_NE, zero, 64);
+
+  /* crypto_rand() uses this thread's generator. */
+  tt_ptr_op(get_thread_fast_rng(), OP_NE, NULL);
+  tt_ptr_op(get_thread_fast_rng(), OP_EQ, get_thread_fast_rng());
+  destroy_thread_fast_rng();
+  crypto_rand((char*)a, 64);
+  tt_mem_op(a, OP_NE, zero, 64);
+
+ done:
+  crypto_fast_rng_free(r1);
+  crypto_fast_rng_free(r2);
+  tor_free(a);
+  tor_free(b);
+}
+
 static void
 test_crypto_rng_range(void *arg)
 {
@@ -3180,6 +3247,7 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
   { "rng_range", test_crypto_rng_range, 0, NULL, NULL },
+  { "fast_rng", test_crypto_fast_rng, TT_FORK, NULL, NULL },
   { "rng_strongest", test_crypto_rng_strongest, TT_FORK, NULL, NULL },
   { "rng_strongest_nosyscall", test_crypto_rng_strongest, TT_FORK,
     &passthrough_setup, (void*)"nosyscall" },
@@ -2986,6 +2986,28 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* The preamble parser agrees with the full parser. */
+  {
+    consensus_flavor_t pre_flav = -1;
+    time_t pre_valid_after = 0;
+    tt_int_op(0, OP_EQ, networkstatus_parse_consensus_preamble(
+                                consensus_text, &pre_flav, &pre_valid_after));
+    tt_int_op(pre_flav, OP_EQ, FLAV_NS);
+    tt_int_op(pre_valid_after, OP_EQ, con->valid_after);
+    tt_int_op(0, OP_EQ, networkstatus_parse_consensus_preamble(
+                             consensus_text_md, &pre_flav, &pre_valid_after));
+    tt_int_op(pre_flav, OP_EQ, FLAV_MICRODESC);
+    tt_int_op(pre_valid_after, OP_EQ, con_md->valid_after);
+    tt_int_op(-1, OP_EQ, networkstatus_parse_consensus_preamble(
+                             "network-status-version 3 nonesuch\n"
+                             "valid-after 2019-01-01 00:00:00\n",
+                             &pre_flav, &pre_valid_after));
+    tt_int_op(-1, OP_EQ, networkstatus_parse_consensus_preamble(
+                             "network-status-version 3\n"
+                             "fresh-until 2019-01-01 00:00:00\n",
+                             &pre_flav, &pre_valid_after));
+  }
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
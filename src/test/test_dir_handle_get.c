@@ -39,6 +39,7 @@
 #include "test/log_test_helpers.h"
 #include "feature/dircommon/voting_schedule.h"
 
+#include "feature/dircache/cached_dir_st.h"
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/dirclient/dir_server_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -2583,6 +2584,82 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   ;
 }
 
+static void
+test_dir_handle_get_spool_write_direct(void *data)
+{
+  dir_connection_t *conn = NULL;
+  cached_dir_t *cached = NULL;
+  spooled_resource_t *spooled = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  smartlist_t *chunks = smartlist_new();
+  char *received = NULL;
+  size_t n_received = 0;
+  ssize_t r;
+  int i;
+  (void) data;
+
+  for (i = 0; i < 1000; ++i)
+    smartlist_add_asprintf(chunks, "r relay%d %d\n", i, i*7919);
+  cached = new_cached_dir(smartlist_join_strings(chunks, "", 0, NULL),
+                          time(NULL));
+  tt_assert(cached->dir_compressed_len > 100);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  conn = dir_connection_new(AF_INET);
+  conn->base_.state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  spooled = spooled_resource_new(DIR_SPOOL_NETWORKSTATUS, NULL, 0);
+  spooled->cached_dir_ref = cached;
+  ++cached->refcnt;
+  smartlist_add(conn->spool, spooled);
+
+  /* Not without a real socket. */
+  tt_int_op(0, OP_EQ, connection_dirserv_can_write_direct(conn));
+  conn->base_.s = fds[0];
+  tt_int_op(1, OP_EQ, connection_dirserv_can_write_direct(conn));
+
+  /* Filling the outbuf leaves a direct-writable object in the spool. */
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  tt_int_op(0, OP_EQ, connection_get_outbuf_len(TO_CONN(conn)));
+
+  r = connection_dirserv_write_direct(conn, 100);
+  tt_int_op(r, OP_EQ, 100);
+  tt_ptr_op(conn->spool, OP_NE, NULL);
+  r = connection_dirserv_write_direct(conn, 1<<20);
+  tt_int_op(r, OP_EQ, cached->dir_compressed_len - 100);
+  tt_ptr_op(conn->spool, OP_EQ, NULL);
+  tt_int_op(0, OP_EQ, connection_dirserv_can_write_direct(conn));
+
+  received = tor_malloc(cached->dir_compressed_len + 1);
+  while (n_received < cached->dir_compressed_len) {
+    r = tor_socket_recv(fds[1], received + n_received,
+                        cached->dir_compressed_len + 1 - n_received, 0);
+    tt_int_op(r, OP_GT, 0);
+    n_received += r;
+  }
+  tt_int_op(n_received, OP_EQ, cached->dir_compressed_len);
+  tt_mem_op(received, OP_EQ, cached->dir_compressed, n_received);
+
+ done:
+  if (conn) {
+    dir_conn_clear_spool(conn);
+    conn->base_.s = TOR_INVALID_SOCKET;
+    connection_free_minimal(TO_CONN(conn));
+  }
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  if (cached)
+    cached_dir_decref(cached);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(received);
+}
+
 #define DIR_HANDLE_CMD(name,flags) \
   { #name, test_dir_handle_get_##name, (flags), NULL, NULL }
 
@@ -2642,5 +2719,6 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures_busy, 0),
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures, 0),
   DIR_HANDLE_CMD(parse_accept_encoding, 0),
+  DIR_HANDLE_CMD(spool_write_direct, 0),
   END_OF_TESTCASES
 };
@@ -14,6 +14,12 @@
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
 
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+
+#include <event2/dns.h>
+
 #define NS_MODULE dns
 
 #define NS_SUBMODULE clip_ttl
@@ -534,7 +540,7 @@ NS(test_main)(void *arg)
   cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
   cache_entry->magic = CACHED_RESOLVE_MAGIC;
   cache_entry->state = CACHE_STATE_PENDING;
-  cache_entry->minheap_idx = -1;
+  cache_entry->wheel_slot = -1;
   cache_entry->expire = time(NULL) + 60 * 60;
 
   (void)arg;
@@ -615,7 +621,7 @@ NS(test_main)(void *arg)
   cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
   cache_entry->magic = CACHED_RESOLVE_MAGIC;
   cache_entry->state = CACHE_STATE_CACHED;
-  cache_entry->minheap_idx = -1;
+  cache_entry->wheel_slot = -1;
   cache_entry->expire = time(NULL) + 60 * 60;
 
   (void)arg;
@@ -735,6 +741,216 @@ NS(test_main)(void *arg)
 
 #undef NS_SUBMODULE
 
+/** Helper: add a pending resolve for <b>address</b> to the cache, give it
+ * an IPv4 answer (a real one iff <b>ok</b>) with <b>ttl</b>, and turn it into
+ * a cached answer.  Return the cached answer.  (We never asked for IPv6 or
+ * PTR answers, so those statuses stay unset.) */
+static cached_resolve_t *
+add_finished_resolve(const char *address, int ok, uint32_t ttl)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  cached_resolve_t query;
+
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_PENDING;
+  resolve->wheel_slot = -1;
+  strlcpy(resolve->address, address, sizeof(resolve->address));
+  dns_insert_cache_entry(resolve);
+  set_expiry(resolve, time(NULL) + 300);
+
+  if (ok) {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+    resolve->result_ipv4.addr_ipv4 = 0x7f000001;
+  } else {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_ERR;
+  }
+  resolve->ttl_ipv4 = ttl;
+  make_pending_resolve_cached(resolve);
+
+  strlcpy(query.address, address, sizeof(query.address));
+  return dns_get_cache_entry(&query);
+}
+
+#define NS_SUBMODULE ASPECT(cache, expiry)
+
+/* Cached answers leave the cache once their expiry time has passed, and not
+ * before. */
+static void
+NS(test_main)(void *arg)
+{
+  cached_resolve_t *short_lived, *long_lived;
+  cached_resolve_t query;
+  time_t now = time(NULL);
+
+  (void)arg;
+
+  dns_init();
+
+  short_lived = add_finished_resolve("short.example.com", 1, 60);
+  long_lived = add_finished_resolve("long.example.com", 1, 6000);
+  tt_assert(short_lived);
+  tt_assert(long_lived);
+  tt_int_op(short_lived->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(short_lived->expire, OP_GE, now + MIN_DNS_TTL_AT_EXIT);
+  tt_int_op(long_lived->expire, OP_GE, now + MAX_DNS_TTL_AT_EXIT);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 2);
+
+  purge_expired_resolves(now + MIN_DNS_TTL_AT_EXIT - 1);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 2);
+  tt_u64_op(dns_get_cache_stats()->n_expired, OP_EQ, 0);
+
+  /* The short-lived answer goes, and so do the finished pending resolves
+   * that sat on the wheel. */
+  purge_expired_resolves(short_lived->expire);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 1);
+  tt_u64_op(dns_get_cache_stats()->n_expired, OP_EQ, 1);
+  strlcpy(query.address, "short.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, NULL);
+  strlcpy(query.address, "long.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, long_lived);
+
+  /* Jumping far ahead still finds everything. */
+  purge_expired_resolves(now + 100000);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 0);
+  tt_u64_op(dns_get_cache_stats()->n_expired, OP_EQ, 2);
+
+ done:
+  dns_free_all();
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE ASPECT(cache, negative_limit)
+
+/* We keep only a bounded number of negative answers, dropping the oldest
+ * ones first, and never drop positive answers to make room for them. */
+static void
+NS(test_main)(void *arg)
+{
+  cached_resolve_t *good;
+  cached_resolve_t query;
+  char name[64];
+  int i;
+
+  (void)arg;
+
+  dns_init();
+
+  good = add_finished_resolve("good.example.com", 1, 60);
+  tt_assert(good);
+  tt_assert(!good->is_negative);
+
+  for (i = 0; i < DNS_MAX_NEGATIVE_ENTRIES + 10; ++i) {
+    cached_resolve_t *bad;
+    tor_snprintf(name, sizeof(name), "nx%d.example.com", i);
+    bad = add_finished_resolve(name, 0, 60);
+    tt_assert(bad);
+    tt_assert(bad->is_negative);
+  }
+
+  tt_int_op(dns_cache_entry_count(), OP_EQ, DNS_MAX_NEGATIVE_ENTRIES + 1);
+  tt_u64_op(dns_get_cache_stats()->n_negative_evicted, OP_EQ, 10);
+  strlcpy(query.address, "nx9.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, NULL);
+  strlcpy(query.address, "nx10.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_NE, NULL);
+  strlcpy(query.address, "good.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, good);
+
+ done:
+  dns_free_all();
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE ASPECT(cache, oom)
+
+/* Under memory pressure we give up negative answers before positive ones,
+ * and positive ones in the order they would expire. */
+static void
+NS(test_main)(void *arg)
+{
+  cached_resolve_t *soon, *late;
+  cached_resolve_t query;
+  size_t removed;
+
+  (void)arg;
+
+  dns_init();
+
+  late = add_finished_resolve("late.example.com", 1, 6000);
+  soon = add_finished_resolve("soon.example.com", 1, 60);
+  tt_assert(add_finished_resolve("nx1.example.com", 0, 60));
+  tt_assert(add_finished_resolve("nx2.example.com", 0, 60));
+  tt_assert(soon && late);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 4);
+
+  removed = dns_cache_handle_oom(time(NULL), 2 * sizeof(cached_resolve_t));
+  tt_u64_op(removed, OP_GE, 2 * sizeof(cached_resolve_t));
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 2);
+  strlcpy(query.address, "soon.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, soon);
+
+  removed = dns_cache_handle_oom(time(NULL), 1);
+  tt_u64_op(removed, OP_GE, 1);
+  tt_int_op(dns_cache_entry_count(), OP_EQ, 1);
+  strlcpy(query.address, "late.example.com", sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, late);
+  tt_u64_op(dns_get_cache_stats()->n_oom_evicted, OP_EQ, 3);
+
+ done:
+  dns_free_all();
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE thread_lookup
+
+/* The lookups we do on resolver threads report their answers and their
+ * errors the way eventdns would. */
+static void
+NS(test_main)(void *arg)
+{
+  dns_thread_job_t job;
+  char buf[TOR_ADDR_BUF_LEN];
+
+  (void)arg;
+
+  tt_int_op(dns_err_from_eai(0), OP_EQ, DNS_ERR_NONE);
+  tt_int_op(dns_err_from_eai(EAI_NONAME), OP_EQ, DNS_ERR_NOTEXIST);
+  tt_int_op(dns_err_from_eai(EAI_AGAIN), OP_EQ, DNS_ERR_TIMEOUT);
+  tt_int_op(dns_err_from_eai(EAI_FAIL), OP_EQ, DNS_ERR_SERVERFAILED);
+  tt_int_op(dns_err_from_eai(EAI_MEMORY), OP_EQ, DNS_ERR_UNKNOWN);
+
+  /* Numeric names don't need a nameserver. */
+  memset(&job, 0, sizeof(job));
+  job.query_type = DNS_IPv4_A;
+  job.lookup_name = (char *)"127.0.0.1";
+  dns_thread_do_lookup(&job);
+  tt_int_op(job.result, OP_EQ, DNS_ERR_NONE);
+  tt_str_op(fmt_addr(&job.answer), OP_EQ, "127.0.0.1");
+
+  memset(&job, 0, sizeof(job));
+  job.query_type = DNS_IPv6_AAAA;
+  job.lookup_name = (char *)"::1";
+  dns_thread_do_lookup(&job);
+  tt_int_op(job.result, OP_EQ, DNS_ERR_NONE);
+  tt_str_op(tor_addr_to_str(buf, &job.answer, sizeof(buf), 0), OP_EQ, "::1");
+
+  /* An IPv6 address has no IPv4 answer. */
+  memset(&job, 0, sizeof(job));
+  job.query_type = DNS_IPv4_A;
+  job.lookup_name = (char *)"::1";
+  dns_thread_do_lookup(&job);
+  tt_int_op(job.result, OP_NE, DNS_ERR_NONE);
+  tt_int_op(tor_addr_family(&job.answer), OP_EQ, AF_UNSPEC);
+
+ done:
+  ;
+}
+
+#undef NS_SUBMODULE
+
 struct testcase_t dns_tests[] = {
    TEST_CASE(clip_ttl),
    TEST_CASE(resolve),
@@ -745,6 +961,10 @@ struct testcase_t dns_tests[] = {
    TEST_CASE_ASPECT(resolve_impl, cache_hit_pending),
    TEST_CASE_ASPECT(resolve_impl, cache_hit_cached),
    TEST_CASE_ASPECT(resolve_impl, cache_miss),
+   TEST_CASE_ASPECT(cache, expiry),
+   TEST_CASE_ASPECT(cache, negative_limit),
+   TEST_CASE_ASPECT(cache, oom),
+   TEST_CASE(thread_lookup),
    END_OF_TESTCASES
 };
 
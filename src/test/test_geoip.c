@@ -14,6 +14,10 @@
 #include "feature/stats/geoip_stats.h"
 #include "test/test.h"
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
    * ipv4 and ipv6, we should get the same result no matter which
@@ -380,6 +384,129 @@ test_geoip_with_pt(void *arg)
   tor_free(s);
 }
 
+static void
+test_geoip_client_table(void *arg)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  tor_addr_t addr;
+  clientmap_entry_t *ent;
+  size_t full_size;
+  int i;
+
+  (void)arg;
+
+  tt_uint_op(geoip_client_cache_total_allocation(), OP_EQ, 0);
+
+  /* Enough clients to make the table grow several times; the odd ones are
+   * an hour older than the even ones. */
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL,
+                           (i & 1) ? now - 7200 : now - 3600);
+  }
+  /* The same addresses again, with a transport, count separately. */
+  for (i = 0; i < 100; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, "obfs4", now);
+  }
+  tor_addr_parse(&addr, "2001:db8::1");
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    ent = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+    tt_assert(ent);
+    tt_assert(tor_addr_eq(&ent->addr, &addr));
+    tt_uint_op(ent->last_seen_in_minutes, OP_EQ,
+               ((i & 1) ? now - 7200 : now - 3600) / 60);
+    tt_assert(! geoip_lookup_client(&addr, NULL,
+                                    GEOIP_CLIENT_NETWORKSTATUS));
+  }
+  tor_addr_from_ipv4h(&addr, 0x0a000000 + 42);
+  ent = geoip_lookup_client(&addr, "obfs4", GEOIP_CLIENT_CONNECT);
+  tt_assert(ent);
+  tt_uint_op(ent->last_seen_in_minutes, OP_EQ, now / 60);
+  tt_assert(! geoip_lookup_client(&addr, "meek", GEOIP_CLIENT_CONNECT));
+  tor_addr_parse(&addr, "2001:db8::1");
+  tt_assert(geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT));
+
+  full_size = geoip_client_cache_total_allocation();
+  tt_uint_op(full_size, OP_GE, 5101 * sizeof(clientmap_entry_t));
+
+  /* Forgetting the older half must leave every other entry reachable. */
+  geoip_remove_old_clients(now - 5400);
+  for (i = 0; i < 5000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    ent = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+    if (i & 1) {
+      tt_ptr_op(ent, OP_EQ, NULL);
+    } else {
+      tt_assert(ent);
+      tt_assert(tor_addr_eq(&ent->addr, &addr));
+    }
+  }
+
+  /* Forgetting almost everything shrinks the table. */
+  geoip_remove_old_clients(now - 60);
+  tt_uint_op(geoip_client_cache_total_allocation(), OP_LT, full_size);
+  tor_addr_from_ipv4h(&addr, 0x0a000000 + 42);
+  tt_assert(geoip_lookup_client(&addr, "obfs4", GEOIP_CLIENT_CONNECT));
+  tt_assert(! geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT));
+
+ done:
+  geoip_stats_free_all();
+}
+
+static void
+test_geoip_client_cache_oom(void *arg)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  tor_addr_t addr;
+  size_t before, freed;
+  int i;
+
+  (void)arg;
+
+  /* 2000 clients last seen 20 hours ago, 500 seen 10 hours ago, and 1000
+   * seen an hour ago. */
+  for (i = 0; i < 3500; ++i) {
+    time_t when = i < 2000 ? now - 20*3600 :
+                  i < 2500 ? now - 10*3600 : now - 3600;
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, when);
+  }
+  before = geoip_client_cache_total_allocation();
+  tt_uint_op(before, OP_EQ, 8192 * sizeof(clientmap_entry_t));
+
+  /* Ask for half the table back.  Dropping the oldest clients is enough to
+   * fit the rest in a quarter of the space, so nobody else goes. */
+  freed = geoip_client_cache_handle_oom(now, before / 2);
+  tt_uint_op(freed, OP_GE, before / 2);
+  tt_uint_op(freed, OP_EQ, before - geoip_client_cache_total_allocation());
+  tt_uint_op(geoip_client_cache_total_allocation(), OP_EQ,
+             2048 * sizeof(clientmap_entry_t));
+  for (i = 0; i < 3500; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    if (i < 2000) {
+      tt_assert(! geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT));
+    } else {
+      tt_assert(geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT));
+    }
+  }
+
+  /* Clients seen within the minimum cutoff are never removed, even if that
+   * means we can't free as much as we were asked to. */
+  before = geoip_client_cache_total_allocation();
+  freed = geoip_client_cache_handle_oom(now, before);
+  tt_uint_op(freed, OP_EQ, before - geoip_client_cache_total_allocation());
+  tt_uint_op(geoip_client_cache_total_allocation(), OP_GT, 0);
+  tor_addr_from_ipv4h(&addr, 0x0a000000 + 3000);
+  tt_assert(geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT));
+
+ done:
+  geoip_stats_free_all();
+}
+
 #undef SET_TEST_ADDRESS
 #undef SET_TEST_IPV6
 #undef CHECK_COUNTRY
@@ -564,6 +691,100 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+static void
+test_geoip_binary_file(void *arg)
+{
+  (void)arg;
+  char *fname_text = tor_strdup(get_fname("geoip_text"));
+  char *fname_bin = tor_strdup(get_fname("geoip_bin"));
+  char *fname_cache = tor_strdup(get_fname("geoip_cache"));
+  char *digest = NULL;
+  char *contents = NULL;
+  struct stat st;
+  size_t len;
+  /* Addresses inside ranges, in gaps, and at range boundaries. */
+  const uint32_t probes[] = { 0, 134445935, 134445936, 134445939,
+                              134445940, 134447104, 134738944, 135000000,
+                              135432191, 135432192, 0x08080808,
+                              0xffffffff };
+  char expected[ARRAY_LENGTH(probes)][3];
+  unsigned i;
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname_text, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_text, LOG_WARN));
+  digest = tor_strdup(geoip_db_digest(AF_INET));
+  for (i = 0; i < ARRAY_LENGTH(probes); ++i) {
+    int country = geoip_get_country_by_ipv4(probes[i]);
+    tt_int_op(country, OP_GE, 0);
+    strlcpy(expected[i], geoip_get_country_name(country), 3);
+  }
+  tt_str_op(expected[2], OP_EQ, "mp");
+  tt_str_op(expected[4], OP_EQ, "gu");
+  tt_str_op(expected[0], OP_EQ, "??");
+  tt_str_op(expected[9], OP_EQ, "??");
+  tt_str_op(expected[11], OP_EQ, "??");
+
+  /* Adjacent US ranges are merged, and the gaps at either end are kept:
+   * the binary file is much smaller than the text. */
+  tt_int_op(0, OP_EQ, geoip_write_binary_file(AF_INET, fname_bin));
+  contents = read_file_to_str(fname_bin, RFTS_BIN, &st);
+  tt_assert(contents);
+  len = (size_t) st.st_size;
+  tt_mem_op(contents, OP_EQ, "TORGEOIP", 8);
+  tt_int_op(len, OP_LT, strlen(GEOIP_CONTENT));
+
+  /* Loading the binary file gives the same answers and digest, even with
+   * the countries registered in a different order. */
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, geoip_parse_entry("::1,::2,ZZ", AF_INET6));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_bin, LOG_WARN));
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+  for (i = 0; i < ARRAY_LENGTH(probes); ++i) {
+    tt_str_op(expected[i], OP_EQ,
+              geoip_get_country_name(geoip_get_country_by_ipv4(probes[i])));
+  }
+
+  /* A truncated binary file is rejected, and leaves the table alone. */
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_cache, contents, len-1, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_cache, LOG_INFO));
+  tt_str_op("gu", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445940)));
+
+  /* With a cache: the first load parses the text and writes the cache, and
+   * the second maps the cache. */
+  geoip_free_all();
+  tor_free(contents);
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname_text,
+                                                 fname_cache, LOG_WARN));
+  contents = read_file_to_str(fname_cache, RFTS_BIN, NULL);
+  tt_assert(contents);
+  tt_mem_op(contents, OP_EQ, "TORGEOIP", 8);
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname_text,
+                                                 fname_cache, LOG_WARN));
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+  tt_str_op("gu", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445940)));
+
+  /* Once the text file changes, the cache is out of date. */
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, write_str_to_file(fname_text,
+                                        "134445936,134445939,MP\n"
+                                        "134445940,134447103,FR\n", 1));
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname_text,
+                                                 fname_cache, LOG_WARN));
+  tt_str_op(digest, OP_NE, geoip_db_digest(AF_INET));
+  tt_str_op("fr", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(134445940)));
+
+ done:
+  tor_free(fname_text);
+  tor_free(fname_bin);
+  tor_free(fname_cache);
+  tor_free(digest);
+  tor_free(contents);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -572,9 +793,12 @@ test_geoip_load_2nd_file(void *arg)
 struct testcase_t geoip_tests[] = {
   { "geoip", test_geoip, TT_FORK, NULL, NULL },
   { "geoip_with_pt", test_geoip_with_pt, TT_FORK, NULL, NULL },
+  { "client_table", test_geoip_client_table, TT_FORK, NULL, NULL },
+  { "client_cache_oom", test_geoip_client_cache_oom, TT_FORK, NULL, NULL },
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "binary_file", test_geoip_binary_file, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
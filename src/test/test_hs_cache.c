@@ -81,14 +81,15 @@ test_directory(void *arg)
      * between the store and this call. */
     hs_cache_clean_as_dir(time(NULL));
     /* We should find it in our cache. */
-    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out,
+                                 NULL);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, desc1_str);
     /* Tell our OOM to run and to at least remove a byte which will result in
      * removing the descriptor from our cache. */
     oom_size = hs_cache_handle_oom(time(NULL), 1);
     tt_int_op(oom_size, OP_GE, 1);
-    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL, NULL);
     tt_int_op(ret, OP_EQ, 0);
   }
 
@@ -114,13 +115,14 @@ test_directory(void *arg)
     /* This one should clear out our zero lifetime desc. */
     hs_cache_clean_as_dir(time(NULL));
     /* We should find desc1 in our cache. */
-    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out,
+                                 NULL);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, desc1_str);
     /* We should NOT find our zero lifetime desc in our cache. */
     ret = hs_cache_lookup_as_dir(3,
                                  helper_get_hsdir_query(desc_zero_lifetime),
-                                 NULL);
+                                 NULL, NULL);
     tt_int_op(ret, OP_EQ, 0);
     /* Cleanup our entire cache. */
     oom_size = hs_cache_handle_oom(time(NULL), 1);
@@ -137,10 +139,10 @@ test_directory(void *arg)
     ret = hs_cache_store_as_dir("hs-descriptor 3\nJUNK");
     tt_int_op(ret, OP_EQ, -1);
     /* Undecodable base64 query. */
-    ret = hs_cache_lookup_as_dir(3, "blah", NULL);
+    ret = hs_cache_lookup_as_dir(3, "blah", NULL, NULL);
     tt_int_op(ret, OP_EQ, -1);
     /* Decodable base64 query but wrong ed25519 size. */
-    ret = hs_cache_lookup_as_dir(3, "dW5pY29ybg==", NULL);
+    ret = hs_cache_lookup_as_dir(3, "dW5pY29ybg==", NULL, NULL);
     tt_int_op(ret, OP_EQ, -1);
   }
 
@@ -151,7 +153,8 @@ test_directory(void *arg)
     /* Add a descriptor. */
     ret = hs_cache_store_as_dir(desc1_str);
     tt_int_op(ret, OP_EQ, 0);
-    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out,
+                                 NULL);
     tt_int_op(ret, OP_EQ, 1);
     /* Bump revision counter. */
     desc1->plaintext_data.revision_counter++;
@@ -160,7 +163,8 @@ test_directory(void *arg)
     ret = hs_cache_store_as_dir(new_desc_str);
     tt_int_op(ret, OP_EQ, 0);
     /* Look it up, it should have been replaced. */
-    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out,
+                                 NULL);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, new_desc_str);
     tor_free(new_desc_str);
@@ -183,6 +187,9 @@ test_clean_as_dir(void *arg)
   (void) arg;
 
   init_test();
+  /* Entries are timestamped with approx_time(), which a forked test
+   * inherits from whenever the test suite started. */
+  update_approx_time(now);
 
   /* Generate a valid descriptor with values. */
   ret = ed25519_keypair_generate(&signing_kp1, 0);
@@ -198,21 +205,21 @@ test_clean_as_dir(void *arg)
   ret = cache_clean_v3_as_dir(now, 0);
   tt_int_op(ret, OP_EQ, 0);
   /* Should be present after clean up. */
-  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL, NULL);
   tt_int_op(ret, OP_EQ, 1);
   /* Set a cutoff 100 seconds in the past. It should not remove the entry
    * since the entry is still recent enough. */
   ret = cache_clean_v3_as_dir(now, now - 100);
   tt_int_op(ret, OP_EQ, 0);
   /* Should be present after clean up. */
-  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL, NULL);
   tt_int_op(ret, OP_EQ, 1);
   /* Set a cutoff of 100 seconds in the future. It should remove the entry
    * that we've just added since it's not too old for the cutoff. */
   ret = cache_clean_v3_as_dir(now, now + 100);
   tt_int_op(ret, OP_GT, 0);
   /* Shouldn't be present after clean up. */
-  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL, NULL);
   tt_int_op(ret, OP_EQ, 0);
 
  done:
@@ -220,6 +227,97 @@ test_clean_as_dir(void *arg)
   tor_free(desc1_str);
 }
 
+static void
+test_clean_as_dir_by_age(void *arg)
+{
+  int i, ret;
+  size_t removed, entry_sizes = 0;
+  time_t now = time(NULL);
+  char *desc_str[3] = { NULL, NULL, NULL };
+  hs_descriptor_t *desc[3] = { NULL, NULL, NULL };
+  ed25519_keypair_t signing_kp;
+  const char *desc_out;
+  size_t desc_len;
+
+  (void) arg;
+
+  init_test();
+  tt_uint_op(cache_get_v3_dir_allocation(), OP_EQ, 0);
+
+  /* Store three descriptors, 100 seconds apart, that all land in the same
+   * shard. The newest goes in first, then the oldest, then the middle one,
+   * so that the cache has to insert both at the head of the shard and in
+   * the middle of it to keep it sorted. */
+  for (i = 0; i < 3; i++) {
+    const int order[3] = { 2, 0, 1 };
+    const int n = order[i];
+    do {
+      hs_descriptor_free(desc[n]);
+      ret = ed25519_keypair_generate(&signing_kp, 0);
+      tt_int_op(ret, OP_EQ, 0);
+      desc[n] = hs_helper_build_hs_desc_with_ip(&signing_kp);
+      tt_assert(desc[n]);
+    } while (i > 0 &&
+             ((desc[n]->plaintext_data.blinded_pubkey.pubkey[0] ^
+               desc[2]->plaintext_data.blinded_pubkey.pubkey[0]) &
+              (HS_CACHE_DIR_N_SHARDS - 1)));
+    ret = hs_desc_encode_descriptor(desc[n], &signing_kp, NULL,
+                                    &desc_str[n]);
+    tt_int_op(ret, OP_EQ, 0);
+    update_approx_time(now - 300 + n * 100);
+    ret = hs_cache_store_as_dir(desc_str[n]);
+    tt_int_op(ret, OP_EQ, 0);
+  }
+  update_approx_time(now);
+  tt_uint_op(cache_get_v3_dir_allocation(), OP_GT, 0);
+
+  /* Lookups hand back the cached string and its length. */
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[1]),
+                               &desc_out, &desc_len);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_str_op(desc_out, OP_EQ, desc_str[1]);
+  tt_uint_op(desc_len, OP_EQ, strlen(desc_str[1]));
+
+  /* Expiry walks the shard oldest first and stops at the first entry that
+   * is too young, so each cutoff only removes the right entries if the
+   * shard is sorted. A cutoff between the first and second descriptor
+   * removes only the oldest one. */
+  removed = cache_clean_v3_as_dir(now, now - 250);
+  tt_uint_op(removed, OP_GT, 0);
+  for (i = 0; i < 3; i++) {
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[i]),
+                                 NULL, NULL);
+    tt_int_op(ret, OP_EQ, i != 0);
+  }
+
+  /* A cutoff between the second and third descriptor removes the middle
+   * one as well. */
+  removed = cache_clean_v3_as_dir(now, now - 150);
+  tt_uint_op(removed, OP_GT, 0);
+  for (i = 0; i < 3; i++) {
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[i]),
+                                 NULL, NULL);
+    tt_int_op(ret, OP_EQ, i == 2);
+  }
+  entry_sizes = cache_get_v3_dir_allocation();
+  tt_uint_op(entry_sizes, OP_GT, 0);
+
+  /* Nothing else is that old. */
+  removed = cache_clean_v3_as_dir(now, now - 150);
+  tt_uint_op(removed, OP_EQ, 0);
+
+  /* Removing the last one gives back everything we accounted for. */
+  removed = cache_clean_v3_as_dir(now, now);
+  tt_uint_op(removed, OP_EQ, entry_sizes);
+  tt_uint_op(cache_get_v3_dir_allocation(), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < 3; i++) {
+    hs_descriptor_free(desc[i]);
+    tor_free(desc_str[i]);
+  }
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -555,6 +653,8 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
+  { "clean_as_dir_by_age", test_clean_as_dir_by_age, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
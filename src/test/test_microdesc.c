@@ -5,8 +5,12 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define DIRCLIENT_PRIVATE
+#define MICRODESC_PRIVATE
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/dirauth/dirvote.h"
+#include "feature/dirclient/dirclient.h"
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/microdesc.h"
@@ -19,6 +23,8 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 
+#include "lib/evloop/workqueue.h"
+
 #include "test/test.h"
 
 #ifdef HAVE_SYS_STAT_H
@@ -811,6 +817,270 @@ test_md_corrupt_desc(void *arg)
   smartlist_free(sl);
 }
 
+static int
+mock_cpuworker_is_running(void)
+{
+  return 1;
+}
+
+static workqueue_reply_t (*mock_queued_fn)(void *, void *) = NULL;
+static void (*mock_queued_reply_fn)(void *) = NULL;
+static void *mock_queued_arg = NULL;
+static struct workqueue_entry_s *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) prio;
+  mock_queued_fn = fn;
+  mock_queued_reply_fn = reply_fn;
+  mock_queued_arg = arg;
+  return (struct workqueue_entry_s *)arg;
+}
+
+static void
+test_md_parse_in_worker(void *arg)
+{
+  (void) arg;
+  smartlist_t *which = smartlist_new();
+  digest256map_t *pending = digest256map_new();
+  char digest1[DIGEST256_LEN], digest2[DIGEST256_LEN];
+  char *body = NULL;
+  smartlist_t *chunks = smartlist_new();
+  int i;
+
+  MOCK(cpuworker_is_running, mock_cpuworker_is_running);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  crypto_digest256(digest1, test_md2, strlen(test_md2), DIGEST_SHA256);
+  memset(digest2, 0x5a, sizeof(digest2));
+  smartlist_add(which, tor_memdup(digest1, DIGEST256_LEN));
+  smartlist_add(which, tor_memdup(digest2, DIGEST256_LEN));
+
+  /* Small responses get parsed in the main thread. */
+  tt_int_op(-1, OP_EQ,
+            microdesc_parse_launch_worker(test_md2, strlen(test_md2),
+                                          time(NULL), 200, digest2, which));
+  tt_ptr_op(mock_queued_arg, OP_EQ, NULL);
+  tt_int_op(0, OP_EQ, dir_n_microdesc_parse_jobs());
+
+  /* Big ones go to a worker. */
+  for (i = 0; i < 100; ++i)
+    smartlist_add(chunks, (char*)test_md2);
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  tt_int_op(0, OP_EQ,
+            microdesc_parse_launch_worker(body, strlen(body),
+                                          time(NULL), 200, digest2, which));
+  which = NULL; /* the job owns it now. */
+  tor_free(body);
+  tt_ptr_op(mock_queued_arg, OP_NE, NULL);
+  tt_int_op(1, OP_EQ, dir_n_microdesc_parse_jobs());
+
+  /* While it's being parsed, we shouldn't ask for those microdescs again. */
+  dir_list_microdescs_being_parsed(pending);
+  tt_int_op(2, OP_EQ, digest256map_size(pending));
+  tt_assert(digest256map_get(pending, (const uint8_t *)digest1));
+  tt_assert(digest256map_get(pending, (const uint8_t *)digest2));
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(
+                                       get_microdesc_cache(), digest1));
+
+  tt_int_op(WQ_RPL_REPLY, OP_EQ, mock_queued_fn(NULL, mock_queued_arg));
+  mock_queued_reply_fn(mock_queued_arg);
+
+  tt_int_op(0, OP_EQ, dir_n_microdesc_parse_jobs());
+  tt_ptr_op(NULL, OP_NE, microdesc_cache_lookup_by_digest256(
+                                       get_microdesc_cache(), digest1));
+
+ done:
+  UNMOCK(cpuworker_is_running);
+  UNMOCK(cpuworker_queue_work);
+  if (which) {
+    SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+    smartlist_free(which);
+  }
+  smartlist_free(chunks);
+  digest256map_free(pending, NULL);
+  tor_free(body);
+  microdesc_free_all();
+}
+
+static void
+test_md_rebuild_in_worker(void *arg)
+{
+  (void) arg;
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  microdesc_t *md1, *md2, *md3;
+  smartlist_t *added = NULL;
+  char *fn = NULL, *s = NULL;
+  void *job;
+  time_t now = time(NULL);
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  mock_queued_arg = NULL;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_bg"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md1 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md2 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+
+  tt_int_op(0, OP_EQ, microdesc_cache_launch_rebuild(mc, 1));
+  tt_ptr_op(mock_queued_arg, OP_NE, NULL);
+  job = mock_queued_arg;
+  /* Nothing changes until the worker is done. */
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  /* We don't start a second rebuild while the first is running. */
+  tt_int_op(0, OP_EQ, microdesc_cache_rebuild(mc, 1));
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_ptr_op(mock_queued_arg, OP_EQ, job);
+
+  /* This one arrives while the worker is busy. */
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md3 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+
+  tt_int_op(WQ_RPL_REPLY, OP_EQ, mock_queued_fn(NULL, job));
+  mock_queued_reply_fn(job);
+
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_mem_op(md1->body, OP_EQ, s + md1->off, strlen(test_md1));
+  tt_mem_op(md2->body, OP_EQ, s + md2->off, strlen(test_md2));
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+  tor_free(s);
+  tor_free(fn);
+
+  /* The journal only holds the one that came in late. */
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->CacheDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_mem_op(md3->body, OP_EQ, s + md3->off, md3->bodylen);
+  tt_ptr_op(NULL, OP_EQ, tor_memstr(s, strlen(s), test_md1));
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(s);
+  tor_free(fn);
+}
+
+/** What mock_workqueue_entry_cancel() should return: the work's argument
+ * if it hasn't started yet, or NULL if a worker has picked it up. */
+static int mock_cancel_succeeds = 0;
+
+static void *
+mock_workqueue_entry_cancel(workqueue_entry_t *ent)
+{
+  /* mock_cpuworker_queue_work() hands out the work argument as the entry. */
+  return mock_cancel_succeeds ? ent : NULL;
+}
+
+static void
+test_md_rebuild_cleared(void *arg)
+{
+  (void) arg;
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  char *tmp_fn = NULL;
+  void *job;
+  time_t now = time(NULL);
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(workqueue_entry_cancel, mock_workqueue_entry_cancel);
+  mock_queued_arg = NULL;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_clr"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&tmp_fn, "%s"PATH_SEPARATOR"cached-microdescs.tmp",
+               options->CacheDirectory);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+
+  /* Clearing the cache before a worker starts the job cancels it. */
+  mock_cancel_succeeds = 1;
+  tt_int_op(0, OP_EQ, microdesc_cache_launch_rebuild(mc, 1));
+  tt_int_op(FN_NOENT, OP_NE, file_status(tmp_fn));
+  microdesc_cache_reload(mc);
+  tt_int_op(FN_NOENT, OP_EQ, file_status(tmp_fn));
+  mock_queued_arg = NULL;
+  tt_int_op(0, OP_EQ, microdesc_cache_launch_rebuild(mc, 1));
+  tt_ptr_op(mock_queued_arg, OP_NE, NULL);
+
+  /* Once a worker has it, the job runs to completion, but nothing else may
+   * write the temporary file until it's done. */
+  job = mock_queued_arg;
+  mock_cancel_succeeds = 0;
+  microdesc_cache_reload(mc);
+  tt_int_op(0, OP_EQ, microdesc_cache_rebuild(mc, 1));
+  tt_ptr_op(mock_queued_arg, OP_EQ, job);
+  tt_int_op(FN_NOENT, OP_NE, file_status(tmp_fn));
+  tt_int_op(WQ_RPL_REPLY, OP_EQ, mock_queued_fn(NULL, job));
+  mock_queued_reply_fn(job);
+  tt_int_op(FN_NOENT, OP_EQ, file_status(tmp_fn));
+
+  /* If we shut down while a worker has the job, we wait for it and clean
+   * up after it. */
+  mock_queued_arg = NULL;
+  tt_int_op(0, OP_EQ, microdesc_cache_launch_rebuild(mc, 1));
+  tt_ptr_op(mock_queued_arg, OP_NE, NULL);
+  tt_int_op(WQ_RPL_REPLY, OP_EQ, mock_queued_fn(NULL, mock_queued_arg));
+  microdesc_free_all();
+  tt_int_op(FN_NOENT, OP_EQ, file_status(tmp_fn));
+
+ done:
+  mock_cancel_succeeds = 1;
+  microdesc_free_all();
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(workqueue_entry_cancel);
+  if (options)
+    tor_free(options->CacheDirectory);
+  smartlist_free(added);
+  tor_free(tmp_fn);
+}
+
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
@@ -818,5 +1088,8 @@ struct testcase_t microdesc_tests[] = {
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   { "corrupt_desc", test_md_corrupt_desc, TT_FORK, NULL, NULL },
+  { "parse_in_worker", test_md_parse_in_worker, TT_FORK, NULL, NULL },
+  { "rebuild_in_worker", test_md_rebuild_in_worker, TT_FORK, NULL, NULL },
+  { "rebuild_cleared", test_md_rebuild_cleared, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -231,6 +231,189 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+static routerstatus_t *
+make_test_rs(const char *id, uint32_t addr)
+{
+  routerstatus_t *rs = tor_malloc_zero(sizeof(*rs));
+  memcpy(rs->identity_digest, id, DIGEST_LEN);
+  strlcpy(rs->nickname, "relay", sizeof(rs->nickname));
+  rs->addr = addr;
+  rs->or_port = 9001;
+  rs->is_valid = rs->is_flagged_running = 1;
+  return rs;
+}
+
+static void
+test_nodelist_consensus_delta(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  char ids[4][DIGEST_LEN];
+  routerstatus_t *rs;
+  const node_t *node;
+  tor_addr_t addr;
+  int i;
+  (void)arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  for (i = 0; i < 4; ++i)
+    memset(ids[i], 'a'+i, DIGEST_LEN);
+
+  ns1 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns1->type = NS_TYPE_CONSENSUS;
+  ns1->flavor = FLAV_NS;
+  ns1->routerstatus_list = smartlist_new();
+  for (i = 0; i < 3; ++i)
+    smartlist_add(ns1->routerstatus_list, make_test_rs(ids[i], 0x01020300+i));
+
+  /* The first consensus adds every node. */
+  dummy_ns = ns1;
+  setup_full_capture_of_logs(LOG_INFO);
+  nodelist_set_consensus(ns1);
+  expect_log_msg("New consensus changed 3 nodes and removed 0.\n");
+  mock_clean_saved_logs();
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  tor_addr_from_ipv4h(&addr, 0x01020301);
+  tt_assert(nodelist_probably_contains_address(&addr));
+
+  /* Same consensus again: nothing changed. */
+  nodelist_set_consensus(ns1);
+  expect_log_msg("New consensus changed 0 nodes and removed 0.\n");
+  mock_clean_saved_logs();
+
+  /* Node 0 is unchanged, node 1 moves and loses Running, node 2 leaves, and
+   * node 3 joins. */
+  ns2 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns2->type = NS_TYPE_CONSENSUS;
+  ns2->flavor = FLAV_NS;
+  ns2->routerstatus_list = smartlist_new();
+  smartlist_add(ns2->routerstatus_list, make_test_rs(ids[0], 0x01020300));
+  rs = make_test_rs(ids[1], 0x05060708);
+  rs->is_flagged_running = 0;
+  smartlist_add(ns2->routerstatus_list, rs);
+  smartlist_add(ns2->routerstatus_list, make_test_rs(ids[3], 0x01020303));
+
+  dummy_ns = ns2;
+  nodelist_set_consensus(ns2);
+  networkstatus_vote_free(ns1);
+  ns1 = NULL;
+  expect_log_msg("New consensus changed 2 nodes and removed 1.\n");
+  tor_addr_from_ipv4h(&addr, 0x05060708);
+  tt_assert(nodelist_probably_contains_address(&addr));
+  tor_addr_from_ipv4h(&addr, 0x01020303);
+  tt_assert(nodelist_probably_contains_address(&addr));
+
+  /* Unchanged nodes still point at the new routerstatus and get its flags. */
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  node = node_get_by_id(ids[0]);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns2->routerstatus_list, 0));
+  node = node_get_by_id(ids[1]);
+  tt_int_op(node->is_running, OP_EQ, 0);
+  tt_ptr_op(node_get_by_id(ids[2]), OP_EQ, NULL);
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(networkstatus_get_latest_consensus);
+  nodelist_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+}
+
+/** Return a consensus listing a v3 HSDir for each of the <b>n_ids</b>
+ * identities in <b>ids</b>, valid from <b>valid_after</b> for three hours. */
+static networkstatus_t *
+make_test_hsdir_consensus(char ids[][DIGEST_LEN], int n_ids,
+                          time_t valid_after)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  int i;
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->valid_after = valid_after;
+  ns->fresh_until = valid_after + 3600;
+  ns->valid_until = valid_after + 3*3600;
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < n_ids; ++i) {
+    routerstatus_t *rs = make_test_rs(ids[i], 0x01020300+i);
+    rs->is_hs_dir = 1;
+    rs->pv.supports_v3_hsdir = 1;
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+static void
+test_nodelist_hsdir_index_after_non_live(void *arg)
+{
+  networkstatus_t *live1 = NULL, *stale = NULL, *live2 = NULL;
+  char ids[2][DIGEST_LEN];
+  routerinfo_t *ri[2] = { NULL, NULL }, *ri_old = NULL;
+  const node_t *node;
+  time_t now = approx_time();
+  int i;
+  (void)arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  /* Hsdir indices are built from the nodes' ed25519 identities, which they
+   * get from their routerinfos. */
+  for (i = 0; i < 2; ++i) {
+    memset(ids[i], 'a'+i, DIGEST_LEN);
+    ri[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    memcpy(ri[i]->cache_info.identity_digest, ids[i], DIGEST_LEN);
+    ri[i]->cache_info.signing_key_cert = tor_malloc_zero(sizeof(tor_cert_t));
+    crypto_rand((char*)&ri[i]->cache_info.signing_key_cert->signing_key,
+                sizeof(ed25519_public_key_t));
+  }
+  nodelist_set_routerinfo(ri[0], &ri_old);
+
+  /* A live consensus with one HSDir gives it an index. */
+  live1 = make_test_hsdir_consensus(ids, 1, now - 60);
+  dummy_ns = live1;
+  nodelist_set_consensus(live1);
+  node = node_get_by_id(ids[0]);
+  tt_assert(! tor_mem_is_zero((const char*)node->hsdir_index.fetch,
+                              DIGEST256_LEN));
+
+  /* A second HSDir joins under a consensus that is no longer live, so it
+   * can't get an index yet. */
+  stale = make_test_hsdir_consensus(ids, 2, now - 4*3600);
+  dummy_ns = stale;
+  nodelist_set_routerinfo(ri[1], &ri_old);
+  nodelist_set_consensus(stale);
+  networkstatus_vote_free(live1);
+  live1 = NULL;
+  node = node_get_by_id(ids[1]);
+  tt_assert(node);
+  tt_assert(tor_mem_is_zero((const char*)node->hsdir_index.fetch,
+                            DIGEST256_LEN));
+
+  /* The next live consensus has the same entries and the same hsdir index
+   * inputs as the first one, but the new HSDir still needs its index. */
+  live2 = make_test_hsdir_consensus(ids, 2, now - 60);
+  dummy_ns = live2;
+  nodelist_set_consensus(live2);
+  node = node_get_by_id(ids[1]);
+  tt_assert(! tor_mem_is_zero((const char*)node->hsdir_index.fetch,
+                              DIGEST256_LEN));
+  tt_assert(! tor_mem_is_zero((const char*)node->hsdir_index.store_first,
+                              DIGEST256_LEN));
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  nodelist_free_all();
+  networkstatus_vote_free(live1);
+  networkstatus_vote_free(stale);
+  networkstatus_vote_free(live2);
+  for (i = 0; i < 2; ++i) {
+    if (ri[i])
+      tor_free(ri[i]->cache_info.signing_key_cert);
+    tor_free(ri[i]);
+  }
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -239,6 +422,8 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(consensus_delta, TT_FORK),
+  NODE(hsdir_index_after_non_live, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -354,9 +354,40 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+/** Make sure the OOM victim heap hands back entries oldest-first. */
+static void
+test_oom_victim_heap(void *arg)
+{
+  oom_heap_ent_t heap[64];
+  uint32_t ages[64];
+  int i, n = 64;
+  uint32_t last_age = UINT32_MAX;
+  (void)arg;
+
+  for (i = 0; i < n; ++i) {
+    ages[i] = crypto_rand_int(1000);
+    heap[i].age = ages[i];
+    heap[i].item = &ages[i];
+  }
+  oom_heap_build(heap, n);
+
+  for (i = 0; i < 64; ++i) {
+    uint32_t *item = oom_heap_pop(heap, &n);
+    tt_ptr_op(item, OP_NE, NULL);
+    tt_uint_op(*item, OP_LE, last_age);
+    last_age = *item;
+  }
+  tt_int_op(n, OP_EQ, 0);
+  tt_ptr_op(oom_heap_pop(heap, &n), OP_EQ, NULL);
+
+ done:
+  ;
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "victim_heap", test_oom_victim_heap, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -3649,6 +3649,39 @@ test_options_validate__transport(void *ignored)
   tor_free(msg);
 }
 
+static void
+test_options_validate__server_dns_resolver_threads(void *ignored)
+{
+  (void)ignored;
+  int ret;
+  char *msg;
+  options_test_data_t *tdata = NULL;
+
+  tdata = get_options_test_data(TEST_OPTIONS_DEFAULT_VALUES
+                                "ServerDNSResolverThreads 129\n"
+                                );
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, -1);
+  tt_str_op(msg, OP_EQ, "ServerDNSResolverThreads must be at most 128, but "
+            "was set to 129");
+  tor_free(msg);
+
+  free_options_test_data(tdata);
+  tdata = get_options_test_data(TEST_OPTIONS_DEFAULT_VALUES
+                                "ServerDNSResolverThreads 4\n"
+                                "Sandbox 1\n"
+                                );
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, -1);
+  tt_str_op(msg, OP_EQ,
+            "ServerDNSResolverThreads is not compatible with Sandbox.");
+  tor_free(msg);
+
+ done:
+  free_options_test_data(tdata);
+  tor_free(msg);
+}
+
 static void
 test_options_validate__constrained_sockets(void *ignored)
 {
@@ -4228,6 +4261,7 @@ struct testcase_t options_tests[] = {
   LOCAL_VALIDATE_TEST(addr_policies),
   LOCAL_VALIDATE_TEST(dir_auth),
   LOCAL_VALIDATE_TEST(transport),
+  LOCAL_VALIDATE_TEST(server_dns_resolver_threads),
   LOCAL_VALIDATE_TEST(constrained_sockets),
   LOCAL_VALIDATE_TEST(v3_auth),
   LOCAL_VALIDATE_TEST(virtual_addr),
@@ -9,6 +9,7 @@
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 
@@ -2437,10 +2438,126 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Helper: check that the compiled form of <b>policy</b> agrees with the
+ * policy itself for <b>addr</b> at each of the ports around
+ * <b>port_min</b> and <b>port_max</b>. */
+static void
+test_compiled_policy_helper(const smartlist_t *policy,
+                            const addr_policy_compiled_t *compiled,
+                            const tor_addr_t *addr,
+                            int port_min, int port_max)
+{
+  const int ports[] = { port_min - 1, port_min, port_max, port_max + 1,
+                        crypto_rand_int_range(1, 65536) };
+  unsigned i;
+  /* A null address means "unknown" to compare_tor_addr_to_addr_policy(). */
+  if (tor_addr_is_null(addr))
+    return;
+  for (i = 0; i < ARRAY_LENGTH(ports); ++i) {
+    if (ports[i] < 1 || ports[i] > 65535)
+      continue;
+    tt_int_op(compare_tor_addr_to_compiled_policy(addr, ports[i], compiled),
+              OP_EQ,
+              compare_tor_addr_to_addr_policy(addr, ports[i], policy));
+  }
+ done:
+  ;
+}
+
+/** Make sure compiled policies match exactly the same addresses and ports as
+ * the policies they were compiled from. */
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL;
+  addr_policy_compiled_t *compiled = NULL;
+  short_policy_t *short_policy = NULL;
+  config_line_t line;
+  tor_addr_t addr;
+  int i;
+  (void)arg;
+
+  line.key = (char*)"ExitPolicy";
+  line.value = (char*)"reject 10.1.2.0/24:80-90, accept 10.0.0.0/8:*, "
+    "accept 198.51.100.7:22, reject6 [2001:db8::]/32:25, "
+    "accept6 [2001:db8:1::]/48:*, accept *:443, accept *4:8000-8100, "
+    "reject 0.0.0.0/1:53";
+  line.next = NULL;
+  tt_int_op(0, OP_EQ,
+            policies_parse_exit_policy(&line, &policy,
+                                       EXIT_POLICY_IPV6_ENABLED |
+                                       EXIT_POLICY_REJECT_PRIVATE |
+                                       EXIT_POLICY_ADD_DEFAULT, NULL));
+  compiled = addr_policy_compile(policy);
+  tt_assert(compiled);
+
+  /* The edges of every rule, and just past them. */
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, rule) {
+    tor_addr_copy(&addr, &rule->addr);
+    test_compiled_policy_helper(policy, compiled, &addr,
+                                rule->prt_min, rule->prt_max);
+    if (tor_addr_family(&addr) == AF_INET) {
+      uint32_t a = tor_addr_to_ipv4h(&addr);
+      uint32_t hostmask = rule->maskbits >= 32 ? 0 :
+        (0xffffffffu >> rule->maskbits);
+      tor_addr_from_ipv4h(&addr, a - 1);
+      test_compiled_policy_helper(policy, compiled, &addr,
+                                  rule->prt_min, rule->prt_max);
+      tor_addr_from_ipv4h(&addr, (a | hostmask));
+      test_compiled_policy_helper(policy, compiled, &addr,
+                                  rule->prt_min, rule->prt_max);
+      tor_addr_from_ipv4h(&addr, (a | hostmask) + 1);
+      test_compiled_policy_helper(policy, compiled, &addr,
+                                  rule->prt_min, rule->prt_max);
+    }
+  } SMARTLIST_FOREACH_END(rule);
+
+  /* And some random addresses. */
+  for (i = 0; i < 1000; ++i) {
+    uint8_t a6[16];
+    tor_addr_from_ipv4h(&addr,
+                        (uint32_t)crypto_rand_uint64(UINT64_C(1) << 32));
+    test_compiled_policy_helper(policy, compiled, &addr, 1, 65535);
+    crypto_rand((char *)a6, sizeof(a6));
+    if (i & 1)
+      memcpy(a6, "\x20\x01\x0d\xb8", 4);
+    tor_addr_from_ipv6_bytes(&addr, (const char *)a6);
+    test_compiled_policy_helper(policy, compiled, &addr, 1, 65535);
+  }
+
+  /* Port summaries use a binary search only when they can. */
+  short_policy = parse_short_policy("accept 1-10,80,443,8000-8100");
+  tt_assert(short_policy);
+  tt_assert(short_policy->entries_sorted);
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 443, short_policy),
+            OP_EQ, ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 8050, short_policy),
+            OP_EQ, ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 11, short_policy),
+            OP_EQ, ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 9000, short_policy),
+            OP_EQ, ADDR_POLICY_REJECTED);
+  short_policy_free(short_policy);
+  short_policy = parse_short_policy("accept 443,1-100");
+  tt_assert(short_policy);
+  tt_assert(! short_policy->entries_sorted);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 443, short_policy),
+            OP_EQ, ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(&addr, 50, short_policy),
+            OP_EQ, ADDR_POLICY_PROBABLY_ACCEPTED);
+
+ done:
+  addr_policy_list_free(policy);
+  addr_policy_compiled_free(compiled);
+  short_policy_free(short_policy);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
@@ -225,10 +225,55 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_bw_per_second(void *arg)
+{
+  char *s = NULL;
+  time_t start = time(NULL) + 2;
+  int i;
+
+  (void)arg;
+
+  rep_hist_init();
+
+  /* Nothing observed yet. */
+  s = rep_hist_get_per_second_bandwidth("read", 0);
+  tt_str_op(s, OP_EQ, "");
+  tor_free(s);
+  tt_ptr_op(rep_hist_get_per_second_bandwidth("sideways", 0), OP_EQ, NULL);
+
+  rep_hist_note_bytes_written(100, start);
+  rep_hist_note_bytes_written(50, start);
+  rep_hist_note_bytes_written(7, start+1);
+  rep_hist_note_bytes_written(3, start+3);
+  /* Only complete seconds are reported, oldest first. */
+  s = rep_hist_get_per_second_bandwidth("write", 3);
+  tt_str_op(s, OP_EQ, "150,7,0");
+  tor_free(s);
+
+  /* The rolling measure still only covers NUM_SECS_ROLLING_MEASURE seconds,
+   * even though we remember many more. */
+  for (i = 4; i < 100; ++i)
+    rep_hist_note_bytes_written(1000, start+i);
+  advance_obs(write_array);
+  commit_max(write_array);
+  tt_u64_op(find_largest_max(write_array), OP_EQ, 10*1000);
+
+  /* The full history also covers the seconds since rep_hist_init(). */
+  s = rep_hist_get_per_second_bandwidth("write", 0);
+  tt_assert(strstr(s, "0,150,7,0,3,1000,"));
+  tt_assert(!strcmpend(s, ",1000"));
+
+ done:
+  tor_free(s);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "bw_per_second", test_relay_bw_per_second,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -50,6 +50,7 @@
 
 #include "test/test.h"
 #include "test/test_dir_common.h"
+#include "test/test_helpers.h"
 #include "test/log_test_helpers.h"
 
 void construct_consensus(char **consensus_text_md, time_t now);
@@ -763,6 +764,59 @@ test_warn_early_consensus(void *arg)
   tor_free(c);
 }
 
+/** Make sure that picking nodes from the precomputed weight table honors
+ * exclusions, and that router_choose_random_node() still gives the right
+ * answer when the table draws can't find anything. */
+static void
+test_routerlist_choose_random_node_from_table(void *arg)
+{
+  smartlist_t *excluded = smartlist_new(), *empty = smartlist_new();
+  const node_t *keep, *node;
+  int i;
+  (void)arg;
+
+  helper_setup_fake_routerlist();
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_GT, 1);
+
+  /* With nothing excluded, every draw is acceptable. */
+  node = router_choose_random_node_from_table(empty, NULL, NULL, 0,
+                                              WEIGHT_FOR_MID);
+  tt_ptr_op(node, OP_NE, NULL);
+
+  /* Exclude all nodes but one. */
+  keep = smartlist_get(nodelist_get_list(), 0);
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, n,
+                    if (n != keep) smartlist_add(excluded, (void *)n));
+  for (i = 0; i < 100; ++i) {
+    node = router_choose_random_node_from_table(empty, excluded, NULL, 0,
+                                                WEIGHT_FOR_MID);
+    tt_assert(node == NULL || node == keep);
+    node = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(node, OP_EQ, keep);
+  }
+
+  /* Excluding our own family works the same way. */
+  node = router_choose_random_node_from_table(excluded, NULL, NULL, 0,
+                                              WEIGHT_FOR_EXIT);
+  tt_assert(node == NULL || node == keep);
+
+  /* Once everything is excluded, there is nothing to pick. */
+  smartlist_add(excluded, (void *)keep);
+  node = router_choose_random_node_from_table(empty, excluded, NULL, 0,
+                                              WEIGHT_FOR_MID);
+  tt_ptr_op(node, OP_EQ, NULL);
+
+  /* A changed nodelist means a rebuilt table. */
+  node_select_weights_changed();
+  node = router_choose_random_node_from_table(empty, NULL, NULL, 0,
+                                              WEIGHT_FOR_MID);
+  tt_ptr_op(node, OP_NE, NULL);
+
+ done:
+  smartlist_free(excluded);
+  smartlist_free(empty);
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 #define ROUTER(name,flags) \
@@ -779,6 +833,7 @@ struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
   NODE(router_is_already_dir_fetching, TT_FORK),
+  NODE(choose_random_node_from_table, TT_FORK),
   ROUTER(pick_directory_server_impl, TT_FORK),
   { "directory_guard_fetch_with_no_dirinfo",
     test_directory_guard_fetch_with_no_dirinfo, TT_FORK, NULL, NULL },
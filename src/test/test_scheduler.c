@@ -1265,6 +1265,85 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static int mock_update_socket_info_calls = 0;
+
+static void
+update_socket_info_impl_mock_count(socket_table_ent_t *ent)
+{
+  ++mock_update_socket_info_calls;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->limit = INT_MAX;
+}
+
+static void
+test_scheduler_kist_sock_info_cache(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock_var);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock_var);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_count);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(1000000000));
+
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTSockInfoCacheTime = 100;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  channel_t *chan1 = new_fake_channel();
+  tt_assert(chan1);
+  chan1->magic = TLS_CHAN_MAGIC;
+  channel_register(chan1);
+  scheduler_channel_wants_writes(chan1);
+  mock_flush_some_cells_num = 1;
+  mock_more_to_flush = 0;
+
+  /* First run: we have never asked the kernel about this socket. */
+  scheduler_channel_has_waiting_cells(chan1);
+  the_scheduler->run();
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 1);
+
+  /* Second run within the cache time: reuse what we know. */
+  scheduler_channel_has_waiting_cells(chan1);
+  the_scheduler->run();
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 1);
+
+  /* The socket drained its outbuf, so it freed space: ask again. */
+  scheduler_channel_wants_writes(chan1);
+  scheduler_channel_has_waiting_cells(chan1);
+  the_scheduler->run();
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 2);
+
+  /* The cached information expires. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1100000000));
+  scheduler_channel_has_waiting_cells(chan1);
+  the_scheduler->run();
+  tt_int_op(mock_update_socket_info_calls, OP_EQ, 3);
+
+ done:
+  chan1->state = CHANNEL_STATE_CLOSED;
+  chan1->registered = 0;
+  channel_free(chan1);
+  scheduler_free_all();
+
+  monotime_disable_test_mocking();
+  UNMOCK(get_options);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_should_write_to_kernel);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1355,8 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_sock_info_cache", test_scheduler_kist_sock_info_cache, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -2729,6 +2729,62 @@ test_util_decompress_dos(void *arg)
   ;
 }
 
+static void
+test_util_compress_state_reuse(void *arg)
+{
+  (void) arg;
+  const char msg1[] = "network-status-version 3 microdesc\nvote-status "
+    "consensus\nconsensus-method 28\n";
+  const char msg2[] = "onion-key\n-----BEGIN RSA PUBLIC KEY-----\n";
+  char buf[1024];
+  char *fresh = NULL, *reused = NULL, *out = NULL;
+  size_t fresh_len = 0, reused_len = 0, out_len = 0;
+  tor_compress_state_t *state = NULL;
+  const char *inp;
+  size_t inlen, outleft;
+  char *outp;
+
+  tt_int_op(0, OP_EQ, tor_compress(&fresh, &fresh_len, msg2, strlen(msg2),
+                                   GZIP_METHOD));
+
+  /* Abandon a stream halfway through: its state goes back to the pool. */
+  state = tor_compress_new(1, GZIP_METHOD, HIGH_COMPRESSION);
+  tt_assert(state);
+  inp = msg1;
+  inlen = strlen(msg1);
+  outp = buf;
+  outleft = sizeof(buf);
+  tt_int_op(TOR_COMPRESS_OK, OP_EQ,
+            tor_compress_process(state, &outp, &outleft, &inp, &inlen, 0));
+  const size_t allocated = tor_compress_get_total_allocation();
+  tor_compress_free(state);
+  /* Pooled states still count as allocated. */
+  tt_int_op(tor_compress_get_total_allocation(), OP_LE, allocated);
+  tt_int_op(tor_compress_get_total_allocation(), OP_GT, 0);
+
+  /* A reused state must behave exactly like a new one. */
+  tt_int_op(0, OP_EQ, tor_compress(&reused, &reused_len, msg2, strlen(msg2),
+                                   GZIP_METHOD));
+  tt_mem_op(fresh, OP_EQ, reused, fresh_len);
+  tt_int_op(fresh_len, OP_EQ, reused_len);
+
+  tt_int_op(0, OP_EQ, tor_uncompress(&out, &out_len, reused, reused_len,
+                                     GZIP_METHOD, 1, LOG_WARN));
+  tt_str_op(out, OP_EQ, msg2);
+
+  /* When we're low on memory, we release the pool, and all the memory is
+   * gone. */
+  const size_t pooled = tor_compress_get_total_allocation();
+  tt_int_op(tor_compress_handle_oom(), OP_EQ, pooled);
+  tt_int_op(tor_compress_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(tor_compress_handle_oom(), OP_EQ, 0);
+
+ done:
+  tor_free(fresh);
+  tor_free(reused);
+  tor_free(out);
+}
+
 static void
 test_util_gzip_compression_bomb(void *arg)
 {
@@ -6467,6 +6523,7 @@ struct testcase_t util_tests[] = {
   COMPRESS_DOS(zstd, "x-zstd"),
   COMPRESS_DOS(zstd_nostatic, "x-zstd:nostatic"),
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
+  UTIL_TEST(compress_state_reuse, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
   UTIL_LEGACY(control_formats),
@@ -316,6 +316,169 @@ replysock_readable_cb(threadpool_t *tp)
   }
 }
 
+/* Machinery for check_stealing_order(). */
+
+/** Number of the thread whose state this is, for check_stealing_order(). */
+typedef struct order_state_s {
+  int thread_num;
+} order_state_t;
+
+/** One item of work for check_stealing_order(). */
+typedef struct order_work_s {
+  int serial;
+  /** If set, wait until this is true before finishing. */
+  int *gate;
+  /** Number of the thread that ran this work. */
+  int ran_on;
+} order_work_t;
+
+static tor_mutex_t order_lock;
+static tor_cond_t order_cond;
+static int order_n_started = 0;
+static int order_ran[4];
+static int order_n_ran = 0;
+static int order_replied[4];
+static int order_n_replied = 0;
+static int order_n_threads_made = 0;
+
+static void *
+new_order_state(void *arg)
+{
+  order_state_t *st = tor_malloc_zero(sizeof(*st));
+  (void)arg;
+  st->thread_num = order_n_threads_made++;
+  return st;
+}
+
+static void
+free_order_state(void *arg)
+{
+  tor_free(arg);
+}
+
+static workqueue_reply_t
+workqueue_do_ordered(void *state, void *work)
+{
+  order_state_t *st = state;
+  order_work_t *w = work;
+
+  tor_mutex_acquire(&order_lock);
+  ++order_n_started;
+  tor_cond_signal_all(&order_cond);
+  while (w->gate && ! *w->gate)
+    tor_cond_wait(&order_cond, &order_lock, NULL);
+  w->ran_on = st->thread_num;
+  order_ran[order_n_ran++] = w->serial;
+  tor_cond_signal_all(&order_cond);
+  tor_mutex_release(&order_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+handle_ordered_reply(void *arg)
+{
+  order_work_t *w = arg;
+  order_replied[order_n_replied++] = w->serial;
+}
+
+/** Wait until at least <b>n</b> ordered items have started and at least
+ * <b>n_ran</b> have finished.  The caller must hold order_lock. */
+static void
+wait_for_ordered(int n_started, int n_ran)
+{
+  while (order_n_started < n_started || order_n_ran < n_ran)
+    tor_cond_wait(&order_cond, &order_lock, NULL);
+}
+
+/** Run the replies on <b>rq</b> until at least <b>n</b> ordered items have
+ * been replied to, or we give up. */
+static void
+process_ordered_replies(replyqueue_t *rq, int n)
+{
+  const struct timeval tv = { 0, 5000 };
+  int i;
+  for (i = 0; i < 1000 && order_n_replied < n; ++i) {
+    replyqueue_process(rq);
+    if (order_n_replied < n) {
+      tor_mutex_acquire(&order_lock);
+      tor_cond_wait(&order_cond, &order_lock, &tv);
+      tor_mutex_release(&order_lock);
+    }
+  }
+}
+
+/** Check that a worker whose own queues hold only low-priority work steals
+ * high-priority work from a busy worker first, and that replies are run in
+ * the order the work finished.  Return 0 on success, -1 on failure. */
+static int
+check_stealing_order(uint32_t as_flags)
+{
+  replyqueue_t *rq;
+  threadpool_t *tp;
+  int gate[2] = { 0, 0 };
+  order_work_t work[4];
+  int i, ok;
+
+  rq = replyqueue_new(as_flags);
+  if (rq == NULL)
+    return -1;
+  tor_mutex_init_for_cond(&order_lock);
+  tor_cond_init(&order_cond);
+  memset(work, 0, sizeof(work));
+  for (i = 0; i < 4; ++i)
+    work[i].serial = i;
+
+  /* Work goes to the threads round robin.  Keep both threads busy with
+   * items 0 and 1 until we open their gates. */
+  tp = threadpool_new(2, rq, new_order_state, free_order_state, NULL);
+  if (tp == NULL)
+    return -1;
+  work[0].gate = &gate[0];
+  work[1].gate = &gate[1];
+  threadpool_queue_work(tp, workqueue_do_ordered, handle_ordered_reply,
+                        &work[0]);
+  threadpool_queue_work(tp, workqueue_do_ordered, handle_ordered_reply,
+                        &work[1]);
+  tor_mutex_acquire(&order_lock);
+  wait_for_ordered(2, 0);
+  tor_mutex_release(&order_lock);
+
+  /* Now thread 0 has high-priority item 2 waiting, and thread 1 has
+   * low-priority item 3.  Let thread 1 go on: it should take item 2 from
+   * thread 0 before it runs its own item 3. */
+  threadpool_queue_work_priority(tp, WQ_PRI_HIGH, workqueue_do_ordered,
+                                 handle_ordered_reply, &work[2]);
+  threadpool_queue_work_priority(tp, WQ_PRI_LOW, workqueue_do_ordered,
+                                 handle_ordered_reply, &work[3]);
+  tor_mutex_acquire(&order_lock);
+  gate[1] = 1;
+  tor_cond_signal_all(&order_cond);
+  wait_for_ordered(4, 3);
+  tor_mutex_release(&order_lock);
+
+  /* Make sure thread 1's replies are all in before item 0 can finish. */
+  process_ordered_replies(rq, 3);
+  tor_mutex_acquire(&order_lock);
+  gate[0] = 1;
+  tor_cond_signal_all(&order_cond);
+  tor_mutex_release(&order_lock);
+  process_ordered_replies(rq, 4);
+
+  ok = order_ran[0] == 1 && order_ran[1] == 2 && order_ran[2] == 3 &&
+    order_ran[3] == 0 && work[2].ran_on == 1 && order_n_replied == 4;
+  for (i = 0; i < order_n_replied; ++i)
+    ok = ok && order_replied[i] == order_ran[i];
+  if (!ok || opt_verbose) {
+    printf("Ran items %d %d %d %d; replied %d %d %d %d; item 2 ran on "
+           "thread %d\n", order_ran[0], order_ran[1], order_ran[2],
+           order_ran[3], order_replied[0], order_replied[1],
+           order_replied[2], order_replied[3], work[2].ran_on);
+  }
+  /* We leave the threads of this pool waiting for work: there's no way to
+   * free a pool. */
+  return ok ? 0 : -1;
+}
+
 static void
 help(void)
 {
@@ -403,6 +566,11 @@ main(int argc, char **argv)
   if (as_flags && rq == NULL)
     return 77; // 77 means "skipped".
 
+  if (check_stealing_order(as_flags) < 0) {
+    puts("FAIL");
+    return 1;
+  }
+
   tor_assert(rq);
   tp = threadpool_new(opt_n_threads,
                       rq, new_state, free_state, NULL);